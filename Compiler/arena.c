@@ -0,0 +1,308 @@
+/***************************************************************************************************
+ *
+ * RunlessBASIC
+ * Copyright 2013 Joshua Hawcroft <dev@joshhawcroft.com>
+ *
+ * arena.c
+ * Region (bump) allocator for short-lived structures such as the AST.
+ *
+ ***************************************************************************************************
+ *
+ * RunlessBASIC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RunlessBASIC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RunlessBASIC.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************************************/
+
+/*
+ * An arena hands out memory by advancing a pointer through large chunks obtained from the heap.
+ * Nothing is freed individually; arena_reset() releases every allocation at once, which lets the
+ * parser discard a whole tree (including any partially built subtrees left behind by a syntax
+ * error) in constant time.
+ *
+ * Requests larger than a quarter of a chunk get a chunk of their own, so a large block doesn't
+ * waste the remainder of the current chunk.  The first chunk survives a reset, so an arena that is
+ * reset between small parses needn't touch the heap at all.
+ *
+ * An arena is not thread-safe; each parser owns its own.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "arena.h"
+#include "memory.h"
+#include "test.h"
+
+
+#define ARENA_CHUNK_SIZE (64 * 1024)
+#define ARENA_LARGE_SIZE (ARENA_CHUNK_SIZE / 4)
+#define ARENA_ALIGNMENT 8
+
+#define ARENA_ALIGN(size) (((size) + (ARENA_ALIGNMENT - 1)) & ~(long)(ARENA_ALIGNMENT - 1))
+
+
+typedef struct ArenaChunk ArenaChunk;
+
+struct ArenaChunk
+{
+    ArenaChunk      *next;
+    long            size;
+    /* the data follows the header, at an aligned offset */
+};
+
+#define ARENA_HEADER_SIZE ARENA_ALIGN(sizeof(struct ArenaChunk))
+#define ARENA_CHUNK_DATA(chunk) ((char*)(chunk) + ARENA_HEADER_SIZE)
+
+
+struct Arena
+{
+    /* most recent first; the first chunk allocated survives a reset */
+    ArenaChunk      *chunks;
+    ArenaChunk      *first;
+    char            *next;
+    char            *limit;
+    long            used;
+    long            size;
+};
+
+
+
+static ArenaChunk* _arena_chunk(Arena *in_arena, long in_size)
+{
+    ArenaChunk *chunk;
+    
+    chunk = safe_malloc(ARENA_HEADER_SIZE + in_size);
+    chunk->size = in_size;
+    in_arena->size += ARENA_HEADER_SIZE + in_size;
+    return chunk;
+}
+
+
+Arena* arena_create(void)
+{
+    Arena *arena;
+    
+    arena = safe_malloc(sizeof(struct Arena));
+    arena->size = 0;
+    arena->used = 0;
+    arena->chunks = _arena_chunk(arena, ARENA_CHUNK_SIZE);
+    arena->chunks->next = NULL;
+    arena->first = arena->chunks;
+    arena->next = ARENA_CHUNK_DATA(arena->chunks);
+    arena->limit = arena->next + ARENA_CHUNK_SIZE;
+    
+    return arena;
+}
+
+
+void arena_dispose(Arena *in_arena)
+{
+    ArenaChunk *chunk, *next;
+    
+    if (!in_arena) return;
+    for (chunk = in_arena->chunks; chunk; chunk = next)
+    {
+        next = chunk->next;
+        safe_free(chunk);
+    }
+    safe_free(in_arena);
+}
+
+
+void* arena_alloc(Arena *in_arena, long in_size)
+{
+    ArenaChunk *chunk;
+    char *result;
+    
+    assert(in_size >= 0);
+    in_size = ARENA_ALIGN(in_size);
+    in_arena->used += in_size;
+    
+    if (in_size <= in_arena->limit - in_arena->next)
+    {
+        result = in_arena->next;
+        in_arena->next += in_size;
+        return result;
+    }
+    
+    if (in_size > ARENA_LARGE_SIZE)
+    {
+        /* goes behind the current chunk, which carries on serving small requests */
+        chunk = _arena_chunk(in_arena, in_size);
+        chunk->next = in_arena->chunks->next;
+        in_arena->chunks->next = chunk;
+        return ARENA_CHUNK_DATA(chunk);
+    }
+    
+    chunk = _arena_chunk(in_arena, ARENA_CHUNK_SIZE);
+    chunk->next = in_arena->chunks;
+    in_arena->chunks = chunk;
+    result = ARENA_CHUNK_DATA(chunk);
+    in_arena->next = result + in_size;
+    in_arena->limit = result + ARENA_CHUNK_SIZE;
+    return result;
+}
+
+
+void* arena_grow(Arena *in_arena, void *in_memory, long in_size, long in_new_size)
+{
+    void *result;
+    
+    assert(in_new_size >= in_size);
+    if (!in_memory) return arena_alloc(in_arena, in_new_size);
+    
+    if (((char*)in_memory + ARENA_ALIGN(in_size) == in_arena->next) &&
+        (ARENA_ALIGN(in_new_size) <= in_arena->limit - (char*)in_memory))
+    {
+        in_arena->used += ARENA_ALIGN(in_new_size) - ARENA_ALIGN(in_size);
+        in_arena->next = (char*)in_memory + ARENA_ALIGN(in_new_size);
+        return in_memory;
+    }
+    
+    result = arena_alloc(in_arena, in_new_size);
+    memcpy(result, in_memory, in_size);
+    return result;
+}
+
+
+void arena_reset(Arena *in_arena)
+{
+    ArenaChunk *chunk, *next;
+    
+    for (chunk = in_arena->chunks; chunk; chunk = next)
+    {
+        next = chunk->next;
+        if (chunk == in_arena->first) continue;
+        in_arena->size -= ARENA_HEADER_SIZE + chunk->size;
+        safe_free(chunk);
+    }
+    in_arena->chunks = in_arena->first;
+    in_arena->chunks->next = NULL;
+    in_arena->next = ARENA_CHUNK_DATA(in_arena->chunks);
+    in_arena->limit = in_arena->next + ARENA_CHUNK_SIZE;
+    in_arena->used = 0;
+}
+
+
+long arena_used(Arena *in_arena)
+{
+    return in_arena->used;
+}
+
+
+long arena_size(Arena *in_arena)
+{
+    return in_arena->size;
+}
+
+
+
+/*********
+ Testing
+ */
+
+#ifdef DEBUG
+
+
+static const char* test_1(void)
+{
+    Arena *arena;
+    char *block1, *block2;
+    double *real;
+    
+    arena = arena_create();
+    CHECK(arena_used(arena) == 0);
+    CHECK(arena_size(arena) >= ARENA_CHUNK_SIZE);
+    
+    block1 = arena_alloc(arena, 3);
+    real = arena_alloc(arena, sizeof(double));
+    CHECK(((long)real % ARENA_ALIGNMENT) == 0);
+    CHECK((char*)real >= block1 + 3);
+    *real = 1.5;
+    
+    /* the most recent block grows in place, others move */
+    block2 = arena_alloc(arena, 10);
+    memcpy(block2, "abcdefghij", 10);
+    CHECK(arena_grow(arena, block2, 10, 100) == block2);
+    block1 = arena_grow(arena, block1, 3, 50);
+    CHECK(block1 != NULL);
+    CHECK(block1 != block2);
+    block2 = arena_grow(arena, block2, 100, 200);
+    CHECK(memcmp(block2, "abcdefghij", 10) == 0);
+    CHECK(*real == 1.5);
+    
+    arena_dispose(arena);
+    return NULL;
+}
+
+
+/* large blocks, many chunks and reuse of the first chunk after a reset */
+static const char* test_2(void)
+{
+    Arena *arena;
+    long size;
+    char *first, *large, *block;
+    int i;
+    
+    arena = arena_create();
+    size = arena_size(arena);
+    first = arena_alloc(arena, 16);
+    
+    large = arena_alloc(arena, ARENA_CHUNK_SIZE * 2);
+    memset(large, 1, ARENA_CHUNK_SIZE * 2);
+    block = arena_alloc(arena, 16);
+    CHECK(block == first + 16);
+    
+    for (i = 0; i < 10000; i++)
+    {
+        block = arena_alloc(arena, 100);
+        memset(block, i, 100);
+    }
+    CHECK(arena_used(arena) == 32 + ARENA_CHUNK_SIZE * 2 + 10000 * ARENA_ALIGN(100));
+    CHECK(arena_size(arena) > 10000 * 100);
+    
+    arena_reset(arena);
+    CHECK(arena_used(arena) == 0);
+    CHECK(arena_size(arena) == size);
+    CHECK(arena_alloc(arena, 16) == first);
+    
+    arena_dispose(arena);
+    return NULL;
+}
+
+
+void arena_run_tests(void)
+{
+    const char *test_error;
+    test_error = NULL;
+    
+    if (!test_error) test_error = test_1();
+    if (!test_error) test_error = test_2();
+    
+    if (test_error)
+    {
+        fprintf(stderr, "arena_run_tests(): Failed: %s\n", test_error);
+        exit(1);
+    }
+    else
+    {
+        fprintf(stdout, "arena_run_tests(): OK\n");
+    }
+}
+
+
+#endif
+
+
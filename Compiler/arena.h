@@ -0,0 +1,59 @@
+/***************************************************************************************************
+ *
+ * RunlessBASIC
+ * Copyright 2013 Joshua Hawcroft <dev@joshhawcroft.com>
+ *
+ * arena.h
+ * (see C source file for details)
+ *
+ ***************************************************************************************************
+ *
+ * RunlessBASIC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RunlessBASIC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RunlessBASIC.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************************************/
+
+#include "memory.h"
+
+#ifndef _ARENA_H
+#define _ARENA_H
+
+
+typedef struct Arena Arena;
+
+
+Arena* arena_create(void);
+void arena_dispose(Arena *in_arena);
+
+/* memory is suitably aligned for pointers, longs and doubles and remains valid until the
+ arena is reset or disposed; it is never freed individually */
+void* arena_alloc(Arena *in_arena, long in_size);
+
+/* resizes a block obtained from the arena, in place if it was the most recent allocation;
+ otherwise the contents are copied to a new block and the old one is abandoned */
+void* arena_grow(Arena *in_arena, void *in_memory, long in_size, long in_new_size);
+
+/* releases everything allocated from the arena at once; the first chunk is kept for reuse */
+void arena_reset(Arena *in_arena);
+
+/* bytes handed out since the last reset, and bytes held from the heap */
+long arena_used(Arena *in_arena);
+long arena_size(Arena *in_arena);
+
+
+#ifdef DEBUG
+void arena_run_tests(void);
+#endif
+
+
+#endif
@@ -26,116 +26,353 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <math.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "ast.h"
 #include "memory.h"
 #include "test.h"
 
 
+#define AST_INLINE_CHILDREN 1
+#define AST_WALK_DEPTH 64
+
+/* node flags */
+#define AST_FROZEN 0x01
+#define AST_FROZEN_ROOT 0x02
+#define AST_MAPPED 0x04
+#define AST_LITERAL 0x08
+#define AST_ARENA 0x10
+
+
+/* the leading fields of both kinds of node */
+typedef struct AstHeader
+{
+    unsigned char   type;
+    unsigned char   flags;
+} AstHeader;
+
+
+typedef union AstValue
+{
+    Atom            atom;
+    int64_t         integer;
+    double          real;
+    /* the number of children of a frozen list node */
+    uint32_t        count;
+    /* a string node of a mapped tree; its entry in the string table and its own index, by which
+     the table is found */
+    struct
+    {
+        uint32_t        string;
+        uint32_t        node;
+    }               mapped;
+    /* a string literal of a frozen or mapped tree; its text follows the nodes, at offset bytes
+     from the node */
+    struct
+    {
+        uint32_t        offset;
+        uint32_t        length;
+    }               literal;
+} AstValue;
+
+
+/* 24 bytes; nodes from an arena are flagged AST_ARENA, and a list node also holds the arena,
+ for growing its array of children */
 struct AstNode
 {
-    AstNodeType     type;
+    AstHeader       header;
+    int             count;
     union
     {
+        /* children are held in the node until there are more than AST_INLINE_CHILDREN */
         struct
         {
-            int             count;
-            AstNode         **nodes;
+            union
+            {
+                AstNode         *local[AST_INLINE_CHILDREN];
+                AstNode         **nodes;
+            }               children;
+            Arena           *arena;
         }               list;
-        char            *string;
-        long            integer;
-        double          real;
+        AstValue        scalar;
+        /* a string literal's own copy of its text, from the node's arena */
+        struct
+        {
+            const char      *text;
+            long            length;
+        }               literal;
     }               value;
 };
 
 
+/* a frozen tree is a single block of these in pre-order; a node's first child follows it and
+ its next sibling follows its subtree, so no links are stored.  16 bytes, with literals held
+ in the node */
+typedef struct AstFrozenNode
+{
+    AstHeader       header;
+    uint32_t        size;
+    AstValue        value;
+} AstFrozenNode;
+
+
+#define HEADER(node) ((AstHeader*)(node))
+#define FROZEN(node) ((AstFrozenNode*)(node))
+#define IS_FROZEN(node) (HEADER(node)->flags & AST_FROZEN)
+#define IS_MAPPED(node) (HEADER(node)->flags & AST_MAPPED)
+#define IS_LITERAL(node) (HEADER(node)->flags & AST_LITERAL)
+
+
+
+#define AST_OPERATOR_NAME(code, name) [code] = name,
+
+static const char *operator_names[AST_OPERATOR_COUNT] = {
+    [AST_OP_NONE] = "none",
+    AST_OPERATORS(AST_OPERATOR_NAME)
+};
+
+#undef AST_OPERATOR_NAME
+
 
-static char* _string_clone(const char *in_string)
+static AstValue* _ast_value(AstNode *in_node)
 {
-    char *result;
-    long length;
-    length = strlen(in_string);
-    result = safe_malloc(length + 1);
-    strcpy(result, in_string);
-    return result;
+    if (IS_FROZEN(in_node)) return &(FROZEN(in_node)->value);
+    return &(in_node->value.scalar);
+}
+
+
+static Atom _ast_cache_atom(AstNode *in_node);
+
+static Atom _ast_atom(AstNode *in_node)
+{
+    if (IS_LITERAL(in_node)) return ATOM_NONE;
+    if (IS_MAPPED(in_node)) return _ast_cache_atom(in_node);
+    return _ast_value(in_node)->atom;
 }
 
 
-AstNode* ast_create(AstNodeType in_type)
+/* the text of a string node, whether a literal or an atom */
+static const char* _ast_text(AstNode *in_node, long *out_length)
+{
+    const char *text;
+    Atom atom;
+    
+    if (IS_LITERAL(in_node) && IS_FROZEN(in_node))
+    {
+        *out_length = FROZEN(in_node)->value.literal.length;
+        return (const char*)in_node + FROZEN(in_node)->value.literal.offset;
+    }
+    if (IS_LITERAL(in_node))
+    {
+        *out_length = in_node->value.literal.length;
+        return in_node->value.literal.text;
+    }
+    atom = _ast_atom(in_node);
+    text = intern_text(atom);
+    *out_length = intern_length(atom);
+    return text;
+}
+
+
+/* the value of a literal, with the atom of a mapped string node resolved */
+static AstValue _ast_scalar(AstNode *in_node)
+{
+    AstValue value;
+    
+    if (!(IS_MAPPED(in_node) && (HEADER(in_node)->type == AST_STRING))) return *_ast_value(in_node);
+    memset(&value, 0, sizeof(value));
+    value.atom = _ast_atom(in_node);
+    return value;
+}
+
+
+static Boolean _has_list(AstNode *in_node);
+
+AstNode* ast_create(Arena *in_arena, AstNodeType in_type)
 {
     AstNode *node;
-    node = safe_malloc(sizeof(struct AstNode));
+    if (in_arena) node = arena_alloc(in_arena, sizeof(struct AstNode));
+    else node = safe_malloc(sizeof(struct AstNode));
     memset(node, 0, sizeof(struct AstNode));
-    node->type = in_type;
+    node->header.type = in_type;
+    if (in_arena) node->header.flags = AST_ARENA;
+    if (_has_list(node)) node->value.list.arena = in_arena;
     return node;
 }
 
 
-AstNode* ast_create_string(const char *in_string)
+/* string nodes refer to interned text, apart from literals, which hold a copy of their own */
+AstNode* ast_create_string(Arena *in_arena, const char *in_string)
 {
+    return ast_create_atom(in_arena, intern_string(in_string));
+}
+
+
+AstNode* ast_create_string_n(Arena *in_arena, const char *in_string, long in_length)
+{
+    return ast_create_atom(in_arena, intern(in_string, in_length));
+}
+
+
+AstNode* ast_create_atom(Arena *in_arena, Atom in_atom)
+{
+    assert(in_atom != ATOM_NONE);
+    
     AstNode *node;
-    node = ast_create(AST_STRING);
-    node->value.string = _string_clone(in_string);
+    node = ast_create(in_arena, AST_STRING);
+    node->value.scalar.atom = in_atom;
     return node;
 }
 
 
-AstNode* ast_create_integer(long in_integer)
+AstNode* ast_create_literal(Arena *in_arena, const char *in_text, long in_length)
 {
     AstNode *node;
-    node = ast_create(AST_INTEGER);
-    node->value.integer = in_integer;
+    char *text;
+    
+    node = ast_create(in_arena, AST_STRING);
+    node->header.flags |= AST_LITERAL;
+    if (in_arena) text = arena_alloc(in_arena, in_length + 1);
+    else text = safe_malloc(in_length + 1);
+    memcpy(text, in_text, in_length);
+    text[in_length] = 0;
+    node->value.literal.text = text;
+    node->value.literal.length = in_length;
     return node;
 }
 
 
-AstNode* ast_create_boolean(Boolean in_bool)
+AstNode* ast_create_integer(Arena *in_arena, long in_integer)
 {
     AstNode *node;
-    node = ast_create(AST_BOOLEAN);
-    node->value.integer = in_bool;
+    node = ast_create(in_arena, AST_INTEGER);
+    node->value.scalar.integer = in_integer;
     return node;
 }
 
 
-AstNode* ast_create_colour(long in_colour)
+AstNode* ast_create_boolean(Arena *in_arena, Boolean in_bool)
 {
     AstNode *node;
-    node = ast_create(AST_COLOUR);
-    node->value.integer = in_colour;
+    node = ast_create(in_arena, AST_BOOLEAN);
+    node->value.scalar.integer = in_bool;
     return node;
 }
 
 
-AstNode* ast_create_real(double in_real)
+AstNode* ast_create_colour(Arena *in_arena, long in_colour)
 {
     AstNode *node;
-    node = ast_create(AST_REAL);
-    node->value.real = in_real;
+    node = ast_create(in_arena, AST_COLOUR);
+    node->value.scalar.integer = in_colour;
     return node;
 }
 
 
-AstNode* ast_create_operator(const char *in_desc)
+AstNode* ast_create_real(Arena *in_arena, double in_real)
 {
     AstNode *node;
-    node = ast_create(AST_OPERATOR);
-    node->value.string = _string_clone(in_desc);
+    node = ast_create(in_arena, AST_REAL);
+    node->value.scalar.real = in_real;
+    return node;
+}
+
+
+/* operators are held as their code; nothing is allocated beyond the node */
+AstNode* ast_create_operator(Arena *in_arena, AstOperator in_operator)
+{
+    assert((in_operator > AST_OP_NONE) && (in_operator < AST_OPERATOR_COUNT));
+    
+    AstNode *node;
+    node = ast_create(in_arena, AST_OPERATOR);
+    node->value.scalar.integer = in_operator;
     return node;
 }
 
 
+/* beyond AST_INLINE_CHILDREN, children are held in an array whose capacity is the smallest
+ power of two that fits them, so the capacity is implied by the count */
+static int _ast_capacity(int in_count)
+{
+    int capacity;
+    for (capacity = AST_INLINE_CHILDREN * 2; capacity < in_count; capacity *= 2) {}
+    return capacity;
+}
+
+
+static AstNode** _ast_children(AstNode *in_node)
+{
+    if (in_node->count <= AST_INLINE_CHILDREN) return in_node->value.list.children.local;
+    return in_node->value.list.children.nodes;
+}
+
+
+static AstNode** _ast_array(Arena *in_arena, int in_capacity)
+{
+    if (in_arena) return arena_alloc(in_arena, sizeof(AstNode*) * in_capacity);
+    return safe_malloc(sizeof(AstNode*) * in_capacity);
+}
+
+
+/* makes room for one more child */
+static void _ast_grow(AstNode *io_node)
+{
+    AstNode **nodes;
+    Arena *arena;
+    int count;
+    
+    count = io_node->count;
+    arena = io_node->value.list.arena;
+    if (count < AST_INLINE_CHILDREN) return;
+    if (count == AST_INLINE_CHILDREN)
+    {
+        nodes = _ast_array(arena, _ast_capacity(count + 1));
+        memcpy(nodes, io_node->value.list.children.local, sizeof(AstNode*) * count);
+        io_node->value.list.children.nodes = nodes;
+        return;
+    }
+    if (count < _ast_capacity(count)) return;
+    
+    nodes = io_node->value.list.children.nodes;
+    if (arena)
+        nodes = arena_grow(arena, nodes, sizeof(AstNode*) * count, sizeof(AstNode*) * _ast_capacity(count + 1));
+    else
+        nodes = safe_realloc(nodes, sizeof(AstNode*) * _ast_capacity(count + 1));
+    io_node->value.list.children.nodes = nodes;
+}
+
+
+/* after a removal, brings the children back into the node once they fit */
+static void _ast_shrink(AstNode *io_node)
+{
+    AstNode **nodes;
+    
+    if (io_node->count != AST_INLINE_CHILDREN) return;
+    nodes = io_node->value.list.children.nodes;
+    memcpy(io_node->value.list.children.local, nodes, sizeof(AstNode*) * AST_INLINE_CHILDREN);
+    if (!io_node->value.list.arena) safe_free(nodes);
+}
+
+
 void ast_append(AstNode *in_parent, AstNode *in_child)
 {
-    in_parent->value.list.nodes = safe_realloc(in_parent->value.list.nodes,
-                                               sizeof(AstNode*) * (in_parent->value.list.count + 1));
-    in_parent->value.list.nodes[ in_parent->value.list.count++ ] = in_child;
+    assert(!IS_FROZEN(in_parent));
+    assert((!in_child) || (((HEADER(in_child)->flags ^ HEADER(in_parent)->flags) & AST_ARENA) == 0));
+    
+    _ast_grow(in_parent);
+    in_parent->count++;
+    _ast_children(in_parent)[ in_parent->count - 1 ] = in_child;
 }
 
 
 static Boolean _has_list(AstNode *in_node)
 {
-    switch (in_node->type)
+    switch (HEADER(in_node)->type)
     {
         case AST_EXPRESSION:
         case AST_LIST:
@@ -149,217 +386,586 @@ static Boolean _has_list(AstNode *in_node)
 }
 
 
-static Boolean _ast_walk_int(AstNode *in_node, AstWalker in_walker, int in_level, void *io_user)
+static int _ast_count(AstNode *in_node)
 {
-    int i;
-    if (!in_node) return False;
-    if (in_walker(in_node, False, in_level, io_user)) return True;
-    if (_has_list(in_node))
+    if (!IS_FROZEN(in_node)) return in_node->count;
+    if (!_has_list(in_node)) return 0;
+    return FROZEN(in_node)->value.count;
+}
+
+
+/*********
+ Walking
+ */
+
+typedef struct AstWalkFrame
+{
+    AstNode         *node;
+    int             next;
+} AstWalkFrame;
+
+
+struct AstWalkStack
+{
+    AstWalkFrame    *frames;
+    int             capacity;
+    Boolean         owned;
+};
+
+
+AstWalkStack* ast_walk_stack_create(void)
+{
+    AstWalkStack *stack;
+    
+    stack = safe_malloc(sizeof(struct AstWalkStack));
+    stack->capacity = AST_WALK_DEPTH;
+    stack->frames = safe_malloc(sizeof(AstWalkFrame) * stack->capacity);
+    stack->owned = True;
+    return stack;
+}
+
+
+void ast_walk_stack_dispose(AstWalkStack *in_stack)
+{
+    if (!in_stack) return;
+    if (in_stack->owned) safe_free(in_stack->frames);
+    safe_free(in_stack);
+}
+
+
+/* pushes a frame for in_node at in_depth; a skipped node gets no children */
+static void _ast_walk_push(AstWalkStack *io_stack, int in_depth, AstNode *in_node, AstWalkResult in_result)
+{
+    AstWalkFrame *frames;
+    
+    if (in_depth == io_stack->capacity)
     {
-        for (i = 0; i < in_node->value.list.count; i++)
+        if (io_stack->owned)
+            io_stack->frames = safe_realloc(io_stack->frames, sizeof(AstWalkFrame) * io_stack->capacity * 2);
+        else
         {
-            if (_ast_walk_int(in_node->value.list.nodes[i], in_walker, in_level+1, io_user)) return True;
+            /* the initial frames belong to ast_walk(), on the C stack */
+            frames = safe_malloc(sizeof(AstWalkFrame) * io_stack->capacity * 2);
+            memcpy(frames, io_stack->frames, sizeof(AstWalkFrame) * io_stack->capacity);
+            io_stack->frames = frames;
+            io_stack->owned = True;
         }
+        io_stack->capacity *= 2;
     }
-    if (in_walker(in_node, True, in_level, io_user)) return True;
-    return False;
+    io_stack->frames[in_depth].node = in_node;
+    io_stack->frames[in_depth].next = ((in_result == AST_WALK_SKIP) ? INT_MAX : 0);
+}
+
+
+static void _ast_walk_tree(AstNode *in_tree, AstWalker in_walker, void *io_user, AstWalkStack *io_stack)
+{
+    AstWalkFrame *frame;
+    AstNode *child;
+    AstWalkResult result;
+    int depth;
+    
+    result = in_walker(in_tree, False, 0, io_user);
+    if (result == AST_WALK_STOP) return;
+    _ast_walk_push(io_stack, 0, in_tree, result);
+    depth = 1;
+    
+    while (depth > 0)
+    {
+        frame = io_stack->frames + depth - 1;
+        if (_has_list(frame->node) && (frame->next < frame->node->count))
+        {
+            child = _ast_children(frame->node)[frame->next++];
+            if (!child) continue;
+            result = in_walker(child, False, depth, io_user);
+            if (result == AST_WALK_STOP) return;
+            _ast_walk_push(io_stack, depth++, child, result);
+        }
+        else
+        {
+            depth--;
+            if (in_walker(frame->node, True, depth, io_user) == AST_WALK_STOP) return;
+        }
+    }
+}
+
+
+/* a frozen tree is walked by a linear scan, keeping the nodes whose subtrees enclose the
+ current node so they can be ended */
+static void _ast_walk_frozen(AstNode *in_tree, AstWalker in_walker, void *io_user, AstWalkStack *io_stack)
+{
+    AstFrozenNode *node, *end, *open;
+    AstWalkResult result;
+    int depth;
+    
+    depth = 0;
+    node = FROZEN(in_tree);
+    end = node + node->size;
+    while (node < end)
+    {
+        while (depth > 0)
+        {
+            open = FROZEN(io_stack->frames[depth-1].node);
+            if (open + open->size > node) break;
+            depth--;
+            if (in_walker((AstNode*)open, True, depth, io_user) == AST_WALK_STOP) return;
+        }
+        
+        result = in_walker((AstNode*)node, False, depth, io_user);
+        if (result == AST_WALK_STOP) return;
+        _ast_walk_push(io_stack, depth++, (AstNode*)node, result);
+        
+        if (result == AST_WALK_SKIP) node += node->size;
+        else node++;
+    }
+    while (depth > 0)
+    {
+        depth--;
+        if (in_walker(io_stack->frames[depth].node, True, depth, io_user) == AST_WALK_STOP) return;
+    }
+}
+
+
+void ast_walk_with(AstNode *in_tree, AstWalker in_walker, void *io_user, AstWalkStack *io_stack)
+{
+    if (!in_tree) return;
+    if (IS_FROZEN(in_tree))
+        _ast_walk_frozen(in_tree, in_walker, io_user, io_stack);
+    else
+        _ast_walk_tree(in_tree, in_walker, io_user, io_stack);
 }
 
 
 void ast_walk(AstNode *in_tree, AstWalker in_walker, void *io_user)
 {
-    _ast_walk_int(in_tree, in_walker, 0, io_user);
+    AstWalkFrame frames[AST_WALK_DEPTH];
+    AstWalkStack stack;
+    
+    stack.frames = frames;
+    stack.capacity = AST_WALK_DEPTH;
+    stack.owned = False;
+    ast_walk_with(in_tree, in_walker, io_user, &stack);
+    if (stack.owned) safe_free(stack.frames);
+}
+
+
+/*********
+ Serialization
+ */
+
+#define AST_MAX_PADDING 99
+#define AST_NUMBER_SIZE 64
+#define AST_BUFFER_SIZE 4096
+
+
+typedef struct AstSerializer
+{
+    AstFormat       format;
+    AstWriter       writer;
+    void            *sink;
+    Boolean         separate;
+} AstSerializer;
+
+
+static const char *type_names[] = {
+    [AST_NULL] = "null",
+    [AST_STATEMENT] = "statement",
+    [AST_PATH] = "path",
+    [AST_LIST] = "list",
+    [AST_EXPRESSION] = "expression",
+    [AST_CONTROL] = "control",
+    [AST_STRING] = "string",
+    [AST_INTEGER] = "integer",
+    [AST_REAL] = "real",
+    [AST_OPERATOR] = "operator",
+    [AST_COLOUR] = "colour",
+    [AST_BOOLEAN] = "boolean",
+};
+
+
+static void _ast_put(AstSerializer *in_serializer, const char *in_text)
+{
+    in_serializer->writer(in_serializer->sink, in_text, strlen(in_text));
 }
 
 
-static const char* _ast_padding(int in_amount)
+/* escapes the text as the contents of a JSON string */
+static void _ast_put_json_string(AstSerializer *in_serializer, const char *in_text)
 {
-    if (in_amount > 99)
-        in_amount = 99;
-    static char whitespace[1000] =
-    "                                                                                                    "
-    "                                                                                                    "
-    "                                                                                                    "
-    "                                                                                                    "
-    "                                                                                                    "
-    "                                                                                                    "
-    "                                                                                                    "
-    "                                                                                                    "
-    "                                                                                                    "
-    "                                                                                                    ";
-    static int last_amount = 0;
-    whitespace[last_amount] = ' ';
-    last_amount = in_amount;
-    whitespace[last_amount] = 0;
-    return whitespace;
+    const char *run;
+    char escape[8];
+    
+    for (run = in_text; *in_text; in_text++)
+    {
+        if ((*in_text != '"') && (*in_text != '\\') && ((unsigned char)*in_text >= 0x20)) continue;
+        if (in_text > run) in_serializer->writer(in_serializer->sink, run, in_text - run);
+        if ((*in_text == '"') || (*in_text == '\\')) sprintf(escape, "\\%c", *in_text);
+        else sprintf(escape, "\\u%04x", (unsigned char)*in_text);
+        _ast_put(in_serializer, escape);
+        run = in_text + 1;
+    }
+    if (in_text > run) in_serializer->writer(in_serializer->sink, run, in_text - run);
 }
 
 
-static const char* _ast_node_desc(AstNode *in_node, Boolean in_end, int in_level)
+/* the value of a literal, formatted for the text representation */
+static const char* _ast_literal_text(AstNode *in_node, char *out_buffer)
 {
-    static char buffer[2048];
-    long offset;
+    switch (HEADER(in_node)->type)
+    {
+        case AST_STRING:
+            return ast_text(in_node);
+        case AST_INTEGER:
+        case AST_COLOUR:
+            sprintf(out_buffer, "%ld", (long)_ast_value(in_node)->integer);
+            return out_buffer;
+        case AST_REAL:
+            sprintf(out_buffer, "%fd", _ast_value(in_node)->real);
+            return out_buffer;
+        case AST_OPERATOR:
+            return operator_names[_ast_value(in_node)->integer];
+        case AST_BOOLEAN:
+            return ((_ast_value(in_node)->integer) ? "true" : "false");
+        default:
+            return NULL;
+    }
+}
+
+
+/* <type:value> for a literal; <type> { ... } for a list */
+static void _ast_write_text(AstSerializer *in_serializer, AstNode *in_node, Boolean in_end, int in_level)
+{
+    static const char padding[AST_MAX_PADDING + 1] =
+        "                                                                                                   ";
+    char number[AST_NUMBER_SIZE];
+    const char *text;
+    int width;
     
-    buffer[0] = 0;
+    width = in_level * 2;
+    if (width > AST_MAX_PADDING) width = AST_MAX_PADDING;
     
     if (in_end)
     {
-        switch (in_node->type)
-        {
-            case AST_STATEMENT:
-            case AST_PATH:
-            case AST_LIST:
-            case AST_EXPRESSION:
-            case AST_CONTROL:
-                sprintf(buffer, "%s}\n", _ast_padding(in_level * 2));
-                break;
-            default:
-                break;
-        }
-        return buffer;
+        if (!_has_list(in_node)) return;
+        in_serializer->writer(in_serializer->sink, padding, width);
+        _ast_put(in_serializer, "}\n");
+        return;
     }
     
-    offset = sprintf(buffer, "%s<", _ast_padding(in_level * 2));
-    switch (in_node->type)
+    in_serializer->writer(in_serializer->sink, padding, width);
+    _ast_put(in_serializer, "<");
+    if (HEADER(in_node)->type > AST_BOOLEAN)
+    {
+        _ast_put(in_serializer, "unknown>\n");
+        return;
+    }
+    _ast_put(in_serializer, type_names[HEADER(in_node)->type]);
+    if (_has_list(in_node))
+    {
+        _ast_put(in_serializer, "> {\n");
+        return;
+    }
+    
+    text = _ast_literal_text(in_node, number);
+    if (text)
+    {
+        if (ast_is(in_node, AST_STRING)) _ast_put(in_serializer, ":\"");
+        else _ast_put(in_serializer, ":");
+        _ast_put(in_serializer, text);
+        if (ast_is(in_node, AST_STRING)) _ast_put(in_serializer, "\"");
+    }
+    _ast_put(in_serializer, ">\n");
+}
+
+
+/* {"type":"<type>","value":<value>} for a literal; {"type":"<type>","children":[...]} for a list */
+static void _ast_write_json(AstSerializer *io_serializer, AstNode *in_node, Boolean in_end)
+{
+    char number[AST_NUMBER_SIZE];
+    
+    if (in_end)
+    {
+        if (_has_list(in_node)) _ast_put(io_serializer, "]}");
+        io_serializer->separate = True;
+        return;
+    }
+    
+    if (io_serializer->separate) _ast_put(io_serializer, ",");
+    io_serializer->separate = True;
+    
+    _ast_put(io_serializer, "{\"type\":\"");
+    if (HEADER(in_node)->type > AST_BOOLEAN) _ast_put(io_serializer, "unknown");
+    else _ast_put(io_serializer, type_names[HEADER(in_node)->type]);
+    _ast_put(io_serializer, "\"");
+    
+    if (_has_list(in_node))
+    {
+        _ast_put(io_serializer, ",\"children\":[");
+        io_serializer->separate = False;
+        return;
+    }
+    
+    switch (HEADER(in_node)->type)
     {
-        case AST_STATEMENT:
-            offset += sprintf(buffer + offset, "statement");
-            break;
-        case AST_PATH:
-            offset += sprintf(buffer + offset, "path");
-            break;
-        case AST_LIST:
-            offset += sprintf(buffer + offset, "list");
-            break;
-        case AST_EXPRESSION:
-            offset += sprintf(buffer + offset, "expression");
-            break;
-        case AST_CONTROL:
-            offset += sprintf(buffer + offset, "control");
-            break;
-            
-        case AST_NULL:
-            offset += sprintf(buffer + offset, "null>\n");
-            return buffer;
         case AST_STRING:
-            offset += sprintf(buffer + offset, "string:\"%s\">\n", in_node->value.string);
-            return buffer;
-        case AST_INTEGER:
-            offset += sprintf(buffer + offset, "integer:%ld>\n", in_node->value.integer);
-            return buffer;
-        case AST_REAL:
-            offset += sprintf(buffer + offset, "real:%fd>\n", in_node->value.real);
-            return buffer;
         case AST_OPERATOR:
-            offset += sprintf(buffer + offset, "operator:%s>\n", in_node->value.string);
-            return buffer;
+            _ast_put(io_serializer, ",\"value\":\"");
+            _ast_put_json_string(io_serializer, _ast_literal_text(in_node, number));
+            _ast_put(io_serializer, "\"");
+            break;
+        case AST_INTEGER:
         case AST_COLOUR:
-            offset += sprintf(buffer + offset, "colour:%ld>\n", in_node->value.integer);
-            return buffer;
         case AST_BOOLEAN:
-            offset += sprintf(buffer + offset, "boolean:%s>\n", ((in_node->value.integer)?"true":"false"));
-            return buffer;
+            _ast_put(io_serializer, ",\"value\":");
+            _ast_put(io_serializer, _ast_literal_text(in_node, number));
+            break;
+        case AST_REAL:
+            /* round-trips the double; JSON has no infinities or NaN */
+            _ast_put(io_serializer, ",\"value\":");
+            if (isfinite(_ast_value(in_node)->real))
+            {
+                sprintf(number, "%.17g", _ast_value(in_node)->real);
+                _ast_put(io_serializer, number);
+            }
+            else
+                _ast_put(io_serializer, "null");
+            break;
         default:
-            if (!in_end) printf(buffer + offset, "unknown>\n");
-            return buffer;
+            break;
     }
-    offset += sprintf(buffer + offset, "> {\n");
-    
-    return buffer;
+    _ast_put(io_serializer, "}");
 }
 
 
-Boolean ast_string_walker(AstNode *in_node, Boolean in_end, int in_level, void *io_user)
+static AstWalkResult _ast_serialize_walker(AstNode *in_node, Boolean in_end, int in_level, void *io_user)
 {
-    const char *text;
-    long text_length, string_length;
+    AstSerializer *serializer = io_user;
     
-    text = _ast_node_desc(in_node, in_end, in_level);
-    text_length = strlen(text);
+    if (serializer->format == AST_FORMAT_JSON)
+        _ast_write_json(serializer, in_node, in_end);
+    else
+        _ast_write_text(serializer, in_node, in_end, in_level);
+    return AST_WALK_CONTINUE;
+}
+
+
+void ast_write(AstNode *in_tree, AstFormat in_format, AstWriter in_writer, void *io_sink)
+{
+    AstSerializer serializer;
     
-    if (! (*(char**)io_user)) string_length = 0;
-    else string_length = strlen((const char *)*(char**)io_user);
-    *(char**)io_user = safe_realloc(*(char**)io_user, text_length + string_length + 1);
-    strcpy(*(char**)io_user + string_length, text);
+    serializer.format = in_format;
+    serializer.writer = in_writer;
+    serializer.sink = io_sink;
+    serializer.separate = False;
+    ast_walk(in_tree, _ast_serialize_walker, &serializer);
+    if ((in_format == AST_FORMAT_JSON) && in_tree) in_writer(io_sink, "\n", 1);
+}
+
+
+/* output is staged in a buffer rather than written piece by piece */
+typedef struct AstFileSink
+{
+    FILE            *file;
+    long            length;
+    char            buffer[AST_BUFFER_SIZE];
+} AstFileSink;
+
+
+static void _ast_file_writer(void *io_sink, const char *in_text, long in_length)
+{
+    AstFileSink *sink = io_sink;
     
-    return False;
+    if (sink->length + in_length > AST_BUFFER_SIZE)
+    {
+        fwrite(sink->buffer, 1, sink->length, sink->file);
+        sink->length = 0;
+    }
+    if (in_length > AST_BUFFER_SIZE)
+    {
+        fwrite(in_text, 1, in_length, sink->file);
+        return;
+    }
+    memcpy(sink->buffer + sink->length, in_text, in_length);
+    sink->length += in_length;
 }
 
 
-Boolean ast_debug_walker(AstNode *in_node, Boolean in_end, int in_level, void *io_user)
+void ast_write_file(AstNode *in_tree, AstFormat in_format, FILE *in_file)
 {
-    const char *text;
-    text = _ast_node_desc(in_node, in_end, in_level);
-    printf("%s", text);
-    return False;
+    AstFileSink sink;
+    
+    sink.file = in_file;
+    sink.length = 0;
+    ast_write(in_tree, in_format, _ast_file_writer, &sink);
+    if (sink.length > 0) fwrite(sink.buffer, 1, sink.length, in_file);
 }
 
 
-static Boolean _has_string(AstNode *in_node)
+/* doubles as it fills, so a tree of any size is written in linear time */
+typedef struct AstStringSink
 {
-    switch (in_node->type)
+    char            *text;
+    long            length;
+    long            capacity;
+} AstStringSink;
+
+
+static void _ast_string_writer(void *io_sink, const char *in_text, long in_length)
+{
+    AstStringSink *sink = io_sink;
+    
+    if (sink->length + in_length + 1 > sink->capacity)
     {
-        case AST_OPERATOR:
-        case AST_STRING:
-            return True;
-        default:
-            return False;
+        while (sink->length + in_length + 1 > sink->capacity) sink->capacity *= 2;
+        sink->text = safe_realloc(sink->text, sink->capacity);
     }
+    memcpy(sink->text + sink->length, in_text, in_length);
+    sink->length += in_length;
+}
+
+
+char* ast_write_string(AstNode *in_tree, AstFormat in_format)
+{
+    AstStringSink sink;
+    
+    if (!in_tree) return NULL;
+    sink.capacity = AST_BUFFER_SIZE;
+    sink.length = 0;
+    sink.text = safe_malloc(sink.capacity);
+    ast_write(in_tree, in_format, _ast_string_writer, &sink);
+    sink.text[sink.length] = 0;
+    return sink.text;
+}
+
+
+AstWalkResult ast_debug_walker(AstNode *in_node, Boolean in_end, int in_level, void *io_user)
+{
+    AstFileSink sink;
+    AstSerializer serializer;
+    
+    (void)io_user;
+    sink.file = stdout;
+    sink.length = 0;
+    serializer.format = AST_FORMAT_TEXT;
+    serializer.writer = _ast_file_writer;
+    serializer.sink = &sink;
+    _ast_write_text(&serializer, in_node, in_end, in_level);
+    fwrite(sink.buffer, 1, sink.length, stdout);
+    return AST_WALK_CONTINUE;
 }
 
 
+static void _ast_cache_unmap(AstNode *in_tree);
+
+/* arena trees are released with their arena, frozen and mapped trees in one go from their root */
 void ast_dispose(AstNode *in_tree)
 {
     int i;
     if (!in_tree) return;
-    if (_has_list(in_tree))
+    if (IS_MAPPED(in_tree))
+    {
+        _ast_cache_unmap(in_tree);
+        return;
+    }
+    if (IS_FROZEN(in_tree))
     {
-        for (i = 0; i < in_tree->value.list.count; i++)
-            ast_dispose(in_tree->value.list.nodes[i]);
+        assert(HEADER(in_tree)->flags & AST_FROZEN_ROOT);
+        safe_free(in_tree);
+        return;
     }
-    else if (_has_string(in_tree))
+    if (HEADER(in_tree)->flags & AST_ARENA) return;
+    if (IS_LITERAL(in_tree)) safe_free((char*)in_tree->value.literal.text);
+    if (_has_list(in_tree))
     {
-        if (in_tree->value.string)
-            safe_free(in_tree->value.string);
+        for (i = 0; i < in_tree->count; i++)
+            ast_dispose(_ast_children(in_tree)[i]);
+        if (in_tree->count > AST_INLINE_CHILDREN) safe_free(in_tree->value.list.children.nodes);
     }
     safe_free(in_tree);
 }
 
 
+AstNode* ast_copy(AstNode *in_tree, Arena *in_arena)
+{
+    AstNode *copy, *child;
+    AstNode **children;
+    const char *text;
+    long length;
+    int i;
+    
+    if (!in_tree) return NULL;
+    if (IS_LITERAL(in_tree))
+    {
+        text = _ast_text(in_tree, &length);
+        return ast_create_literal(in_arena, text, length);
+    }
+    copy = ast_create(in_arena, HEADER(in_tree)->type);
+    if (!_has_list(in_tree))
+    {
+        copy->value.scalar = _ast_scalar(in_tree);
+        return copy;
+    }
+    if (IS_FROZEN(in_tree))
+    {
+        child = ast_child(in_tree, AST_FIRST);
+        for (i = 0; i < _ast_count(in_tree); i++, child = ast_skip(child))
+            ast_append(copy, ast_copy(child, in_arena));
+        return copy;
+    }
+    
+    copy->count = in_tree->count;
+    if (copy->count > AST_INLINE_CHILDREN)
+        copy->value.list.children.nodes = _ast_array(in_arena, _ast_capacity(copy->count));
+    children = _ast_children(copy);
+    for (i = 0; i < copy->count; i++)
+        children[i] = ast_copy(_ast_children(in_tree)[i], in_arena);
+    return copy;
+}
+
+
 AstNode* ast_child(AstNode *in_node, int in_child)
 {
     assert(in_node);
     assert(in_child >= -1);
     if (!_has_list(in_node)) return NULL;
-    if (in_node->value.list.count == 0) return NULL;
+    if (_ast_count(in_node) == 0) return NULL;
     if (in_child == AST_LAST)
-        in_child = in_node->value.list.count-1;
-    else if (in_child >= in_node->value.list.count)
+        in_child = _ast_count(in_node)-1;
+    else if (in_child >= _ast_count(in_node))
         return NULL;
-    return in_node->value.list.nodes[in_child];
+    if (IS_FROZEN(in_node))
+    {
+        AstFrozenNode *child;
+        for (child = FROZEN(in_node) + 1; in_child > 0; in_child--)
+            child += child->size;
+        return (AstNode*)child;
+    }
+    return _ast_children(in_node)[in_child];
 }
 
 
+/* the following children move up to close the gap */
 AstNode* ast_remove(AstNode *in_node, int in_child)
 {
     assert(in_node);
     assert(in_child >= -1);
     
     AstNode *result;
+    AstNode **children;
     
+    assert(!IS_FROZEN(in_node));
     if (!_has_list(in_node)) return NULL;
-    if (in_node->value.list.count == 0) return NULL;
+    if (in_node->count == 0) return NULL;
     if (in_child == AST_LAST)
-        in_child = in_node->value.list.count-1;
-    else if (in_child >= in_node->value.list.count)
+        in_child = in_node->count-1;
+    else if (in_child >= in_node->count)
         return NULL;
     
-    result = in_node->value.list.nodes[in_child];
-    
-    /* don't actually remove the child, just insert a NULL pointer,
-     our walker function will skip over this anyway and our tree should
-     be short-lived enough that it doesn't matter */
-    in_node->value.list.nodes[in_child] = NULL;
+    children = _ast_children(in_node);
+    result = children[in_child];
+    memmove(children + in_child, children + in_child + 1,
+            sizeof(AstNode*) * (in_node->count - in_child - 1));
+    in_node->count--;
+    _ast_shrink(in_node);
     
     return result;
 }
@@ -370,7 +976,7 @@ Boolean ast_is(AstNode *in_node, AstNodeType in_type)
     if (!in_node)
         return (in_type == AST_NULL);
     else
-        return (in_node->type == in_type);
+        return (HEADER(in_node)->type == in_type);
 }
 
 
@@ -379,17 +985,22 @@ void ast_insert(AstNode *in_node, int in_before, AstNode *in_child)
     assert(in_node);
     assert(in_before >= 0);
     assert(in_child);
+    assert(!IS_FROZEN(in_node));
+    assert(((HEADER(in_child)->flags ^ HEADER(in_node)->flags) & AST_ARENA) == 0);
+    
+    AstNode **children;
     
-    in_node->value.list.nodes = safe_realloc(in_node->value.list.nodes,
-                                             sizeof(AstNode*) * (++in_node->value.list.count));
+    _ast_grow(in_node);
+    in_node->count++;
+    children = _ast_children(in_node);
     
-    if (in_before < in_node->value.list.count-1)
-        memmove(in_node->value.list.nodes + in_before + 1, in_node->value.list.nodes + in_before,
-                sizeof(AstNode*) * ( in_node->value.list.count - in_before - 1 ));
+    if (in_before < in_node->count-1)
+        memmove(children + in_before + 1, children + in_before,
+                sizeof(AstNode*) * ( in_node->count - in_before - 1 ));
     else
-        in_before = in_node->value.list.count-1;
+        in_before = in_node->count-1;
     
-    in_node->value.list.nodes[ in_before ] = in_child;
+    children[ in_before ] = in_child;
 }
 
 
@@ -401,18 +1012,597 @@ void ast_prepend(AstNode *in_node, AstNode *in_child)
 
 int ast_count(AstNode *in_node)
 {
-    return in_node->value.list.count;
+    return _ast_count(in_node);
 }
 
 
-/* TODO: need to fix this to do a case-insensitive comparison on UTF-8 strings;
- may need an external string library */
+/* identifiers are case-insensitive; compares the case-folded atoms */
 Boolean ast_text_is(AstNode *in_node, const char *in_text)
 {
-    if (in_node->type != AST_STRING) return False;
-    return (strcmp(in_node->value.string, in_text) == 0);
+    return ast_text_is_n(in_node, in_text, strlen(in_text));
 }
 
+
+/* literals are compared exactly */
+Boolean ast_text_is_n(AstNode *in_node, const char *in_text, long in_length)
+{
+    const char *text;
+    long length;
+    
+    if (!ast_is(in_node, AST_STRING)) return False;
+    if (!IS_LITERAL(in_node)) return intern_same(_ast_atom(in_node), intern(in_text, in_length));
+    text = _ast_text(in_node, &length);
+    return ((length == in_length) && (memcmp(text, in_text, length) == 0));
+}
+
+
+Boolean ast_atom_is(AstNode *in_node, Atom in_atom)
+{
+    if (!ast_is(in_node, AST_STRING)) return False;
+    if (in_atom == ATOM_NONE) return False;
+    if (IS_LITERAL(in_node)) return ast_text_is_n(in_node, intern_text(in_atom), intern_length(in_atom));
+    return intern_same(_ast_atom(in_node), in_atom);
+}
+
+
+Atom ast_atom(AstNode *in_node)
+{
+    if (!ast_is(in_node, AST_STRING)) return ATOM_NONE;
+    return _ast_atom(in_node);
+}
+
+
+const char* ast_text(AstNode *in_node)
+{
+    long length;
+    
+    if (!ast_is(in_node, AST_STRING)) return NULL;
+    return _ast_text(in_node, &length);
+}
+
+
+AstOperator ast_operator(AstNode *in_node)
+{
+    if (!ast_is(in_node, AST_OPERATOR)) return AST_OP_NONE;
+    return (AstOperator)_ast_value(in_node)->integer;
+}
+
+
+const char* ast_operator_name(AstOperator in_operator)
+{
+    assert((in_operator >= AST_OP_NONE) && (in_operator < AST_OPERATOR_COUNT));
+    return operator_names[in_operator];
+}
+
+static long _ast_size(AstNode *in_node)
+{
+    long size;
+    int i;
+    
+    if (!in_node) return 0;
+    if (IS_FROZEN(in_node)) return FROZEN(in_node)->size;
+    size = 1;
+    if (_has_list(in_node))
+    {
+        for (i = 0; i < in_node->count; i++)
+            size += _ast_size(_ast_children(in_node)[i]);
+    }
+    return size;
+}
+
+
+long ast_size(AstNode *in_node)
+{
+    return _ast_size(in_node);
+}
+
+
+/* bytes of literal text in a subtree, with their terminators */
+static long _ast_literal_size(AstNode *in_node)
+{
+    AstFrozenNode *node;
+    long size;
+    int i;
+    
+    if (!in_node) return 0;
+    size = 0;
+    if (IS_FROZEN(in_node))
+    {
+        for (node = FROZEN(in_node); node < FROZEN(in_node) + FROZEN(in_node)->size; node++)
+        {
+            if (node->header.flags & AST_LITERAL) size += node->value.literal.length + 1;
+        }
+    }
+    else if (IS_LITERAL(in_node))
+        size = in_node->value.literal.length + 1;
+    else if (_has_list(in_node))
+    {
+        for (i = 0; i < in_node->count; i++)
+            size += _ast_literal_size(_ast_children(in_node)[i]);
+    }
+    return size;
+}
+
+
+/* copies the text of a literal to *io_text, after the nodes of the frozen tree */
+static void _ast_freeze_literal(AstNode *in_node, AstFrozenNode *out_node, char **io_text)
+{
+    const char *text;
+    long length;
+    
+    text = _ast_text(in_node, &length);
+    memcpy(*io_text, text, length);
+    (*io_text)[length] = 0;
+    out_node->header.flags |= AST_LITERAL;
+    out_node->value.literal.offset = *io_text - (char*)out_node;
+    out_node->value.literal.length = length;
+    *io_text += length + 1;
+}
+
+
+/* writes the subtree at out_node onwards and returns the node that follows it */
+static AstFrozenNode* _ast_freeze(AstNode *in_node, AstFrozenNode *out_node, char **io_text)
+{
+    AstFrozenNode *next;
+    AstNode *child;
+    int i;
+    
+    out_node->header.type = in_node->header.type;
+    out_node->header.flags = AST_FROZEN;
+    memset(&(out_node->value), 0, sizeof(AstValue));
+    next = out_node + 1;
+    
+    if (_has_list(in_node))
+    {
+        /* gaps left by NULL children are closed up */
+        for (i = 0; i < in_node->count; i++)
+        {
+            child = _ast_children(in_node)[i];
+            if (!child) continue;
+            next = _ast_freeze(child, next, io_text);
+            out_node->value.count++;
+        }
+    }
+    else if (IS_LITERAL(in_node))
+        _ast_freeze_literal(in_node, out_node, io_text);
+    else
+        out_node->value = in_node->value.scalar;
+    
+    out_node->size = next - out_node;
+    return next;
+}
+
+
+/* the text of literals follows the nodes in the same block */
+AstNode* ast_freeze(AstNode *in_tree)
+{
+    AstFrozenNode *frozen;
+    AstNode *node;
+    long size, text_size, i;
+    char *text;
+    
+    if (!in_tree) return NULL;
+    size = ast_size(in_tree);
+    text_size = _ast_literal_size(in_tree);
+    assert(sizeof(AstFrozenNode) * size + text_size <= UINT32_MAX);
+    frozen = safe_malloc(sizeof(AstFrozenNode) * size + text_size);
+    text = (char*)(frozen + size);
+    if (IS_FROZEN(in_tree))
+    {
+        memcpy(frozen, in_tree, sizeof(AstFrozenNode) * size);
+        /* the copy stands on its own, even if the original was mapped */
+        for (i = 0; i < size; i++)
+        {
+            node = (AstNode*)(FROZEN(in_tree) + i);
+            if (IS_LITERAL(node))
+                _ast_freeze_literal(node, frozen + i, &text);
+            else if (IS_MAPPED(node))
+                frozen[i].value = _ast_scalar(node);
+            frozen[i].header.flags &= ~(AST_MAPPED | AST_FROZEN_ROOT);
+        }
+    }
+    else
+        _ast_freeze(in_tree, frozen, &text);
+    frozen->header.flags |= AST_FROZEN_ROOT;
+    return (AstNode*)frozen;
+}
+
+
+long ast_memory(AstNode *in_tree)
+{
+    long memory;
+    int i;
+    
+    if (!in_tree) return 0;
+    if (IS_FROZEN(in_tree)) return sizeof(AstFrozenNode) * FROZEN(in_tree)->size + _ast_literal_size(in_tree);
+    memory = sizeof(struct AstNode);
+    if (IS_LITERAL(in_tree)) memory += in_tree->value.literal.length + 1;
+    if (_has_list(in_tree))
+    {
+        if (in_tree->count > AST_INLINE_CHILDREN)
+            memory += sizeof(AstNode*) * _ast_capacity(in_tree->count);
+        for (i = 0; i < in_tree->count; i++)
+            memory += ast_memory(_ast_children(in_tree)[i]);
+    }
+    return memory;
+}
+
+
+Boolean ast_is_frozen(AstNode *in_node)
+{
+    return (in_node && IS_FROZEN(in_node));
+}
+
+
+AstNode* ast_skip(AstNode *in_node)
+{
+    assert(IS_FROZEN(in_node));
+    return (AstNode*)(FROZEN(in_node) + FROZEN(in_node)->size);
+}
+
+
+/*********
+ Caching
+ */
+
+/* the on-disk form of a frozen tree: this header, the nodes, the string table and then the text
+ of the strings.  it holds no pointers, so it's used where it's mapped without being read in.
+ little-endian throughout; bump the version when the header, the nodes or the node types change */
+#define AST_CACHE_MAGIC "RLBA"
+#define AST_CACHE_VERSION 2
+#define AST_CACHE_MIN_SLOTS 16
+
+
+typedef struct AstCacheHeader
+{
+    char            magic[4];
+    uint32_t        version;
+    /* operator nodes hold AstOperator codes */
+    uint32_t        operators;
+    uint32_t        nodes;
+    uint32_t        strings;
+    /* offsets of the text of the strings and of the end of the file */
+    uint32_t        text;
+    uint32_t        length;
+    /* the modification time and size of the source the tree was parsed from, when it was saved;
+     the tree is only loaded for a source that still has exactly these */
+    uint32_t        source_nanoseconds;
+    int64_t         source_seconds;
+    uint64_t        source_size;
+} AstCacheHeader;
+
+
+/* the atom is 0 in the file and is filled in as the file is loaded, before the mapping is made
+ read-only; the mapping is private, so nothing is written back */
+typedef struct AstCacheString
+{
+    uint32_t        offset;
+    uint32_t        length;
+    Atom            atom;
+} AstCacheString;
+
+
+/* an entry of the table that gives each distinct atom one string */
+typedef struct AstCacheSlot
+{
+    Atom            atom;
+    uint32_t        string;
+    uint32_t        offset;
+} AstCacheSlot;
+
+
+static Boolean _ast_little_endian(void)
+{
+    uint16_t probe = 1;
+    return (*(unsigned char*)&probe == 1);
+}
+
+
+static AstCacheString* _ast_cache_strings(AstCacheHeader *in_header)
+{
+    return (AstCacheString*)((char*)(in_header + 1) + sizeof(AstFrozenNode) * in_header->nodes);
+}
+
+
+static Atom _ast_cache_atom(AstNode *in_node)
+{
+    AstCacheHeader *header;
+    
+    /* the string indices were checked, and the strings interned, as the file was loaded */
+    header = (AstCacheHeader*)(FROZEN(in_node) - FROZEN(in_node)->value.mapped.node) - 1;
+    assert(FROZEN(in_node)->value.mapped.string < header->strings);
+    return _ast_cache_strings(header)[FROZEN(in_node)->value.mapped.string].atom;
+}
+
+
+static void _ast_cache_unmap(AstNode *in_tree)
+{
+    AstCacheHeader *header;
+    
+    assert(HEADER(in_tree)->flags & AST_FROZEN_ROOT);
+    header = (AstCacheHeader*)in_tree - 1;
+    munmap(header, header->length);
+}
+
+
+static AstCacheSlot* _ast_cache_slot(AstCacheSlot *in_slots, long in_slot_count, Atom in_atom)
+{
+    long slot;
+    
+    slot = (in_atom * 2654435761u) & (in_slot_count - 1);
+    while ((in_slots[slot].atom != ATOM_NONE) && (in_slots[slot].atom != in_atom))
+        slot = (slot + 1) & (in_slot_count - 1);
+    return in_slots + slot;
+}
+
+
+/* the modification time, to the nanosecond where the system records it, and the size of a source */
+static Boolean _ast_cache_stamp(const char *in_source_pathname, AstCacheHeader *out_header)
+{
+    struct stat info;
+    
+    if ((stat(in_source_pathname, &info) != 0) || (info.st_size < 0)) return False;
+    out_header->source_seconds = info.st_mtime;
+#ifdef __APPLE__
+    out_header->source_nanoseconds = (uint32_t)info.st_mtimespec.tv_nsec;
+#else
+    out_header->source_nanoseconds = (uint32_t)info.st_mtim.tv_nsec;
+#endif
+    out_header->source_size = (uint64_t)info.st_size;
+    return True;
+}
+
+
+static Boolean _ast_cache_write(const char *in_pathname, const char *in_image, long in_length)
+{
+    char *temporary;
+    Boolean written;
+    int fd;
+    
+    /* written aside and renamed into place, so a reader never maps a partial file */
+    temporary = safe_malloc(strlen(in_pathname) + 5);
+    sprintf(temporary, "%s.tmp", in_pathname);
+    written = False;
+    fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0)
+    {
+        written = (write(fd, in_image, in_length) == in_length);
+        if (close(fd) != 0) written = False;
+        if (written) written = (rename(temporary, in_pathname) == 0);
+        if (!written) unlink(temporary);
+    }
+    safe_free(temporary);
+    return written;
+}
+
+
+Boolean ast_save(AstNode *in_tree, const char *in_pathname, const char *in_source_pathname)
+{
+    AstNode *frozen;
+    AstFrozenNode *nodes, *image_nodes;
+    AstCacheHeader *header;
+    AstCacheString *strings;
+    AstCacheSlot *slots, *slot;
+    long size, slot_count, string_count, text_length, literal_length, length, i;
+    Boolean saved;
+    char *image, *literals;
+    AstCacheHeader source;
+    
+    assert(in_source_pathname);
+    if ((!in_tree) || (!_ast_little_endian())) return False;
+    if (!_ast_cache_stamp(in_source_pathname, &source)) return False;
+    frozen = (IS_FROZEN(in_tree) ? in_tree : ast_freeze(in_tree));
+    nodes = FROZEN(frozen);
+    size = nodes->size;
+    
+    /* each distinct atom is given a string; literals keep their own text, after the strings */
+    for (slot_count = AST_CACHE_MIN_SLOTS; slot_count < size * 2; slot_count *= 2) {}
+    slots = safe_malloc(sizeof(AstCacheSlot) * slot_count);
+    memset(slots, 0, sizeof(AstCacheSlot) * slot_count);
+    string_count = text_length = 0;
+    for (i = 0; i < size; i++)
+    {
+        if ((nodes[i].header.type != AST_STRING) || (nodes[i].header.flags & AST_LITERAL)) continue;
+        slot = _ast_cache_slot(slots, slot_count, _ast_atom((AstNode*)(nodes + i)));
+        if (slot->atom != ATOM_NONE) continue;
+        slot->atom = _ast_atom((AstNode*)(nodes + i));
+        slot->string = string_count++;
+        slot->offset = text_length;
+        text_length += intern_length(slot->atom) + 1;
+    }
+    
+    literal_length = _ast_literal_size(frozen);
+    text_length += literal_length;
+    
+    length = sizeof(AstCacheHeader) + sizeof(AstFrozenNode) * size + sizeof(AstCacheString) * string_count;
+    if (length + text_length > UINT32_MAX)
+    {
+        saved = False;
+        goto done;
+    }
+    image = safe_malloc(length + text_length);
+    memset(image, 0, length + text_length);
+    
+    header = (AstCacheHeader*)image;
+    memcpy(header->magic, AST_CACHE_MAGIC, sizeof(header->magic));
+    header->version = AST_CACHE_VERSION;
+    header->operators = AST_OPERATOR_COUNT;
+    header->nodes = size;
+    header->strings = string_count;
+    header->text = length;
+    header->length = length + text_length;
+    header->source_nanoseconds = source.source_nanoseconds;
+    header->source_seconds = source.source_seconds;
+    header->source_size = source.source_size;
+    
+    strings = _ast_cache_strings(header);
+    for (i = 0; i < slot_count; i++)
+    {
+        if (slots[i].atom == ATOM_NONE) continue;
+        strings[slots[i].string].offset = slots[i].offset;
+        strings[slots[i].string].length = intern_length(slots[i].atom);
+        memcpy(image + header->text + slots[i].offset, intern_text(slots[i].atom), intern_length(slots[i].atom));
+    }
+    
+    image_nodes = (AstFrozenNode*)(header + 1);
+    literals = image + header->length - literal_length;
+    for (i = 0; i < size; i++)
+    {
+        image_nodes[i].header.type = nodes[i].header.type;
+        image_nodes[i].header.flags = AST_FROZEN | AST_MAPPED;
+        image_nodes[i].size = nodes[i].size;
+        if (nodes[i].header.flags & AST_LITERAL)
+            _ast_freeze_literal((AstNode*)(nodes + i), image_nodes + i, &literals);
+        else if (nodes[i].header.type == AST_STRING)
+        {
+            slot = _ast_cache_slot(slots, slot_count, _ast_atom((AstNode*)(nodes + i)));
+            image_nodes[i].value.mapped.string = slot->string;
+            image_nodes[i].value.mapped.node = i;
+        }
+        else
+            image_nodes[i].value = nodes[i].value;
+    }
+    image_nodes[0].header.flags |= AST_FROZEN_ROOT;
+    
+    saved = _ast_cache_write(in_pathname, image, header->length);
+    safe_free(image);
+    
+done:
+    safe_free(slots);
+    if (frozen != in_tree) ast_dispose(frozen);
+    return saved;
+}
+
+
+/* a node of a mapped tree; it may only refer to other nodes within its subtree and to text within
+ the file, so that a damaged file is never trusted.  the size of the root is checked with the
+ header and that of each other node with its parent, which comes before it */
+static Boolean _ast_cache_node_valid(AstCacheHeader *in_header, uint32_t in_index)
+{
+    AstFrozenNode *nodes, *node;
+    uint64_t text, child, end, count;
+    unsigned char flags;
+    
+    nodes = (AstFrozenNode*)(in_header + 1);
+    node = nodes + in_index;
+    flags = AST_FROZEN | AST_MAPPED | ((in_index == 0) ? AST_FROZEN_ROOT : 0);
+    if (node->header.flags == (flags | AST_LITERAL))
+    {
+        if (node->header.type != AST_STRING) return False;
+        text = (uint64_t)((char*)node - (char*)in_header) + node->value.literal.offset;
+        return ( (node->size == 1) && (text >= in_header->text) &&
+                (text + node->value.literal.length < in_header->length) &&
+                (((char*)in_header)[text + node->value.literal.length] == 0) );
+    }
+    if (node->header.flags != flags) return False;
+    
+    switch (node->header.type)
+    {
+        case AST_EXPRESSION:
+        case AST_LIST:
+        case AST_PATH:
+        case AST_STATEMENT:
+        case AST_CONTROL:
+            /* the children's subtrees fill the node's exactly */
+            end = (uint64_t)in_index + node->size;
+            count = 0;
+            for (child = in_index + 1; child < end; child += nodes[child].size)
+            {
+                if ((nodes[child].size == 0) || (nodes[child].size > end - child)) return False;
+                count++;
+            }
+            return ((child == end) && (count == node->value.count));
+        case AST_STRING:
+            return ( (node->size == 1) && (node->value.mapped.string < in_header->strings) &&
+                    (node->value.mapped.node == in_index) );
+        case AST_OPERATOR:
+            return ( (node->size == 1) && (node->value.integer >= AST_OP_NONE) &&
+                    (node->value.integer < AST_OPERATOR_COUNT) );
+        case AST_NULL:
+        case AST_INTEGER:
+        case AST_REAL:
+        case AST_COLOUR:
+        case AST_BOOLEAN:
+            return (node->size == 1);
+        default:
+            return False;
+    }
+}
+
+
+/* the header must match the source, and every node and string must stay within the file */
+static Boolean _ast_cache_valid(AstCacheHeader *in_header, long in_length, AstCacheHeader *in_source)
+{
+    AstFrozenNode *nodes;
+    AstCacheString *strings;
+    uint32_t i;
+    
+    nodes = (AstFrozenNode*)(in_header + 1);
+    if (memcmp(in_header->magic, AST_CACHE_MAGIC, sizeof(in_header->magic)) != 0) return False;
+    if (in_header->version != AST_CACHE_VERSION) return False;
+    if (in_header->operators != AST_OPERATOR_COUNT) return False;
+    if (in_header->length != in_length) return False;
+    if ( (in_header->source_nanoseconds != in_source->source_nanoseconds) ||
+        (in_header->source_seconds != in_source->source_seconds) ||
+        (in_header->source_size != in_source->source_size) ) return False;
+    if (in_header->nodes == 0) return False;
+    if (in_header->text != sizeof(AstCacheHeader) + sizeof(AstFrozenNode) * (uint64_t)in_header->nodes +
+        sizeof(AstCacheString) * (uint64_t)in_header->strings) return False;
+    if (in_header->text > in_header->length) return False;
+    if (nodes[0].size != in_header->nodes) return False;
+    
+    strings = _ast_cache_strings(in_header);
+    for (i = 0; i < in_header->strings; i++)
+    {
+        if (strings[i].atom != ATOM_NONE) return False;
+        if ((uint64_t)in_header->text + strings[i].offset + strings[i].length >= in_header->length) return False;
+    }
+    for (i = 0; i < in_header->nodes; i++)
+        if (!_ast_cache_node_valid(in_header, i)) return False;
+    return True;
+}
+
+
+AstNode* ast_load(const char *in_pathname, const char *in_source_pathname)
+{
+    AstCacheHeader source, *header;
+    AstCacheString *strings;
+    struct stat info;
+    void *mapping;
+    uint32_t i;
+    int fd;
+    
+    assert(in_source_pathname);
+    if (!_ast_little_endian()) return NULL;
+    if (!_ast_cache_stamp(in_source_pathname, &source)) return NULL;
+    fd = open(in_pathname, O_RDONLY);
+    if (fd < 0) return NULL;
+    if ( (fstat(fd, &info) != 0) || (info.st_size < 0) ||
+        ((size_t)info.st_size < sizeof(AstCacheHeader) + sizeof(AstFrozenNode)) || ((size_t)info.st_size > UINT32_MAX) )
+    {
+        close(fd);
+        return NULL;
+    }
+    mapping = mmap(NULL, (size_t)info.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapping == MAP_FAILED) return NULL;
+    if (!_ast_cache_valid(mapping, info.st_size, &source))
+    {
+        munmap(mapping, (size_t)info.st_size);
+        return NULL;
+    }
+    
+    /* the strings are interned now, rather than when they're first asked for, so that the tree is
+     never written to after it's loaded and any number of threads may read it */
+    header = mapping;
+    strings = _ast_cache_strings(header);
+    for (i = 0; i < header->strings; i++)
+        strings[i].atom = intern((char*)header + header->text + strings[i].offset, strings[i].length);
+    mprotect(mapping, (size_t)info.st_size, PROT_READ);
+    return (AstNode*)(header + 1);
+}
+
+
 /* TODO: write tests for AST module and include assertions,
   finish sanity checks in functions and decide what level to include */
 
@@ -23,7 +23,11 @@
  *
  **************************************************************************************************/
 
+#include <stdio.h>
+
 #include "memory.h"
+#include "intern.h"
+#include "arena.h"
 
 #ifndef _AST_H
 #define _AST_H
@@ -67,43 +71,126 @@ typedef enum {
  
  AST_EXPRESSION:
  
-    Takes the form: <unary-operator> <operand1> | <operand1> [<binary-operator> <operand2> ...]
-    <unary-operator> will be either: new or not
+    Takes the form: <unary-operator> <operand> | <operand1> <binary-operator> <operand2> | <operand>
+    <unary-operator> will be either: new, not or negate
     operators are just like strings.
     <operandN> may be another expression, a path or a literal
+    Precedence is resolved by the parser, so each binary operation is a separate expression;
+    a + b * c is <a> <add> (<b> <multiply> <c>).  A lone operand is only wrapped in an
+    expression where the grammar calls for one.
  */
 
 
+/* operators, with the names that appear in the text representation of the AST */
+#define AST_OPERATORS(X) \
+    X(AST_OP_NEW,               "new") \
+    X(AST_OP_NEGATE,            "negate") \
+    X(AST_OP_LOGICAL_NOT,       "logical-not") \
+    X(AST_OP_LOGICAL_OR,        "logical-or") \
+    X(AST_OP_LOGICAL_AND,       "logical-and") \
+    X(AST_OP_EQUAL,             "equal") \
+    X(AST_OP_NOT_EQUAL,         "not-equal") \
+    X(AST_OP_LESS_THAN,         "less-than") \
+    X(AST_OP_LESS_OR_EQUAL,     "less-or-equal") \
+    X(AST_OP_MORE_THAN,         "more-than") \
+    X(AST_OP_MORE_OR_EQUAL,     "more-or-equal") \
+    X(AST_OP_IS,                "is") \
+    X(AST_OP_ADD,               "add") \
+    X(AST_OP_SUBTRACT,          "subtract") \
+    X(AST_OP_MULTIPLY,          "multiply") \
+    X(AST_OP_DIVIDE,            "divide") \
+    X(AST_OP_INT_DIVIDE,        "int-divide") \
+    X(AST_OP_MODULUS,           "modulus") \
+    X(AST_OP_IS_A,              "is-a")
+
+#define AST_OPERATOR_ENUM(code, name) code,
+
+typedef enum {
+    AST_OP_NONE = 0,
+    AST_OPERATORS(AST_OPERATOR_ENUM)
+    AST_OPERATOR_COUNT
+} AstOperator;
+
+#undef AST_OPERATOR_ENUM
+
+
 struct AstNode;
 typedef struct AstNode AstNode;
 
 
-AstNode* ast_create(AstNodeType in_type);
-AstNode* ast_create_string(const char *inString);
-AstNode* ast_create_operator(const char *in_desc);
-AstNode* ast_create_integer(long in_integer);
-AstNode* ast_create_boolean(Boolean in_bool);
-AstNode* ast_create_colour(long in_colour);
-AstNode* ast_create_real(double in_real);
+/* nodes are carved from in_arena, or from the heap if it's NULL; an arena tree is released
+ with its arena and a heap tree by ast_dispose().  a node's children must come from the same
+ place as the node */
+AstNode* ast_create(Arena *in_arena, AstNodeType in_type);
+AstNode* ast_create_string(Arena *in_arena, const char *inString);
+AstNode* ast_create_string_n(Arena *in_arena, const char *in_string, long in_length);
+AstNode* ast_create_atom(Arena *in_arena, Atom in_atom);
+/* a string literal; the text is copied into the node's arena rather than interned, is compared
+ case-sensitively, and the node has no atom */
+AstNode* ast_create_literal(Arena *in_arena, const char *in_text, long in_length);
+AstNode* ast_create_operator(Arena *in_arena, AstOperator in_operator);
+AstNode* ast_create_integer(Arena *in_arena, long in_integer);
+AstNode* ast_create_boolean(Arena *in_arena, Boolean in_bool);
+AstNode* ast_create_colour(Arena *in_arena, long in_colour);
+AstNode* ast_create_real(Arena *in_arena, double in_real);
 void ast_append(AstNode *in_parent, AstNode *in_child);
 
-typedef Boolean (*AstWalker) (AstNode *in_node, Boolean in_end, int in_level, void *io_user);
+/* returned by a walker; AST_WALK_SKIP on entering a node passes over its children, though the
+ node is still ended */
+typedef enum {
+    AST_WALK_CONTINUE = 0,
+    AST_WALK_STOP,
+    AST_WALK_SKIP,
+} AstWalkResult;
+
+typedef AstWalkResult (*AstWalker) (AstNode *in_node, Boolean in_end, int in_level, void *io_user);
 
+/* walks are iterative, so the depth of a tree is limited only by memory */
 void ast_walk(AstNode *in_tree, AstWalker in_walker, void *io_user);
 
-Boolean ast_debug_walker(AstNode *in_node, Boolean in_end, int in_level, void *io_user);
+/* an explicit stack for ast_walk_with(); it grows as needed and can be reused by any number of
+ walks, one at a time */
+typedef struct AstWalkStack AstWalkStack;
+
+AstWalkStack* ast_walk_stack_create(void);
+void ast_walk_stack_dispose(AstWalkStack *in_stack);
+void ast_walk_with(AstNode *in_tree, AstWalker in_walker, void *io_user, AstWalkStack *io_stack);
+
+/* prints the text representation of each node to stdout */
+AstWalkResult ast_debug_walker(AstNode *in_node, Boolean in_end, int in_level, void *io_user);
 
-/* io_user should be a char** and initalized to NULL before the call to ast_walk();
- upon return it will contain the text representation of the AST */
-Boolean ast_string_walker(AstNode *in_node, Boolean in_end, int in_level, void *io_user);
+
+/* serialization; the text format is the one the parser's test corpora use, and the JSON format
+ has an object for each node, with its "type" and either its "value" or its "children" */
+typedef enum {
+    AST_FORMAT_TEXT,
+    AST_FORMAT_JSON,
+} AstFormat;
+
+/* receives the output a piece at a time; in_text isn't NULL terminated */
+typedef void (*AstWriter) (void *io_sink, const char *in_text, long in_length);
+
+void ast_write(AstNode *in_tree, AstFormat in_format, AstWriter in_writer, void *io_sink);
+void ast_write_file(AstNode *in_tree, AstFormat in_format, FILE *in_file);
+
+/* NULL for a NULL tree; the caller frees the result with safe_free() */
+char* ast_write_string(AstNode *in_tree, AstFormat in_format);
 
 void ast_dispose(AstNode *in_tree);
 
+/* deep copy of a tree into in_arena, or onto the heap if it's NULL; use to keep a tree
+ beyond the life of the arena it was built in */
+AstNode* ast_copy(AstNode *in_tree, Arena *in_arena);
+
 enum {
     AST_FIRST = 0,
     AST_LAST = -1,
 };
 
+/* in_child is an index, AST_FIRST or AST_LAST.  constant time, except on a frozen node, which has
+ no array of children: finding child i skips the subtrees before it, so it's O(i) and AST_LAST is
+ O(count).  to visit each child of a frozen node in turn, take AST_FIRST then ast_skip() from one
+ child to the next */
 AstNode* ast_child(AstNode *in_node, int in_child);
 AstNode* ast_remove(AstNode *in_node, int in_child);
 void ast_insert(AstNode *in_node, int in_before, AstNode *in_child);
@@ -111,9 +198,47 @@ void ast_prepend(AstNode *in_node, AstNode *in_child);
 
 Boolean ast_is(AstNode *in_node, AstNodeType in_type);
 Boolean ast_text_is(AstNode *in_node, const char *in_text);
+Boolean ast_text_is_n(AstNode *in_node, const char *in_text, long in_length);
+Boolean ast_atom_is(AstNode *in_node, Atom in_atom);
+
+Atom ast_atom(AstNode *in_node);
+const char* ast_text(AstNode *in_node);
+
+/* AST_OP_NONE if the node isn't an operator */
+AstOperator ast_operator(AstNode *in_node);
+const char* ast_operator_name(AstOperator in_operator);
 
 int ast_count(AstNode *in_node);
 
+/* nodes in the subtree, including in_node; constant time for a frozen tree */
+long ast_size(AstNode *in_node);
+
+/* bytes occupied by the nodes of a tree and their child arrays */
+long ast_memory(AstNode *in_tree);
+
+
+/* a frozen tree is a read-only copy of a tree in a single block, with the nodes in pre-order and
+ each holding the size of its subtree; ast_walk() over it is a linear scan.  the accessors above
+ work on either kind of tree.  NULL children are dropped.  it's released by ast_dispose() on the
+ root, and can be thawed with ast_copy().  each node takes 16 bytes: a subtree size in place of
+ links, and atoms and literals held in the node */
+AstNode* ast_freeze(AstNode *in_tree);
+Boolean ast_is_frozen(AstNode *in_node);
+
+/* the node after in_node's subtree in a frozen tree; its next sibling, if it has one */
+AstNode* ast_skip(AstNode *in_node);
+
+/* a frozen tree saved to a file in a binary form that's loaded by mapping it into memory, with no
+ reading in or unpacking.  the file records the size and modification time of the source the tree
+ was parsed from, as they are when it's saved, and is only loaded while the source still has
+ exactly those.  the result of ast_load() is a frozen tree that's released by ast_dispose(); it's
+ NULL if either file is missing, the source has changed, or the file isn't a sound tree or was
+ written by another version.  loading checks every node and interns every string, so its cost is
+ linear in the size of the tree (a few milliseconds for hundreds of thousands of nodes); the tree is
+ read-only once loaded and may be read by any number of threads */
+Boolean ast_save(AstNode *in_tree, const char *in_pathname, const char *in_source_pathname);
+AstNode* ast_load(const char *in_pathname, const char *in_source_pathname);
+
 
 
 #endif
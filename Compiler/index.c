@@ -30,6 +30,7 @@
 #include "sqlite/sqlite3.h"
 
 #include "index.h"
+#include "ast.h"
 #include "memory.h"
 #include "rlb.h"
 
@@ -86,6 +87,11 @@ static void _index_init(Index *in_index)
                        ")",
                        NULL,NULL,NULL);
     if (err != SQLITE_OK) fail("Couldn't initalise index (4)");
+    
+    err = sqlite3_exec(in_index->db,
+                       "CREATE INDEX sym_file ON sym (file_id)",
+                       NULL,NULL,NULL);
+    if (err != SQLITE_OK) fail("Couldn't initalise index (5)");
 }
 
 
@@ -147,6 +153,298 @@ void index_close(Index *in_index)
 }
 
 
+typedef struct IndexWalk
+{
+    Index           *index;
+    sqlite3_stmt    *insert;
+    sqlite3_int64   file_id;
+    sqlite3_int64   class_id;
+} IndexWalk;
+
+
+static sqlite3_int64 _index_symbol(IndexWalk *in_walk, AstNode *in_decl, sqlite3_int64 in_parent_id)
+{
+    int err;
+    
+    sqlite3_reset(in_walk->insert);
+    err = sqlite3_bind_int64(in_walk->insert, 1, in_walk->file_id);
+    if (err != SQLITE_OK) fail("Couldn't index symbol (1)");
+    err = sqlite3_bind_text(in_walk->insert, 2, ast_text(ast_child(in_decl, 1)), -1, SQLITE_STATIC);
+    if (err != SQLITE_OK) fail("Couldn't index symbol (2)");
+    err = sqlite3_bind_text(in_walk->insert, 3, ast_text(ast_child(in_decl, 0)), -1, SQLITE_STATIC);
+    if (err != SQLITE_OK) fail("Couldn't index symbol (3)");
+    err = sqlite3_bind_int64(in_walk->insert, 4, in_parent_id);
+    if (err != SQLITE_OK) fail("Couldn't index symbol (4)");
+    
+    err = sqlite3_step(in_walk->insert);
+    if (err != SQLITE_DONE) fail("Couldn't index symbol (5)");
+    
+    return sqlite3_last_insert_rowid(in_walk->index->db);
+}
+
+
+/* classes and their members are indexed from their declarations; nothing below a member,
+ including routine bodies, is visited */
+static AstWalkResult _index_walker(AstNode *in_node, Boolean in_end, int in_level, void *io_user)
+{
+    IndexWalk *walk = io_user;
+    
+    if (in_level == 0) return AST_WALK_CONTINUE;
+    
+    if (in_end)
+    {
+        if (in_level == 1) walk->class_id = 0;
+        return AST_WALK_CONTINUE;
+    }
+    
+    if ((!ast_is(in_node, AST_CONTROL)) || (!ast_text(ast_child(in_node, 1))))
+        return AST_WALK_SKIP;
+    
+    if (in_level == 1)
+    {
+        if (!ast_text_is(ast_child(in_node, 0), "class")) return AST_WALK_SKIP;
+        walk->class_id = _index_symbol(walk, in_node, 0);
+        return AST_WALK_CONTINUE;
+    }
+    
+    _index_symbol(walk, in_node, walk->class_id);
+    return AST_WALK_SKIP;
+}
+
+
+/* the id of the file's row, which is kept when the file is indexed again so that its symbols
+ can be found by it and replaced */
+static sqlite3_int64 _index_file_id(Index *in_index, const char *in_pathname)
+{
+    int             err;
+    sqlite3_stmt    *stmt;
+    sqlite3_int64   file_id;
+    
+    err = sqlite3_prepare_v2(in_index->db,
+                             "SELECT id FROM file WHERE pathname = ?1",
+                             -1,
+                             &stmt,
+                             NULL);
+    if (err != SQLITE_OK) fail("Couldn't index file (1)");
+    err = sqlite3_bind_text(stmt, 1, in_pathname, -1, SQLITE_STATIC);
+    if (err != SQLITE_OK) fail("Couldn't index file (2)");
+    err = sqlite3_step(stmt);
+    if ((err != SQLITE_ROW) && (err != SQLITE_DONE)) fail("Couldn't index file (3)");
+    file_id = (err == SQLITE_ROW) ? sqlite3_column_int64(stmt, 0) : 0;
+    sqlite3_finalize(stmt);
+    
+    if (file_id)
+    {
+        err = sqlite3_prepare_v2(in_index->db,
+                                 "UPDATE file SET build = ?1 WHERE id = ?2",
+                                 -1,
+                                 &stmt,
+                                 NULL);
+        if (err != SQLITE_OK) fail("Couldn't index file (4)");
+        err = sqlite3_bind_int64(stmt, 1, in_index->build);
+        if (err != SQLITE_OK) fail("Couldn't index file (5)");
+        err = sqlite3_bind_int64(stmt, 2, file_id);
+        if (err != SQLITE_OK) fail("Couldn't index file (6)");
+    }
+    else
+    {
+        err = sqlite3_prepare_v2(in_index->db,
+                                 "INSERT INTO file (pathname, build) VALUES (?1, ?2)",
+                                 -1,
+                                 &stmt,
+                                 NULL);
+        if (err != SQLITE_OK) fail("Couldn't index file (4)");
+        err = sqlite3_bind_text(stmt, 1, in_pathname, -1, SQLITE_STATIC);
+        if (err != SQLITE_OK) fail("Couldn't index file (5)");
+        err = sqlite3_bind_int64(stmt, 2, in_index->build);
+        if (err != SQLITE_OK) fail("Couldn't index file (6)");
+    }
+    
+    err = sqlite3_step(stmt);
+    if (err != SQLITE_DONE) fail("Couldn't index file (7)");
+    sqlite3_finalize(stmt);
+    
+    return file_id ? file_id : sqlite3_last_insert_rowid(in_index->db);
+}
+
+
+void index_file(Index *in_index, const char *in_pathname, AstNode *in_ast)
+{
+    IndexWalk       walk;
+    sqlite3_stmt    *stmt;
+    int             err;
+    
+    /* one transaction for the file, rather than one for each symbol */
+    err = sqlite3_exec(in_index->db, "BEGIN", NULL,NULL,NULL);
+    if (err != SQLITE_OK) fail("Couldn't index file (8)");
+    
+    walk.index = in_index;
+    walk.file_id = _index_file_id(in_index, in_pathname);
+    walk.class_id = 0;
+    
+    /* the symbols previously recorded for the file, found by the index on file_id */
+    err = sqlite3_prepare_v2(in_index->db,
+                             "DELETE FROM sym WHERE file_id = ?1",
+                             -1,
+                             &stmt,
+                             NULL);
+    if (err != SQLITE_OK) fail("Couldn't index file (9)");
+    err = sqlite3_bind_int64(stmt, 1, walk.file_id);
+    if (err != SQLITE_OK) fail("Couldn't index file (10)");
+    err = sqlite3_step(stmt);
+    if (err != SQLITE_DONE) fail("Couldn't index file (11)");
+    sqlite3_finalize(stmt);
+    
+    err = sqlite3_prepare_v2(in_index->db,
+                             "INSERT INTO sym (file_id, name, type, parent_id) VALUES (?1, ?2, ?3, ?4)",
+                             -1,
+                             &(walk.insert),
+                             NULL);
+    if (err != SQLITE_OK) fail("Couldn't index file (12)");
+    
+    ast_walk(in_ast, _index_walker, &walk);
+    
+    sqlite3_finalize(walk.insert);
+    
+    err = sqlite3_exec(in_index->db, "COMMIT", NULL,NULL,NULL);
+    if (err != SQLITE_OK) fail("Couldn't index file (13)");
+}
+
+
+/*********
+ Testing
+ */
+
+#ifdef DEBUG
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "parser.h"
+#include "test.h"
+
+
+#define TEST_INDEX_PATH P_tmpdir "/rlb-index-XXXXXX"
+
+
+static const char *test_shape_source =
+"Class CShape\r\n"
+"\tProtected pSides As Integer\r\n"
+"\tPublic Function Area() As Double\r\n"
+"\t\tDim sides(3) As Integer\r\n"
+"\t\tFor i = 1 To 3\r\n"
+"\t\t\tDim nested(2) As Integer\r\n"
+"\t\tNext\r\n"
+"\tEnd Function\r\n"
+"End Class\r\n";
+
+static const char *test_edited_source =
+"Class CShape\r\n"
+"\tPublic Sub Draw()\r\n"
+"\t\tDim pen As Integer\r\n"
+"\tEnd Sub\r\n"
+"End Class\r\n";
+
+static const char *test_other_source =
+"Class COther\r\n"
+"\tPrivate Sub Run()\r\n"
+"\tEnd Sub\r\n"
+"End Class\r\n";
+
+
+/* appends the row's one column to the text */
+static int _test_symbol_row(void *io_text, int in_columns, char **in_values, char **in_names)
+{
+    char *text = io_text;
+    (void)in_columns;
+    (void)in_names;
+    if (*text) strcat(text, " ");
+    strcat(text, in_values[0]);
+    return 0;
+}
+
+
+/* the symbols recorded, in order, as "type:name@parent" */
+static const char* _test_symbols(Index *in_index, char *out_text)
+{
+    out_text[0] = 0;
+    CHECK(sqlite3_exec(in_index->db,
+                       "SELECT s.type || ':' || s.name || '@' || coalesce(p.name, '') "
+                       "FROM sym s LEFT JOIN sym p ON s.parent_id = p.id ORDER BY s.id",
+                       _test_symbol_row, out_text, NULL) == SQLITE_OK);
+    return NULL;
+}
+
+
+static const char* _test_index(Index *in_index, Parser *in_parser, const char *in_pathname, const char *in_source)
+{
+    CHECK(parser_parse(in_parser, (char*)in_source));
+    index_file(in_index, in_pathname, parser_ast(in_parser));
+    return NULL;
+}
+
+
+/* classes and their members are indexed, but nothing within a routine's body; indexing a
+ file again replaces its symbols and keeps its row, and leaves other files' alone */
+static const char* test_1(void)
+{
+    char path[sizeof(TEST_INDEX_PATH)], symbols[1024];
+    const char *test_error;
+    Index *index;
+    Parser *parser;
+    int fd;
+    
+    strcpy(path, TEST_INDEX_PATH);
+    fd = mkstemp(path);
+    CHECK(fd >= 0);
+    close(fd);
+    unlink(path);
+    index = index_open(path);
+    CHECK(index != NULL);
+    parser = parser_create();
+    
+    if ((test_error = _test_index(index, parser, "shape.rbbas", test_shape_source))) return test_error;
+    if ((test_error = _test_symbols(index, symbols))) return test_error;
+    CHECK(strcmp(symbols, "class:CShape@ property:pSides@CShape function:Area@CShape") == 0);
+    
+    if ((test_error = _test_index(index, parser, "other.rbbas", test_other_source))) return test_error;
+    if ((test_error = _test_index(index, parser, "shape.rbbas", test_edited_source))) return test_error;
+    if ((test_error = _test_symbols(index, symbols))) return test_error;
+    CHECK(strcmp(symbols, "class:COther@ subroutine:Run@COther class:CShape@ subroutine:Draw@CShape") == 0);
+    symbols[0] = 0;
+    CHECK(sqlite3_exec(index->db, "SELECT id || ':' || pathname FROM file ORDER BY id",
+                       _test_symbol_row, symbols, NULL) == SQLITE_OK);
+    CHECK(strcmp(symbols, "1:shape.rbbas 2:other.rbbas") == 0);
+    
+    parser_dispose(parser);
+    index_close(index);
+    unlink(path);
+    return NULL;
+}
+
+
+void index_run_tests(void)
+{
+    const char *test_error;
+    test_error = NULL;
+    
+    if (!test_error) test_error = test_1();
+    
+    if (test_error)
+    {
+        fprintf(stderr, "index_run_tests(): Failed: %s\n", test_error);
+        exit(1);
+    }
+    else
+    {
+        fprintf(stdout, "index_run_tests(): OK\n");
+    }
+}
+
+
+#endif
+
+
 /*err = sqlite3_prepare_v2(in_index->db,
  "CREATE TABLE file ("
  " id INTEGER PRIMARY KEY AUTOINCREMENT, "
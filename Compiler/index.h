@@ -23,6 +23,8 @@
  *
  **************************************************************************************************/
 
+#include "ast.h"
+
 #ifndef rlb_index_h
 #define rlb_index_h
 
@@ -46,6 +48,15 @@ typedef struct Index Index;
 Index* index_open(const char *in_path);
 void index_close(Index *in_index);
 
+/* records the classes declared in a parsed file and their members, replacing anything previously
+ recorded for the file */
+void index_file(Index *in_index, const char *in_pathname, AstNode *in_ast);
+
+
+#ifdef DEBUG
+void index_run_tests(void);
+#endif
+
 
 
 
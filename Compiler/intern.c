@@ -0,0 +1,577 @@
+/***************************************************************************************************
+ *
+ * RunlessBASIC
+ * Copyright 2013 Joshua Hawcroft <dev@joshhawcroft.com>
+ *
+ * intern.c
+ * Global table of interned identifiers and strings.
+ *
+ ***************************************************************************************************
+ *
+ * RunlessBASIC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RunlessBASIC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RunlessBASIC.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************************************/
+
+/*
+ * Every distinct spelling is stored once and identified by a 32-bit atom.  BASIC identifiers are
+ * case-insensitive, so each atom also records the atom of its case-folded spelling (Unicode simple
+ * case folding); "Integer" and "INTEGER" are different atoms with the same folded atom.
+ *
+ * The table is shared by every lexer and parser in the process and is protected by a mutex.
+ * Entries live in fixed-size pages that never move and are never freed, so the text and folded
+ * atom of an atom can be read without taking the lock.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "intern.h"
+#include "unicode.h"
+#include "memory.h"
+#include "test.h"
+
+
+#define INTERN_PAGE_BITS 12
+#define INTERN_PAGE_SIZE (1 << INTERN_PAGE_BITS)
+#define INTERN_MAX_PAGES 16384
+#define INTERN_INITIAL_SLOTS 4096
+#define INTERN_STORAGE_CHUNK (64 * 1024)
+#define INTERN_SHORT_TEXT 256
+
+
+typedef struct InternEntry
+{
+    const char      *text;
+    long            length;
+    uint32_t        hash;
+    Atom            folded;
+} InternEntry;
+
+
+static pthread_mutex_t _intern_lock = PTHREAD_MUTEX_INITIALIZER;
+static InternEntry *_intern_pages[INTERN_MAX_PAGES];
+static Atom _intern_count = 0;
+static Atom *_intern_slots = NULL;
+static long _intern_slot_count = 0;
+static char *_intern_storage = NULL;
+static long _intern_storage_left = 0;
+
+
+
+/*********
+ Case Folding
+ */
+
+/* characters first..last, every stride characters, fold to character + delta;
+ generated from the Unicode 14 simple lowercase mappings */
+static const struct InternFoldRange
+{
+    long first;
+    long last;
+    int delta;
+    int stride;
+} _intern_fold_ranges[] = {
+    { 0x0041, 0x005A, 32, 1 }, { 0x00C0, 0x00D6, 32, 1 }, { 0x00D8, 0x00DE, 32, 1 },
+    { 0x0100, 0x012E, 1, 2 }, { 0x0132, 0x0136, 1, 2 }, { 0x0139, 0x0147, 1, 2 },
+    { 0x014A, 0x0176, 1, 2 }, { 0x0178, 0x0178, -121, 1 }, { 0x0179, 0x017D, 1, 2 },
+    { 0x0181, 0x0181, 210, 1 }, { 0x0182, 0x0184, 1, 2 }, { 0x0186, 0x0186, 206, 1 },
+    { 0x0187, 0x0187, 1, 1 }, { 0x0189, 0x018A, 205, 1 }, { 0x018B, 0x018B, 1, 1 },
+    { 0x018E, 0x018E, 79, 1 }, { 0x018F, 0x018F, 202, 1 }, { 0x0190, 0x0190, 203, 1 },
+    { 0x0191, 0x0191, 1, 1 }, { 0x0193, 0x0193, 205, 1 }, { 0x0194, 0x0194, 207, 1 },
+    { 0x0196, 0x0196, 211, 1 }, { 0x0197, 0x0197, 209, 1 }, { 0x0198, 0x0198, 1, 1 },
+    { 0x019C, 0x019C, 211, 1 }, { 0x019D, 0x019D, 213, 1 }, { 0x019F, 0x019F, 214, 1 },
+    { 0x01A0, 0x01A4, 1, 2 }, { 0x01A6, 0x01A6, 218, 1 }, { 0x01A7, 0x01A7, 1, 1 },
+    { 0x01A9, 0x01A9, 218, 1 }, { 0x01AC, 0x01AC, 1, 1 }, { 0x01AE, 0x01AE, 218, 1 },
+    { 0x01AF, 0x01AF, 1, 1 }, { 0x01B1, 0x01B2, 217, 1 }, { 0x01B3, 0x01B5, 1, 2 },
+    { 0x01B7, 0x01B7, 219, 1 }, { 0x01B8, 0x01B8, 1, 1 }, { 0x01BC, 0x01BC, 1, 1 },
+    { 0x01C4, 0x01C4, 2, 1 }, { 0x01C5, 0x01C5, 1, 1 }, { 0x01C7, 0x01C7, 2, 1 },
+    { 0x01C8, 0x01C8, 1, 1 }, { 0x01CA, 0x01CA, 2, 1 }, { 0x01CB, 0x01DB, 1, 2 },
+    { 0x01DE, 0x01EE, 1, 2 }, { 0x01F1, 0x01F1, 2, 1 }, { 0x01F2, 0x01F4, 1, 2 },
+    { 0x01F6, 0x01F6, -97, 1 }, { 0x01F7, 0x01F7, -56, 1 }, { 0x01F8, 0x021E, 1, 2 },
+    { 0x0220, 0x0220, -130, 1 }, { 0x0222, 0x0232, 1, 2 }, { 0x023A, 0x023A, 10795, 1 },
+    { 0x023B, 0x023B, 1, 1 }, { 0x023D, 0x023D, -163, 1 }, { 0x023E, 0x023E, 10792, 1 },
+    { 0x0241, 0x0241, 1, 1 }, { 0x0243, 0x0243, -195, 1 }, { 0x0244, 0x0244, 69, 1 },
+    { 0x0245, 0x0245, 71, 1 }, { 0x0246, 0x024E, 1, 2 }, { 0x0370, 0x0372, 1, 2 },
+    { 0x0376, 0x0376, 1, 1 }, { 0x037F, 0x037F, 116, 1 }, { 0x0386, 0x0386, 38, 1 },
+    { 0x0388, 0x038A, 37, 1 }, { 0x038C, 0x038C, 64, 1 }, { 0x038E, 0x038F, 63, 1 },
+    { 0x0391, 0x03A1, 32, 1 }, { 0x03A3, 0x03AB, 32, 1 }, { 0x03CF, 0x03CF, 8, 1 },
+    { 0x03D8, 0x03EE, 1, 2 }, { 0x03F4, 0x03F4, -60, 1 }, { 0x03F7, 0x03F7, 1, 1 },
+    { 0x03F9, 0x03F9, -7, 1 }, { 0x03FA, 0x03FA, 1, 1 }, { 0x03FD, 0x03FF, -130, 1 },
+    { 0x0400, 0x040F, 80, 1 }, { 0x0410, 0x042F, 32, 1 }, { 0x0460, 0x0480, 1, 2 },
+    { 0x048A, 0x04BE, 1, 2 }, { 0x04C0, 0x04C0, 15, 1 }, { 0x04C1, 0x04CD, 1, 2 },
+    { 0x04D0, 0x052E, 1, 2 }, { 0x0531, 0x0556, 48, 1 }, { 0x10A0, 0x10C5, 7264, 1 },
+    { 0x10C7, 0x10C7, 7264, 1 }, { 0x10CD, 0x10CD, 7264, 1 }, { 0x13A0, 0x13EF, 38864, 1 },
+    { 0x13F0, 0x13F5, 8, 1 }, { 0x1C90, 0x1CBA, -3008, 1 }, { 0x1CBD, 0x1CBF, -3008, 1 },
+    { 0x1E00, 0x1E94, 1, 2 }, { 0x1E9E, 0x1E9E, -7615, 1 }, { 0x1EA0, 0x1EFE, 1, 2 },
+    { 0x1F08, 0x1F0F, -8, 1 }, { 0x1F18, 0x1F1D, -8, 1 }, { 0x1F28, 0x1F2F, -8, 1 },
+    { 0x1F38, 0x1F3F, -8, 1 }, { 0x1F48, 0x1F4D, -8, 1 }, { 0x1F59, 0x1F5F, -8, 2 },
+    { 0x1F68, 0x1F6F, -8, 1 }, { 0x1F88, 0x1F8F, -8, 1 }, { 0x1F98, 0x1F9F, -8, 1 },
+    { 0x1FA8, 0x1FAF, -8, 1 }, { 0x1FB8, 0x1FB9, -8, 1 }, { 0x1FBA, 0x1FBB, -74, 1 },
+    { 0x1FBC, 0x1FBC, -9, 1 }, { 0x1FC8, 0x1FCB, -86, 1 }, { 0x1FCC, 0x1FCC, -9, 1 },
+    { 0x1FD8, 0x1FD9, -8, 1 }, { 0x1FDA, 0x1FDB, -100, 1 }, { 0x1FE8, 0x1FE9, -8, 1 },
+    { 0x1FEA, 0x1FEB, -112, 1 }, { 0x1FEC, 0x1FEC, -7, 1 }, { 0x1FF8, 0x1FF9, -128, 1 },
+    { 0x1FFA, 0x1FFB, -126, 1 }, { 0x1FFC, 0x1FFC, -9, 1 }, { 0x2126, 0x2126, -7517, 1 },
+    { 0x212A, 0x212A, -8383, 1 }, { 0x212B, 0x212B, -8262, 1 }, { 0x2132, 0x2132, 28, 1 },
+    { 0x2160, 0x216F, 16, 1 }, { 0x2183, 0x2183, 1, 1 }, { 0x24B6, 0x24CF, 26, 1 },
+    { 0x2C00, 0x2C2F, 48, 1 }, { 0x2C60, 0x2C60, 1, 1 }, { 0x2C62, 0x2C62, -10743, 1 },
+    { 0x2C63, 0x2C63, -3814, 1 }, { 0x2C64, 0x2C64, -10727, 1 }, { 0x2C67, 0x2C6B, 1, 2 },
+    { 0x2C6D, 0x2C6D, -10780, 1 }, { 0x2C6E, 0x2C6E, -10749, 1 }, { 0x2C6F, 0x2C6F, -10783, 1 },
+    { 0x2C70, 0x2C70, -10782, 1 }, { 0x2C72, 0x2C72, 1, 1 }, { 0x2C75, 0x2C75, 1, 1 },
+    { 0x2C7E, 0x2C7F, -10815, 1 }, { 0x2C80, 0x2CE2, 1, 2 }, { 0x2CEB, 0x2CED, 1, 2 },
+    { 0x2CF2, 0x2CF2, 1, 1 }, { 0xA640, 0xA66C, 1, 2 }, { 0xA680, 0xA69A, 1, 2 },
+    { 0xA722, 0xA72E, 1, 2 }, { 0xA732, 0xA76E, 1, 2 }, { 0xA779, 0xA77B, 1, 2 },
+    { 0xA77D, 0xA77D, -35332, 1 }, { 0xA77E, 0xA786, 1, 2 }, { 0xA78B, 0xA78B, 1, 1 },
+    { 0xA78D, 0xA78D, -42280, 1 }, { 0xA790, 0xA792, 1, 2 }, { 0xA796, 0xA7A8, 1, 2 },
+    { 0xA7AA, 0xA7AA, -42308, 1 }, { 0xA7AB, 0xA7AB, -42319, 1 }, { 0xA7AC, 0xA7AC, -42315, 1 },
+    { 0xA7AD, 0xA7AD, -42305, 1 }, { 0xA7AE, 0xA7AE, -42308, 1 }, { 0xA7B0, 0xA7B0, -42258, 1 },
+    { 0xA7B1, 0xA7B1, -42282, 1 }, { 0xA7B2, 0xA7B2, -42261, 1 }, { 0xA7B3, 0xA7B3, 928, 1 },
+    { 0xA7B4, 0xA7C2, 1, 2 }, { 0xA7C4, 0xA7C4, -48, 1 }, { 0xA7C5, 0xA7C5, -42307, 1 },
+    { 0xA7C6, 0xA7C6, -35384, 1 }, { 0xA7C7, 0xA7C9, 1, 2 }, { 0xA7D0, 0xA7D0, 1, 1 },
+    { 0xA7D6, 0xA7D8, 1, 2 }, { 0xA7F5, 0xA7F5, 1, 1 }, { 0xFF21, 0xFF3A, 32, 1 },
+    { 0x10400, 0x10427, 40, 1 }, { 0x104B0, 0x104D3, 40, 1 }, { 0x10570, 0x1057A, 39, 1 },
+    { 0x1057C, 0x1058A, 39, 1 }, { 0x1058C, 0x10592, 39, 1 }, { 0x10594, 0x10595, 39, 1 },
+    { 0x10C80, 0x10CB2, 64, 1 }, { 0x118A0, 0x118BF, 32, 1 }, { 0x16E40, 0x16E5F, 32, 1 },
+    { 0x1E900, 0x1E921, 34, 1 },
+};
+
+
+static long _intern_fold_char(long in_char)
+{
+    long low, high, middle;
+    const struct InternFoldRange *range;
+    
+    low = 0;
+    high = sizeof(_intern_fold_ranges) / sizeof(struct InternFoldRange) - 1;
+    while (low <= high)
+    {
+        middle = (low + high) / 2;
+        range = &(_intern_fold_ranges[middle]);
+        if (in_char < range->first) high = middle - 1;
+        else if (in_char > range->last) low = middle + 1;
+        else
+        {
+            if ((in_char - range->first) % range->stride == 0) return in_char + range->delta;
+            return in_char;
+        }
+    }
+    return in_char;
+}
+
+
+/* case-folds UTF-8 text; out_folded must have room for (in_length * 3 / 2 + 4) bytes
+ (folding may turn a 2-byte character into a 3-byte one).  Invalid sequences are copied as is. */
+static long _intern_fold(const char *in_text, long in_length, char *out_folded)
+{
+    long i, length, c;
+    int count;
+    
+    length = 0;
+    for (i = 0; i < in_length; )
+    {
+        c = (unsigned char)in_text[i];
+        if (c < 0x80)
+        {
+            if ((c >= 'A') && (c <= 'Z')) c += 'a' - 'A';
+            out_folded[length++] = (char)c;
+            i++;
+            continue;
+        }
+        
+        count = unicode_decode(in_text + i, in_length - i, &c);
+        if (count == 0)
+        {
+            out_folded[length++] = in_text[i++];
+            continue;
+        }
+        length += unicode_encode(_intern_fold_char(c), out_folded + length);
+        i += count;
+    }
+    out_folded[length] = 0;
+    return length;
+}
+
+
+
+/*********
+ Table
+ */
+
+static InternEntry* _intern_entry(Atom in_atom)
+{
+    return &(_intern_pages[in_atom >> INTERN_PAGE_BITS][in_atom & (INTERN_PAGE_SIZE - 1)]);
+}
+
+
+#ifndef NDEBUG
+/* doesn't read _intern_count, which may be changing under another thread's lock; an atom's page is
+ allocated before the atom is handed out and is never moved */
+static Boolean _intern_valid(Atom in_atom)
+{
+    return (((in_atom >> INTERN_PAGE_BITS) < INTERN_MAX_PAGES) && (_intern_pages[in_atom >> INTERN_PAGE_BITS] != NULL));
+}
+#endif
+
+
+/* FNV-1a */
+static uint32_t _intern_hash(const char *in_text, long in_length)
+{
+    uint32_t hash;
+    long i;
+    
+    hash = 2166136261u;
+    for (i = 0; i < in_length; i++)
+    {
+        hash ^= (unsigned char)in_text[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+
+static const char* _intern_store_text(const char *in_text, long in_length)
+{
+    char *result;
+    
+    if (in_length + 1 > INTERN_STORAGE_CHUNK / 4)
+        result = safe_malloc(in_length + 1);
+    else
+    {
+        if (in_length + 1 > _intern_storage_left)
+        {
+            _intern_storage = safe_malloc(INTERN_STORAGE_CHUNK);
+            _intern_storage_left = INTERN_STORAGE_CHUNK;
+        }
+        result = _intern_storage;
+        _intern_storage += in_length + 1;
+        _intern_storage_left -= in_length + 1;
+    }
+    memcpy(result, in_text, in_length);
+    result[in_length] = 0;
+    return result;
+}
+
+
+static void _intern_place(Atom *io_slots, long in_slot_count, Atom in_atom, uint32_t in_hash)
+{
+    long slot;
+    
+    for (slot = in_hash & (in_slot_count - 1); io_slots[slot]; slot = (slot + 1) & (in_slot_count - 1)) {}
+    io_slots[slot] = in_atom;
+}
+
+
+/* keeps the open-addressed hash table at most half full */
+static void _intern_grow(void)
+{
+    Atom *slots, atom;
+    long slot_count;
+    
+    slot_count = (_intern_slot_count ? _intern_slot_count * 2 : INTERN_INITIAL_SLOTS);
+    slots = safe_malloc(sizeof(Atom) * slot_count);
+    memset(slots, 0, sizeof(Atom) * slot_count);
+    for (atom = 1; atom <= _intern_count; atom++)
+        _intern_place(slots, slot_count, atom, _intern_entry(atom)->hash);
+    
+    if (_intern_slots) safe_free(_intern_slots);
+    _intern_slots = slots;
+    _intern_slot_count = slot_count;
+}
+
+
+/* must be called with the lock held */
+static Atom _intern_find_or_add(const char *in_text, long in_length)
+{
+    uint32_t hash;
+    long slot;
+    Atom atom;
+    InternEntry *entry;
+    
+    if ((_intern_count + 1) * 2 > _intern_slot_count) _intern_grow();
+    
+    hash = _intern_hash(in_text, in_length);
+    for (slot = hash & (_intern_slot_count - 1); _intern_slots[slot]; slot = (slot + 1) & (_intern_slot_count - 1))
+    {
+        entry = _intern_entry(_intern_slots[slot]);
+        if ( (entry->hash == hash) && (entry->length == in_length) && (memcmp(entry->text, in_text, in_length) == 0) )
+            return _intern_slots[slot];
+    }
+    
+    if (_intern_count + 1 >= (Atom)INTERN_MAX_PAGES * INTERN_PAGE_SIZE)
+        fail("Too many interned strings");
+    atom = ++_intern_count;
+    if (!_intern_pages[atom >> INTERN_PAGE_BITS])
+        _intern_pages[atom >> INTERN_PAGE_BITS] = safe_malloc(sizeof(InternEntry) * INTERN_PAGE_SIZE);
+    
+    entry = _intern_entry(atom);
+    entry->text = _intern_store_text(in_text, in_length);
+    entry->length = in_length;
+    entry->hash = hash;
+    entry->folded = ATOM_NONE;
+    _intern_slots[slot] = atom;
+    
+    return atom;
+}
+
+
+Atom intern(const char *in_text, long in_length)
+{
+    assert(in_text || (in_length == 0));
+    assert(in_length >= 0);
+    
+    Atom atom, folded;
+    char short_folded[INTERN_SHORT_TEXT * 3 / 2 + 4];
+    char *folded_text;
+    long folded_length;
+    InternEntry *entry;
+    
+    if (!in_text) in_text = "";
+    
+    pthread_mutex_lock(&_intern_lock);
+    
+    atom = _intern_find_or_add(in_text, in_length);
+    entry = _intern_entry(atom);
+    if (entry->folded == ATOM_NONE)
+    {
+        /* first time this spelling has been seen; find its folded counterpart */
+        if (in_length <= INTERN_SHORT_TEXT) folded_text = short_folded;
+        else folded_text = safe_malloc(in_length * 3 / 2 + 4);
+        
+        folded_length = _intern_fold(in_text, in_length, folded_text);
+        if ( (folded_length == in_length) && (memcmp(folded_text, in_text, in_length) == 0) )
+            entry->folded = atom;
+        else
+        {
+            folded = _intern_find_or_add(folded_text, folded_length);
+            if (_intern_entry(folded)->folded == ATOM_NONE)
+                _intern_entry(folded)->folded = folded;
+            entry->folded = folded;
+        }
+        
+        if (folded_text != short_folded) safe_free(folded_text);
+    }
+    
+    pthread_mutex_unlock(&_intern_lock);
+    
+    return atom;
+}
+
+
+Atom intern_string(const char *in_text)
+{
+    assert(in_text);
+    return intern(in_text, strlen(in_text));
+}
+
+
+Atom intern_folded(Atom in_atom)
+{
+    if (in_atom == ATOM_NONE) return ATOM_NONE;
+    assert(_intern_valid(in_atom));
+    return _intern_entry(in_atom)->folded;
+}
+
+
+Boolean intern_same(Atom in_atom1, Atom in_atom2)
+{
+    if (in_atom1 == in_atom2) return True;
+    if ((in_atom1 == ATOM_NONE) || (in_atom2 == ATOM_NONE)) return False;
+    return (intern_folded(in_atom1) == intern_folded(in_atom2));
+}
+
+
+const char* intern_text(Atom in_atom)
+{
+    if (in_atom == ATOM_NONE) return NULL;
+    assert(_intern_valid(in_atom));
+    return _intern_entry(in_atom)->text;
+}
+
+
+long intern_length(Atom in_atom)
+{
+    if (in_atom == ATOM_NONE) return 0;
+    assert(_intern_valid(in_atom));
+    return _intern_entry(in_atom)->length;
+}
+
+
+/* the number of distinct spellings interned so far */
+long intern_count(void)
+{
+    long count;
+    
+    pthread_mutex_lock(&_intern_lock);
+    count = _intern_count;
+    pthread_mutex_unlock(&_intern_lock);
+    return count;
+}
+
+
+
+
+/*********
+ Testing
+ */
+
+#ifdef DEBUG
+
+
+#define TEST_THREADS 4
+#define TEST_THREAD_NAMES 5000
+
+
+static const char* test_1(void)
+{
+    Atom atom1, atom2, atom3;
+    
+    atom1 = intern_string("Integer");
+    atom2 = intern("Integer", 7);
+    atom3 = intern("INTEGER something", 7);
+    CHECK(atom1 != ATOM_NONE);
+    CHECK(atom1 == atom2);
+    CHECK(atom1 != atom3);
+    CHECK(intern_folded(atom1) == intern_folded(atom3));
+    CHECK(intern_same(atom1, atom3));
+    CHECK(!intern_same(atom1, intern_string("Integers")));
+    CHECK(strcmp(intern_text(atom1), "Integer") == 0);
+    CHECK(strcmp(intern_text(atom3), "INTEGER") == 0);
+    CHECK(strcmp(intern_text(intern_folded(atom3)), "integer") == 0);
+    CHECK(intern_length(atom3) == 7);
+    CHECK(intern_folded(intern_folded(atom1)) == intern_folded(atom1));
+    
+    atom1 = intern("", 0);
+    CHECK(atom1 != ATOM_NONE);
+    CHECK(intern_length(atom1) == 0);
+    CHECK(intern_text(atom1)[0] == 0);
+    
+    CHECK(intern_text(ATOM_NONE) == NULL);
+    CHECK(!intern_same(ATOM_NONE, atom1));
+    
+    return NULL;
+}
+
+
+/* non-ASCII case folding */
+static const char* test_2(void)
+{
+    char folded[64];
+    
+    CHECK(intern_same(intern_string("\xC3\x89" "cole"), intern_string("\xC3\xA9" "COLE")));          /* Ecole */
+    CHECK(intern_same(intern_string("\xCE\xA3\xCE\x9F\xCE\xA6"), intern_string("\xCF\x83\xCE\xBF\xCF\x86")));  /* Greek */
+    CHECK(intern_same(intern_string("\xD0\x94\xD0\xB0"), intern_string("\xD0\xB4\xD0\x90")));      /* Cyrillic */
+    CHECK(intern_same(intern_string("\xC4\x80"), intern_string("\xC4\x81")));                      /* A macron */
+    CHECK(!intern_same(intern_string("\xC4\x81"), intern_string("\xC4\x82")));
+    
+    /* U+023A folds to the 3-byte U+2C65 */
+    CHECK(_intern_fold("\xC8\xBA", 2, folded) == 3);
+    CHECK(memcmp(folded, "\xE2\xB1\xA5", 3) == 0);
+    
+    /* invalid sequences are left alone */
+    CHECK(_intern_fold("A\xFF\xC3" "B", 4, folded) == 4);
+    CHECK(memcmp(folded, "a\xFF\xC3" "b", 4) == 0);
+    
+    return NULL;
+}
+
+
+/* grows beyond the initial hash table and page */
+static const char* test_3(void)
+{
+    char name[32];
+    Atom atoms[20000];
+    int i;
+    
+    for (i = 0; i < 20000; i++)
+    {
+        sprintf(name, "Name%d", i);
+        atoms[i] = intern_string(name);
+    }
+    for (i = 0; i < 20000; i++)
+    {
+        sprintf(name, "NAME%d", i);
+        CHECK(intern_folded(intern_string(name)) == intern_folded(atoms[i]));
+        sprintf(name, "Name%d", i);
+        CHECK(strcmp(intern_text(atoms[i]), name) == 0);
+    }
+    
+    return NULL;
+}
+
+
+static void* _test_thread(void *in_atoms)
+{
+    char name[32];
+    int i;
+    
+    for (i = 0; i < TEST_THREAD_NAMES; i++)
+    {
+        sprintf(name, "Shared%d", i);
+        ((Atom*)in_atoms)[i] = intern_string(name);
+    }
+    return NULL;
+}
+
+
+/* threads interning the same names concurrently get the same atoms */
+static const char* test_4(void)
+{
+    pthread_t threads[TEST_THREADS];
+    Atom *atoms[TEST_THREADS];
+    int t, i;
+    
+    for (t = 0; t < TEST_THREADS; t++)
+    {
+        atoms[t] = safe_malloc(sizeof(Atom) * TEST_THREAD_NAMES);
+        CHECK(pthread_create(&(threads[t]), NULL, &_test_thread, atoms[t]) == 0);
+    }
+    for (t = 0; t < TEST_THREADS; t++)
+        pthread_join(threads[t], NULL);
+    
+    for (i = 0; i < TEST_THREAD_NAMES; i++)
+    {
+        for (t = 1; t < TEST_THREADS; t++)
+            CHECK(atoms[t][i] == atoms[0][i]);
+    }
+    for (t = 0; t < TEST_THREADS; t++)
+        safe_free(atoms[t]);
+    
+    return NULL;
+}
+
+
+void intern_run_tests(void)
+{
+    const char *test_error;
+    test_error = NULL;
+    
+    if (!test_error) test_error = test_1();
+    if (!test_error) test_error = test_2();
+    if (!test_error) test_error = test_3();
+    if (!test_error) test_error = test_4();
+    
+    if (test_error)
+    {
+        fprintf(stderr, "intern_run_tests(): Failed: %s\n", test_error);
+        exit(1);
+    }
+    else
+    {
+        fprintf(stdout, "intern_run_tests(): OK\n");
+    }
+}
+
+
+#endif
@@ -0,0 +1,60 @@
+/***************************************************************************************************
+ *
+ * RunlessBASIC
+ * Copyright 2013 Joshua Hawcroft <dev@joshhawcroft.com>
+ *
+ * intern.h
+ * (see C source file for details)
+ *
+ ***************************************************************************************************
+ *
+ * RunlessBASIC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RunlessBASIC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RunlessBASIC.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************************************/
+
+#include <stdint.h>
+
+#include "memory.h"
+
+#ifndef _INTERN_H
+#define _INTERN_H
+
+
+/* an interned string; 0 is never a valid atom */
+typedef uint32_t Atom;
+
+#define ATOM_NONE 0
+
+
+Atom intern(const char *in_text, long in_length);
+Atom intern_string(const char *in_text);
+
+/* the atom of the case-folded spelling; two atoms name the same identifier
+ if their folded atoms are equal */
+Atom intern_folded(Atom in_atom);
+Boolean intern_same(Atom in_atom1, Atom in_atom2);
+
+/* the text is NULL terminated and remains valid for the life of the process */
+const char* intern_text(Atom in_atom);
+long intern_length(Atom in_atom);
+
+long intern_count(void);
+
+
+#ifdef DEBUG
+void intern_run_tests(void);
+#endif
+
+
+#endif
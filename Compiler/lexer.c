@@ -26,12 +26,18 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
 #include <assert.h>
 #include <math.h>
+#include <limits.h>
+#include <stdint.h>
+#include <time.h>
 
 #include "lexer.h"
 #include "memory.h"
+#include "scan.h"
+#include "number.h"
+#include "readfile.h"
+#include "unicode.h"
 #include "test.h"
 
 
@@ -39,24 +45,92 @@
 #define MAX_OCT_LENGTH 16
 #define MAX_BIN_LENGTH 128
 #define MAX_DEC_LENGTH 64
+#define MAX_KEYWORD_LENGTH 10
+#define MAX_CONDITION_TOKENS 64
 
 #define TOKEN_BUFFER_SIZE 10
 #define AUTOFREE_QUEUE 10
 
+/* bytes requested from a stream's reader at a time */
+#define STREAM_CHUNK_SIZE (64 * 1024)
+
+
+/* the whole token stream, as a structure of arrays, with a gap where the last edit was made
+ (see lexer_edit()).  Tokens from the gap on are kept at the end of the arrays and their
+ offsets are relative to the end of the source, so an edit that changes the length of the
+ source leaves them as they are.
+ The text of a string literal or comment is a slice of the source, found from its offset,
+ unless it had to be unescaped; then the value holds the text, which belongs to the table */
+typedef union TokenValue
+{
+    long                integer;
+    double              real;
+    Atom                atom;
+    const char          *text;
+} TokenValue;
+
+typedef struct TokenTable
+{
+    long                count;
+    long                capacity;
+    long                gap;
+    unsigned char       *types;
+    long                *offsets;
+    long                *lengths;
+    TokenValue          *values;
+    
+    /* with trivia kept (otherwise NULL), the length of each token's text in the source and
+     of the trivia trailing it; the trivia leading a token is whatever precedes it after
+     the trivia trailing the previous token */
+    int                 *extents;
+    int                 *trailing;
+} TokenTable;
+
 
 struct Lexer
 {
     char                *source;
+    long                source_length;
     char                *source_offset;
+    const ScanKernels   *scan;
     Boolean             last_was_text;
     char                *old_source_offset;
     long                line_number;
-    Boolean             textize_known;
+    long                *line_starts;
+    long                line_capacity;
+    long                line_gap;   /* line starts have a gap, as the token table does */
     Token               buffer[TOKEN_BUFFER_SIZE];
     int                 buffer_start;
     char                *autofree_list[AUTOFREE_QUEUE];
     int                 autofree_index;
     long                last_valid_offset;
+    TokenTable          *table;
+    long                cursor;
+    
+    /* when lexing a stream, the source is a window onto the input, which begins at
+     source_base bytes into the input */
+    ReadChunk           reader;
+    void                *reader_user;
+    long                source_base;
+    long                source_capacity;
+    Boolean             at_end;
+    
+    /* offset of the first byte that isn't valid UTF-8, or -1; streams are checked as they're
+     read, up to utf8_checked */
+    long                utf8_error;
+    long                utf8_checked;
+    
+    /* conditional compilation; the constants that are True (NULL if not compiling
+     conditionally), the number of #If whose active branch is being lexed, and the offset and
+     description of the first directive in error, or -1 */
+    Atom                *defined;
+    int                 defined_count;
+    int                 condition_depth;
+    long                condition_error;
+    const char          *condition_message;
+    
+    /* comments are kept as trivia, rather than tokens (see lexer_create_trivia()) */
+    Boolean             trivia;
 };
 
 
@@ -187,14 +261,41 @@ static Lexer* _lexer_create(char *inSource, Boolean enable_lookahead)
     
     outLexer->last_valid_offset = 0;
     outLexer->source = inSource;
+    outLexer->source_length = strlen(inSource);
     outLexer->source_offset = inSource;
+    outLexer->scan = scan_best();
     outLexer->last_was_text = False;
     outLexer->old_source_offset = NULL;
     outLexer->line_number = 1;
-    outLexer->textize_known = False;
+    outLexer->line_capacity = 64;
+    outLexer->line_starts = safe_malloc(sizeof(long) * outLexer->line_capacity);
+    outLexer->line_starts[0] = 0;
+    outLexer->line_gap = 1;
     outLexer->autofree_index = 0;
     for (i = 0; i < AUTOFREE_QUEUE; i++)
         outLexer->autofree_list[i] = NULL;
+    for (i = 0; i < TOKEN_BUFFER_SIZE; i++)
+    {
+        outLexer->buffer[i].text = NULL;
+        outLexer->buffer[i].offset = -1;
+    }
+    outLexer->buffer_start = 0;
+    outLexer->table = NULL;
+    outLexer->cursor = 0;
+    outLexer->reader = NULL;
+    outLexer->reader_user = NULL;
+    outLexer->source_base = 0;
+    outLexer->source_capacity = 0;
+    outLexer->at_end = True;
+    outLexer->utf8_error = outLexer->scan->utf8(inSource, inSource + outLexer->source_length) - inSource;
+    if (outLexer->utf8_error == outLexer->source_length) outLexer->utf8_error = -1;
+    outLexer->utf8_checked = outLexer->source_length;
+    outLexer->defined = NULL;
+    outLexer->defined_count = 0;
+    outLexer->condition_depth = 0;
+    outLexer->condition_error = -1;
+    outLexer->condition_message = NULL;
+    outLexer->trivia = False;
     
     if (enable_lookahead)
         _lexer_fill_buffer(outLexer);
@@ -209,206 +310,543 @@ Lexer* lexer_create(char *in_source)
 }
 
 
-static char* _lexer_grab_text(const char *inSource, long inLength)
+/* records the start of a new line; the lexer only moves forward through the source,
+ so the line starts are always in ascending order, and the gap is at the end.
+ Streams only count lines */
+static void _lexer_new_line(Lexer *in_lexer, const char *in_line_start)
 {
-    assert(inSource != NULL);
-    assert(inLength >= 0);
-    
-#if DEBUG
-    long source_len;
-    source_len = strlen(inSource);
-    assert(inLength <= source_len);
-#endif
-    
-    char *out_text;
-    out_text = safe_malloc(inLength + 1);
-    memcpy(out_text, inSource, inLength);
-    out_text[inLength] = 0;
-    return out_text;
+    if (!in_lexer->line_starts)
+    {
+        in_lexer->line_number++;
+        return;
+    }
+    assert(in_lexer->line_gap == in_lexer->line_number);
+    if (in_lexer->line_number == in_lexer->line_capacity)
+    {
+        in_lexer->line_capacity *= 2;
+        in_lexer->line_starts = safe_realloc(in_lexer->line_starts, sizeof(long) * in_lexer->line_capacity);
+    }
+    in_lexer->line_starts[in_lexer->line_number++] = in_line_start - in_lexer->source;
+    in_lexer->line_gap++;
+}
+
+
+/* offset at which a line starts; those from the gap on are at the end of the array, relative
+ to the end of the source */
+static long _lexer_line_start(Lexer *in_lexer, long in_line)
+{
+    if (in_line < in_lexer->line_gap) return in_lexer->line_starts[in_line];
+    return in_lexer->line_starts[in_line + in_lexer->line_capacity - in_lexer->line_number] + in_lexer->source_length;
 }
 
 
+/* is the text a slice of the source, rather than owned by the lexer? */
+static Boolean _lexer_is_slice(Lexer *in_lexer, const char *in_text)
+{
+    return ( (in_text >= in_lexer->source) && (in_text <= in_lexer->source + in_lexer->source_length) );
+}
+
+
+/* character classes, indexed by the unsigned byte; a lookup is cheaper than a chain of
+ comparisons and, unlike <ctype.h>, doesn't depend upon the locale.  Bytes with the high bit
+ set are only ever part of an identifier (a UTF-8 sequence) */
+#define CHAR_ALPHA              0x001   /* ASCII letter */
+#define CHAR_IDENTIFIER_START   0x002
+#define CHAR_IDENTIFIER         0x004
+#define CHAR_DIGIT              0x008
+#define CHAR_HEX                0x010
+#define CHAR_OCT                0x020
+#define CHAR_BIN                0x040
+#define CHAR_SPACE              0x080   /* space or tab */
+#define CHAR_NEW_LINE           0x100
+
+#define CHAR_CLASS_LETTER       (CHAR_ALPHA | CHAR_IDENTIFIER_START | CHAR_IDENTIFIER)
+#define CHAR_CLASS_HIGH         (CHAR_IDENTIFIER_START | CHAR_IDENTIFIER)
+
+static const unsigned short _lexer_char_class[256] = {
+    ['\t'] = CHAR_SPACE,
+    [' '] = CHAR_SPACE,
+    ['\n'] = CHAR_NEW_LINE,
+    ['\r'] = CHAR_NEW_LINE,
+    ['0' ... '1'] = CHAR_IDENTIFIER | CHAR_DIGIT | CHAR_HEX | CHAR_OCT | CHAR_BIN,
+    ['2' ... '7'] = CHAR_IDENTIFIER | CHAR_DIGIT | CHAR_HEX | CHAR_OCT,
+    ['8' ... '9'] = CHAR_IDENTIFIER | CHAR_DIGIT | CHAR_HEX,
+    ['A' ... 'F'] = CHAR_CLASS_LETTER | CHAR_HEX,
+    ['G' ... 'Z'] = CHAR_CLASS_LETTER,
+    ['a' ... 'f'] = CHAR_CLASS_LETTER | CHAR_HEX,
+    ['g' ... 'z'] = CHAR_CLASS_LETTER,
+    ['_'] = CHAR_IDENTIFIER_START | CHAR_IDENTIFIER,
+    [0x80 ... 0xFF] = CHAR_CLASS_HIGH,
+};
+
+/* ASCII letters folded to lowercase; every other byte maps to itself */
+static const unsigned char _lexer_fold_table[256] = {
+    0x00, 0x01, 0x02, 0x03, 0x04, 0x05, 0x06, 0x07, 0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F,
+    0x10, 0x11, 0x12, 0x13, 0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F,
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B, 0x2C, 0x2D, 0x2E, 0x2F,
+    0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F,
+    0x40, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x6B, 0x6C, 0x6D, 0x6E, 0x6F,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x5B, 0x5C, 0x5D, 0x5E, 0x5F,
+    0x60, 0x61, 0x62, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6A, 0x6B, 0x6C, 0x6D, 0x6E, 0x6F,
+    0x70, 0x71, 0x72, 0x73, 0x74, 0x75, 0x76, 0x77, 0x78, 0x79, 0x7A, 0x7B, 0x7C, 0x7D, 0x7E, 0x7F,
+    0x80, 0x81, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89, 0x8A, 0x8B, 0x8C, 0x8D, 0x8E, 0x8F,
+    0x90, 0x91, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9A, 0x9B, 0x9C, 0x9D, 0x9E, 0x9F,
+    0xA0, 0xA1, 0xA2, 0xA3, 0xA4, 0xA5, 0xA6, 0xA7, 0xA8, 0xA9, 0xAA, 0xAB, 0xAC, 0xAD, 0xAE, 0xAF,
+    0xB0, 0xB1, 0xB2, 0xB3, 0xB4, 0xB5, 0xB6, 0xB7, 0xB8, 0xB9, 0xBA, 0xBB, 0xBC, 0xBD, 0xBE, 0xBF,
+    0xC0, 0xC1, 0xC2, 0xC3, 0xC4, 0xC5, 0xC6, 0xC7, 0xC8, 0xC9, 0xCA, 0xCB, 0xCC, 0xCD, 0xCE, 0xCF,
+    0xD0, 0xD1, 0xD2, 0xD3, 0xD4, 0xD5, 0xD6, 0xD7, 0xD8, 0xD9, 0xDA, 0xDB, 0xDC, 0xDD, 0xDE, 0xDF,
+    0xE0, 0xE1, 0xE2, 0xE3, 0xE4, 0xE5, 0xE6, 0xE7, 0xE8, 0xE9, 0xEA, 0xEB, 0xEC, 0xED, 0xEE, 0xEF,
+    0xF0, 0xF1, 0xF2, 0xF3, 0xF4, 0xF5, 0xF6, 0xF7, 0xF8, 0xF9, 0xFA, 0xFB, 0xFC, 0xFD, 0xFE, 0xFF
+};
+
+#define CHAR_IS(in_char, in_class) ((_lexer_char_class[(unsigned char)(in_char)] & (in_class)) != 0)
+
+
 static Boolean _lexer_is_hex_char(char in_char)
 {
-    switch (in_char)
-    {
-        case 'A':
-        case 'a':
-        case 'B':
-        case 'b':
-        case 'C':
-        case 'c':
-        case 'D':
-        case 'd':
-        case 'E':
-        case 'e':
-        case 'F':
-        case 'f':
-        case '0':
-        case '1':
-        case '2':
-        case '3':
-        case '4':
-        case '5':
-        case '6':
-        case '7':
-        case '8':
-        case '9':
-            return True;
-    }
-    return False;
+    return CHAR_IS(in_char, CHAR_HEX);
 }
 
 
 static Boolean _lexer_is_oct_char(char in_char)
 {
-    switch (in_char)
-    {
-        case '0':
-        case '1':
-        case '2':
-        case '3':
-        case '4':
-        case '5':
-        case '6':
-        case '7':
-            return True;
-    }
-    return False;
+    return CHAR_IS(in_char, CHAR_OCT);
 }
 
 
 static Boolean _lexer_is_bin_char(char in_char)
 {
-    switch (in_char)
-    {
-        case '0':
-        case '1':
-            return True;
-    }
-    return False;
+    return CHAR_IS(in_char, CHAR_BIN);
+}
+
+
+static Boolean _lexer_is_digit(char in_char)
+{
+    return CHAR_IS(in_char, CHAR_DIGIT);
 }
 
 
-static const char* _lexer_get_dec(Lexer *inLexer, Boolean *out_is_real)
+/* scans a decimal literal, accumulating the value directly from the source;
+ an integer too large for a long becomes a real */
+static void _lexer_get_dec(Lexer *inLexer, Boolean *out_is_real, long *out_integer, double *out_real)
 {
     assert(inLexer);
     assert(inLexer->source_offset);
     assert(out_is_real);
-    
-    long c, len;
-    static char dec[MAX_DEC_LENGTH + 1];
-    
-    len = 0;
+    assert(out_integer);
+    assert(out_real);
+    
+    const char *source;
+    char text[MAX_DEC_LENGTH + 1];
+    uint64_t mantissa;
+    int digits, digit;
+    long c, exponent, exponent_adjust;
+    Boolean truncated, negative_exponent;
+    
+    source = inLexer->source_offset;
+    mantissa = 0;
+    digits = 0;
+    exponent = 0;
+    exponent_adjust = 0;
+    truncated = False;
+    negative_exponent = False;
     *out_is_real = False;
     
-    for (c = 0; ( (inLexer->source_offset[c]) && isdigit(inLexer->source_offset[c])  &&
-                 (c < MAX_DEC_LENGTH) && (inLexer->source_offset[c] != '.') &&
-                 (inLexer->source_offset[c] != 'e') && (inLexer->source_offset[c] != 'E') ); c++)
-        dec[len++] = inLexer->source_offset[c];
-    if (inLexer->source_offset[c] == '.')
+    /* up to 19 significant digits fit in the mantissa; any further digits only scale it */
+    for (c = 0; (c < MAX_DEC_LENGTH) && _lexer_is_digit(source[c]); c++)
+    {
+        digit = source[c] - '0';
+        if (digits < 19)
+        {
+            mantissa = mantissa * 10 + digit;
+            if (mantissa) digits++;
+        }
+        else
+        {
+            if (digit) truncated = True;
+            exponent_adjust++;
+        }
+    }
+    if ((c < MAX_DEC_LENGTH) && (source[c] == '.'))
     {
-        c++;
-        dec[len++] = '.';
         *out_is_real = True;
-        for (; ( (inLexer->source_offset[c]) && isdigit(inLexer->source_offset[c])  &&
-                     (c < MAX_DEC_LENGTH) && (inLexer->source_offset[c] != '.') &&
-                     (inLexer->source_offset[c] != 'e') && (inLexer->source_offset[c] != 'E') ); c++)
-            dec[len++] = inLexer->source_offset[c];
+        for (c++; (c < MAX_DEC_LENGTH) && _lexer_is_digit(source[c]); c++)
+        {
+            digit = source[c] - '0';
+            if (digits < 19)
+            {
+                mantissa = mantissa * 10 + digit;
+                if (mantissa) digits++;
+                exponent_adjust--;
+            }
+            else if (digit) truncated = True;
+        }
     }
-    if ((inLexer->source_offset[c] == 'e') || (inLexer->source_offset[c] == 'E'))
+    if ((c < MAX_DEC_LENGTH) && ((source[c] == 'e') || (source[c] == 'E')))
     {
         *out_is_real = True;
         c++;
-        dec[len++] = 'e';
-        if (inLexer->source_offset[c] == '-')
+        if ((c < MAX_DEC_LENGTH) && (source[c] == '-'))
         {
+            negative_exponent = True;
             c++;
-            dec[len++] = '-';
         }
-        for (; ( (inLexer->source_offset[c]) && isdigit(inLexer->source_offset[c])  &&
-                     (c < MAX_DEC_LENGTH) && (inLexer->source_offset[c] != '.') &&
-                     (inLexer->source_offset[c] != 'e') && (inLexer->source_offset[c] != 'E') ); c++)
-            dec[len++] = inLexer->source_offset[c];
+        for (; (c < MAX_DEC_LENGTH) && _lexer_is_digit(source[c]); c++)
+        {
+            if (exponent < 100000) exponent = exponent * 10 + (source[c] - '0');
+        }
     }
-    dec[len] = 0;
-        
-    inLexer->source_offset += len;
+    
+    inLexer->source_offset += c;
     inLexer->last_was_text = False;
     
-    return dec;
+    if ( (!*out_is_real) && (!truncated) && (exponent_adjust == 0) && (mantissa <= LONG_MAX) )
+    {
+        *out_integer = (long)mantissa;
+        return;
+    }
+    *out_is_real = True;
+    
+    if (negative_exponent) exponent = -exponent;
+    exponent += exponent_adjust;
+    if (exponent < -100000) exponent = -100000;
+    if (exponent > 100000) exponent = 100000;
+    
+    if ( truncated || (!number_to_double(mantissa, (int)exponent, out_real)) )
+    {
+        /* rare; more significant digits than the fast conversion can represent */
+        memcpy(text, source, c);
+        text[c] = 0;
+        *out_real = strtod(text, NULL);
+    }
 }
 
 
-static const char* _lexer_get_hex(Lexer *inLexer, int inLimitLength)
+/* scans up to in_limit_length digits of a hexadecimal (4 bits per digit), octal (3) or
+ binary (1) literal; a value too large for a long is clamped to LONG_MAX */
+static long _lexer_get_radix(Lexer *inLexer, int in_bits, int in_limit_length)
 {
     assert(inLexer);
     assert(inLexer->source_offset);
-    assert(inLimitLength <= MAX_HEX_LENGTH);
-    assert(inLimitLength >= -1);
     
-    long c, len;
-    static char hex[MAX_HEX_LENGTH + 1];
+    const char *source;
+    unsigned long value;
+    long c;
+    int digit;
+    Boolean overflow;
     
-    if (inLimitLength < 0) inLimitLength = MAX_HEX_LENGTH;
-    len = 0;
-    
-    for (c = 0; ( (inLexer->source_offset[c]) && _lexer_is_hex_char(inLexer->source_offset[c]) && (c < inLimitLength) ); c++)
+    source = inLexer->source_offset;
+    value = 0;
+    overflow = False;
+    for (c = 0; c < in_limit_length; c++)
     {
-        hex[len++] = inLexer->source_offset[c];
+        if (in_bits == 4)
+        {
+            if (!_lexer_is_hex_char(source[c])) break;
+            /* letters have bit 6 set; their low nibble is 1 to 6 */
+            digit = (source[c] & 0xF) + 9 * ((source[c] >> 6) & 1);
+        }
+        else if (in_bits == 3)
+        {
+            if (!_lexer_is_oct_char(source[c])) break;
+            digit = source[c] - '0';
+        }
+        else
+        {
+            if (!_lexer_is_bin_char(source[c])) break;
+            digit = source[c] - '0';
+        }
+        
+        if (value > (((unsigned long)LONG_MAX - digit) >> in_bits)) overflow = True;
+        else value = (value << in_bits) | digit;
     }
-    hex[len] = 0;
     
-    inLexer->source_offset += len;
+    inLexer->source_offset += c;
     inLexer->last_was_text = False;
     
-    return hex;
+    if (overflow) return LONG_MAX;
+    return (long)value;
 }
 
 
-static const char* _lexer_get_oct(Lexer *inLexer)
+static long _lexer_get_hex(Lexer *inLexer, int inLimitLength)
 {
-    assert(inLexer);
-    assert(inLexer->source_offset);
-    
-    long c, len;
-    static char oct[MAX_OCT_LENGTH + 1];
-    
-    len = 0;
+    assert(inLimitLength <= MAX_HEX_LENGTH);
+    assert(inLimitLength >= -1);
     
-    for (c = 0; ( (inLexer->source_offset[c]) && _lexer_is_oct_char(inLexer->source_offset[c]) && (c < MAX_OCT_LENGTH) ); c++)
+    if (inLimitLength < 0) inLimitLength = MAX_HEX_LENGTH;
+    return _lexer_get_radix(inLexer, 4, inLimitLength);
+}
+
+
+static long _lexer_get_oct(Lexer *inLexer)
+{
+    return _lexer_get_radix(inLexer, 3, MAX_OCT_LENGTH);
+}
+
+
+static long _lexer_get_bin(Lexer *inLexer)
+{
+    return _lexer_get_radix(inLexer, 1, MAX_BIN_LENGTH);
+}
+
+
+/* ASCII only; bytes with the high bit set are never part of a keyword or symbol */
+static Boolean _lexer_is_alpha(char in_char)
+{
+    return CHAR_IS(in_char, CHAR_ALPHA);
+}
+
+
+static Boolean _lexer_is_alnum(char in_char)
+{
+    return CHAR_IS(in_char, CHAR_ALPHA | CHAR_DIGIT);
+}
+
+
+/* can the character appear in an identifier? (includes any byte of a UTF-8 sequence) */
+static Boolean _lexer_is_identifier_char(char in_char)
+{
+    return CHAR_IS(in_char, CHAR_IDENTIFIER);
+}
+
+
+/* the end of a run of characters of the class; the NUL that terminates the source belongs
+ to no class.  Runs are short enough in practice (a few bytes of an identifier or indentation)
+ that a table lookup per byte is quicker than setting up a vector */
+static char* _lexer_skip_class(char *in_text, unsigned short in_class)
+{
+    while (CHAR_IS(*in_text, in_class)) in_text++;
+    return in_text;
+}
+
+
+/* the CR or LF that ends the line, or in_end */
+static char* _lexer_line_end(char *in_text, const char *in_end)
+{
+    while ( (in_text < in_end) && !CHAR_IS(*in_text, CHAR_NEW_LINE) ) in_text++;
+    return in_text;
+}
+
+
+static char _lexer_fold(char in_char)
+{
+    return (char)_lexer_fold_table[(unsigned char)in_char];
+}
+
+
+/* case-insensitive comparison of in_length characters of the source against a lowercase word */
+static Boolean _lexer_word_is(const char *in_source, const char *in_word, long in_length)
+{
+    long c;
+    for (c = 0; c < in_length; c++)
+        if (_lexer_fold(in_source[c]) != in_word[c]) return False;
+    return True;
+}
+
+
+/* recognises a text keyword; in_text must be an entire alphanumeric run,
+ (a keyword must be followed by a non-alphanumeric character) so only a keyword of exactly
+ in_length characters can match.  Dispatches on the first character, then the length,
+ so at most a handful of comparisons are made per run.
+ Must be kept in sync with known_tokens[] (see test_1.) */
+#define KEYWORD(word, type) \
+    if ((in_length == sizeof(word) - 1) && _lexer_word_is(in_text + 1, (word) + 1, sizeof(word) - 2)) \
+        return type;
+
+static enum LexerTokenType _lexer_keyword(const char *in_text, long in_length)
+{
+    if ((in_length < 2) || (in_length > MAX_KEYWORD_LENGTH)) return TOKEN_UNRECOGNISED;
+    switch (_lexer_fold(in_text[0]))
     {
-        oct[len++] = inLexer->source_offset[c];
+        case 'a':
+            KEYWORD("and", TOKEN_AND)
+            KEYWORD("as", TOKEN_AS)
+            break;
+        case 'b':
+            KEYWORD("byref", TOKEN_BYREF)
+            KEYWORD("byval", TOKEN_BYVAL)
+            break;
+        case 'c':
+            KEYWORD("continue", TOKEN_CONTINUE)
+            KEYWORD("catch", TOKEN_CATCH)
+            KEYWORD("class", TOKEN_CLASS)
+            KEYWORD("const", TOKEN_CONST)
+            KEYWORD("case", TOKEN_CASE)
+            KEYWORD("call", TOKEN_CALL)
+            break;
+        case 'd':
+            KEYWORD("declare", TOKEN_DECLARE)
+            KEYWORD("downto", TOKEN_DOWNTO)
+            KEYWORD("dim", TOKEN_DIM)
+            KEYWORD("do", TOKEN_DO)
+            break;
+        case 'e':
+            KEYWORD("elseif", TOKEN_ELSEIF)
+            KEYWORD("event", TOKEN_EVENT)
+            KEYWORD("exit", TOKEN_EXIT)
+            KEYWORD("else", TOKEN_ELSE)
+            KEYWORD("each", TOKEN_EACH)
+            KEYWORD("end", TOKEN_END)
+            break;
+        case 'f':
+            KEYWORD("function", TOKEN_FUNCTION)
+            KEYWORD("finally", TOKEN_FINALLY)
+            KEYWORD("false", TOKEN_FALSE)
+            KEYWORD("for", TOKEN_FOR)
+            break;
+        case 'g':
+            KEYWORD("goto", TOKEN_GOTO)
+            break;
+        case 'h':
+            KEYWORD("handler", TOKEN_HANDLER)
+            break;
+        case 'i':
+            KEYWORD("implements", TOKEN_IMPLEMENTS)
+            KEYWORD("interface", TOKEN_INTERFACE)
+            KEYWORD("inherits", TOKEN_INHERITS)
+            KEYWORD("inlinec", TOKEN_INLINEC)
+            KEYWORD("isa", TOKEN_ISA)
+            KEYWORD("if", TOKEN_IF)
+            KEYWORD("is", TOKEN_IS)
+            KEYWORD("in", TOKEN_IN)
+            break;
+        case 'l':
+            KEYWORD("loop", TOKEN_LOOP)
+            KEYWORD("lib", TOKEN_LIB)
+            break;
+        case 'm':
+            KEYWORD("mod", TOKEN_MOD)
+            KEYWORD("me", TOKEN_ME)
+            break;
+        case 'n':
+            KEYWORD("next", TOKEN_NEXT)
+            KEYWORD("null", TOKEN_NULL)
+            KEYWORD("new", TOKEN_NEW)
+            KEYWORD("not", TOKEN_NOT)
+            break;
+        case 'o':
+            KEYWORD("or", TOKEN_OR)
+            KEYWORD("of", TOKEN_OF)
+            break;
+        case 'p':
+            KEYWORD("protected", TOKEN_PROTECTED)
+            KEYWORD("private", TOKEN_PRIVATE)
+            KEYWORD("public", TOKEN_PUBLIC)
+            break;
+        case 'r':
+            KEYWORD("return", TOKEN_RETURN)
+            KEYWORD("raise", TOKEN_RAISE)
+            KEYWORD("redim", TOKEN_REDIM)
+            KEYWORD("rem", TOKEN_REM)
+            break;
+        case 's':
+            KEYWORD("static", TOKEN_STATIC)
+            KEYWORD("shared", TOKEN_SHARED)
+            KEYWORD("select", TOKEN_SELECT)
+            KEYWORD("super", TOKEN_SUPER)
+            KEYWORD("step", TOKEN_STEP)
+            KEYWORD("self", TOKEN_SELF)
+            KEYWORD("sub", TOKEN_SUB)
+            break;
+        case 't':
+            KEYWORD("then", TOKEN_THEN)
+            KEYWORD("true", TOKEN_TRUE)
+            KEYWORD("try", TOKEN_TRY)
+            KEYWORD("to", TOKEN_TO)
+            break;
+        case 'u':
+            KEYWORD("until", TOKEN_UNTIL)
+            break;
+        case 'w':
+            KEYWORD("while", TOKEN_WHILE)
+            KEYWORD("wend", TOKEN_WEND)
+            break;
     }
-    oct[len] = 0;
-    
-    inLexer->source_offset += len;
-    inLexer->last_was_text = False;
-    
-    return oct;
+    return TOKEN_UNRECOGNISED;
 }
 
+#undef KEYWORD
 
-static const char* _lexer_get_bin(Lexer *inLexer)
+
+/* recognises a symbol (any known token not beginning with a letter) at in_source;
+ where symbols share a prefix the longest is matched.
+ Must be kept in sync with known_tokens[] (see test_1.) */
+static enum LexerTokenType _lexer_symbol(const char *in_source, long *out_length)
 {
-    assert(inLexer);
-    assert(inLexer->source_offset);
-    
-    long c, len;
-    static char bin[MAX_BIN_LENGTH + 1];
-    
-    len = 0;
-    
-    for (c = 0; ( (inLexer->source_offset[c]) && _lexer_is_bin_char(inLexer->source_offset[c]) && (c < MAX_BIN_LENGTH) ); c++)
+    *out_length = 1;
+    switch (in_source[0])
     {
-        bin[len++] = inLexer->source_offset[c];
+        case '(': return TOKEN_PAREN_LEFT;
+        case ')': return TOKEN_PAREN_RIGHT;
+        case ':': return TOKEN_COLON;
+        case '+': return TOKEN_PLUS;
+        case '-': return TOKEN_HYPHEN;
+        case '*': return TOKEN_MULTIPLY;
+        case '\\': return TOKEN_BACK_SLASH;
+        case '[': return TOKEN_SQUARE_LEFT;
+        case ']': return TOKEN_SQUARE_RIGHT;
+        case '\'': return TOKEN_REM;
+        case '"': return TOKEN_QUOTE;
+        case '=': return TOKEN_EQUAL;
+        case '.': return TOKEN_DOT;
+        case ',': return TOKEN_COMMA;
+        case ' ': return TOKEN_SPACE;
+        case '\t': return TOKEN_SPACE;
+        case '\n': return TOKEN_NEW_LINE;
+        case '\r':
+            if (in_source[1] == '\n') *out_length = 2;
+            return TOKEN_NEW_LINE;
+        case '/':
+            if (in_source[1] != '/') return TOKEN_SLASH;
+            *out_length = 2;
+            return TOKEN_REM;
+        case '<':
+            *out_length = 2;
+            if (in_source[1] == '>') return TOKEN_NOT_EQUAL;
+            if (in_source[1] == '=') return TOKEN_LESS_EQUAL;
+            *out_length = 1;
+            return TOKEN_LESS;
+        case '>':
+            if (in_source[1] != '=') return TOKEN_MORE;
+            *out_length = 2;
+            return TOKEN_MORE_EQUAL;
+        case '&':
+            *out_length = 2;
+            switch (_lexer_fold(in_source[1]))
+            {
+                case 'h': return TOKEN_AMP_HEX;
+                case 'o': return TOKEN_AMP_OCT;
+                case 'b': return TOKEN_AMP_BIN;
+                case 'c': return TOKEN_AMP_COLOR;
+                case 'u': return TOKEN_AMP_UNICODE;
+            }
+            break;
+        case '#':
+            if (_lexer_word_is(in_source + 1, "pragma", 6))
+            {
+                *out_length = 7;
+                return TOKEN_PRAGMA;
+            }
+            if (_lexer_word_is(in_source + 1, "endif", 5))
+            {
+                *out_length = 6;
+                return TOKEN_HASH_ENDIF;
+            }
+            if (_lexer_word_is(in_source + 1, "else", 4))
+            {
+                *out_length = 5;
+                return TOKEN_HASH_ELSE;
+            }
+            if (_lexer_word_is(in_source + 1, "if", 2))
+            {
+                *out_length = 3;
+                return TOKEN_HASH_IF;
+            }
+            break;
     }
-    bin[len] = 0;
-    
-    inLexer->source_offset += len;
-    inLexer->last_was_text = False;
-    
-    return bin;
+    *out_length = 0;
+    return TOKEN_UNRECOGNISED;
 }
 
 
@@ -417,73 +855,74 @@ static Token _lexer_get_token(Lexer *inLexer)
     assert(inLexer);
     assert(inLexer->source_offset);
     
-    const struct KnownToken *known;
-    const char *token;
     char *source_start;
-    long len_token, c;
+    long len_token;
     Token result;
-    Boolean is_text_token;
     
     source_start = inLexer->source_offset;
     inLexer->old_source_offset = source_start;
     
+    /* a keyword can only begin a token, and can't immediately follow unrecognised text */
+    if ( (!inLexer->last_was_text) && _lexer_is_alpha(*source_start) )
+    {
+        /* no keyword is longer than MAX_KEYWORD_LENGTH; the rest of a longer run is skipped below */
+        for (len_token = 1; (len_token <= MAX_KEYWORD_LENGTH) && _lexer_is_alnum(source_start[len_token]); len_token++) {}
+        
+        result.type = _lexer_keyword(source_start, len_token);
+        if (result.type != TOKEN_UNRECOGNISED)
+        {
+            result.offset = source_start - inLexer->source;
+            result.text = source_start;
+            result.length = len_token;
+            inLexer->source_offset += len_token;
+            
+            inLexer->last_was_text = False;
+            
+            return result;
+        }
+        
+        /* no symbol begins with an alphanumeric character */
+        inLexer->source_offset += len_token;
+    }
+    
     /* iterate over the characters in the source */
     while (*(inLexer->source_offset))
-    {        
-        /* iterate over list of recognised tokens */
-        known = known_tokens;
-        while ((token = known->text))
+    {
+        /* no symbol begins with an identifier character, so step over them in bulk */
+        if (_lexer_is_identifier_char(*(inLexer->source_offset)))
+        {
+            inLexer->source_offset = _lexer_skip_class(inLexer->source_offset, CHAR_IDENTIFIER);
+            if (!*(inLexer->source_offset)) break;
+        }
+        
+        result.type = _lexer_symbol(inLexer->source_offset, &len_token);
+        if (result.type != TOKEN_UNRECOGNISED)
         {
-            len_token = strlen(token);
-            is_text_token = isalpha(token[0]);
+            /* found a matching token */
             
-            if (! (is_text_token && (inLexer->last_was_text || (inLexer->source_offset != source_start))) )
+            if (inLexer->source_offset != source_start)
             {
-                /* compare characters of known token and input text */
-                for (c = 0; (
-                             (c < len_token) &&
-                             (inLexer->source_offset[c] != 0) &&
-                             tolower(inLexer->source_offset[c]) == token[c]
-                             ); c++)
-                {
-                    if ( (c+1 == len_token) &&
-                        (
-                            ( is_text_token && (!isalnum(inLexer->source_offset[c+1])) ) ||
-                            (! is_text_token)
-                        ) )
-                    {
-                        /* found a matching token */
-                        
-                        if (inLexer->source_offset != source_start)
-                        {
-                            /* got a text token first */
-                            result.type = TOKEN_UNRECOGNISED;
-                            result.offset = source_start - inLexer->source;
-                            result.text = _lexer_grab_text(source_start, inLexer->source_offset - source_start);
-                            
-                            inLexer->last_was_text = True;
-                            
-                            return result;
-                        }
-                        
-                        result.type = known->type;
-                        result.offset = inLexer->source_offset - inLexer->source;
-                        if (inLexer->textize_known)
-                            result.text = _lexer_grab_text(inLexer->source_offset, len_token);
-                        else
-                            result.text = NULL;
-                        inLexer->source_offset += len_token;
-                        
-                        inLexer->last_was_text = False;
-                        
-                        if (result.type == TOKEN_NEW_LINE) inLexer->line_number++;
-                        
-                        return result;
-                    }
-                }
-            
+                /* got a text token first */
+                result.type = TOKEN_UNRECOGNISED;
+                result.offset = source_start - inLexer->source;
+                result.text = source_start;
+                result.length = inLexer->source_offset - source_start;
+                
+                inLexer->last_was_text = True;
+                
+                return result;
             }
-            known++;
+            
+            result.offset = inLexer->source_offset - inLexer->source;
+            result.text = inLexer->source_offset;
+            result.length = len_token;
+            inLexer->source_offset += len_token;
+            
+            inLexer->last_was_text = False;
+            
+            if (result.type == TOKEN_NEW_LINE) _lexer_new_line(inLexer, inLexer->source_offset);
+            
+            return result;
         }
         
         /* no matching known token */
@@ -495,211 +934,597 @@ static Token _lexer_get_token(Lexer *inLexer)
     {
         result.type = TOKEN_UNRECOGNISED;
         result.offset = source_start - inLexer->source;
-        result.text = _lexer_grab_text(source_start, inLexer->source_offset - source_start);
+        result.text = source_start;
+        result.length = inLexer->source_offset - source_start;
         return result;
     }
     
     /* couldn't find another token */
     result.type = TOKEN_UNRECOGNISED;
     result.text = NULL;
+    result.length = 0;
     result.offset = -1;
     return result;
 }
 
 
-static void _lexer_append_string(char **inString1, const char *inString2)
+/* growable text buffer; capacity doubles, so appending is amortised constant time */
+typedef struct LexerBuffer
+{
+    char    *text;
+    long    length;
+    long    capacity;
+} LexerBuffer;
+
+
+static void _lexer_buffer_append(LexerBuffer *io_buffer, const char *in_text, long in_length)
 {
-    assert(inString1);
-    assert(inString2);
+    assert(io_buffer);
+    assert(in_text || (in_length == 0));
     
-    long len;
-    if (*inString1) len = strlen(*inString1);
-    else len = 0;
-    *inString1 = safe_realloc(*inString1, len + strlen(inString2) + 1);
-    strcpy(*inString1 + len, inString2);
+    if (io_buffer->length + in_length + 1 > io_buffer->capacity)
+    {
+        if (io_buffer->capacity == 0) io_buffer->capacity = 64;
+        while (io_buffer->length + in_length + 1 > io_buffer->capacity)
+            io_buffer->capacity *= 2;
+        io_buffer->text = safe_realloc(io_buffer->text, io_buffer->capacity);
+    }
+    memcpy(io_buffer->text + io_buffer->length, in_text, in_length);
+    io_buffer->length += in_length;
+    io_buffer->text[io_buffer->length] = 0;
 }
 
 
-static Boolean _lexer_is_valid_identifier(const char *inText)
+/* an identifier begins with a letter or underscore and continues with letters, digits and
+ underscores; beyond ASCII, letters are the characters with the Unicode XID_Start and
+ XID_Continue properties */
+static Boolean _lexer_is_valid_identifier(const char *inText, long inLength)
 {
     assert(inText);
     
-    long i, len;
-    len = strlen(inText);
-    if ((len == 0) || (len > 1000)) return False;
-    if (! ((inText[0] == '_') || isalpha(inText[0]) || (inText[0] > 127) || (inText[0] < 0)) ) return False;
-    for (i = 1; i < len; i++)
-        if (! ((inText[i] == '_') || isalnum(inText[i]) || (inText[i] > 127) || (inText[i] < 0)) ) return False;
+    long i, c;
+    int count;
+    
+    if ((inLength == 0) || (inLength > 1000)) return False;
+    for (i = 0; i < inLength; i += count)
+    {
+        c = (unsigned char)inText[i];
+        count = 1;
+        if (c < 0x80)
+        {
+            if (!CHAR_IS(c, (i == 0) ? CHAR_IDENTIFIER_START : CHAR_IDENTIFIER)) return False;
+            continue;
+        }
+        count = unicode_decode(inText + i, inLength - i, &c);
+        if (!count) return False;
+        if (!((i == 0) ? unicode_is_xid_start(c) : unicode_is_xid_continue(c))) return False;
+    }
     return True;
 }
 
 
-static const char* _lexer_encode_unicode_char(long inCodePoint)
+/* encodes into the caller's buffer, which must hold at least UNICODE_MAX_BYTES + 1 characters */
+static const char* _lexer_encode_unicode_char(long inCodePoint, char *out_text)
 {
-#warning "_lexer_encode_unicode_char() is not properly implemented (use a Unicode library)"
-    static char short_string[2];
-    short_string[0] = inCodePoint;
-    short_string[1] = 0;
-    return short_string;
+    out_text[unicode_encode(inCodePoint, out_text)] = 0;
+    return out_text;
 }
 
 
-static Token _lexer_get_next_token(Lexer *inLexer)
+/* scans the body of a string literal, beginning after the opening quote, in a single pass.
+ Doubled quotes ("") and &uXXXX code points are decoded into an owned buffer; a literal without
+ either is returned as a slice of the source.  Returns False if the source ends before the
+ closing quote. */
+static Boolean _lexer_scan_string(Lexer *inLexer, Token *out_token)
 {
-    Token token, another_token, yet_another_token;
-    const char *temp_string;
-    Boolean is_real;
-    
-    /* skip whitespace */
-    for (;;)
-    {
-        token = _lexer_get_token(inLexer);
-        if (token.offset < 0) return token;
-        if (token.type != TOKEN_SPACE) break;
-    }
-    
-    /* handle specific cases */
-    switch (token.type)
+    LexerBuffer buffer;
+    const char *scan, *run, *end;
+    const char *encoded;
+    char encoded_text[UNICODE_MAX_BYTES + 1];
+    
+    buffer.text = NULL;
+    buffer.length = 0;
+    buffer.capacity = 0;
+    
+    end = inLexer->source + inLexer->source_length;
+    run = inLexer->source_offset;
+    for (scan = run; scan < end; scan++)
     {
-        case TOKEN_QUOTE:
-            /* string literal */
-            token.type = TOKEN_LIT_STRING;
-            inLexer->textize_known = True;
-            for (;;)
-            {
-                another_token = _lexer_get_token(inLexer);
-                if (another_token.offset < 0)
-                {
-                    /* found end of stream before end of string; return a single quote */
-                    if (token.text) free(token.text);
-                    token.text = NULL;
-                    token.type = TOKEN_QUOTE;
-                    break;
-                }
-                if (another_token.type == TOKEN_QUOTE)
-                {
-                    yet_another_token = _lexer_get_token(inLexer);
-                    if (yet_another_token.type == TOKEN_QUOTE)
-                    {
-                        /* string contains a quote */
-                        _lexer_append_string(&(token.text), "\"");
-                        continue;
-                    }
-                    else
-                    {
-                        /* end of string has been reached */
-                        inLexer->source_offset = inLexer->old_source_offset;
-                        break;
-                    }
-                }
-                
-                if (another_token.type == TOKEN_AMP_UNICODE)
+        switch (*scan)
+        {
+            case '"':
+                if (scan[1] == '"')
                 {
-                    /* unicode code point; followed by precisely 4-hexadecimal characters */
-                    temp_string = _lexer_get_hex(inLexer, 4);
-                    //printf("Hex: %ld\n", strtol(temp_string, NULL, 16));
-                    _lexer_append_string(&(token.text),
-                                         _lexer_encode_unicode_char( strtol(temp_string, NULL, 16) )
-                                         );
-                    
+                    /* string contains a quote; keep the first of the pair */
+                    _lexer_buffer_append(&buffer, run, scan + 1 - run);
+                    scan++;
+                    run = scan + 1;
                     continue;
                 }
                 
-                if (another_token.text)
+                /* end of string has been reached */
+                if (buffer.text)
                 {
-                    _lexer_append_string(&(token.text), another_token.text);
-                    free(another_token.text);
+                    _lexer_buffer_append(&buffer, run, scan - run);
+                    out_token->text = buffer.text;
+                    out_token->length = buffer.length;
                 }
-            }
-            inLexer->textize_known = False;
-            break;
-            
-        case TOKEN_REM:
-            /* line comment */
-            inLexer->textize_known = True;
-            for (;;)
-            {
-                another_token = _lexer_get_token(inLexer);
-                if ((another_token.type == TOKEN_NEW_LINE) || (another_token.offset < 0))
+                else
                 {
-                    inLexer->source_offset = inLexer->old_source_offset;
-                    break;
+                    out_token->text = run;
+                    out_token->length = scan - run;
                 }
+                inLexer->source_offset = (char*)scan + 1;
+                inLexer->last_was_text = False;
+                return True;
                 
-                if (another_token.text)
-                {
-                    _lexer_append_string(&(token.text), another_token.text);
-                    free(another_token.text);
-                }
-            }
-            inLexer->textize_known = False;
-            break;
-        
-            /* hexadecimal, binary or octal numeric integer literal
-             (any non-hex character signifies the end) */
+            case '&':
+                if (_lexer_fold(scan[1]) != 'u') continue;
+                
+                /* unicode code point; followed by precisely 4-hexadecimal characters */
+                _lexer_buffer_append(&buffer, run, scan - run);
+                inLexer->source_offset = (char*)scan + 2;
+                encoded = _lexer_encode_unicode_char( _lexer_get_hex(inLexer, 4), encoded_text );
+                _lexer_buffer_append(&buffer, encoded, strlen(encoded));
+                run = inLexer->source_offset;
+                scan = run - 1;
+                continue;
+                
+            case '\r':
+                if (scan[1] == '\n') scan++;
+                _lexer_new_line(inLexer, scan + 1);
+                continue;
+            case '\n':
+                _lexer_new_line(inLexer, scan + 1);
+                continue;
+        }
+    }
+    
+    /* found end of stream before end of string */
+    if (buffer.text) safe_free(buffer.text);
+    inLexer->source_offset = (char*)end;
+    return False;
+}
+
+
+/* has lexing reached the end of a stream's window before the end of the input? the token
+ being lexed is lexed again once more of the input has been read (see _lexer_next_token()) */
+static Boolean _lexer_at_window_end(Lexer *in_lexer)
+{
+    return ( in_lexer->reader && (!in_lexer->at_end) &&
+            (in_lexer->source_offset >= in_lexer->source + in_lexer->source_length) );
+}
+
+
+static Token _lexer_get_unconditional_token(Lexer *inLexer)
+{
+    Token token;
+    Boolean is_real;
+    long integer;
+    double real;
+    
+    /* skip whitespace */
+    if (CHAR_IS(*(inLexer->source_offset), CHAR_SPACE))
+    {
+        inLexer->source_offset = _lexer_skip_class(inLexer->source_offset, CHAR_SPACE);
+        inLexer->last_was_text = False;
+    }
+    token = _lexer_get_token(inLexer);
+    if (token.offset < 0) return token;
+    
+    /* handle specific cases */
+    switch (token.type)
+    {
+        case TOKEN_QUOTE:
+            /* string literal; if it isn't terminated, return a single quote */
+            if (_lexer_scan_string(inLexer, &token))
+                token.type = TOKEN_LIT_STRING;
+            break;
+            
+        case TOKEN_REM:
+            /* line comment; the text is everything up to the end of the line */
+            token.text = inLexer->source_offset;
+            inLexer->source_offset = _lexer_line_end(inLexer->source_offset, inLexer->source + inLexer->source_length);
+            inLexer->last_was_text = False;
+            token.length = inLexer->source_offset - token.text;
+            break;
+        
+            /* hexadecimal, binary or octal numeric integer literal
+             (any non-hex character signifies the end) */
         case TOKEN_AMP_BIN:
             token.type = TOKEN_LIT_INTEGER;
-            temp_string = _lexer_get_bin(inLexer);
-            token.value.integer = strtol(temp_string, NULL, 2);
-            //printf("Bin: %ld (%s)\n", token.value_integer, temp_string);
+            token.value.integer = _lexer_get_bin(inLexer);
             break;
         case TOKEN_AMP_HEX:
             token.type = TOKEN_LIT_INTEGER;
-            temp_string = _lexer_get_hex(inLexer, -1);
-            token.value.integer = strtol(temp_string, NULL, 16);
-            //printf("Hex: %ld (%s)\n", token.value_integer, temp_string);
+            token.value.integer = _lexer_get_hex(inLexer, -1);
             break;
         case TOKEN_AMP_OCT:
             token.type = TOKEN_LIT_INTEGER;
-            temp_string = _lexer_get_oct(inLexer);
-            token.value.integer = strtol(temp_string, NULL, 8);
-            //printf("Oct: %ld (%s)\n", token.value_integer, temp_string);
+            token.value.integer = _lexer_get_oct(inLexer);
             break;
         
         case TOKEN_AMP_COLOR:
             /* colour literal; &cRRGGBBAA (any non-hex character signifies the end) */
             token.type = TOKEN_LIT_COLOUR;
-            temp_string = _lexer_get_hex(inLexer, 8);
-            token.value.integer = strtol(temp_string, NULL, 16);
-            //printf("Color: %ld (%s)\n", token.value_integer, temp_string);
+            token.value.integer = _lexer_get_hex(inLexer, 8);
             break;
             
         default:
             /* identifier or decimal numeric literal;
              [negation (-) operators accumulate so there's no need to deal with them here] */
-            if ( (token.text) && isdigit(token.text[0]) )
+            if ( (token.text) && _lexer_is_digit(token.text[0]) )
             {
                 /* got a numeric literal */
-                free(token.text);
-                token.text = NULL;
                 inLexer->source_offset = inLexer->old_source_offset;
-                temp_string = _lexer_get_dec(inLexer, &is_real);
+                _lexer_get_dec(inLexer, &is_real, &integer, &real);
                 if (!is_real)
                 {
                     token.type = TOKEN_LIT_INTEGER;
-                    token.value.integer = strtol(temp_string, NULL, 10);
-                    //printf("Int: %ld\n", token.value.integer);
+                    token.value.integer = integer;
                 }
                 else
                 {
                     token.type = TOKEN_LIT_REAL;
-                    token.value.real = strtof(temp_string, NULL);
-                    //printf("Real: %lf (%s)\n", token.value.real, temp_string);
+                    token.value.real = real;
                 }
             }
             else if (token.type == TOKEN_UNRECOGNISED)
             {
-                /* got an identifier; validate it */
-                if (token.text && _lexer_is_valid_identifier(token.text))
+                /* got an identifier; validate it.  One cut short by the end of a stream's
+                 window is lexed again, whole, so its piece isn't interned */
+                if (token.text && _lexer_is_valid_identifier(token.text, token.length))
+                {
                     token.type = TOKEN_IDENTIFIER;
+                    if (_lexer_at_window_end(inLexer)) token.value.atom = ATOM_NONE;
+                    else token.value.atom = intern(token.text, token.length);
+                }
             }
             break;
     }
     
+    /* numeric literals span the prefix and digits */
+    if ((token.type == TOKEN_LIT_INTEGER) || (token.type == TOKEN_LIT_REAL) || (token.type == TOKEN_LIT_COLOUR))
+        token.length = inLexer->source_offset - token.text;
+    
     return token;
 }
 
 
+/* moves past the end of the current line, including its line ending */
+static void _lexer_skip_line(Lexer *io_lexer)
+{
+    char *line_end, *offset;
+    
+    line_end = _lexer_line_end(io_lexer->source_offset, io_lexer->source + io_lexer->source_length);
+    offset = line_end;
+    if (*offset == '\r') offset++;
+    if (*offset == '\n') offset++;
+    if (offset != line_end) _lexer_new_line(io_lexer, offset);
+    io_lexer->source_offset = offset;
+    io_lexer->last_was_text = False;
+}
+
+
+static Boolean _lexer_is_defined(Lexer *in_lexer, Atom in_name)
+{
+    int i;
+    for (i = 0; i < in_lexer->defined_count; i++)
+        if (intern_same(in_lexer->defined[i], in_name)) return True;
+    return False;
+}
+
+
+/* a condition is made of constants, True, False, Not, And, Or and parentheses; on anything
+ else, or a missing operand or parenthesis, *io_next is moved past in_count so that the
+ caller reports the condition as malformed */
+static Boolean _lexer_condition_or(Lexer *in_lexer, const Token *in_tokens, int in_count, int *io_next);
+
+static Boolean _lexer_condition_operand(Lexer *in_lexer, const Token *in_tokens, int in_count, int *io_next)
+{
+    Boolean value;
+    
+    if (*io_next >= in_count)
+    {
+        *io_next = in_count + 1;
+        return False;
+    }
+    switch (in_tokens[(*io_next)++].type)
+    {
+        case TOKEN_TRUE:
+            return True;
+        case TOKEN_IDENTIFIER:
+            return _lexer_is_defined(in_lexer, in_tokens[*io_next - 1].value.atom);
+        case TOKEN_NOT:
+            return !_lexer_condition_operand(in_lexer, in_tokens, in_count, io_next);
+        case TOKEN_PAREN_LEFT:
+            value = _lexer_condition_or(in_lexer, in_tokens, in_count, io_next);
+            if ((*io_next < in_count) && (in_tokens[*io_next].type == TOKEN_PAREN_RIGHT)) (*io_next)++;
+            else *io_next = in_count + 1;
+            return value;
+        case TOKEN_FALSE:
+            return False;
+        default:
+            *io_next = in_count + 1;
+            return False;
+    }
+}
+
+
+static Boolean _lexer_condition_and(Lexer *in_lexer, const Token *in_tokens, int in_count, int *io_next)
+{
+    Boolean value;
+    
+    value = _lexer_condition_operand(in_lexer, in_tokens, in_count, io_next);
+    while ((*io_next < in_count) && (in_tokens[*io_next].type == TOKEN_AND))
+    {
+        (*io_next)++;
+        value = _lexer_condition_operand(in_lexer, in_tokens, in_count, io_next) && value;
+    }
+    return value;
+}
+
+
+static Boolean _lexer_condition_or(Lexer *in_lexer, const Token *in_tokens, int in_count, int *io_next)
+{
+    Boolean value;
+    
+    value = _lexer_condition_and(in_lexer, in_tokens, in_count, io_next);
+    while ((*io_next < in_count) && (in_tokens[*io_next].type == TOKEN_OR))
+    {
+        (*io_next)++;
+        value = _lexer_condition_and(in_lexer, in_tokens, in_count, io_next) || value;
+    }
+    return value;
+}
+
+
+/* records the first directive in error, for the parser to report */
+static void _lexer_condition_error(Lexer *io_lexer, long in_offset, const char *in_message)
+{
+    if (io_lexer->condition_error >= 0) return;
+    io_lexer->condition_error = in_offset;
+    io_lexer->condition_message = in_message;
+}
+
+
+/* evaluates the condition of an #If or #ElseIf, up to an optional Then; the rest of the
+ line, including its line ending, is consumed.  A condition that is malformed or too long to
+ evaluate is an error, and False */
+static Boolean _lexer_condition(Lexer *io_lexer)
+{
+    Token tokens[MAX_CONDITION_TOKENS], token;
+    int count, next;
+    Boolean value, too_long;
+    
+    count = 0;
+    too_long = False;
+    for (;;)
+    {
+        token = _lexer_get_unconditional_token(io_lexer);
+        if ((token.offset < 0) || (token.type == TOKEN_NEW_LINE)) break;
+        if ( ((token.type == TOKEN_LIT_STRING) || (token.type == TOKEN_REM)) && (!_lexer_is_slice(io_lexer, token.text)) )
+            safe_free((char*)token.text);
+        if (token.type == TOKEN_REM) continue;
+        if (count < MAX_CONDITION_TOKENS) tokens[count++] = token;
+        else too_long = True;
+    }
+    
+    if (too_long)
+    {
+        _lexer_condition_error(io_lexer, tokens[0].offset, "Malformed condition; too many tokens");
+        return False;
+    }
+    if ((count > 0) && (tokens[count - 1].type == TOKEN_THEN)) count--;
+    next = 0;
+    value = _lexer_condition_or(io_lexer, tokens, count, &next);
+    if (next != count)
+    {
+        _lexer_condition_error(io_lexer, (count > 0) ? tokens[0].offset : token.offset, "Malformed condition");
+        return False;
+    }
+    return value;
+}
+
+
+/* skips an inactive region a line at a time, without lexing it, to the #EndIf that ends
+ the innermost open #If, or unless in_to_end_if, to the first #Else, or #ElseIf whose
+ condition is True, at the same level; nested #If...#EndIf are stepped over */
+static void _lexer_skip_inactive(Lexer *io_lexer, Boolean in_to_end_if)
+{
+    const char *end;
+    char *directive;
+    enum LexerTokenType type;
+    long length, depth;
+    
+    end = io_lexer->source + io_lexer->source_length;
+    depth = 0;
+    while (io_lexer->source_offset < end)
+    {
+        directive = _lexer_skip_class(io_lexer->source_offset, CHAR_SPACE);
+        io_lexer->source_offset = directive;
+        if (*directive != '#')
+        {
+            _lexer_skip_line(io_lexer);
+            continue;
+        }
+        
+        type = _lexer_symbol(directive, &length);
+        if (type == TOKEN_HASH_IF)
+            depth++;
+        else if ((type == TOKEN_HASH_ENDIF) && (depth > 0))
+            depth--;
+        else if (type == TOKEN_HASH_ENDIF)
+        {
+            io_lexer->condition_depth--;
+            _lexer_skip_line(io_lexer);
+            return;
+        }
+        else if ((type == TOKEN_HASH_ELSE) && (depth == 0) && (!in_to_end_if))
+        {
+            io_lexer->source_offset = directive + length;
+            if (!_lexer_word_is(io_lexer->source_offset, "if", 2) || CHAR_IS(io_lexer->source_offset[2], CHAR_IDENTIFIER))
+            {
+                _lexer_skip_line(io_lexer);
+                return;
+            }
+            io_lexer->source_offset += 2;
+            io_lexer->last_was_text = False;
+            if (_lexer_condition(io_lexer)) return;
+            continue;
+        }
+        _lexer_skip_line(io_lexer);
+    }
+}
+
+
+/* the next token, compiling conditionally if constants were defined: the directives and the
+ inactive regions they enclose produce no tokens.  An #Else or #EndIf without an #If is
+ returned as a token, and an #If still open at the end of the source is recorded as an
+ error, for the parser to report */
+static Token _lexer_get_next_token(Lexer *inLexer)
+{
+    Token token;
+    
+    for (;;)
+    {
+        token = _lexer_get_unconditional_token(inLexer);
+        if (!inLexer->defined) return token;
+        if (token.offset < 0)
+        {
+            if (inLexer->condition_depth > 0)
+                _lexer_condition_error(inLexer, inLexer->source_length, "Expected #EndIf");
+            return token;
+        }
+        
+        switch (token.type)
+        {
+            case TOKEN_HASH_IF:
+                inLexer->condition_depth++;
+                if (!_lexer_condition(inLexer)) _lexer_skip_inactive(inLexer, False);
+                break;
+            case TOKEN_HASH_ELSE:
+                /* the branch taken has ended; skip the rest, including any #ElseIf */
+                if (inLexer->condition_depth == 0) return token;
+                _lexer_skip_line(inLexer);
+                _lexer_skip_inactive(inLexer, True);
+                break;
+            case TOKEN_HASH_ENDIF:
+                if (inLexer->condition_depth == 0) return token;
+                inLexer->condition_depth--;
+                _lexer_skip_line(inLexer);
+                break;
+            default:
+                return token;
+        }
+    }
+}
+
+
+/* discards the input before in_keep, moves the rest to the start of the window and reads
+ the next chunk after it, growing the window if there isn't room for a whole chunk.
+ Buffered tokens that are slices of the window are moved with it */
+static void _lexer_stream_refill(Lexer *in_lexer, const char *in_keep)
+{
+    long shift, used, relative[TOKEN_BUFFER_SIZE], bytes;
+    const char *stop, *end;
+    int i;
+    
+    shift = in_keep - in_lexer->source;
+    used = in_lexer->source_length - shift;
+    
+    for (i = 0; i < TOKEN_BUFFER_SIZE; i++)
+    {
+        relative[i] = -1;
+        if ((in_lexer->buffer[i].offset >= 0) && in_lexer->buffer[i].text && _lexer_is_slice(in_lexer, in_lexer->buffer[i].text))
+            relative[i] = in_lexer->buffer[i].text - in_keep;
+    }
+    
+    memmove(in_lexer->source, in_keep, used);
+    in_lexer->source_base += shift;
+    in_lexer->source_offset -= shift;
+    if (in_lexer->source_capacity - used - 1 < STREAM_CHUNK_SIZE)
+    {
+        in_lexer->source_capacity = in_lexer->source_capacity * 2;
+        if (in_lexer->source_capacity < used + STREAM_CHUNK_SIZE + 1)
+            in_lexer->source_capacity = used + STREAM_CHUNK_SIZE + 1;
+        bytes = in_lexer->source_offset - in_lexer->source;
+        in_lexer->source = safe_realloc(in_lexer->source, in_lexer->source_capacity);
+        in_lexer->source_offset = in_lexer->source + bytes;
+    }
+    
+    bytes = in_lexer->reader(in_lexer->reader_user, in_lexer->source + used, STREAM_CHUNK_SIZE);
+    if (bytes == 0) in_lexer->at_end = True;
+    in_lexer->source_length = used + bytes;
+    in_lexer->source[in_lexer->source_length] = 0;
+    
+    /* a character cut short by the end of the chunk is checked again once the rest is read */
+    if (in_lexer->utf8_error < 0)
+    {
+        end = in_lexer->source + in_lexer->source_length;
+        stop = in_lexer->scan->utf8(in_lexer->source + (in_lexer->utf8_checked - in_lexer->source_base), end);
+        in_lexer->utf8_checked = in_lexer->source_base + (stop - in_lexer->source);
+        if ( (stop < end) && (in_lexer->at_end || (end - stop >= UNICODE_MAX_BYTES)) )
+            in_lexer->utf8_error = in_lexer->utf8_checked;
+    }
+    
+    for (i = 0; i < TOKEN_BUFFER_SIZE; i++)
+    {
+        if (relative[i] >= 0)
+            in_lexer->buffer[i].text = in_lexer->source + relative[i];
+    }
+}
+
+
+/* the next token from the source, or for a stream, from the input.  A token that reaches
+ the end of the window may continue in the next chunk, so it is lexed again once the next
+ chunk has been read; the window only holds the buffered tokens and the token being lexed */
+static Token _lexer_next_token(Lexer *in_lexer)
+{
+    Token token;
+    char *start;
+    const char *keep;
+    long line_number;
+    Boolean last_was_text;
+    int i;
+    
+    if (!in_lexer->reader) return _lexer_get_next_token(in_lexer);
+    
+    for (;;)
+    {
+        start = in_lexer->source_offset;
+        line_number = in_lexer->line_number;
+        last_was_text = in_lexer->last_was_text;
+        
+        token = _lexer_get_next_token(in_lexer);
+        if ( in_lexer->at_end || (in_lexer->source_offset < in_lexer->source + in_lexer->source_length) )
+        {
+            if (token.offset >= 0) token.offset += in_lexer->source_base;
+            return token;
+        }
+        
+        /* try again with more of the input */
+        if ( (token.offset >= 0) && ((token.type == TOKEN_LIT_STRING) || (token.type == TOKEN_REM)) &&
+            (!_lexer_is_slice(in_lexer, token.text)) )
+            safe_free((char*)token.text);
+        in_lexer->source_offset = start;
+        in_lexer->line_number = line_number;
+        in_lexer->last_was_text = last_was_text;
+        
+        keep = start;
+        if ( (in_lexer->utf8_error < 0) && (in_lexer->source + (in_lexer->utf8_checked - in_lexer->source_base) < keep) )
+            keep = in_lexer->source + (in_lexer->utf8_checked - in_lexer->source_base);
+        for (i = 0; i < TOKEN_BUFFER_SIZE; i++)
+        {
+            if ( (in_lexer->buffer[i].offset >= 0) && in_lexer->buffer[i].text &&
+                _lexer_is_slice(in_lexer, in_lexer->buffer[i].text) && (in_lexer->buffer[i].text < keep) )
+                keep = in_lexer->buffer[i].text;
+        }
+        _lexer_stream_refill(in_lexer, keep);
+    }
+}
+
+
 static void _lexer_fill_buffer(Lexer *in_lexer)
 {
     assert(in_lexer);
@@ -712,12 +1537,13 @@ static void _lexer_fill_buffer(Lexer *in_lexer)
         in_lexer->buffer[i].offset = -1;
         in_lexer->buffer[i].type = TOKEN_UNRECOGNISED;
         in_lexer->buffer[i].text = NULL;
+        in_lexer->buffer[i].length = 0;
     }
     
     in_lexer->buffer_start = 0;
     for (i = 0; i < TOKEN_BUFFER_SIZE; i++)
     {
-        token = _lexer_get_next_token(in_lexer);
+        token = _lexer_next_token(in_lexer);
         if (token.offset < 0) break;
         in_lexer->buffer[i] = token;
     }
@@ -746,102 +1572,954 @@ static void _lexer_autofree(Lexer *in_lexer, char *in_string)
 }
 
 
-Token lexer_get(Lexer *in_lexer)
+/* moves a run of tokens within the arrays */
+static void _lexer_table_move(TokenTable *io_table, long in_to, long in_from, long in_count)
 {
-    Token token;
-    
-    assert(in_lexer);
-    
-    token = in_lexer->buffer[ in_lexer->buffer_start ];
-    _lexer_autofree(in_lexer, token.text);
-    
-    in_lexer->buffer[ in_lexer->buffer_start ] = _lexer_get_next_token(in_lexer);
-    
-    in_lexer->buffer_start++;
-    if (in_lexer->buffer_start >= TOKEN_BUFFER_SIZE)
-        in_lexer->buffer_start = 0;
-    
-    if (token.offset > 0)
-        in_lexer->last_valid_offset = token.offset;
-    
-    return token;
+    memmove(io_table->types + in_to, io_table->types + in_from, sizeof(unsigned char) * in_count);
+    memmove(io_table->offsets + in_to, io_table->offsets + in_from, sizeof(long) * in_count);
+    memmove(io_table->lengths + in_to, io_table->lengths + in_from, sizeof(long) * in_count);
+    memmove(io_table->values + in_to, io_table->values + in_from, sizeof(TokenValue) * in_count);
+    if (io_table->extents)
+    {
+        memmove(io_table->extents + in_to, io_table->extents + in_from, sizeof(int) * in_count);
+        memmove(io_table->trailing + in_to, io_table->trailing + in_from, sizeof(int) * in_count);
+    }
 }
 
 
-Token lexer_peek(Lexer *in_lexer, int in_how_far)
+/* enlarges the arrays, keeping the tokens after the gap at the end */
+static void _lexer_table_grow(TokenTable *io_table, long in_capacity)
 {
-    assert(in_lexer);
-    assert( (in_how_far >= 0) || (in_how_far < TOKEN_BUFFER_SIZE-1) );
-    
-    int index;
-    
-    index = in_lexer->buffer_start + in_how_far;
-    if (index >= TOKEN_BUFFER_SIZE)
-        index -= TOKEN_BUFFER_SIZE;
-    
-    if (in_lexer->buffer[index].offset > 0)
-        in_lexer->last_valid_offset = in_lexer->buffer[index].offset;
-    
-    return in_lexer->buffer[index];
+    long old_capacity, tail;
+    
+    old_capacity = io_table->capacity;
+    tail = io_table->count - io_table->gap;
+    io_table->capacity = in_capacity;
+    io_table->types = safe_realloc(io_table->types, sizeof(unsigned char) * io_table->capacity);
+    io_table->offsets = safe_realloc(io_table->offsets, sizeof(long) * io_table->capacity);
+    io_table->lengths = safe_realloc(io_table->lengths, sizeof(long) * io_table->capacity);
+    io_table->values = safe_realloc(io_table->values, sizeof(TokenValue) * io_table->capacity);
+    if (io_table->extents)
+    {
+        io_table->extents = safe_realloc(io_table->extents, sizeof(int) * io_table->capacity);
+        io_table->trailing = safe_realloc(io_table->trailing, sizeof(int) * io_table->capacity);
+    }
+    if (tail > 0) _lexer_table_move(io_table, io_table->capacity - tail, old_capacity - tail, tail);
 }
 
 
-long lexer_offset(Lexer *in_lexer)
+/* index into the arrays of the token at an index within the table */
+static long _lexer_table_slot(TokenTable *in_table, long in_index)
 {
-    return in_lexer->last_valid_offset;
+    if (in_index < in_table->gap) return in_index;
+    return in_index + in_table->capacity - in_table->count;
 }
 
 
+static long _lexer_table_offset(Lexer *in_lexer, long in_index)
+{
+    TokenTable *table;
+    
+    table = in_lexer->table;
+    if (in_index < table->gap) return table->offsets[in_index];
+    return table->offsets[in_index + table->capacity - table->count] + in_lexer->source_length;
+}
 
-#ifdef DEBUG
 
-static const char* lexer_debug_token_type(enum LexerTokenType in_type)
+/* appends a token to a table being lexed, whose gap is at the end */
+static void _lexer_table_append(Lexer *in_lexer, TokenTable *io_table, Token in_token)
 {
-    const struct KnownToken *known;
-    
-    switch (in_type)
+    assert(io_table->gap == io_table->count);
+    if (io_table->count == io_table->capacity)
+        _lexer_table_grow(io_table, io_table->capacity * 2);
+    
+    io_table->types[io_table->count] = in_token.type;
+    io_table->offsets[io_table->count] = in_token.offset;
+    io_table->lengths[io_table->count] = in_token.length;
+    switch (in_token.type)
     {
-        case TOKEN_NEW_LINE:
-            return "<newline>";
-        case TOKEN_IDENTIFIER:
-            return "<identifier>";
-        case TOKEN_SPACE:
-            return "<space>";
         case TOKEN_LIT_STRING:
-            return "<literal-string>";
-        case TOKEN_LIT_INTEGER:
-            return "<literal-integer>";
+        case TOKEN_REM:
+            io_table->values[io_table->count].text = _lexer_is_slice(in_lexer, in_token.text) ? NULL : in_token.text;
+            break;
         case TOKEN_LIT_REAL:
-            return "<literal-real>";
-        case TOKEN_LIT_COLOUR:
-            return "<literal-colour>";
-        default: break;
+            io_table->values[io_table->count].real = in_token.value.real;
+            break;
+        case TOKEN_IDENTIFIER:
+            io_table->values[io_table->count].atom = in_token.value.atom;
+            break;
+        default:
+            io_table->values[io_table->count].integer = in_token.value.integer;
+            break;
     }
+    io_table->count++;
+    io_table->gap++;
+}
+
+
+/* appends a token keeping the trivia around it: the spaces after a token and a comment
+ ending its line trail it; anything else before a token, such as indentation or a
+ comment on a line of its own, leads it */
+static void _lexer_table_append_trivia(Lexer *in_lexer, TokenTable *io_table, Token in_token)
+{
+    const char *trailing;
+    long end, last;
     
-    known = known_tokens;
+    end = in_lexer->source_offset - in_lexer->source;
+    last = io_table->count - 1;
+    if (in_token.type == TOKEN_REM)
+    {
+        assert(_lexer_is_slice(in_lexer, in_token.text));
+        if ((last >= 0) && (io_table->types[last] != TOKEN_NEW_LINE))
+            io_table->trailing[last] = (int)(end - io_table->offsets[last] - io_table->extents[last]);
+        return;
+    }
     
-    while (known->text)
+    _lexer_table_append(in_lexer, io_table, in_token);
+    io_table->extents[last + 1] = (int)(end - in_token.offset);
+    trailing = in_lexer->source_offset;
+    if (in_token.type != TOKEN_NEW_LINE)
+        trailing = _lexer_skip_class(in_lexer->source_offset, CHAR_SPACE);
+    io_table->trailing[last + 1] = (int)(trailing - in_lexer->source_offset);
+}
+
+
+/* tokenizes the entire source */
+static TokenTable* _lexer_table_create(Lexer *in_lexer)
+{
+    TokenTable *table;
+    Token token;
+    
+    table = safe_malloc(sizeof(TokenTable));
+    table->count = 0;
+    table->gap = 0;
+    /* roughly one token for every five characters of typical source */
+    table->capacity = in_lexer->source_length / 5 + 16;
+    table->types = safe_malloc(sizeof(unsigned char) * table->capacity);
+    table->offsets = safe_malloc(sizeof(long) * table->capacity);
+    table->lengths = safe_malloc(sizeof(long) * table->capacity);
+    table->values = safe_malloc(sizeof(TokenValue) * table->capacity);
+    table->extents = NULL;
+    table->trailing = NULL;
+    if (in_lexer->trivia)
     {
-        if (known->type == in_type)
-            return known->text;
-        
-        known++;
+        table->extents = safe_malloc(sizeof(int) * table->capacity);
+        table->trailing = safe_malloc(sizeof(int) * table->capacity);
     }
     
-    return NULL;
+    for (;;)
+    {
+        token = _lexer_get_next_token(in_lexer);
+        if (token.offset < 0) break;
+        if (in_lexer->trivia) _lexer_table_append_trivia(in_lexer, table, token);
+        else _lexer_table_append(in_lexer, table, token);
+    }
+    
+    return table;
 }
 
 
-void lexer_debug_token(Token in_token)
+/* releases the texts of a run of tokens that belong to the table */
+static void _lexer_table_free_texts(TokenTable *io_table, long in_first, long in_end)
 {
-    if (in_token.offset < 0)
+    long i, slot;
+    
+    for (i = in_first; i < in_end; i++)
     {
-        printf("END OF SOURCE\n");
-        return;
+        slot = _lexer_table_slot(io_table, i);
+        if ( ((io_table->types[slot] == TOKEN_LIT_STRING) || (io_table->types[slot] == TOKEN_REM)) &&
+            io_table->values[slot].text )
+            safe_free((char*)io_table->values[slot].text);
+    }
+}
+
+
+static void _lexer_table_dispose(Lexer *in_lexer)
+{
+    TokenTable *table;
+    
+    table = in_lexer->table;
+    _lexer_table_free_texts(table, 0, table->count);
+    safe_free(table->types);
+    safe_free(table->offsets);
+    safe_free(table->lengths);
+    safe_free(table->values);
+    if (table->extents) safe_free(table->extents);
+    if (table->trailing) safe_free(table->trailing);
+    safe_free(table);
+    in_lexer->table = NULL;
+}
+
+
+/* token at an index within the table; beyond the end is the end of stream token */
+static Token _lexer_table_token(Lexer *in_lexer, long in_index)
+{
+    TokenTable *table;
+    Token token;
+    long slot;
+    
+    table = in_lexer->table;
+    if ((in_index < 0) || (in_index >= table->count))
+    {
+        token.type = TOKEN_UNRECOGNISED;
+        token.offset = -1;
+        token.text = NULL;
+        token.length = 0;
+        token.value.integer = 0;
+        return token;
+    }
+    
+    slot = _lexer_table_slot(table, in_index);
+    token.type = table->types[slot];
+    token.offset = _lexer_table_offset(in_lexer, in_index);
+    token.length = table->lengths[slot];
+    token.text = in_lexer->source + token.offset;
+    token.value.integer = 0;
+    switch (token.type)
+    {
+        case TOKEN_LIT_STRING:
+            /* the text follows the opening quote */
+            if (table->values[slot].text) token.text = table->values[slot].text;
+            else token.text++;
+            break;
+        case TOKEN_REM:
+            /* the text follows the ', // or Rem */
+            if (table->values[slot].text) token.text = table->values[slot].text;
+            else token.text += (*token.text == '\'') ? 1 : (*token.text == '/') ? 2 : 3;
+            break;
+        case TOKEN_LIT_REAL:
+            token.value.real = table->values[slot].real;
+            break;
+        case TOKEN_IDENTIFIER:
+            token.value.atom = table->values[slot].atom;
+            break;
+        default:
+            token.value.integer = table->values[slot].integer;
+            break;
+    }
+    return token;
+}
+
+
+Lexer* lexer_create_stream(ReadChunk in_reader, void *io_user)
+{
+    Lexer *lexer;
+    char *window;
+    
+    assert(in_reader != NULL);
+    
+    window = safe_malloc(STREAM_CHUNK_SIZE * 2);
+    window[0] = 0;
+    
+    lexer = _lexer_create(window, False);
+    lexer->reader = in_reader;
+    lexer->reader_user = io_user;
+    lexer->source_capacity = STREAM_CHUNK_SIZE * 2;
+    lexer->at_end = False;
+    safe_free(lexer->line_starts);
+    lexer->line_starts = NULL;
+    
+    _lexer_fill_buffer(lexer);
+    return lexer;
+}
+
+
+Lexer* lexer_create_table(char *in_source)
+{
+    Lexer *lexer;
+    
+    lexer = _lexer_create(in_source, False);
+    lexer->table = _lexer_table_create(lexer);
+    return lexer;
+}
+
+
+Lexer* lexer_create_conditional(char *in_source, const char * const *in_defined)
+{
+    Lexer *lexer;
+    int count;
+    
+    assert(in_defined != NULL);
+    
+    lexer = _lexer_create(in_source, False);
+    for (count = 0; in_defined[count]; count++) {}
+    lexer->defined = safe_malloc(sizeof(Atom) * (count + 1));
+    for (lexer->defined_count = 0; lexer->defined_count < count; lexer->defined_count++)
+        lexer->defined[lexer->defined_count] = intern_string(in_defined[lexer->defined_count]);
+    lexer->table = _lexer_table_create(lexer);
+    return lexer;
+}
+
+
+Lexer* lexer_create_trivia(char *in_source)
+{
+    Lexer *lexer;
+    
+    lexer = _lexer_create(in_source, False);
+    lexer->trivia = True;
+    lexer->table = _lexer_table_create(lexer);
+    return lexer;
+}
+
+
+TokenTrivia lexer_trivia_at(Lexer *in_lexer, long in_index)
+{
+    TokenTable *table;
+    TokenTrivia trivia;
+    long slot;
+    
+    assert(in_lexer);
+    assert(in_lexer->trivia);
+    assert((in_index >= 0) && (in_index <= in_lexer->table->count));
+    
+    table = in_lexer->table;
+    trivia.leading = 0;
+    if (in_index > 0)
+    {
+        slot = _lexer_table_slot(table, in_index - 1);
+        trivia.leading = _lexer_table_offset(in_lexer, in_index - 1) + table->extents[slot] + table->trailing[slot];
+    }
+    if (in_index == table->count)
+    {
+        trivia.start = trivia.end = trivia.trailing = in_lexer->source_length;
+        return trivia;
+    }
+    slot = _lexer_table_slot(table, in_index);
+    trivia.start = _lexer_table_offset(in_lexer, in_index);
+    trivia.end = trivia.start + table->extents[slot];
+    trivia.trailing = trivia.end + table->trailing[slot];
+    return trivia;
+}
+
+
+long lexer_token_count(Lexer *in_lexer)
+{
+    assert(in_lexer);
+    assert(in_lexer->table);
+    return in_lexer->table->count;
+}
+
+
+Token lexer_token_at(Lexer *in_lexer, long in_index)
+{
+    assert(in_lexer);
+    assert(in_lexer->table);
+    return _lexer_table_token(in_lexer, in_index);
+}
+
+
+long lexer_position(Lexer *in_lexer)
+{
+    assert(in_lexer);
+    assert(in_lexer->table);
+    return in_lexer->cursor;
+}
+
+
+void lexer_seek(Lexer *in_lexer, long in_index)
+{
+    assert(in_lexer);
+    assert(in_lexer->table);
+    assert((in_index >= 0) && (in_index <= in_lexer->table->count));
+    in_lexer->cursor = in_index;
+}
+
+
+/* index of the first token that ends at or after the offset; tokens never overlap, so
+ their ends are in ascending order */
+static long _lexer_table_find(Lexer *in_lexer, long in_offset)
+{
+    TokenTable *table;
+    long low, high, middle;
+    
+    table = in_lexer->table;
+    low = 0;
+    high = table->count;
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        if (_lexer_table_offset(in_lexer, middle) + table->lengths[_lexer_table_slot(table, middle)] < in_offset)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+
+/* moves the gap to before the token at an index, making the offsets of the tokens it passes
+ over absolute or relative to the end of the source */
+static void _lexer_table_move_gap(Lexer *io_lexer, long in_index)
+{
+    TokenTable *table;
+    long size, i;
+    
+    table = io_lexer->table;
+    size = table->capacity - table->count;
+    if (in_index > table->gap)
+    {
+        _lexer_table_move(table, table->gap, table->gap + size, in_index - table->gap);
+        for (i = table->gap; i < in_index; i++)
+            table->offsets[i] += io_lexer->source_length;
+    }
+    else if (in_index < table->gap)
+    {
+        _lexer_table_move(table, in_index + size, in_index, table->gap - in_index);
+        for (i = in_index + size; i < table->gap + size; i++)
+            table->offsets[i] -= io_lexer->source_length;
+    }
+    table->gap = in_index;
+}
+
+
+/* replaces the tokens from the gap up to (but not including) in_end with the fresh tokens,
+ leaving the gap after them */
+static void _lexer_table_splice(TokenTable *io_table, long in_end, TokenTable *in_fresh)
+{
+    long count;
+    
+    io_table->count -= in_end - io_table->gap;
+    count = io_table->count + in_fresh->count;
+    if (count > io_table->capacity)
+        _lexer_table_grow(io_table, count + count / 2);
+    
+    memcpy(io_table->types + io_table->gap, in_fresh->types, sizeof(unsigned char) * in_fresh->count);
+    memcpy(io_table->offsets + io_table->gap, in_fresh->offsets, sizeof(long) * in_fresh->count);
+    memcpy(io_table->lengths + io_table->gap, in_fresh->lengths, sizeof(long) * in_fresh->count);
+    memcpy(io_table->values + io_table->gap, in_fresh->values, sizeof(TokenValue) * in_fresh->count);
+    
+    io_table->gap += in_fresh->count;
+    io_table->count = count;
+}
+
+
+/* number of line starts at or before the offset */
+static long _lexer_lines_before(Lexer *in_lexer, long in_offset)
+{
+    long low, high, middle;
+    
+    low = 0;
+    high = in_lexer->line_number;
+    while (low < high)
+    {
+        middle = low + (high - low) / 2;
+        if (_lexer_line_start(in_lexer, middle) <= in_offset)
+            low = middle + 1;
+        else
+            high = middle;
+    }
+    return low;
+}
+
+
+/* moves the gap in the line starts to before a line, as _lexer_table_move_gap() */
+static void _lexer_lines_move_gap(Lexer *io_lexer, long in_line)
+{
+    long *starts, size, i;
+    
+    starts = io_lexer->line_starts;
+    size = io_lexer->line_capacity - io_lexer->line_number;
+    if (in_line > io_lexer->line_gap)
+    {
+        memmove(starts + io_lexer->line_gap, starts + io_lexer->line_gap + size, sizeof(long) * (in_line - io_lexer->line_gap));
+        for (i = io_lexer->line_gap; i < in_line; i++)
+            starts[i] += io_lexer->source_length;
+    }
+    else if (in_line < io_lexer->line_gap)
+    {
+        memmove(starts + in_line + size, starts + in_line, sizeof(long) * (io_lexer->line_gap - in_line));
+        for (i = in_line + size; i < io_lexer->line_gap + size; i++)
+            starts[i] -= io_lexer->source_length;
+    }
+    io_lexer->line_gap = in_line;
+}
+
+
+/* replaces the line starts from the gap up to (but not including) in_end with the fresh
+ line starts, leaving the gap after them */
+static void _lexer_lines_splice(Lexer *io_lexer, long in_end, const long *in_fresh, long in_fresh_count)
+{
+    long count, capacity, tail;
+    
+    io_lexer->line_number -= in_end - io_lexer->line_gap;
+    count = io_lexer->line_number + in_fresh_count;
+    if (count > io_lexer->line_capacity)
+    {
+        capacity = io_lexer->line_capacity;
+        tail = io_lexer->line_number - io_lexer->line_gap;
+        io_lexer->line_capacity = count + count / 2;
+        io_lexer->line_starts = safe_realloc(io_lexer->line_starts, sizeof(long) * io_lexer->line_capacity);
+        memmove(io_lexer->line_starts + io_lexer->line_capacity - tail, io_lexer->line_starts + capacity - tail, sizeof(long) * tail);
+    }
+    
+    memcpy(io_lexer->line_starts + io_lexer->line_gap, in_fresh, sizeof(long) * in_fresh_count);
+    io_lexer->line_gap += in_fresh_count;
+    io_lexer->line_number = count;
+}
+
+
+/* rechecks the UTF-8 of an edited source, from the last character to begin before the edit to
+ the first character boundary after it; the rest of the source is unchanged, so unless the
+ edit removed the first error, the source beyond the edit needn't be checked again */
+static void _lexer_edit_utf8(Lexer *io_lexer, long in_offset, long in_deleted_length, long in_inserted_length)
+{
+    const char *source, *end, *from, *to, *stop;
+    long old_error, delta;
+    
+    old_error = io_lexer->utf8_error;
+    delta = in_inserted_length - in_deleted_length;
+    if ((old_error >= 0) && (old_error + UNICODE_MAX_BYTES <= in_offset)) return;
+    
+    source = io_lexer->source;
+    end = source + io_lexer->source_length;
+    from = source + ((in_offset >= UNICODE_MAX_BYTES - 1) ? in_offset - (UNICODE_MAX_BYTES - 1) : 0);
+    if ((old_error >= 0) && (old_error < in_offset))
+        from = source + old_error;
+    else
+        while ( (from < source + in_offset) && (((unsigned char)*from & 0xC0) == 0x80) ) from++;
+    to = source + in_offset + in_inserted_length;
+    while ( (to < end) && (to < source + in_offset + in_inserted_length + UNICODE_MAX_BYTES - 1) &&
+            (((unsigned char)*to & 0xC0) == 0x80) ) to++;
+    
+    stop = io_lexer->scan->utf8(from, to);
+    if (stop < to)
+        io_lexer->utf8_error = stop - source;
+    else if (to == end)
+        io_lexer->utf8_error = -1;
+    else if (((unsigned char)*to & 0xC0) == 0x80)
+        io_lexer->utf8_error = to - source;
+    else if (old_error >= (to - source) - delta)
+        io_lexer->utf8_error = old_error + delta;
+    else if (old_error < 0)
+        io_lexer->utf8_error = -1;
+    else
+    {
+        /* the first error was replaced; look for the next one */
+        stop = io_lexer->scan->utf8(to, end);
+        io_lexer->utf8_error = (stop < end) ? stop - source : -1;
+    }
+}
+
+
+/* updates the table after an edit to the source, relexing only the damaged region.
+ in_new_source is the entire edited source (it may be the old buffer, edited in place);
+ in_deleted_length bytes at in_offset were replaced by in_inserted_length bytes.
+ Lexing restarts one token before the first token the edit touches and stops as soon as a
+ token after the edit matches the old stream.  The gaps in the table and the line starts
+ move to the restart point, so the tokens and lines after it, being relative to the end of
+ the source, move with the edit without being touched.  The cursor returns to the start. */
+void lexer_edit(Lexer *io_lexer, char *in_new_source, long in_offset, long in_deleted_length, long in_inserted_length)
+{
+    TokenTable *table, fresh;
+    Token token;
+    long new_end, first, end, restart, slot, keep_lines, tail;
+    long *old_lines, old_line_count, old_line_capacity, *new_lines, new_line_count;
+    
+    assert(io_lexer);
+    assert(io_lexer->table);
+    assert(in_new_source);
+    assert((in_offset >= 0) && (in_offset + in_deleted_length <= io_lexer->source_length));
+    
+    /* an edit to a directive changes which regions are lexed, anywhere after it,
+     so with conditional compilation the whole source is lexed again; as it is when
+     keeping trivia, which is for tools that run over the whole source anyway */
+    if (io_lexer->defined || io_lexer->trivia)
+    {
+        _lexer_table_dispose(io_lexer);
+        io_lexer->source = in_new_source;
+        io_lexer->source_length += in_inserted_length - in_deleted_length;
+        io_lexer->source_offset = in_new_source;
+        io_lexer->last_was_text = False;
+        io_lexer->line_number = 1;
+        io_lexer->line_gap = 1;
+        io_lexer->condition_depth = 0;
+        io_lexer->condition_error = -1;
+        io_lexer->condition_message = NULL;
+        io_lexer->table = _lexer_table_create(io_lexer);
+        _lexer_edit_utf8(io_lexer, in_offset, in_deleted_length, in_inserted_length);
+        io_lexer->cursor = 0;
+        return;
+    }
+    
+    table = io_lexer->table;
+    new_end = in_offset + in_inserted_length;
+    
+    /* restart one token before the first token the edit touches, since an edit at a token's
+     boundary may join it to its neighbour.  An unterminated quote swallows the rest of the
+     source and is always the last token, so an edit anywhere after it restarts there */
+    first = _lexer_table_find(io_lexer, in_offset);
+    if (first > 0) first--;
+    restart = ((first > 0) && (first < table->count)) ? _lexer_table_offset(io_lexer, first) : 0;
+    
+    /* text immediately followed by a symbol suppresses keywords in the next token */
+    io_lexer->last_was_text = False;
+    if ((first > 0) && (first < table->count))
+    {
+        slot = _lexer_table_slot(table, first - 1);
+        io_lexer->last_was_text = ( ((table->types[slot] == TOKEN_IDENTIFIER) || (table->types[slot] == TOKEN_UNRECOGNISED)) &&
+                                   (_lexer_table_offset(io_lexer, first - 1) + table->lengths[slot] == restart) );
+    }
+    
+    /* from here on, the offsets of the old tokens and lines after the restart point are
+     where the edit moved them */
+    _lexer_table_move_gap(io_lexer, first);
+    keep_lines = _lexer_lines_before(io_lexer, restart);
+    _lexer_lines_move_gap(io_lexer, keep_lines);
+    io_lexer->source = in_new_source;
+    io_lexer->source_length += in_inserted_length - in_deleted_length;
+    io_lexer->source_offset = in_new_source + restart;
+    
+    /* the relexed tokens and line starts are collected separately, then spliced in */
+    old_lines = io_lexer->line_starts;
+    old_line_count = io_lexer->line_number;
+    old_line_capacity = io_lexer->line_capacity;
+    io_lexer->line_capacity = 16;
+    io_lexer->line_starts = safe_malloc(sizeof(long) * io_lexer->line_capacity);
+    io_lexer->line_number = 0;
+    io_lexer->line_gap = 0;
+    
+    fresh.count = 0;
+    fresh.capacity = 16;
+    fresh.gap = 0;
+    fresh.types = safe_malloc(sizeof(unsigned char) * fresh.capacity);
+    fresh.offsets = safe_malloc(sizeof(long) * fresh.capacity);
+    fresh.lengths = safe_malloc(sizeof(long) * fresh.capacity);
+    fresh.values = safe_malloc(sizeof(TokenValue) * fresh.capacity);
+    fresh.extents = NULL;
+    fresh.trailing = NULL;
+    
+    end = first;
+    for (;;)
+    {
+        token = _lexer_get_next_token(io_lexer);
+        if (token.offset < 0)
+        {
+            end = table->count;
+            break;
+        }
+        
+        /* past the edit, the old stream resumes with the first token that is lexed the same */
+        if (token.offset >= new_end)
+        {
+            while ( (end < table->count) && (_lexer_table_offset(io_lexer, end) < token.offset) ) end++;
+            slot = _lexer_table_slot(table, end);
+            if ( (end < table->count) && (_lexer_table_offset(io_lexer, end) == token.offset) &&
+                (table->types[slot] == token.type) && (table->lengths[slot] == token.length) )
+            {
+                if ( ((token.type == TOKEN_LIT_STRING) || (token.type == TOKEN_REM)) &&
+                    (!_lexer_is_slice(io_lexer, token.text)) )
+                    safe_free((char*)token.text);
+                
+                /* the lines this token started are amongst the old ones */
+                io_lexer->line_number = io_lexer->line_gap = _lexer_lines_before(io_lexer, token.offset);
+                break;
+            }
+        }
+        
+        _lexer_table_append(io_lexer, &fresh, token);
+    }
+    
+    /* splice the line starts: those before the restart point, the relexed lines, then
+     those after the point of resynchronisation */
+    new_lines = io_lexer->line_starts;
+    new_line_count = io_lexer->line_number;
+    io_lexer->line_starts = old_lines;
+    io_lexer->line_number = old_line_count;
+    io_lexer->line_capacity = old_line_capacity;
+    io_lexer->line_gap = keep_lines;
+    tail = old_line_count;
+    if (end < table->count)
+        tail = _lexer_lines_before(io_lexer, _lexer_table_offset(io_lexer, end));
+    _lexer_lines_splice(io_lexer, tail, new_lines, new_line_count);
+    safe_free(new_lines);
+    
+    /* the texts of replaced tokens are released */
+    _lexer_table_free_texts(table, first, end);
+    _lexer_table_splice(table, end, &fresh);
+    
+    safe_free(fresh.types);
+    safe_free(fresh.offsets);
+    safe_free(fresh.lengths);
+    safe_free(fresh.values);
+    
+    _lexer_edit_utf8(io_lexer, in_offset, in_deleted_length, in_inserted_length);
+    io_lexer->cursor = 0;
+}
+
+
+Token lexer_get(Lexer *in_lexer)
+{
+    Token token, next;
+    
+    assert(in_lexer);
+    
+    if (in_lexer->table)
+    {
+        token = _lexer_table_token(in_lexer, in_lexer->cursor);
+        if (in_lexer->cursor < in_lexer->table->count) in_lexer->cursor++;
+        if (token.offset > 0)
+            in_lexer->last_valid_offset = token.offset;
+        return token;
+    }
+    
+    /* lex the next token before taking this one from the buffer, since reading more of a
+     stream may move this token's text */
+    next = _lexer_next_token(in_lexer);
+    
+    token = in_lexer->buffer[ in_lexer->buffer_start ];
+    if (token.text && (!_lexer_is_slice(in_lexer, token.text)))
+        _lexer_autofree(in_lexer, (char*)token.text);
+    else
+        _lexer_autofree(in_lexer, NULL);
+    
+    in_lexer->buffer[ in_lexer->buffer_start ] = next;
+    
+    in_lexer->buffer_start++;
+    if (in_lexer->buffer_start >= TOKEN_BUFFER_SIZE)
+        in_lexer->buffer_start = 0;
+    
+    if (token.offset > 0)
+        in_lexer->last_valid_offset = token.offset;
+    
+    return token;
+}
+
+
+int lexer_get_many(Lexer *in_lexer, CompactToken *out_tokens, int in_max)
+{
+    TokenTable *table;
+    Token next, *token;
+    long cursor, slot;
+    int count;
+    
+    assert(in_lexer);
+    assert(out_tokens || (in_max == 0));
+    
+    if (in_lexer->table)
+    {
+        table = in_lexer->table;
+        cursor = in_lexer->cursor;
+        if (in_max > table->count - cursor) in_max = (int)(table->count - cursor);
+        for (count = 0; count < in_max; count++)
+        {
+            slot = _lexer_table_slot(table, cursor + count);
+            out_tokens[count].offset = _lexer_table_offset(in_lexer, cursor + count);
+            out_tokens[count].length = (int)table->lengths[slot];
+            out_tokens[count].type = table->types[slot];
+        }
+        in_lexer->cursor += count;
+    }
+    else
+    {
+        /* as lexer_get(), but the texts aren't returned so they're freed straight away */
+        for (count = 0; count < in_max; count++)
+        {
+            if (in_lexer->buffer[ in_lexer->buffer_start ].offset < 0) break;
+            next = _lexer_next_token(in_lexer);
+            
+            token = &(in_lexer->buffer[ in_lexer->buffer_start ]);
+            out_tokens[count].offset = token->offset;
+            out_tokens[count].length = (int)token->length;
+            out_tokens[count].type = token->type;
+            if (token->text && (!_lexer_is_slice(in_lexer, token->text)))
+                safe_free((char*)token->text);
+            *token = next;
+            
+            in_lexer->buffer_start++;
+            if (in_lexer->buffer_start >= TOKEN_BUFFER_SIZE)
+                in_lexer->buffer_start = 0;
+        }
+    }
+    
+    if ((count > 0) && (out_tokens[count - 1].offset > 0))
+        in_lexer->last_valid_offset = out_tokens[count - 1].offset;
+    return count;
+}
+
+
+Token lexer_peek(Lexer *in_lexer, int in_how_far)
+{
+    assert(in_lexer);
+    assert(in_how_far >= 0);
+    
+    int index;
+    Token token;
+    
+    if (in_lexer->table)
+    {
+        token = _lexer_table_token(in_lexer, in_lexer->cursor + in_how_far);
+        if (token.offset > 0)
+            in_lexer->last_valid_offset = token.offset;
+        return token;
+    }
+    
+    assert(in_how_far < TOKEN_BUFFER_SIZE-1);
+    
+    index = in_lexer->buffer_start + in_how_far;
+    if (index >= TOKEN_BUFFER_SIZE)
+        index -= TOKEN_BUFFER_SIZE;
+    
+    if (in_lexer->buffer[index].offset > 0)
+        in_lexer->last_valid_offset = in_lexer->buffer[index].offset;
+    
+    return in_lexer->buffer[index];
+}
+
+
+long lexer_offset(Lexer *in_lexer)
+{
+    return in_lexer->last_valid_offset;
+}
+
+
+long lexer_utf8_error(Lexer *in_lexer)
+{
+    assert(in_lexer);
+    return in_lexer->utf8_error;
+}
+
+
+long lexer_condition_error(Lexer *in_lexer, const char **out_message)
+{
+    assert(in_lexer);
+    assert(out_message);
+    *out_message = in_lexer->condition_message;
+    return in_lexer->condition_error;
+}
+
+
+long lexer_line_count(Lexer *in_lexer)
+{
+    assert(in_lexer);
+    return in_lexer->line_number;
+}
+
+
+/* maps a byte offset to a line and column by binary search of the line starts; both are
+ 1-based and the column counts UTF-8 characters, not bytes */
+void lexer_location(Lexer *in_lexer, long in_offset, long *out_line, long *out_column)
+{
+    long low, high, middle, column;
+    const char *scan, *end;
+    
+    assert(in_lexer);
+    assert(in_lexer->line_starts);
+    assert(out_line);
+    assert(out_column);
+    
+    if (in_offset < 0) in_offset = 0;
+    if (in_offset > in_lexer->source_length) in_offset = in_lexer->source_length;
+    
+    /* find the last line that starts at or before the offset */
+    low = 0;
+    high = in_lexer->line_number - 1;
+    while (low < high)
+    {
+        middle = low + (high - low + 1) / 2;
+        if (_lexer_line_start(in_lexer, middle) <= in_offset)
+            low = middle;
+        else
+            high = middle - 1;
+    }
+    
+    /* count the characters that aren't UTF-8 continuation bytes */
+    column = 1;
+    end = in_lexer->source + in_offset;
+    for (scan = in_lexer->source + _lexer_line_start(in_lexer, low); scan < end; scan++)
+    {
+        if ((*scan & 0xC0) != 0x80) column++;
+    }
+    
+    *out_line = low + 1;
+    *out_column = column;
+}
+
+
+char* lexer_token_string(Token in_token)
+{
+    char *result;
+    
+    if (!in_token.text) return NULL;
+    result = safe_malloc(in_token.length + 1);
+    memcpy(result, in_token.text, in_token.length);
+    result[in_token.length] = 0;
+    return result;
+}
+
+
+void lexer_dispose(Lexer *in_lexer)
+{
+    int i;
+    
+    if (!in_lexer) return;
+    for (i = 0; i < AUTOFREE_QUEUE; i++)
+    {
+        if (in_lexer->autofree_list[i])
+            safe_free(in_lexer->autofree_list[i]);
+    }
+    for (i = 0; i < TOKEN_BUFFER_SIZE; i++)
+    {
+        if (in_lexer->buffer[i].text && (!_lexer_is_slice(in_lexer, in_lexer->buffer[i].text)))
+            safe_free((char*)in_lexer->buffer[i].text);
+    }
+    if (in_lexer->table) _lexer_table_dispose(in_lexer);
+    if (in_lexer->line_starts) safe_free(in_lexer->line_starts);
+    if (in_lexer->reader) safe_free(in_lexer->source);
+    if (in_lexer->defined) safe_free(in_lexer->defined);
+    safe_free(in_lexer);
+}
+
+
+
+#ifdef DEBUG
+
+static const char* lexer_debug_token_type(enum LexerTokenType in_type)
+{
+    const struct KnownToken *known;
+    
+    switch (in_type)
+    {
+        case TOKEN_NEW_LINE:
+            return "<newline>";
+        case TOKEN_IDENTIFIER:
+            return "<identifier>";
+        case TOKEN_SPACE:
+            return "<space>";
+        case TOKEN_LIT_STRING:
+            return "<literal-string>";
+        case TOKEN_LIT_INTEGER:
+            return "<literal-integer>";
+        case TOKEN_LIT_REAL:
+            return "<literal-real>";
+        case TOKEN_LIT_COLOUR:
+            return "<literal-colour>";
+        default: break;
+    }
+    
+    known = known_tokens;
+    
+    while (known->text)
+    {
+        if (known->type == in_type)
+            return known->text;
+        
+        known++;
+    }
+    
+    return NULL;
+}
+
+
+void lexer_debug_token(Token in_token)
+{
+    if (in_token.offset < 0)
+    {
+        printf("END OF SOURCE\n");
+        return;
     }
     printf("%s", lexer_debug_token_type(in_token.type));
     if (in_token.text)
-        printf(" \"%s\"", in_token.text);
+        printf(" \"%.*s\"", (int)in_token.length, in_token.text);
     if ((in_token.type == TOKEN_LIT_INTEGER) || (in_token.type == TOKEN_LIT_COLOUR))
         printf(" %ld", in_token.value.integer);
     else if (in_token.type == TOKEN_LIT_REAL)
@@ -863,13 +2541,23 @@ void lexer_debug_token(Token in_token)
 
 
 
+/* compares the text of a token with a NULL terminated string */
+static Boolean _test_text_is(Token in_token, const char *in_text)
+{
+    if (!in_token.text) return False;
+    return ( (in_token.length == (long)strlen(in_text)) && (memcmp(in_token.text, in_text, in_token.length) == 0) );
+}
+
+
 /* checks that the hard-coded list of known tokens is correctly formatted:
  i)  uses lowercase letters
- ii) is sorted with the longest tokens at the top */
+ ii) is sorted with the longest tokens at the top
+ and that every known token is recognised by _lexer_keyword() or _lexer_symbol() */
 static const char* test_1(void)
 {
     const struct KnownToken *known;
     long last_length, this_length, c;
+    char upper[16];
     
     known = known_tokens;
     last_length = 0;
@@ -880,12 +2568,42 @@ static const char* test_1(void)
         if ((this_length > last_length) && (last_length != 0))
             return "known_tokens[] must be manually sorted from longest to shortest token.";
         for (c = 0; c < this_length; c++)
-            if (isupper(known->text[c]))
+            if (known->text[c] != _lexer_fold(known->text[c]))
                 return "known_tokens[] must only contain lowercase characters.";
         last_length = this_length;
         
+        for (c = 0; c <= this_length; c++)
+            upper[c] = _lexer_is_alpha(known->text[c]) ? known->text[c] - ('a' - 'A') : known->text[c];
+        
+        if (_lexer_is_alpha(known->text[0]))
+        {
+            if (_lexer_keyword(known->text, this_length) != known->type)
+                return "known_tokens[] keyword isn't recognised by _lexer_keyword().";
+            if (_lexer_keyword(upper, this_length) != known->type)
+                return "_lexer_keyword() must be case-insensitive.";
+            if (_lexer_keyword(known->text, this_length - 1) == known->type)
+                return "_lexer_keyword() must only match an entire alphanumeric run.";
+        }
+        else
+        {
+            if ( (_lexer_symbol(known->text, &c) != known->type) || (c != this_length) )
+                return "known_tokens[] symbol isn't recognised by _lexer_symbol().";
+            if ( (_lexer_symbol(upper, &c) != known->type) || (c != this_length) )
+                return "_lexer_symbol() must be case-insensitive.";
+        }
+        
         known++;
     }
+    
+    CHECK(_lexer_keyword("isabel", 6) == TOKEN_UNRECOGNISED);
+    CHECK(_lexer_keyword("i", 1) == TOKEN_UNRECOGNISED);
+    CHECK(_lexer_symbol("#iffy", &c) == TOKEN_HASH_IF);
+    CHECK(c == 3);
+    CHECK(_lexer_symbol("#", &c) == TOKEN_UNRECOGNISED);
+    CHECK(_lexer_symbol("&z", &c) == TOKEN_UNRECOGNISED);
+    CHECK(_lexer_symbol("\r\n", &c) == TOKEN_NEW_LINE);
+    CHECK(c == 2);
+    
     return NULL;
 }
 
@@ -900,31 +2618,44 @@ static const char* test_2(void)
     CHECK(lexer);
     CHECK(!lexer->last_was_text);
     CHECK(lexer->source == source);
-    CHECK(lexer->textize_known == False);
+    CHECK(lexer->source_length == (long)strlen(source));
     CHECK(lexer->line_number == 1);
     
     return NULL;
 }
 
 
-/* checks _lexer_grab_text(const char *inSource, long inLength) */
+/* checks char* lexer_token_string(Token in_token) */
 static const char* test_3(void)
 {
     char *source = "This is a test";
     char *result;
+    Token token;
     
-    result = _lexer_grab_text(source, 4);
+    token.text = source;
+    token.length = 4;
+    result = lexer_token_string(token);
     CHECK(result);
-    CHECK(memcmp(result, source, 4) == 0);
+    CHECK(strcmp(result, "This") == 0);
     CHECK(result != source);
+    safe_free(result);
     
-    result = _lexer_grab_text(source + 8, 6);
+    token.text = source + 8;
+    token.length = 6;
+    result = lexer_token_string(token);
     CHECK(result);
-    CHECK(memcmp(result, source + 8, 4) == 0);
+    CHECK(strcmp(result, "a test") == 0);
+    safe_free(result);
     
-    result = _lexer_grab_text(source, 0);
+    token.text = source;
+    token.length = 0;
+    result = lexer_token_string(token);
     CHECK(result);
     CHECK(result[0] == 0);
+    safe_free(result);
+    
+    token.text = NULL;
+    CHECK(lexer_token_string(token) == NULL);
     
     return NULL;
 }
@@ -983,297 +2714,348 @@ static const char* test_6(void)
 }
 
 
-/* static const char* _lexer_get_dec(Lexer *inLexer, Boolean *out_is_real) */
+/* static void _lexer_get_dec(Lexer *inLexer, Boolean *out_is_real, long *out_integer, double *out_real) */
 static const char* test_7(void)
 {
     Lexer *lexer;
-    const char *dec;
     Boolean is_real;
+    long integer;
+    double real;
     
     lexer = _lexer_create("", False);
     CHECK(lexer);
-    dec = _lexer_get_dec(lexer, &is_real);
-    CHECK(dec);
-    CHECK(dec[0] == 0);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(lexer->source_offset - lexer->source == 0);
     CHECK(!is_real);
+    CHECK(integer == 0);
     
     lexer = _lexer_create("8", False);
     CHECK(lexer);
-    dec = _lexer_get_dec(lexer, &is_real);
-    CHECK(dec);
-    CHECK(strcmp(dec, "8") == 0);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(lexer->source_offset - lexer->source == 1);
     CHECK(!is_real);
+    CHECK(integer == 8);
     
     lexer = _lexer_create("12.3e5 + 2", False);
     CHECK(lexer);
-    dec = _lexer_get_dec(lexer, &is_real);
-    CHECK(dec);
-    CHECK(strcmp(dec, "12.3e5") == 0);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(lexer->source_offset - lexer->source == 6);
     CHECK(is_real);
+    CHECK(real == 12.3e5);
     
     lexer = _lexer_create("3e10 + 2", False);
     CHECK(lexer);
-    dec = _lexer_get_dec(lexer, &is_real);
-    CHECK(dec);
-    CHECK(strcmp(dec, "3e10") == 0);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(lexer->source_offset - lexer->source == 4);
     CHECK(is_real);
+    CHECK(real == 3e10);
     
     lexer = _lexer_create("24e2 + 2", False);
     CHECK(lexer);
-    dec = _lexer_get_dec(lexer, &is_real);
-    CHECK(dec);
-    CHECK(strcmp(dec, "24e2") == 0);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(lexer->source_offset - lexer->source == 4);
     CHECK(is_real);
+    CHECK(real == 24e2);
     
     lexer = _lexer_create("12.3e-17 + 2", False);
     CHECK(lexer);
-    dec = _lexer_get_dec(lexer, &is_real);
-    CHECK(dec);
-    CHECK(strcmp(dec, "12.3e-17") == 0);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(lexer->source_offset - lexer->source == 8);
     CHECK(is_real);
+    CHECK(real == 12.3e-17);
     
     lexer = _lexer_create("0234.317 + 2", False);
     CHECK(lexer);
-    dec = _lexer_get_dec(lexer, &is_real);
-    CHECK(dec);
-    CHECK(strcmp(dec, "0234.317") == 0);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(lexer->source_offset - lexer->source == 8);
     CHECK(is_real);
+    CHECK(real == 0234.317);
     
     lexer = _lexer_create("42 + 2", False);
     CHECK(lexer);
-    dec = _lexer_get_dec(lexer, &is_real);
-    CHECK(dec);
-    CHECK(strcmp(dec, "42") == 0);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(lexer->source_offset - lexer->source == 2);
     CHECK(!is_real);
+    CHECK(integer == 42);
     
     lexer = _lexer_create("0 + 2", False);
     CHECK(lexer);
-    dec = _lexer_get_dec(lexer, &is_real);
-    CHECK(dec);
-    CHECK(strcmp(dec, "0") == 0);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(lexer->source_offset - lexer->source == 1);
     CHECK(!is_real);
+    CHECK(integer == 0);
     
     lexer = _lexer_create(".2 + 2", False);
     CHECK(lexer);
-    dec = _lexer_get_dec(lexer, &is_real);
-    CHECK(dec);
-    CHECK(strcmp(dec, ".2") == 0);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(lexer->source_offset - lexer->source == 2);
     CHECK(is_real);
+    CHECK(real == .2);
     
     lexer = _lexer_create("z12.3e5 + 2", False);
     CHECK(lexer);
-    dec = _lexer_get_dec(lexer, &is_real);
-    CHECK(dec);
-    CHECK(dec[0] == 0);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(lexer->source_offset - lexer->source == 0);
     CHECK(!is_real);
+    CHECK(integer == 0);
     
     lexer = _lexer_create("A0 + 2", False);
     CHECK(lexer);
-    dec = _lexer_get_dec(lexer, &is_real);
-    CHECK(dec);
-    CHECK(dec[0] == 0);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(lexer->source_offset - lexer->source == 0);
     CHECK(!is_real);
+    CHECK(integer == 0);
     
     lexer = _lexer_create("9..1 + 2", False);
     CHECK(lexer);
-    dec = _lexer_get_dec(lexer, &is_real);
-    CHECK(dec);
-    CHECK(strcmp(dec, "9.") == 0);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(lexer->source_offset - lexer->source == 2);
     CHECK(is_real);
+    CHECK(real == 9.0);
     
     lexer = _lexer_create("-5 + 2", False);
     CHECK(lexer);
-    dec = _lexer_get_dec(lexer, &is_real);
-    CHECK(dec);
-    CHECK(dec[0] == 0);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(lexer->source_offset - lexer->source == 0);
     CHECK(!is_real);
+    CHECK(integer == 0);
     
     lexer = _lexer_create("9ee + 2", False);
     CHECK(lexer);
-    dec = _lexer_get_dec(lexer, &is_real);
-    CHECK(dec);
-    CHECK(strcmp(dec, "9e") == 0);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(lexer->source_offset - lexer->source == 2);
+    CHECK(is_real);
+    CHECK(real == 9.0);
+    
+    /* integers that don't fit a long become reals; reals are not narrowed to float */
+    lexer = _lexer_create("9223372036854775807", False);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(!is_real);
+    CHECK(integer == 9223372036854775807L);
+    
+    lexer = _lexer_create("9223372036854775808", False);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(is_real);
+    CHECK(real == 9223372036854775808.0);
+    
+    lexer = _lexer_create("123456789012345678901234567890", False);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(lexer->source_offset - lexer->source == 30);
     CHECK(is_real);
+    CHECK(real == 123456789012345678901234567890.0);
+    
+    lexer = _lexer_create("0.1", False);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(real == 0.1);
+    
+    lexer = _lexer_create("1.7976931348623157e308 4.9406564584124654e-324 1e-400 1e400", False);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(real == 1.7976931348623157e308);
+    lexer->source_offset++;
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(real == 4.9406564584124654e-324);
+    lexer->source_offset++;
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(real == 0.0);
+    lexer->source_offset++;
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(real == HUGE_VAL);
+    
+    /* literals are cut off after MAX_DEC_LENGTH characters */
+    lexer = _lexer_create("0.000000000000000000000000000000000000000000000000000000000000015", False);
+    _lexer_get_dec(lexer, &is_real, &integer, &real);
+    CHECK(lexer->source_offset - lexer->source == MAX_DEC_LENGTH);
+    CHECK(real == 1e-62);
     
     return NULL;
 }
 
 
-/* static const char* _lexer_get_hex(Lexer *inLexer, int inLimitLength) */
+/* static long _lexer_get_hex(Lexer *inLexer, int inLimitLength) */
 static const char* test_8(void)
 {
     Lexer *lexer;
-    const char *hex;
+    long value;
     
     lexer = _lexer_create("", False);
     CHECK(lexer);
-    hex = _lexer_get_hex(lexer, -1);
-    CHECK(hex);
-    CHECK(hex[0] == 0);
+    value = _lexer_get_hex(lexer, -1);
+    CHECK(lexer->source_offset - lexer->source == 0);
+    CHECK(value == 0x0);
     
     lexer = _lexer_create("Z0f8", False);
     CHECK(lexer);
-    hex = _lexer_get_hex(lexer, 0);
-    CHECK(hex);
-    CHECK(hex[0] == 0);
+    value = _lexer_get_hex(lexer, 0);
+    CHECK(lexer->source_offset - lexer->source == 0);
+    CHECK(value == 0x0);
     
     lexer = _lexer_create("Z0f8", False);
     CHECK(lexer);
-    hex = _lexer_get_hex(lexer, -1);
-    CHECK(hex);
-    CHECK(hex[0] == 0);
+    value = _lexer_get_hex(lexer, -1);
+    CHECK(lexer->source_offset - lexer->source == 0);
+    CHECK(value == 0x0);
     
     lexer = _lexer_create("0f8", False);
     CHECK(lexer);
-    hex = _lexer_get_hex(lexer, -1);
-    CHECK(hex);
-    CHECK(strcmp(hex, "0f8") == 0);
+    value = _lexer_get_hex(lexer, -1);
+    CHECK(lexer->source_offset - lexer->source == 3);
+    CHECK(value == 0xF8);
     
     lexer = _lexer_create("0f8z", False);
     CHECK(lexer);
-    hex = _lexer_get_hex(lexer, -1);
-    CHECK(hex);
-    CHECK(strcmp(hex, "0f8") == 0);
+    value = _lexer_get_hex(lexer, -1);
+    CHECK(lexer->source_offset - lexer->source == 3);
+    CHECK(value == 0xF8);
     
     lexer = _lexer_create("9", False);
     CHECK(lexer);
-    hex = _lexer_get_hex(lexer, -1);
-    CHECK(hex);
-    CHECK(strcmp(hex, "9") == 0);
+    value = _lexer_get_hex(lexer, -1);
+    CHECK(lexer->source_offset - lexer->source == 1);
+    CHECK(value == 0x9);
     
     lexer = _lexer_create("F.E42=Pods", False);
     CHECK(lexer);
-    hex = _lexer_get_hex(lexer, -1);
-    CHECK(hex);
-    CHECK(strcmp(hex, "F") == 0);
+    value = _lexer_get_hex(lexer, -1);
+    CHECK(lexer->source_offset - lexer->source == 1);
+    CHECK(value == 0xF);
     
     lexer = _lexer_create("F-E42=Pods", False);
     CHECK(lexer);
-    hex = _lexer_get_hex(lexer, -1);
-    CHECK(hex);
-    CHECK(strcmp(hex, "F") == 0);
+    value = _lexer_get_hex(lexer, -1);
+    CHECK(lexer->source_offset - lexer->source == 1);
+    CHECK(value == 0xF);
     
     lexer = _lexer_create("F00D15600D41 ", False);
     CHECK(lexer);
-    hex = _lexer_get_hex(lexer, -1);
-    CHECK(hex);
-    CHECK(strcmp(hex, "F00D15600D41") == 0);
+    value = _lexer_get_hex(lexer, -1);
+    CHECK(lexer->source_offset - lexer->source == 12);
+    CHECK(value == 0xF00D15600D41L);
     
     lexer = _lexer_create("F00D156piano00D41 ", False);
     CHECK(lexer);
-    hex = _lexer_get_hex(lexer, 4);
-    CHECK(hex);
-    CHECK(strcmp(hex, "F00D") == 0);
+    value = _lexer_get_hex(lexer, 4);
+    CHECK(lexer->source_offset - lexer->source == 4);
+    CHECK(value == 0xF00D);
+    
+    /* too large for a long */
+    lexer = _lexer_create("FFFFFFFFFFFFFFFFFF", False);
+    value = _lexer_get_hex(lexer, -1);
+    CHECK(lexer->source_offset - lexer->source == 18);
+    CHECK(value == LONG_MAX);
+    
+    lexer = _lexer_create("7fffffffffffffff", False);
+    value = _lexer_get_hex(lexer, -1);
+    CHECK(value == LONG_MAX);
     
     return NULL;
 }
 
 
-/* static const char* _lexer_get_oct(Lexer *inLexer) */
+/* static long _lexer_get_oct(Lexer *inLexer) */
 static const char* test_9(void)
 {
     Lexer *lexer;
-    const char *hex;
+    long value;
     
     lexer = _lexer_create("", False);
     CHECK(lexer);
-    hex = _lexer_get_oct(lexer);
-    CHECK(hex);
-    CHECK(hex[0] == 0);
+    value = _lexer_get_oct(lexer);
+    CHECK(lexer->source_offset - lexer->source == 0);
+    CHECK(value == 0);
     
     lexer = _lexer_create("428", False);
     CHECK(lexer);
-    hex = _lexer_get_oct(lexer);
-    CHECK(hex);
-    CHECK(strcmp(hex, "42") == 0);
+    value = _lexer_get_oct(lexer);
+    CHECK(lexer->source_offset - lexer->source == 2);
+    CHECK(value == 042);
     
     lexer = _lexer_create("42.", False);
     CHECK(lexer);
-    hex = _lexer_get_oct(lexer);
-    CHECK(hex);
-    CHECK(strcmp(hex, "42") == 0);
+    value = _lexer_get_oct(lexer);
+    CHECK(lexer->source_offset - lexer->source == 2);
+    CHECK(value == 042);
     
     lexer = _lexer_create("0e-", False);
     CHECK(lexer);
-    hex = _lexer_get_oct(lexer);
-    CHECK(hex);
-    CHECK(strcmp(hex, "0") == 0);
+    value = _lexer_get_oct(lexer);
+    CHECK(lexer->source_offset - lexer->source == 1);
+    CHECK(value == 0);
     
     lexer = _lexer_create("42-", False);
     CHECK(lexer);
-    hex = _lexer_get_oct(lexer);
-    CHECK(hex);
-    CHECK(strcmp(hex, "42") == 0);
+    value = _lexer_get_oct(lexer);
+    CHECK(lexer->source_offset - lexer->source == 2);
+    CHECK(value == 042);
     
     lexer = _lexer_create("42z", False);
     CHECK(lexer);
-    hex = _lexer_get_oct(lexer);
-    CHECK(hex);
-    CHECK(strcmp(hex, "42") == 0);
+    value = _lexer_get_oct(lexer);
+    CHECK(lexer->source_offset - lexer->source == 2);
+    CHECK(value == 042);
     
     lexer = _lexer_create("9", False);
     CHECK(lexer);
-    hex = _lexer_get_oct(lexer);
-    CHECK(hex);
-    CHECK(strcmp(hex, "") == 0);
+    value = _lexer_get_oct(lexer);
+    CHECK(lexer->source_offset - lexer->source == 0);
+    CHECK(value == 0);
     
     return NULL;
 }
 
 
-/* static const char* _lexer_get_bin(Lexer *inLexer) */
+/* static long _lexer_get_bin(Lexer *inLexer) */
 static const char* test_10(void)
 {
     Lexer *lexer;
-    const char *bin;
+    long value;
     
     lexer = _lexer_create("", False);
     CHECK(lexer);
-    bin = _lexer_get_bin(lexer);
-    CHECK(bin);
-    CHECK(bin[0] == 0);
+    value = _lexer_get_bin(lexer);
+    CHECK(lexer->source_offset - lexer->source == 0);
+    CHECK(value == 0);
     
     lexer = _lexer_create("208", False);
     CHECK(lexer);
-    bin = _lexer_get_bin(lexer);
-    CHECK(bin);
-    CHECK(bin[0] == 0);
+    value = _lexer_get_bin(lexer);
+    CHECK(lexer->source_offset - lexer->source == 0);
+    CHECK(value == 0);
     
     lexer = _lexer_create("108", False);
     CHECK(lexer);
-    bin = _lexer_get_bin(lexer);
-    CHECK(bin);
-    CHECK(strcmp(bin, "10") == 0);
+    value = _lexer_get_bin(lexer);
+    CHECK(lexer->source_offset - lexer->source == 2);
+    CHECK(value == 2);
     
     lexer = _lexer_create("01.", False);
     CHECK(lexer);
-    bin = _lexer_get_bin(lexer);
-    CHECK(bin);
-    CHECK(strcmp(bin, "01") == 0);
+    value = _lexer_get_bin(lexer);
+    CHECK(lexer->source_offset - lexer->source == 2);
+    CHECK(value == 1);
     
     lexer = _lexer_create("0e-", False);
     CHECK(lexer);
-    bin = _lexer_get_bin(lexer);
-    CHECK(bin);
-    CHECK(strcmp(bin, "0") == 0);
+    value = _lexer_get_bin(lexer);
+    CHECK(lexer->source_offset - lexer->source == 1);
+    CHECK(value == 0);
     
     lexer = _lexer_create("10-", False);
     CHECK(lexer);
-    bin = _lexer_get_bin(lexer);
-    CHECK(bin);
-    CHECK(strcmp(bin, "10") == 0);
+    value = _lexer_get_bin(lexer);
+    CHECK(lexer->source_offset - lexer->source == 2);
+    CHECK(value == 2);
     
     lexer = _lexer_create("11z", False);
     CHECK(lexer);
-    bin = _lexer_get_bin(lexer);
-    CHECK(bin);
-    CHECK(strcmp(bin, "11") == 0);
+    value = _lexer_get_bin(lexer);
+    CHECK(lexer->source_offset - lexer->source == 2);
+    CHECK(value == 3);
     
     lexer = _lexer_create("4", False);
     CHECK(lexer);
-    bin = _lexer_get_bin(lexer);
-    CHECK(bin);
-    CHECK(strcmp(bin, "") == 0);
+    value = _lexer_get_bin(lexer);
+    CHECK(lexer->source_offset - lexer->source == 0);
+    CHECK(value == 0);
     
     return NULL;
 }
@@ -1297,7 +3079,7 @@ static const char* test_11(void)
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_UNRECOGNISED);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "name") == 0);
+    CHECK(_test_text_is(token, "name"));
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_SPACE);
     token = _lexer_get_token(lexer);
@@ -1307,7 +3089,7 @@ static const char* test_11(void)
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_UNRECOGNISED);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "this") == 0);
+    CHECK(_test_text_is(token, "this"));
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_SPACE);
     token = _lexer_get_token(lexer);
@@ -1317,14 +3099,14 @@ static const char* test_11(void)
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_UNRECOGNISED);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "comment") == 0);
+    CHECK(_test_text_is(token, "comment"));
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_NEW_LINE);
 
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_UNRECOGNISED);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "name") == 0);
+    CHECK(_test_text_is(token, "name"));
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_SPACE);
     token = _lexer_get_token(lexer);
@@ -1336,7 +3118,7 @@ static const char* test_11(void)
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_UNRECOGNISED);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "Hello") == 0);
+    CHECK(_test_text_is(token, "Hello"));
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_SPACE);
     token = _lexer_get_token(lexer);
@@ -1344,7 +3126,7 @@ static const char* test_11(void)
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_UNRECOGNISED);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "0022cruel") == 0);
+    CHECK(_test_text_is(token, "0022cruel"));
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_QUOTE);
     token = _lexer_get_token(lexer);
@@ -1354,7 +3136,7 @@ static const char* test_11(void)
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_UNRECOGNISED);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "world!") == 0);
+    CHECK(_test_text_is(token, "world!"));
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_QUOTE);
     token = _lexer_get_token(lexer);
@@ -1367,13 +3149,13 @@ static const char* test_11(void)
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_UNRECOGNISED);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "3") == 0);
+    CHECK(_test_text_is(token, "3"));
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_DOT);
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_UNRECOGNISED);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "14159") == 0);
+    CHECK(_test_text_is(token, "14159"));
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_NEW_LINE);
     
@@ -1382,7 +3164,7 @@ static const char* test_11(void)
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_UNRECOGNISED);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "1001ANd") == 0);
+    CHECK(_test_text_is(token, "1001ANd"));
     
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_SPACE);
@@ -1391,7 +3173,7 @@ static const char* test_11(void)
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_UNRECOGNISED);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "私はガラ") == 0);
+    CHECK(_test_text_is(token, "私はガラ"));
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_EQUAL);
     token = _lexer_get_token(lexer);
@@ -1399,13 +3181,13 @@ static const char* test_11(void)
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_UNRECOGNISED);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "pickle") == 0);
+    CHECK(_test_text_is(token, "pickle"));
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_SPACE);
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_UNRECOGNISED);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "食べ") == 0);
+    CHECK(_test_text_is(token, "食べ"));
     token = _lexer_get_token(lexer);
     CHECK(token.type == TOKEN_QUOTE);
     token = _lexer_get_token(lexer);
@@ -1415,34 +3197,52 @@ static const char* test_11(void)
 }
 
 
-/* static void _lexer_append_string(char **inString1, const char *inString2) */
+/* static void _lexer_buffer_append(LexerBuffer *io_buffer, const char *in_text, long in_length) */
 static const char* test_12(void)
 {
-    char *the_mutating;
+    LexerBuffer the_mutating;
+    int i;
+    
+    the_mutating.text = NULL;
+    the_mutating.length = 0;
+    the_mutating.capacity = 0;
+    
+    _lexer_buffer_append(&the_mutating, "hello", 5);
+    CHECK(the_mutating.text);
+    CHECK(strcmp(the_mutating.text, "hello") == 0);
     
-    the_mutating = NULL;
+    _lexer_buffer_append(&the_mutating, " world", 6);
+    CHECK(the_mutating.text);
+    CHECK(strcmp(the_mutating.text, "hello world") == 0);
+    CHECK(the_mutating.length == 11);
     
-    _lexer_append_string(&the_mutating, "hello");
-    CHECK(the_mutating);
-    CHECK(strcmp(the_mutating, "hello") == 0);
+    for (i = 0; i < 1000; i++)
+        _lexer_buffer_append(&the_mutating, "0123456789", 10);
+    CHECK(the_mutating.length == 10011);
+    CHECK(strlen(the_mutating.text) == 10011);
+    CHECK(the_mutating.capacity >= 10012);
+    CHECK(memcmp(the_mutating.text + 10001, "0123456789", 10) == 0);
     
-    _lexer_append_string(&the_mutating, " world");
-    CHECK(the_mutating);
-    CHECK(strcmp(the_mutating, "hello world") == 0);
+    safe_free(the_mutating.text);
     
     return NULL;
 }
 
 
-/* static Boolean _lexer_is_valid_identifier(const char *inText) */
+/* static Boolean _lexer_is_valid_identifier(const char *inText, long inLength) */
+static Boolean _test_is_valid_identifier(const char *in_text)
+{
+    return _lexer_is_valid_identifier(in_text, strlen(in_text));
+}
+
 static const char* test_13(void)
 {
-    CHECK(_lexer_is_valid_identifier("_pumpkin"));
-    CHECK(!_lexer_is_valid_identifier("2_pumpkin"));
-    CHECK(!_lexer_is_valid_identifier("$_pumpkin"));
-    CHECK(!_lexer_is_valid_identifier(" _pumpkin"));
-    CHECK(!_lexer_is_valid_identifier(""));
-    CHECK(!_lexer_is_valid_identifier("iiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiii"
+    CHECK(_test_is_valid_identifier("_pumpkin"));
+    CHECK(!_test_is_valid_identifier("2_pumpkin"));
+    CHECK(!_test_is_valid_identifier("$_pumpkin"));
+    CHECK(!_test_is_valid_identifier(" _pumpkin"));
+    CHECK(!_test_is_valid_identifier(""));
+    CHECK(!_test_is_valid_identifier("iiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiii"
                                       "iiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiii"
                                       "iiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiii"
                                       "iiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiii"
@@ -1452,38 +3252,49 @@ static const char* test_13(void)
                                       "iiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiii"
                                       "iiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiii"
                                       "iiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiiz"));
-    CHECK(_lexer_is_valid_identifier("hello_there"));
-    CHECK(!_lexer_is_valid_identifier("hello_$there"));
-    CHECK(!_lexer_is_valid_identifier("hello there"));
-    CHECK(_lexer_is_valid_identifier("buns4you"));
-    CHECK(_lexer_is_valid_identifier("buns4you_"));
-    
-    CHECK(_lexer_is_valid_identifier("buώσσαyou_"));
-    CHECK(_lexer_is_valid_identifier("ہیںou_test"));
-    CHECK(_lexer_is_valid_identifier("ہیںou_𣎏世咹_test"));
-    CHECK(_lexer_is_valid_identifier("ہیںou_𣎏世咹_5test"));
-    CHECK(!_lexer_is_valid_identifier("3ہیںou_𣎏世咹_5test"));
-    CHECK(!_lexer_is_valid_identifier("ہیںou_𣎏世咹_5test$"));
-    CHECK(_lexer_is_valid_identifier("私はガラ_"));
+    CHECK(_test_is_valid_identifier("hello_there"));
+    CHECK(!_test_is_valid_identifier("hello_$there"));
+    CHECK(!_test_is_valid_identifier("hello there"));
+    CHECK(_test_is_valid_identifier("buns4you"));
+    CHECK(_test_is_valid_identifier("buns4you_"));
+    
+    CHECK(_test_is_valid_identifier("buώσσαyou_"));
+    CHECK(_test_is_valid_identifier("ہیںou_test"));
+    CHECK(_test_is_valid_identifier("ہیںou_𣎏世咹_test"));
+    CHECK(_test_is_valid_identifier("ہیںou_𣎏世咹_5test"));
+    CHECK(!_test_is_valid_identifier("3ہیںou_𣎏世咹_5test"));
+    CHECK(!_test_is_valid_identifier("ہیںou_𣎏世咹_5test$"));
+    CHECK(_test_is_valid_identifier("私はガラ_"));
     
     return NULL;
 }
 
 
-/* static const char* _lexer_encode_unicode_char(long inCodePoint) */
+/* static const char* _lexer_encode_unicode_char(long inCodePoint, char *out_text) */
 static const char* test_14(void)
 {
     const char *result;
+    char text[UNICODE_MAX_BYTES + 1];
     
-    result = _lexer_encode_unicode_char(32);
+    result = _lexer_encode_unicode_char(32, text);
     CHECK(result);
     CHECK(strcmp(result, " ") == 0);
     
-    result = _lexer_encode_unicode_char(78);
+    result = _lexer_encode_unicode_char(78, text);
     CHECK(result);
     CHECK(strcmp(result, "N") == 0);
     
-    /* TODO: this needs additional tests once the function is properly fixed to work with Unicode */
+    result = _lexer_encode_unicode_char(0xE9, text);
+    CHECK(strcmp(result, "\xC3\xA9") == 0);
+    
+    result = _lexer_encode_unicode_char(0x4E16, text);
+    CHECK(strcmp(result, "\xE4\xB8\x96") == 0);
+    
+    result = _lexer_encode_unicode_char(0x1F600, text);
+    CHECK(strcmp(result, "\xF0\x9F\x98\x80") == 0);
+    
+    result = _lexer_encode_unicode_char(0xD800, text);
+    CHECK(strcmp(result, "\xEF\xBF\xBD") == 0);
     
     return NULL;
 }
@@ -1507,19 +3318,19 @@ static const char* test_15(void)
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_IDENTIFIER);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "x") == 0);
+    CHECK(_test_text_is(token, "x"));
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_COMMA);
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_IDENTIFIER);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "y") == 0);
+    CHECK(_test_text_is(token, "y"));
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_AS);
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_IDENTIFIER);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "Integer") == 0);
+    CHECK(_test_text_is(token, "Integer"));
     
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_NEW_LINE);
@@ -1529,18 +3340,18 @@ static const char* test_15(void)
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_IDENTIFIER);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "name") == 0);
+    CHECK(_test_text_is(token, "name"));
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_AS);
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_IDENTIFIER);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "String") == 0);
+    CHECK(_test_text_is(token, "String"));
     
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_REM);
     CHECK(token.text);
-    CHECK(strcmp(token.text, " this is a comment") == 0);
+    CHECK(_test_text_is(token, " this is a comment"));
     
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_NEW_LINE);
@@ -1548,13 +3359,13 @@ static const char* test_15(void)
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_IDENTIFIER);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "name") == 0);
+    CHECK(_test_text_is(token, "name"));
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_EQUAL);
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_LIT_STRING);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "Hello \"cruel\" world!") == 0);
+    CHECK(_test_text_is(token, "Hello \"cruel\" world!"));
     
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_NEW_LINE);
@@ -1564,7 +3375,7 @@ static const char* test_15(void)
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_IDENTIFIER);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "PI") == 0);
+    CHECK(_test_text_is(token, "PI"));
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_EQUAL);
     token = _lexer_get_next_token(lexer);
@@ -1595,13 +3406,13 @@ static const char* test_15(void)
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_IDENTIFIER);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "私はガラ") == 0);
+    CHECK(_test_text_is(token, "私はガラ"));
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_EQUAL);
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_LIT_STRING);
     CHECK(token.text);
-    CHECK(strcmp(token.text, "pickle 食べ") == 0);
+    CHECK(_test_text_is(token, "pickle 食べ"));
     token = _lexer_get_next_token(lexer);
     CHECK(token.type == TOKEN_END);
     
@@ -1702,139 +3513,898 @@ static const char* test_17()
 }
 
 
-/* Token lexer_get(Lexer *in_lexer)*/
-static const char* test_18()
+/* Token lexer_get(Lexer *in_lexer)*/
+static const char* test_18()
+{
+    Lexer *lexer;
+    Token token;
+    
+    lexer = lexer_create("29 +  &b1001ANd&o74 &hEF17A3\t "
+                         "私はガラ=\"pickle 食べ\"");
+    CHECK(lexer);
+    
+    token = lexer_get(lexer);
+    CHECK(token.type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer_start == 1);
+    CHECK(lexer->buffer[1].type == TOKEN_PLUS);
+    CHECK(lexer->buffer[2].type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer[3].type == TOKEN_AND);
+    CHECK(lexer->buffer[4].type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer[5].type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer[6].type == TOKEN_IDENTIFIER);
+    CHECK(lexer->buffer[7].type == TOKEN_EQUAL);
+    CHECK(lexer->buffer[8].type == TOKEN_LIT_STRING);
+    CHECK(lexer->buffer[9].offset == -1);
+    
+    token = lexer_get(lexer);
+    CHECK(token.type == TOKEN_PLUS);
+    CHECK(lexer->buffer_start == 2);
+    CHECK(lexer->buffer[2].type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer[3].type == TOKEN_AND);
+    CHECK(lexer->buffer[4].type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer[5].type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer[6].type == TOKEN_IDENTIFIER);
+    CHECK(lexer->buffer[7].type == TOKEN_EQUAL);
+    CHECK(lexer->buffer[8].type == TOKEN_LIT_STRING);
+    CHECK(lexer->buffer[9].offset == -1);
+    CHECK(lexer->buffer[0].offset == -1);
+    
+    token = lexer_get(lexer);
+    CHECK(token.type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer_start == 3);
+    CHECK(lexer->buffer[3].type == TOKEN_AND);
+    CHECK(lexer->buffer[4].type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer[5].type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer[6].type == TOKEN_IDENTIFIER);
+    CHECK(lexer->buffer[7].type == TOKEN_EQUAL);
+    CHECK(lexer->buffer[8].type == TOKEN_LIT_STRING);
+    CHECK(lexer->buffer[9].offset == -1);
+    CHECK(lexer->buffer[0].offset == -1);
+    CHECK(lexer->buffer[1].offset == -1);
+    
+    return NULL;
+}
+
+
+/* Token lexer_peek(Lexer *in_lexer, int in_how_far)*/
+static const char* test_19()
+{
+    Lexer *lexer;
+    Token token;
+    
+    lexer = lexer_create("29 +  &b1001ANd&o74 &hEF17A3\t "
+                         "私はガラ=\"pickle 食べ\"");
+    CHECK(lexer);
+    
+    token = lexer_peek(lexer, 0);
+    CHECK(token.type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer_start == 0);
+    CHECK(lexer->buffer[1].type == TOKEN_PLUS);
+    CHECK(lexer->buffer[2].type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer[3].type == TOKEN_AND);
+    CHECK(lexer->buffer[4].type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer[5].type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer[6].type == TOKEN_IDENTIFIER);
+    CHECK(lexer->buffer[7].type == TOKEN_EQUAL);
+    CHECK(lexer->buffer[8].type == TOKEN_LIT_STRING);
+    CHECK(lexer->buffer[9].offset == -1);
+    
+    token = lexer_get(lexer);
+    CHECK(token.type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer_start == 1);
+    CHECK(lexer->buffer[1].type == TOKEN_PLUS);
+    CHECK(lexer->buffer[2].type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer[3].type == TOKEN_AND);
+    CHECK(lexer->buffer[4].type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer[5].type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer[6].type == TOKEN_IDENTIFIER);
+    CHECK(lexer->buffer[7].type == TOKEN_EQUAL);
+    CHECK(lexer->buffer[8].type == TOKEN_LIT_STRING);
+    CHECK(lexer->buffer[9].offset == -1);
+    
+    token = lexer_peek(lexer, 0);
+    CHECK(token.type == TOKEN_PLUS);
+    CHECK(lexer->buffer_start == 1);
+    
+    token = lexer_peek(lexer, 1);
+    CHECK(token.type == TOKEN_LIT_INTEGER);
+    CHECK(lexer->buffer_start == 1);
+    
+    token = lexer_peek(lexer, 2);
+    CHECK(token.type == TOKEN_AND);
+    token = lexer_peek(lexer, 3);
+    CHECK(token.type == TOKEN_LIT_INTEGER);
+    token = lexer_peek(lexer, 4);
+    CHECK(token.type == TOKEN_LIT_INTEGER);
+    token = lexer_peek(lexer, 5);
+    CHECK(token.type == TOKEN_IDENTIFIER);
+    
+    
+    lexer = lexer_create("Namespace1.Class1.MethodA");
+    CHECK(lexer);
+    token = lexer_peek(lexer, 0);
+    CHECK(token.type == TOKEN_IDENTIFIER);
+    token = lexer_peek(lexer, 1);
+    CHECK(token.type == TOKEN_DOT);
+    token = lexer_peek(lexer, 2);
+    CHECK(token.type == TOKEN_IDENTIFIER);
+    token = lexer_peek(lexer, 3);
+    CHECK(token.type == TOKEN_DOT);
+    token = lexer_peek(lexer, 4);
+    CHECK(token.type == TOKEN_IDENTIFIER);
+    
+    
+    return NULL;
+}
+
+
+/* TODO: I fixed a bug which I found by running this through the lexer:
+    "self.Dog(7) = new Dog(\"Fido\", 3)\r\n"
+   The initial loading loop was filling the buffer incorrectly and dropping "Fido"
+   from the token stream.
+ 
+   Suggest adding a test case.
+ */
+
+/* the tokens don't depend upon the kernels that validate the source */
+static Lexer* _test_lexer_with(char *in_source, const ScanKernels *in_scan)
+{
+    Lexer *lexer;
+    lexer = _lexer_create(in_source, False);
+    lexer->scan = in_scan;
+    _lexer_fill_buffer(lexer);
+    return lexer;
+}
+
+static const char* test_20()
+{
+    char *source = "Class  AVeryLongClassNameThatSpansSeveralVectorWidths_0123456789\xC3\xA9\xC3\xA9 Inherits Object\r\n"
+    "\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\t\tDim x$ As Integer = 42\n"
+    "    // a comment which is long enough to need more than one vector load to reach the end\r"
+    "    Rem another long comment, this time without a line ending at the end of the source ....";
+    Lexer *scalar, *vector;
+    Token token1, token2;
+    
+    scalar = _test_lexer_with(source, scan_kernels(SCAN_SCALAR));
+    vector = _test_lexer_with(source, scan_best());
+    do
+    {
+        token1 = lexer_get(scalar);
+        token2 = lexer_get(vector);
+        CHECK(token1.type == token2.type);
+        CHECK(token1.offset == token2.offset);
+        CHECK(token1.length == token2.length);
+    }
+    while (token1.offset >= 0);
+    
+    lexer_dispose(scalar);
+    lexer_dispose(vector);
+    
+    return NULL;
+}
+
+
+/* string literals are scanned in a single pass */
+static const char* test_21()
+{
+    Lexer *lexer;
+    Token token;
+    char *source;
+    long i;
+    
+    lexer = lexer_create("\"abc\" \"a\"\"b\" \"x&u0041y\" \"\" \"unterminated");
+    token = lexer_get(lexer);
+    CHECK(token.type == TOKEN_LIT_STRING);
+    CHECK(_test_text_is(token, "abc"));
+    CHECK(_lexer_is_slice(lexer, token.text));
+    token = lexer_get(lexer);
+    CHECK(token.type == TOKEN_LIT_STRING);
+    CHECK(_test_text_is(token, "a\"b"));
+    CHECK(!_lexer_is_slice(lexer, token.text));
+    token = lexer_get(lexer);
+    CHECK(token.type == TOKEN_LIT_STRING);
+    CHECK(_test_text_is(token, "xAy"));
+    token = lexer_get(lexer);
+    CHECK(token.type == TOKEN_LIT_STRING);
+    CHECK(token.length == 0);
+    token = lexer_get(lexer);
+    CHECK(token.type == TOKEN_QUOTE);
+    CHECK(token.offset == 27);
+    token = lexer_get(lexer);
+    CHECK(token.offset == -1);
+    lexer_dispose(lexer);
+    
+    /* a long literal made entirely of escaped quotes */
+    source = safe_malloc(200000 + 3);
+    source[0] = '"';
+    for (i = 1; i <= 200000; i++) source[i] = '"';
+    source[200001] = '"';
+    source[200002] = 0;
+    lexer = lexer_create(source);
+    token = lexer_get(lexer);
+    CHECK(token.type == TOKEN_LIT_STRING);
+    CHECK(token.length == 100000);
+    for (i = 0; i < token.length; i++) CHECK(token.text[i] == '"');
+    token = lexer_get(lexer);
+    CHECK(token.offset == -1);
+    lexer_dispose(lexer);
+    safe_free(source);
+    
+    return NULL;
+}
+
+
+/* the token table yields the same tokens as the streaming lexer, with unlimited lookahead */
+static const char* test_22()
+{
+    char *source = "Class Dog Inherits Animal ' a comment\r\n"
+    "  Dim name As String = \"Fido\"\"s &u0041\"\r\n"
+    "  Dim age As Integer = &h1F + 3.5e2 - &b101\r\n"
+    "End Class\r\n";
+    Lexer *stream, *table;
+    Token token1, token2;
+    long count;
+    
+    stream = lexer_create(source);
+    table = lexer_create_table(source);
+    count = 0;
+    do
+    {
+        token1 = lexer_get(stream);
+        CHECK(lexer_position(table) == count);
+        token2 = lexer_peek(table, 0);
+        CHECK(token1.type == token2.type);
+        CHECK(token1.offset == token2.offset);
+        CHECK(token1.length == token2.length);
+        if (token1.text) CHECK(memcmp(token1.text, token2.text, token1.length) == 0);
+        if (token1.type == TOKEN_LIT_INTEGER) CHECK(token1.value.integer == token2.value.integer);
+        if (token1.type == TOKEN_LIT_REAL) CHECK(token1.value.real == token2.value.real);
+        if (token1.type == TOKEN_IDENTIFIER) CHECK(token1.value.atom == token2.value.atom);
+        if (token1.type == TOKEN_IDENTIFIER) CHECK(token1.value.atom == intern(token1.text, token1.length));
+        token2 = lexer_get(table);
+        CHECK(token1.offset == token2.offset);
+        if (token1.offset >= 0) count++;
+    }
+    while (token1.offset >= 0);
+    CHECK(lexer_token_count(table) == count);
+    
+    /* lookahead and backtracking beyond the streaming buffer */
+    lexer_seek(table, 0);
+    token1 = lexer_peek(table, 21);
+    CHECK(token1.type == TOKEN_HYPHEN);
+    token1 = lexer_peek(table, count);
+    CHECK(token1.offset == -1);
+    token1 = lexer_token_at(table, 1);
+    CHECK(_test_text_is(token1, "Dog"));
+    token1 = lexer_token_at(table, count - 2);
+    CHECK(token1.type == TOKEN_CLASS);
+    
+    lexer_dispose(stream);
+    lexer_dispose(table);
+    
+    return NULL;
+}
+
+
+/* line and column of offsets; every kind of line ending, a line break inside a string
+ literal and a multi-byte character */
+static const char* test_23()
+{
+    char *source = "Dim a\r\ns = \"x\ny\"\n\xC3\xA9 = 1\rx";
+    Lexer *stream, *table;
+    long line, column;
+    
+    table = lexer_create_table(source);
+    CHECK(lexer_line_count(table) == 5);
+    lexer_location(table, 0, &line, &column);
+    CHECK((line == 1) && (column == 1));
+    lexer_location(table, 4, &line, &column);
+    CHECK((line == 1) && (column == 5));
+    lexer_location(table, 9, &line, &column);
+    CHECK((line == 2) && (column == 3));
+    lexer_location(table, 15, &line, &column);
+    CHECK((line == 3) && (column == 2));
+    lexer_location(table, 20, &line, &column);
+    CHECK((line == 4) && (column == 3));
+    lexer_location(table, 24, &line, &column);
+    CHECK((line == 5) && (column == 1));
+    lexer_location(table, 1000, &line, &column);
+    CHECK((line == 5) && (column == 2));
+    
+    stream = lexer_create(source);
+    while (lexer_get(stream).offset >= 0) {}
+    CHECK(lexer_line_count(stream) == 5);
+    lexer_location(stream, 20, &line, &column);
+    CHECK((line == 4) && (column == 3));
+    
+    lexer_dispose(stream);
+    lexer_dispose(table);
+    
+    return NULL;
+}
+
+
+/* applies an edit to a copy of the source */
+static char* _test_apply_edit(const char *in_source, long in_offset, long in_deleted, const char *in_inserted)
+{
+    char *result;
+    long length, inserted;
+    
+    length = strlen(in_source);
+    inserted = strlen(in_inserted);
+    result = safe_malloc(length - in_deleted + inserted + 1);
+    memcpy(result, in_source, in_offset);
+    memcpy(result + in_offset, in_inserted, inserted);
+    strcpy(result + in_offset + inserted, in_source + in_offset + in_deleted);
+    return result;
+}
+
+
+/* the incrementally updated table is identical to lexing the edited source from scratch */
+static const char* _test_same_tables(Lexer *in_lexer, char *in_source)
+{
+    Lexer *fresh;
+    Token token1, token2;
+    long i, line1, column1, line2, column2;
+    
+    fresh = lexer_create_table(in_source);
+    CHECK(lexer_token_count(in_lexer) == lexer_token_count(fresh));
+    for (i = 0; i < lexer_token_count(fresh); i++)
+    {
+        token1 = lexer_token_at(in_lexer, i);
+        token2 = lexer_token_at(fresh, i);
+        CHECK(token1.type == token2.type);
+        CHECK(token1.offset == token2.offset);
+        CHECK(token1.length == token2.length);
+        CHECK(memcmp(token1.text, token2.text, token1.length) == 0);
+        if (token1.type == TOKEN_LIT_INTEGER) CHECK(token1.value.integer == token2.value.integer);
+        if (token1.type == TOKEN_IDENTIFIER) CHECK(token1.value.atom == token2.value.atom);
+    }
+    CHECK(lexer_line_count(in_lexer) == lexer_line_count(fresh));
+    for (i = 0; i <= (long)strlen(in_source); i += 7)
+    {
+        lexer_location(in_lexer, i, &line1, &column1);
+        lexer_location(fresh, i, &line2, &column2);
+        CHECK((line1 == line2) && (column1 == column2));
+    }
+    lexer_dispose(fresh);
+    return NULL;
+}
+
+
+/* incremental relexing; edits at token boundaries, within and across string literals and
+ comments, and random edits */
+static const char* test_24()
+{
+    static const char *inserts[] = { "\"", "'", "\r\n", "\n", " ", "x", "Dim", "<", ">", "&h", "1", ".5", "\"\"", "_", "" };
+    char *source, *edited;
+    const char *error;
+    Lexer *lexer;
+    unsigned long seed;
+    long offset, deleted, length;
+    int i;
+    
+    source = _test_apply_edit("Class Dog ' a comment\r\n"
+                              "  Dim name As String = \"Fido\"\"s\r\nsecond line\"\r\n"
+                              "  Dim age As Integer = &h1F + 3.5e2 - &b101 <> x\r\n"
+                              "End Class\r\n", 0, 0, "");
+    lexer = lexer_create_table(source);
+    
+    /* open a string that swallows the following line, then close it again */
+    edited = _test_apply_edit(source, 26, 0, "\"");
+    lexer_edit(lexer, edited, 26, 0, 1);
+    safe_free(source);
+    source = edited;
+    if ((error = _test_same_tables(lexer, source))) return error;
+    edited = _test_apply_edit(source, 26, 1, "");
+    lexer_edit(lexer, edited, 26, 1, 0);
+    safe_free(source);
+    source = edited;
+    if ((error = _test_same_tables(lexer, source))) return error;
+    
+    /* join a comment to the next line */
+    edited = _test_apply_edit(source, 21, 2, "");
+    lexer_edit(lexer, edited, 21, 2, 0);
+    safe_free(source);
+    source = edited;
+    if ((error = _test_same_tables(lexer, source))) return error;
+    lexer_dispose(lexer);
+    
+    /* terminate a string left open much earlier in the source */
+    edited = _test_apply_edit("x = \"abc\r\ny = 1\r\nz = 2 + 3\r\nEnd\r\n", 0, 0, "");
+    lexer = lexer_create_table(edited);
+    safe_free(source);
+    source = edited;
+    edited = _test_apply_edit(source, 25, 0, "\"");
+    lexer_edit(lexer, edited, 25, 0, 1);
+    safe_free(source);
+    source = edited;
+    if ((error = _test_same_tables(lexer, source))) return error;
+    
+    /* random edits */
+    seed = 12345;
+    for (i = 0; i < 2000; i++)
+    {
+        length = strlen(source);
+        seed = seed * 1103515245 + 12345;
+        offset = (seed >> 8) % (length + 1);
+        seed = seed * 1103515245 + 12345;
+        deleted = (seed >> 8) % 4;
+        if (offset + deleted > length) deleted = length - offset;
+        if (length > 400) deleted += 8;
+        if (offset + deleted > length) deleted = length - offset;
+        seed = seed * 1103515245 + 12345;
+        edited = _test_apply_edit(source, offset, deleted, inserts[(seed >> 8) % (sizeof(inserts) / sizeof(char*))]);
+        lexer_edit(lexer, edited, offset, deleted, strlen(edited) - length + deleted);
+        safe_free(source);
+        source = edited;
+        if ((error = _test_same_tables(lexer, source))) return error;
+    }
+    
+    lexer_dispose(lexer);
+    safe_free(source);
+    
+    return NULL;
+}
+
+
+/* hands out the source in small chunks of varying size, like a pipe */
+typedef struct TestReader
+{
+    const char  *text;
+    long        length;
+    long        offset;
+    long        chunk;
+} TestReader;
+
+static long _test_read_chunk(void *io_user, char *out_buffer, long in_size)
+{
+    TestReader *reader = io_user;
+    long bytes;
+    
+    bytes = reader->chunk;
+    reader->chunk = reader->chunk % 13 + 1;
+    if (bytes > in_size) bytes = in_size;
+    if (bytes > reader->length - reader->offset) bytes = reader->length - reader->offset;
+    memcpy(out_buffer, reader->text + reader->offset, bytes);
+    reader->offset += bytes;
+    return bytes;
+}
+
+
+/* a stream produces the same tokens as the whole source in memory, whatever the chunk
+ boundaries; the window stays small however long the input */
+static const char* test_25()
+{
+    char *source = "Class Dog Inherits Animal ' a comment\r\n"
+    "  Dim name As String = \"Fido\"\"s &u0041\r\nsecond line\"\r\n"
+    "  Dim age As Integer = &h1F + 3.5e2 - &b101 <> 12345678901234567890\r\n"
+    "End Class\r\n  \"unterminated";
+    char *large, *offset;
+    Lexer *stream, *whole;
+    Token token1, token2;
+    TestReader reader;
+    long count;
+    int start, i;
+    
+    for (start = 1; start <= 13; start++)
+    {
+        reader.text = source;
+        reader.length = strlen(source);
+        reader.offset = 0;
+        reader.chunk = start;
+        stream = lexer_create_stream(_test_read_chunk, &reader);
+        whole = lexer_create(source);
+        do
+        {
+            token1 = lexer_get(stream);
+            token2 = lexer_get(whole);
+            CHECK(token1.type == token2.type);
+            CHECK(token1.offset == token2.offset);
+            CHECK(token1.length == token2.length);
+            if (token1.text) CHECK(memcmp(token1.text, token2.text, token1.length) == 0);
+            if (token1.type == TOKEN_LIT_INTEGER) CHECK(token1.value.integer == token2.value.integer);
+            if (token1.type == TOKEN_LIT_REAL) CHECK(token1.value.real == token2.value.real);
+            if (token1.type == TOKEN_IDENTIFIER) CHECK(token1.value.atom == token2.value.atom);
+        }
+        while (token1.offset >= 0);
+        CHECK(lexer_line_count(stream) == lexer_line_count(whole));
+        lexer_dispose(stream);
+        lexer_dispose(whole);
+    }
+    
+    large = safe_malloc(STREAM_CHUNK_SIZE * 40);
+    offset = large;
+    for (i = 0; i < STREAM_CHUNK_SIZE; i++)
+        offset += sprintf(offset, "x%d = y + \"z\" ' w\n", i % 1000);
+    reader.text = large;
+    reader.length = offset - large;
+    reader.offset = 0;
+    reader.chunk = 1;
+    stream = lexer_create_stream(_test_read_chunk, &reader);
+    while (lexer_get(stream).offset >= 0) {}
+    CHECK(lexer_line_count(stream) == STREAM_CHUNK_SIZE + 1);
+    CHECK(stream->source_capacity <= STREAM_CHUNK_SIZE * 2);
+    lexer_dispose(stream);
+    
+    /* identifiers cut by the end of a chunk are interned whole, never in pieces */
+    offset = large;
+    for (i = 0; i < 500; i++)
+        offset += sprintf(offset, "streamedIdentifier%d = anotherStreamedIdentifier%d\n", i, i);
+    whole = lexer_create(large);
+    while (lexer_get(whole).offset >= 0) {}
+    lexer_dispose(whole);
+    count = intern_count();
+    reader.length = offset - large;
+    reader.offset = 0;
+    reader.chunk = 1;
+    stream = lexer_create_stream(_test_read_chunk, &reader);
+    while (lexer_get(stream).offset >= 0) {}
+    lexer_dispose(stream);
+    CHECK(intern_count() == count);
+    safe_free(large);
+    
+    return NULL;
+}
+
+
+/* invalid UTF-8 is found wherever the source comes from, and edits keep the first error up to date */
+static const char* test_26()
+{
+    static const char *inserts[] = { "\xC3", "\xA9", "\xC3\xA9", "\xE4\xB8", "\x96", "\xF0\x9F\x98\x80", "\xFF", "x", "" };
+    char *source, *edited;
+    Lexer *lexer, *fresh;
+    TestReader reader;
+    unsigned long seed;
+    long offset, deleted, length;
+    int start, i;
+    
+    lexer = lexer_create_table("Dim caf\xC3\xA9 As String = \"\xE4\xB8\x96\"");
+    CHECK(lexer_utf8_error(lexer) == -1);
+    lexer_dispose(lexer);
+    lexer = lexer_create_table("Dim caf\xC3 As String");
+    CHECK(lexer_utf8_error(lexer) == 7);
+    lexer_dispose(lexer);
+    lexer = lexer_create_table("x = \"\xED\xA0\x80\"");
+    CHECK(lexer_utf8_error(lexer) == 5);
+    lexer_dispose(lexer);
+    lexer = lexer_create_table("x\xE4\xB8");
+    CHECK(lexer_utf8_error(lexer) == 1);
+    lexer_dispose(lexer);
+    
+    for (start = 1; start <= 13; start++)
+    {
+        reader.text = "Dim caf\xC3\xA9 As String = \"\xE4\xB8\x96\" ' \xF0\x9F\x98\x80\r\nx = \xC3\xC3\xA9";
+        reader.length = strlen(reader.text);
+        reader.offset = 0;
+        reader.chunk = start;
+        lexer = lexer_create_stream(_test_read_chunk, &reader);
+        while (lexer_get(lexer).offset >= 0) {}
+        CHECK(lexer_utf8_error(lexer) == reader.length - 3);
+        lexer_dispose(lexer);
+        
+        reader.length -= 3;
+        reader.offset = 0;
+        reader.chunk = start;
+        lexer = lexer_create_stream(_test_read_chunk, &reader);
+        while (lexer_get(lexer).offset >= 0) {}
+        CHECK(lexer_utf8_error(lexer) == -1);
+        lexer_dispose(lexer);
+    }
+    
+    source = _test_apply_edit("x = \"caf\xC3\xA9\" + y ' \xE4\xB8\x96\r\nz = 1\r\n", 0, 0, "");
+    lexer = lexer_create_table(source);
+    seed = 54321;
+    for (i = 0; i < 2000; i++)
+    {
+        length = strlen(source);
+        seed = seed * 1103515245 + 12345;
+        offset = (seed >> 8) % (length + 1);
+        seed = seed * 1103515245 + 12345;
+        deleted = (seed >> 8) % 4;
+        if (length > 200) deleted += 4;
+        if (offset + deleted > length) deleted = length - offset;
+        seed = seed * 1103515245 + 12345;
+        edited = _test_apply_edit(source, offset, deleted, inserts[(seed >> 8) % (sizeof(inserts) / sizeof(char*))]);
+        lexer_edit(lexer, edited, offset, deleted, strlen(edited) - length + deleted);
+        safe_free(source);
+        source = edited;
+        fresh = lexer_create_table(source);
+        CHECK(lexer_utf8_error(lexer) == lexer_utf8_error(fresh));
+        lexer_dispose(fresh);
+    }
+    lexer_dispose(lexer);
+    safe_free(source);
+    
+    return NULL;
+}
+
+
+/* the class and fold tables agree with the plain definitions for every byte */
+static const char* test_27()
 {
-    Lexer *lexer;
-    Token token;
-    
-    lexer = lexer_create("29 +  &b1001ANd&o74 &hEF17A3\t "
-                         "私はガラ=\"pickle 食べ\"");
-    CHECK(lexer);
+    int i;
+    Boolean upper, lower, digit;
     
-    token = lexer_get(lexer);
-    CHECK(token.type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer_start == 1);
-    CHECK(lexer->buffer[1].type == TOKEN_PLUS);
-    CHECK(lexer->buffer[2].type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer[3].type == TOKEN_AND);
-    CHECK(lexer->buffer[4].type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer[5].type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer[6].type == TOKEN_IDENTIFIER);
-    CHECK(lexer->buffer[7].type == TOKEN_EQUAL);
-    CHECK(lexer->buffer[8].type == TOKEN_LIT_STRING);
-    CHECK(lexer->buffer[9].offset == -1);
+    for (i = 0; i < 256; i++)
+    {
+        upper = ((i >= 'A') && (i <= 'Z'));
+        lower = ((i >= 'a') && (i <= 'z'));
+        digit = ((i >= '0') && (i <= '9'));
+        CHECK(_lexer_is_alpha(i) == (upper || lower));
+        CHECK(_lexer_is_digit(i) == digit);
+        CHECK(_lexer_is_alnum(i) == (upper || lower || digit));
+        CHECK(_lexer_is_identifier_char(i) == (upper || lower || digit || (i == '_') || (i >= 0x80)));
+        CHECK(CHAR_IS(i, CHAR_IDENTIFIER_START) == (upper || lower || (i == '_') || (i >= 0x80)));
+        CHECK(CHAR_IS(i, CHAR_SPACE) == ((i == ' ') || (i == '\t')));
+        CHECK(CHAR_IS(i, CHAR_NEW_LINE) == ((i == '\r') || (i == '\n')));
+        CHECK((unsigned char)_lexer_fold(i) == (upper ? i + ('a' - 'A') : i));
+    }
     
-    token = lexer_get(lexer);
-    CHECK(token.type == TOKEN_PLUS);
-    CHECK(lexer->buffer_start == 2);
-    CHECK(lexer->buffer[2].type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer[3].type == TOKEN_AND);
-    CHECK(lexer->buffer[4].type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer[5].type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer[6].type == TOKEN_IDENTIFIER);
-    CHECK(lexer->buffer[7].type == TOKEN_EQUAL);
-    CHECK(lexer->buffer[8].type == TOKEN_LIT_STRING);
-    CHECK(lexer->buffer[9].offset == -1);
-    CHECK(lexer->buffer[0].offset == -1);
+    return NULL;
+}
+
+
+/* compiling conditionally produces the tokens of the expected source, with the line count
+ of the original */
+static const char* _test_conditional(const char *in_source, const char * const *in_defined, const char *in_expected)
+{
+    Lexer *lexer, *expected, *whole;
+    Token token1, token2;
+    long i;
+    
+    lexer = lexer_create_conditional((char*)in_source, in_defined);
+    expected = lexer_create_table((char*)in_expected);
+    whole = lexer_create_table((char*)in_source);
+    CHECK(lexer_token_count(lexer) == lexer_token_count(expected));
+    for (i = 0; i < lexer_token_count(lexer); i++)
+    {
+        token1 = lexer_token_at(lexer, i);
+        token2 = lexer_token_at(expected, i);
+        CHECK(token1.type == token2.type);
+        CHECK(token1.length == token2.length);
+        CHECK(memcmp(token1.text, token2.text, token1.length) == 0);
+        if (token1.type != TOKEN_LIT_STRING) CHECK(memcmp(in_source + token1.offset, token2.text, token1.length) == 0);
+    }
+    CHECK(lexer_line_count(lexer) == lexer_line_count(whole));
+    lexer_dispose(lexer);
+    lexer_dispose(expected);
+    lexer_dispose(whole);
     
-    token = lexer_get(lexer);
-    CHECK(token.type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer_start == 3);
-    CHECK(lexer->buffer[3].type == TOKEN_AND);
-    CHECK(lexer->buffer[4].type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer[5].type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer[6].type == TOKEN_IDENTIFIER);
-    CHECK(lexer->buffer[7].type == TOKEN_EQUAL);
-    CHECK(lexer->buffer[8].type == TOKEN_LIT_STRING);
-    CHECK(lexer->buffer[9].offset == -1);
-    CHECK(lexer->buffer[0].offset == -1);
-    CHECK(lexer->buffer[1].offset == -1);
+    return NULL;
+}
+
+static const char* test_28()
+{
+    static const char *source =
+    "x = 1\r\n"
+    "#If TargetWin32 Then\r\n"
+    "  y = 2\r\n"
+    "#ElseIf TargetMacOS And Not TargetCarbon Then ' Cocoa\r\n"
+    "  y = 3\r\n"
+    "  #If DebugBuild\r\n"
+    "    z = \"#EndIf\"\r\n"
+    "  #Else\r\n"
+    "    z = 5\r\n"
+    "  #EndIf\r\n"
+    "#Else\r\n"
+    "  y = 4\r\n"
+    "  #If True\r\n"
+    "  w = 1\r\n"
+    "  #EndIf\r\n"
+    "#EndIf\r\n"
+    "v = 6\n";
+    static const char *win[] = { "TargetWin32", NULL };
+    static const char *cocoa[] = { "targetmacos", "DebugBuild", NULL };
+    static const char *carbon[] = { "TargetMacOS", "TargetCarbon", NULL };
+    static const char *none[] = { NULL };
+    const char *error, *message;
+    char *edited, condition[1024];
+    Lexer *lexer, *fresh;
+    long i;
+    
+    if ((error = _test_conditional(source, win, "x = 1\r\n  y = 2\r\nv = 6\n"))) return error;
+    if ((error = _test_conditional(source, cocoa, "x = 1\r\n  y = 3\r\n    z = \"#EndIf\"\r\nv = 6\n"))) return error;
+    if ((error = _test_conditional(source, carbon, "x = 1\r\n  y = 4\r\n  w = 1\r\nv = 6\n"))) return error;
+    if ((error = _test_conditional(source, none, "x = 1\r\n  y = 4\r\n  w = 1\r\nv = 6\n"))) return error;
+    
+    /* malformed conditions are errors, and False; unbalanced directives are left for the parser */
+    if ((error = _test_conditional("#If (TargetWin32 Then\nx\n#EndIf\ny", win, "y"))) return error;
+    lexer = lexer_create_conditional((char*)"#If (TargetWin32 Then\nx\n#EndIf\ny", win);
+    CHECK(lexer_condition_error(lexer, &message) == 4);
+    CHECK(strcmp(message, "Malformed condition") == 0);
+    lexer_dispose(lexer);
+    lexer = lexer_create_conditional((char*)"#If TargetMacOS = True Then\nx\n#EndIf", win);
+    CHECK(lexer_condition_error(lexer, &message) == 4);
+    lexer_dispose(lexer);
+    lexer = lexer_create_conditional((char*)"#If Then\nx\n#EndIf", win);
+    CHECK(lexer_condition_error(lexer, &message) == 8);
+    lexer_dispose(lexer);
+    if ((error = _test_conditional("#If Not (False Or x) Then\nx\n#EndIf\ny", none, "x\ny"))) return error;
+    if ((error = _test_conditional("#EndIf\nx\n#Else", none, "#EndIf\nx\n#Else"))) return error;
+    
+    /* an #If left open at the end of the source is an error */
+    lexer = lexer_create_conditional((char*)source, win);
+    CHECK(lexer_condition_error(lexer, &message) == -1);
+    lexer_dispose(lexer);
+    if ((error = _test_conditional("#If False\nx\n#If True\ny", none, ""))) return error;
+    lexer = lexer_create_conditional((char*)"#If False\nx\n#If True\ny", none);
+    CHECK(lexer_condition_error(lexer, &message) == (long)strlen("#If False\nx\n#If True\ny"));
+    CHECK(strcmp(message, "Expected #EndIf") == 0);
+    lexer_dispose(lexer);
+    
+    /* so is a condition too long to evaluate, which is False */
+    strcpy(condition, "#If TargetWin32");
+    for (i = 0; i < MAX_CONDITION_TOKENS / 2; i++) strcat(condition, " Or TargetWin32");
+    strcat(condition, " Then\nx\n#EndIf\ny");
+    if ((error = _test_conditional(condition, win, "y"))) return error;
+    lexer = lexer_create_conditional(condition, win);
+    CHECK(lexer_condition_error(lexer, &message) == 4);
+    CHECK(strcmp(message, "Malformed condition; too many tokens") == 0);
+    lexer_dispose(lexer);
+    
+    /* an edit to a directive */
+    edited = _test_apply_edit(source, 0, 0, "");
+    lexer = lexer_create_conditional(edited, win);
+    memcpy(strstr(edited, "Win32"), "Win64", 5);
+    lexer_edit(lexer, edited, strstr(edited, "Win64") - edited + 3, 2, 2);
+    fresh = lexer_create_conditional(edited, win);
+    CHECK(lexer_token_count(lexer) == lexer_token_count(fresh));
+    for (i = 0; i < lexer_token_count(lexer); i++)
+    {
+        CHECK(lexer_token_at(lexer, i).type == lexer_token_at(fresh, i).type);
+        CHECK(lexer_token_at(lexer, i).offset == lexer_token_at(fresh, i).offset);
+    }
+    CHECK(lexer_line_count(lexer) == lexer_line_count(fresh));
+    lexer_dispose(lexer);
+    lexer_dispose(fresh);
+    safe_free(edited);
     
     return NULL;
 }
 
 
-/* Token lexer_peek(Lexer *in_lexer, int in_how_far)*/
-static const char* test_19()
+/* retrieving tokens in batches gives the same tokens as one at a time, for every kind of
+ lexer and any batch size */
+static const char* test_29()
 {
-    Lexer *lexer;
+    char *source = "Class Dog Inherits Animal ' a comment\r\n"
+    "  Dim name As String = \"Fido\"\"s &u0041\r\nsecond line\"\r\n"
+    "  Dim age As Integer = &h1F + 3.5e2 - &b101 <> 12345678901234567890\r\n"
+    "End Class\r\n  \"unterminated";
+    CompactToken batch[16];
+    Lexer *single, *many;
+    TestReader reader;
     Token token;
+    int kind, size, count, i;
     
-    lexer = lexer_create("29 +  &b1001ANd&o74 &hEF17A3\t "
-                         "私はガラ=\"pickle 食べ\"");
-    CHECK(lexer);
-    
-    token = lexer_peek(lexer, 0);
-    CHECK(token.type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer_start == 0);
-    CHECK(lexer->buffer[1].type == TOKEN_PLUS);
-    CHECK(lexer->buffer[2].type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer[3].type == TOKEN_AND);
-    CHECK(lexer->buffer[4].type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer[5].type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer[6].type == TOKEN_IDENTIFIER);
-    CHECK(lexer->buffer[7].type == TOKEN_EQUAL);
-    CHECK(lexer->buffer[8].type == TOKEN_LIT_STRING);
-    CHECK(lexer->buffer[9].offset == -1);
-    
-    token = lexer_get(lexer);
-    CHECK(token.type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer_start == 1);
-    CHECK(lexer->buffer[1].type == TOKEN_PLUS);
-    CHECK(lexer->buffer[2].type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer[3].type == TOKEN_AND);
-    CHECK(lexer->buffer[4].type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer[5].type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer[6].type == TOKEN_IDENTIFIER);
-    CHECK(lexer->buffer[7].type == TOKEN_EQUAL);
-    CHECK(lexer->buffer[8].type == TOKEN_LIT_STRING);
-    CHECK(lexer->buffer[9].offset == -1);
-    
-    token = lexer_peek(lexer, 0);
-    CHECK(token.type == TOKEN_PLUS);
-    CHECK(lexer->buffer_start == 1);
+    for (kind = 0; kind < 3; kind++)
+    {
+        for (size = 1; size <= 16; size++)
+        {
+            reader.text = source;
+            reader.length = strlen(source);
+            reader.offset = 0;
+            reader.chunk = size;
+            if (kind == 0) many = lexer_create(source);
+            else if (kind == 1) many = lexer_create_table(source);
+            else many = lexer_create_stream(_test_read_chunk, &reader);
+            single = lexer_create(source);
+            
+            do
+            {
+                CHECK(lexer_peek(many, 1).offset == lexer_peek(single, 1).offset);
+                count = lexer_get_many(many, batch, size);
+                for (i = 0; i < count; i++)
+                {
+                    token = lexer_get(single);
+                    CHECK(batch[i].type == token.type);
+                    CHECK(batch[i].offset == token.offset);
+                    CHECK(batch[i].length == token.length);
+                }
+            }
+            while (count == size);
+            CHECK(lexer_get(single).offset < 0);
+            CHECK(lexer_get_many(many, batch, size) == 0);
+            
+            lexer_dispose(single);
+            lexer_dispose(many);
+        }
+    }
+    CHECK(sizeof(CompactToken) <= 16);
     
-    token = lexer_peek(lexer, 1);
-    CHECK(token.type == TOKEN_LIT_INTEGER);
-    CHECK(lexer->buffer_start == 1);
+    return NULL;
+}
+
+
+/* the source is rebuilt from the tokens and their trivia byte for byte; trivia is only
+ spaces, tabs and comments, and trailing trivia never crosses a line end */
+static const char* _test_trivia(Lexer *in_lexer, const char *in_source)
+{
+    TokenTrivia trivia;
+    Token token;
+    long i, c, rebuilt;
     
-    token = lexer_peek(lexer, 2);
-    CHECK(token.type == TOKEN_AND);
-    token = lexer_peek(lexer, 3);
-    CHECK(token.type == TOKEN_LIT_INTEGER);
-    token = lexer_peek(lexer, 4);
-    CHECK(token.type == TOKEN_LIT_INTEGER);
-    token = lexer_peek(lexer, 5);
-    CHECK(token.type == TOKEN_IDENTIFIER);
+    rebuilt = 0;
+    for (i = 0; i <= lexer_token_count(in_lexer); i++)
+    {
+        trivia = lexer_trivia_at(in_lexer, i);
+        CHECK(trivia.leading == rebuilt);
+        CHECK((trivia.leading <= trivia.start) && (trivia.start <= trivia.end) && (trivia.end <= trivia.trailing));
+        rebuilt = trivia.trailing;
+        if (i == lexer_token_count(in_lexer)) break;
+        
+        token = lexer_token_at(in_lexer, i);
+        CHECK(token.type != TOKEN_REM);
+        CHECK(token.offset == trivia.start);
+        if ((token.type != TOKEN_LIT_STRING) && (token.type != TOKEN_QUOTE))
+            CHECK(trivia.end - trivia.start == token.length);
+        for (c = trivia.end; c < trivia.trailing; c++)
+            CHECK(!CHAR_IS(in_source[c], CHAR_NEW_LINE));
+        for (c = trivia.leading; c < trivia.start; c++)
+        {
+            if ((in_source[c] == '\'') || ((in_source[c] == '/') && (in_source[c + 1] == '/')))
+            {
+                while ((c < trivia.start) && !CHAR_IS(in_source[c], CHAR_NEW_LINE)) c++;
+                CHECK(c == trivia.start);
+            }
+            else CHECK(CHAR_IS(in_source[c], CHAR_SPACE));
+        }
+    }
+    CHECK(rebuilt == (long)strlen(in_source));
     
+    return NULL;
+}
+
+static const char* test_30()
+{
+    static const char *sources[] = {
+        "Class Dog Inherits Animal ' a comment\r\n"
+        "  Dim name As String = \"Fido\"\"s &u0041\r\nsecond line\"   // another\r\n"
+        "\t' a comment on its own\r\n"
+        "  Dim age As Integer = &h1F + 3.5e2 - &b101 <> 12345678901234567890\r\n"
+        "End Class\r\n  \"unterminated",
+        "  x  \t",
+        "' only a comment",
+        "\n\n  // two\r\r\n",
+        "",
+    };
+    const char *error;
+    char *edited;
+    Lexer *lexer, *plain;
+    long i, j;
+    
+    for (i = 0; i < (long)(sizeof(sources) / sizeof(char*)); i++)
+    {
+        lexer = lexer_create_trivia((char*)sources[i]);
+        if ((error = _test_trivia(lexer, sources[i]))) return error;
+        
+        /* the same tokens as a table, without the comments */
+        plain = lexer_create_table((char*)sources[i]);
+        for (j = 0; j < lexer_token_count(plain); j++)
+        {
+            if (lexer_token_at(plain, j).type == TOKEN_REM) continue;
+            CHECK(lexer_get(lexer).offset == lexer_token_at(plain, j).offset);
+        }
+        CHECK(lexer_get(lexer).offset < 0);
+        lexer_dispose(plain);
+        lexer_dispose(lexer);
+    }
     
-    lexer = lexer_create("Namespace1.Class1.MethodA");
-    CHECK(lexer);
-    token = lexer_peek(lexer, 0);
-    CHECK(token.type == TOKEN_IDENTIFIER);
-    token = lexer_peek(lexer, 1);
-    CHECK(token.type == TOKEN_DOT);
-    token = lexer_peek(lexer, 2);
-    CHECK(token.type == TOKEN_IDENTIFIER);
-    token = lexer_peek(lexer, 3);
-    CHECK(token.type == TOKEN_DOT);
-    token = lexer_peek(lexer, 4);
-    CHECK(token.type == TOKEN_IDENTIFIER);
+    CHECK(lexer_trivia_at(lexer = lexer_create_trivia("x ' y"), 0).trailing == 5);
+    lexer_dispose(lexer);
     
+    lexer = lexer_create_trivia((char*)sources[0]);
+    edited = _test_apply_edit(sources[0], 10, 0, "' ");
+    lexer_edit(lexer, edited, 10, 0, 2);
+    if ((error = _test_trivia(lexer, edited))) return error;
+    lexer_dispose(lexer);
+    safe_free(edited);
     
     return NULL;
 }
 
 
-/* TODO: I fixed a bug which I found by running this through the lexer:
-    "self.Dog(7) = new Dog(\"Fido\", 3)\r\n"
-   The initial loading loop was filling the buffer incorrectly and dropping "Fido"
-   from the token stream.
- 
-   Suggest adding a test case.
- */
-
 void lexer_run_tests(void)
 {
     const char *test_error;
@@ -1859,6 +4429,17 @@ void lexer_run_tests(void)
     if (!test_error) test_error = test_17();
     if (!test_error) test_error = test_18();
     if (!test_error) test_error = test_19();
+    if (!test_error) test_error = test_20();
+    if (!test_error) test_error = test_21();
+    if (!test_error) test_error = test_22();
+    if (!test_error) test_error = test_23();
+    if (!test_error) test_error = test_24();
+    if (!test_error) test_error = test_25();
+    if (!test_error) test_error = test_26();
+    if (!test_error) test_error = test_27();
+    if (!test_error) test_error = test_28();
+    if (!test_error) test_error = test_29();
+    if (!test_error) test_error = test_30();
     
     if (test_error)
     {
@@ -1872,5 +4453,342 @@ void lexer_run_tests(void)
 }
 
 
+
+
+/*********
+ Benchmarks
+ */
+
+#define BENCHMARK_BYTES (64 * 1024 * 1024)
+#define SYNTHETIC_METHODS 20000
+#define EDIT_BENCHMARK_EDITS 1000
+#define BATCH_BENCHMARK_SIZE 256
+#define BATCH_BENCHMARK_PASSES 10
+
+
+/* lexes the entire source repeatedly, until BENCHMARK_BYTES have been processed;
+ returns bytes per second */
+static double _bench_lexer(char *in_source, const ScanKernels *in_scan)
+{
+    Lexer *lexer;
+    Token token;
+    long length, bytes;
+    clock_t start, elapsed;
+    
+    length = strlen(in_source);
+    if (length == 0) return 0;
+    
+    bytes = 0;
+    start = clock();
+    while (bytes < BENCHMARK_BYTES)
+    {
+        lexer = _test_lexer_with(in_source, in_scan);
+        do token = lexer_get(lexer);
+        while (token.offset >= 0);
+        lexer_dispose(lexer);
+        bytes += length;
+    }
+    elapsed = clock() - start;
+    if (elapsed <= 0) elapsed = 1;
+    
+    return (double)bytes / ((double)elapsed / CLOCKS_PER_SEC);
+}
+
+
+static void _bench_report(const char *in_name, char *in_source)
+{
+    const ScanKernels *scalar, *best;
+    double before, after;
+    
+    scalar = scan_kernels(SCAN_SCALAR);
+    best = scan_best();
+    
+    before = _bench_lexer(in_source, scalar);
+    after = _bench_lexer(in_source, best);
+    fprintf(stdout, "%-24s %10ld bytes   %s %8.1f MB/s   %s %8.1f MB/s   (x%.2f)\n", in_name, (long)strlen(in_source),
+            scalar->name, before / (1024 * 1024), best->name, after / (1024 * 1024), after / before);
+}
+
+
+/* validates the source as UTF-8 repeatedly, until BENCHMARK_BYTES have been processed;
+ returns bytes per second */
+static double _bench_utf8(const char *in_source, const ScanKernels *in_scan)
+{
+    const char *end;
+    long length, bytes;
+    clock_t start, elapsed;
+    
+    length = strlen(in_source);
+    end = in_source + length;
+    bytes = 0;
+    start = clock();
+    while (bytes < BENCHMARK_BYTES)
+    {
+        if (in_scan->utf8(in_source, end) != end) return 0;
+        bytes += length;
+    }
+    elapsed = clock() - start;
+    if (elapsed <= 0) elapsed = 1;
+    
+    return (double)bytes / ((double)elapsed / CLOCKS_PER_SEC);
+}
+
+
+static void _bench_utf8_report(const char *in_name, const char *in_source)
+{
+    const ScanKernels *scalar, *best;
+    double before, after;
+    
+    scalar = scan_kernels(SCAN_SCALAR);
+    best = scan_best();
+    
+    before = _bench_utf8(in_source, scalar);
+    after = _bench_utf8(in_source, best);
+    fprintf(stdout, "%-24s utf8 check   %s %8.1f MB/s   %s %8.1f MB/s\n", in_name,
+            scalar->name, before / (1024 * 1024), best->name, after / (1024 * 1024));
+}
+
+
+/* retrieves every token of a table one at a time, then in batches; returns tokens per second */
+static double _bench_retrieval(char *in_source, Boolean in_batched)
+{
+    CompactToken batch[BATCH_BENCHMARK_SIZE];
+    Lexer *lexer;
+    clock_t start, elapsed;
+    long tokens, total;
+    int pass, count;
+    
+    lexer = lexer_create_table(in_source);
+    tokens = lexer_token_count(lexer);
+    total = 0;
+    start = clock();
+    for (pass = 0; pass < BATCH_BENCHMARK_PASSES; pass++)
+    {
+        lexer_seek(lexer, 0);
+        if (in_batched)
+            while ((count = lexer_get_many(lexer, batch, BATCH_BENCHMARK_SIZE)) > 0) total += count;
+        else
+            while (lexer_get(lexer).offset >= 0) total++;
+    }
+    elapsed = clock() - start;
+    if (elapsed <= 0) elapsed = 1;
+    lexer_dispose(lexer);
+    
+    if (total != tokens * BATCH_BENCHMARK_PASSES) return 0;
+    return (double)total / ((double)elapsed / CLOCKS_PER_SEC);
+}
+
+
+static void _bench_retrieval_report(const char *in_name, char *in_source)
+{
+    double single, batched;
+    
+    single = _bench_retrieval(in_source, False);
+    batched = _bench_retrieval(in_source, True);
+    fprintf(stdout, "%-24s lexer_get %8.1f Mtok/s   lexer_get_many %8.1f Mtok/s   (x%.2f)\n", in_name,
+            single / 1000000, batched / 1000000, batched / single);
+}
+
+
+/* compares relexing a large source from scratch with updating its table after
+ single-character edits in the middle of the source: replacing a character in place, then
+ alternately inserting and deleting a space that splits an identifier, which changes the
+ length of the source and the number of tokens */
+static void _bench_edit_report(const char *in_name, char *in_source)
+{
+    Lexer *lexer;
+    clock_t start, full, edits, inserts;
+    char *split;
+    long offset, length;
+    char original;
+    int i;
+    
+    start = clock();
+    lexer = lexer_create_table(in_source);
+    full = clock() - start;
+    
+    length = strlen(in_source);
+    offset = length / 2;
+    while (!_lexer_is_alpha(in_source[offset])) offset++;
+    original = in_source[offset];
+    
+    start = clock();
+    for (i = 0; i < EDIT_BENCHMARK_EDITS; i++)
+    {
+        in_source[offset] = (i & 1) ? original : '_';
+        lexer_edit(lexer, in_source, offset, 1, 1);
+    }
+    edits = clock() - start;
+    in_source[offset] = original;
+    
+    split = safe_malloc(length + 2);
+    memcpy(split, in_source, offset + 1);
+    split[offset + 1] = ' ';
+    memcpy(split + offset + 2, in_source + offset + 1, length - offset);
+    
+    start = clock();
+    for (i = 0; i < EDIT_BENCHMARK_EDITS; i++)
+    {
+        if (i & 1) lexer_edit(lexer, in_source, offset + 1, 1, 0);
+        else lexer_edit(lexer, split, offset + 1, 0, 1);
+    }
+    inserts = clock() - start;
+    lexer_dispose(lexer);
+    safe_free(split);
+    
+    fprintf(stdout, "%-24s full relex %8.3f ms   edit %8.4f ms   insert/delete %8.4f ms\n", in_name,
+            (double)full * 1000 / CLOCKS_PER_SEC, (double)edits * 1000 / CLOCKS_PER_SEC / EDIT_BENCHMARK_EDITS,
+            (double)inserts * 1000 / CLOCKS_PER_SEC / EDIT_BENCHMARK_EDITS);
+}
+
+
+/* a large source file, typical of real code: indented methods with long identifiers,
+ comments, string and numeric literals */
+static char* _bench_synthetic_source(void)
+{
+    static const char *method =
+    "    // Computes the running total for the customer account balance, applying any discounts\r\n"
+    "    Protected Function CalculateAccountBalance%d(customerIdentifier As Integer, includePending As Boolean) As Double\r\n"
+    "        Dim runningTotalAmount As Double = 0.0\r\n"
+    "        Dim transactionRecordCount As Integer = &h%X\r\n"
+    "        For transactionIndex As Integer = 1 To transactionRecordCount\r\n"
+    "            If includePending And (transactionIndex Mod 2 = 0) Then\r\n"
+    "                runningTotalAmount = runningTotalAmount + 1.5e2 * transactionIndex ' pending amount\r\n"
+    "            Else\r\n"
+    "                runningTotalAmount = runningTotalAmount - customerIdentifier / 3\r\n"
+    "            End If\r\n"
+    "        Next\r\n"
+    "        System.DebugLog(\"Account balance computed for \"\"customer\"\" record\")\r\n"
+    "        Return runningTotalAmount\r\n"
+    "    End Function\r\n"
+    "\r\n";
+    char *source, *offset;
+    long size;
+    int i;
+    
+    size = (strlen(method) + 32) * SYNTHETIC_METHODS + 128;
+    source = safe_malloc(size);
+    offset = source;
+    offset += sprintf(offset, "Class AccountLedger Inherits Object\r\n\r\n");
+    for (i = 0; i < SYNTHETIC_METHODS; i++)
+        offset += sprintf(offset, method, i, i);
+    sprintf(offset, "End Class\r\n");
+    
+    return source;
+}
+
+
+/* a source made almost entirely of keywords, in mixed case, with short identifiers and
+ numbers between them; the lexer's time goes mostly to classifying and folding characters */
+static char* _bench_keyword_source(void)
+{
+    static const char *line =
+    "If Not a%d And b Or c Then Return Else Dim d As Integer = &h%X Mod 7 End If\r\n"
+    "WHILE x <> 1 : CONTINUE : EXIT : WEND ' done\r\n"
+    "for each item as string in list step 2 next\r\n"
+    "Select Case y : Case 1 : Call z(ByRef p, ByVal q) : End Select\r\n";
+    char *source, *offset;
+    long size;
+    int i;
+    
+    size = (strlen(line) + 32) * SYNTHETIC_METHODS + 1;
+    source = safe_malloc(size);
+    offset = source;
+    for (i = 0; i < SYNTHETIC_METHODS; i++)
+        offset += sprintf(offset, line, i, i);
+    
+    return source;
+}
+
+
+/* a large cross-platform source, with about 40% of each method in platform branches,
+ lexed whole and then for a single target */
+static void _bench_conditional_report(void)
+{
+    static const char *method =
+    "    Function PlatformPath%d(name As String) As String\r\n"
+    "        Dim result As String = \"\"\r\n"
+    "        Dim count As Integer = &h%X\r\n"
+    "        For index As Integer = 1 To count\r\n"
+    "            result = result + name + Str(index) ' build the path\r\n"
+    "        Next\r\n"
+    "        #If TargetWin32 Then\r\n"
+    "            result = \"C:\\\\Program Files\\\\\" + result\r\n"
+    "            Declare Function GetLastError Lib \"kernel32\" () As Integer\r\n"
+    "            If GetLastError() <> 0 Then Return \"\"\r\n"
+    "        #ElseIf TargetMacOS Then\r\n"
+    "            result = \"/Applications/\" + result\r\n"
+    "        #Else\r\n"
+    "            result = \"/usr/local/share/\" + result\r\n"
+    "            If result.Len > 255 Then Return \"\"\r\n"
+    "        #EndIf\r\n"
+    "        Return result\r\n"
+    "    End Function\r\n"
+    "\r\n";
+    static const char *defined[] = { "TargetMacOS", NULL };
+    Lexer *lexer;
+    clock_t start, whole, conditional;
+    char *source, *offset;
+    long whole_count, conditional_count;
+    
+    source = safe_malloc((strlen(method) + 32) * SYNTHETIC_METHODS + 1);
+    offset = source;
+    for (whole_count = 0; whole_count < SYNTHETIC_METHODS; whole_count++)
+        offset += sprintf(offset, method, (int)whole_count, (int)whole_count);
+    
+    start = clock();
+    lexer = lexer_create_table(source);
+    whole = clock() - start;
+    whole_count = lexer_token_count(lexer);
+    lexer_dispose(lexer);
+    
+    start = clock();
+    lexer = lexer_create_conditional(source, defined);
+    conditional = clock() - start;
+    conditional_count = lexer_token_count(lexer);
+    lexer_dispose(lexer);
+    
+    fprintf(stdout, "%-24s all branches %8.3f ms %8ld tokens   one target %8.3f ms %8ld tokens\n", "cross-platform",
+            (double)whole * 1000 / CLOCKS_PER_SEC, whole_count, (double)conditional * 1000 / CLOCKS_PER_SEC, conditional_count);
+    safe_free(source);
+}
+
+
+void lexer_run_benchmarks(void)
+{
+    char *source, *offset;
+    
+#ifdef TESTSDIR
+    source = readfile(TESTSDIR "parser-statement.tests");
+    _bench_report("parser-statement.tests", source);
+    safe_free(source);
+    
+    source = readfile(TESTSDIR "parser-control.tests");
+    _bench_report("parser-control.tests", source);
+    safe_free(source);
+    
+    source = readfile(TESTSDIR "parser-class.tests");
+    _bench_report("parser-class.tests", source);
+    safe_free(source);
+#endif
+    
+    source = _bench_synthetic_source();
+    _bench_report("synthetic", source);
+    _bench_edit_report("synthetic", source);
+    _bench_retrieval_report("synthetic", source);
+    _bench_utf8_report("synthetic", source);
+    for (offset = source; *offset; offset++)
+        if (*offset == '"') memcpy(offset + 1, "\xC3\xA9\xE4\xB8\x96", 5);
+    _bench_utf8_report("synthetic (non-ASCII)", source);
+    safe_free(source);
+    
+    source = _bench_keyword_source();
+    _bench_report("keyword-dense", source);
+    safe_free(source);
+    
+    _bench_conditional_report();
+}
+
+
 #endif
 
@@ -23,6 +23,9 @@
  *
  **************************************************************************************************/
 
+#include "intern.h"
+#include "readfile.h"
+
 #ifndef _LEXER_H
 #define _LEXER_H
 
@@ -133,32 +136,122 @@ enum LexerTokenType
     TOKEN_AMP_COLOR,
     TOKEN_AMP_UNICODE,
     TOKEN_CONST,
+    
+    /* the number of token types, for tables indexed by type; not a token */
+    TOKEN_COUNT
 };
 
 
+/* text is not NULL terminated; it is a slice of the source of length bytes,
+ except for string literals and comments, which may refer to text owned by the lexer
+ (valid until a few more tokens have been retrieved with lexer_get(), or until the lexer
+ is disposed if it was created with lexer_create_table()).
+ Use lexer_token_string() to obtain a NULL terminated copy.
+ Identifiers are interned; value.atom holds the atom of the spelling. */
 typedef struct Token
 {
     enum LexerTokenType     type;
     long                    offset;
-    char                    *text;
+    const char              *text;
+    long                    length;
     union
     {
         long                    integer;
         double                  real;
+        Atom                    atom;
     }                       value;
 } Token;
 
 
+/* a token's type and extent without its value, for tools that only need to know where the
+ tokens are (highlighting, indexing, counting); 16 bytes rather than 32 */
+typedef struct CompactToken
+{
+    long                    offset;
+    int                     length;
+    unsigned char           type;
+} CompactToken;
+
+
+/* the extent of a token in the source, with the trivia around it: leading trivia runs from
+ leading to start, the token's own text from start to end, and trailing trivia from end to
+ trailing.  Trivia is only spaces, tabs and comments */
+typedef struct TokenTrivia
+{
+    long                    leading;
+    long                    start;
+    long                    end;
+    long                    trailing;
+} TokenTrivia;
+
+
 
 Lexer* lexer_create(char *inSource);
+void lexer_dispose(Lexer *in_lexer);
 Token lexer_get(Lexer *in_lexer);
 Token lexer_peek(Lexer *in_lexer, int in_how_far);
 long lexer_offset(Lexer *in_lexer);
 
+/* retrieves up to in_max tokens at once, as lexer_get() would, into the caller's array;
+ returns the number retrieved, which is less than in_max only at the end of the source */
+int lexer_get_many(Lexer *in_lexer, CompactToken *out_tokens, int in_max);
+
+/* the offset of the first byte of the source that isn't valid UTF-8, or -1 if it all is;
+ checked once as the source is loaded (or read, for a stream) and kept up to date by edits */
+long lexer_utf8_error(Lexer *in_lexer);
+
+/* line starts are recorded as the source is lexed; offsets beyond the last token retrieved
+ (or the whole source, for a table) are reported on the last line seen */
+long lexer_line_count(Lexer *in_lexer);
+void lexer_location(Lexer *in_lexer, long in_offset, long *out_line, long *out_column);
+
+/* lexes input pulled from the reader a chunk at a time, holding only a small window of it in
+ memory; offsets are from the start of the input.  Texts that are slices of the input remain
+ valid only until the next call to lexer_get().  Lines are counted, but lexer_location() isn't
+ available */
+Lexer* lexer_create_stream(ReadChunk in_reader, void *io_user);
+
+/* tokenizes the whole source up front; lexer_get() and lexer_peek() then walk the table
+ with a cursor, lookahead is unlimited and tokens live as long as the lexer */
+Lexer* lexer_create_table(char *in_source);
+long lexer_token_count(Lexer *in_lexer);
+Token lexer_token_at(Lexer *in_lexer, long in_index);
+long lexer_position(Lexer *in_lexer);
+void lexer_seek(Lexer *in_lexer, long in_index);
+
+/* tokenizes the entire source, like lexer_create_table(), but compiles conditionally:
+ #If <condition> [Then], #ElseIf <condition> [Then], #Else and #EndIf are evaluated as the
+ source is lexed.  A condition is made of constants, True, False, Not, And, Or and parentheses;
+ the constants in the NULL terminated in_defined list (compared case-insensitively) are True
+ and any other is False.  Directives produce no tokens, and inactive regions are skipped a
+ line at a time without being lexed.  An edit lexes the whole source again */
+Lexer* lexer_create_conditional(char *in_source, const char * const *in_defined);
+
+/* the offset of the first directive in error when compiling conditionally, or -1, and a
+ description of the error: an #If without an #EndIf, or a condition that is malformed or too
+ long to evaluate (which is taken as False) */
+long lexer_condition_error(Lexer *in_lexer, const char **out_message);
+
+/* tokenizes the entire source, like lexer_create_table(), but keeps the trivia between tokens
+ so that the source can be rebuilt from them, byte for byte: each token's trivia runs on from
+ where the previous token's trivia ended.  Comments are trivia, rather than tokens.
+ Trivia is recorded as lengths in the table, not copied.  An edit lexes the whole source again */
+Lexer* lexer_create_trivia(char *in_source);
+
+/* in_index may be the token count, for the trivia after the last token */
+TokenTrivia lexer_trivia_at(Lexer *in_lexer, long in_index);
+
+/* after an edit replacing in_deleted_length bytes at in_offset with in_inserted_length bytes,
+ brings the table up to date with the edited source, relexing only around the edit */
+void lexer_edit(Lexer *io_lexer, char *in_new_source, long in_offset, long in_deleted_length, long in_inserted_length);
+
+char* lexer_token_string(Token in_token);
+
 
 #ifdef DEBUG
 void lexer_debug_token(Token in_token);
 void lexer_run_tests(void);
+void lexer_run_benchmarks(void);
 #endif
 
 
@@ -27,8 +27,12 @@
 #include <stdlib.h>
 #include <stdarg.h>
 
-static long gFrees = 0;
-static void* gLastPtr = NULL;
+#ifdef DEBUG
+/* per-thread, so the counters can be read back without interference from other threads */
+static __thread long gAllocations = 0;
+static __thread long gFrees = 0;
+static __thread void* gLastPtr = NULL;
+#endif
 
 
 void fail(const char *in_msg)
@@ -57,6 +61,7 @@ void* safe_malloc(long inSize)
     outMemory = malloc(inSize);
     if (!outMemory) fail("Out of memory");
 #ifdef DEBUG
+    gAllocations++;
     gLastPtr = outMemory;
 #endif
     return outMemory;
@@ -69,6 +74,7 @@ void* safe_realloc(void* in_memory, long in_new_size)
     out_memory = realloc(in_memory, in_new_size);
     if (!out_memory) fail("Out of memory");
 #ifdef DEBUG
+    gAllocations++;
     gLastPtr = out_memory;
 #endif
     return out_memory;
@@ -87,6 +93,12 @@ void safe_free(void *in_memory)
 
 #ifdef DEBUG
 
+/* calls to safe_malloc() and safe_realloc() */
+long debug_memory_allocations(void)
+{
+    return gAllocations;
+}
+
 long debug_memory_frees(void)
 {
     return gFrees;
@@ -45,6 +45,7 @@ typedef enum
 
 
 #ifdef DEBUG
+long debug_memory_allocations(void);
 long debug_memory_frees(void);
 void* debug_memory_last_ptr(void);
 #endif
@@ -0,0 +1,45 @@
+/***************************************************************************************************
+ *
+ * RunlessBASIC
+ * Copyright 2013 Joshua Hawcroft <dev@joshhawcroft.com>
+ *
+ * number.h
+ * (see C source file for details)
+ *
+ ***************************************************************************************************
+ *
+ * RunlessBASIC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RunlessBASIC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RunlessBASIC.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************************************/
+
+#include <stdint.h>
+
+#include "memory.h"
+
+#ifndef _NUMBER_H
+#define _NUMBER_H
+
+
+/* converts in_mantissa * 10^in_exponent to the nearest double (ties to even);
+ returns False in the rare cases where the result can't be decided this way,
+ in which case the caller must fall back to strtod() */
+Boolean number_to_double(uint64_t in_mantissa, int in_exponent, double *out_value);
+
+
+#ifdef DEBUG
+void number_run_tests(void);
+#endif
+
+
+#endif
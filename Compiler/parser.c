@@ -26,6 +26,15 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <assert.h>
+#ifdef DEBUG
+#include <math.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#endif
 
 #include "parser.h"
 #include "lexer.h"
@@ -37,10 +46,15 @@ struct Parser
 {
     AstNode* (*init) (Parser*);
     Lexer *lexer;
+    Arena *arena;
     char *error_message;
     long error_offset;
     AstNode *ast;
     AstNode *statement;
+    const char * const *defined;
+    
+    /* scratch space for formatting numbers as text */
+    char number_text[100];
 };
 
 
@@ -74,8 +88,8 @@ static AstNode* _parse_operand(Parser *in_parser)
     {
         /* got negation operator */
         lexer_get(in_parser->lexer);
-        negate = ast_create(AST_EXPRESSION);
-        ast_append(negate, ast_create_operator("negate"));
+        negate = ast_create(in_parser->arena, AST_EXPRESSION);
+        ast_append(negate, ast_create_operator(in_parser->arena, AST_OP_NEGATE));
         token = lexer_peek(in_parser->lexer, 0);
     }
     
@@ -100,42 +114,40 @@ static AstNode* _parse_operand(Parser *in_parser)
             
         case TOKEN_LIT_STRING:
             lexer_get(in_parser->lexer);
-            result = ast_create_string(token.text);
+            result = ast_create_literal(in_parser->arena, token.text, token.length);
             break;
             
         case TOKEN_LIT_INTEGER:
             lexer_get(in_parser->lexer);
-            result = ast_create_integer(token.value.integer);
+            result = ast_create_integer(in_parser->arena, token.value.integer);
             break;
             
         case TOKEN_LIT_REAL:
             lexer_get(in_parser->lexer);
-            result = ast_create_real(token.value.real);
+            result = ast_create_real(in_parser->arena, token.value.real);
             break;
             
         case TOKEN_LIT_COLOUR:
             lexer_get(in_parser->lexer);
-            result = ast_create_colour(token.value.integer);
+            result = ast_create_colour(in_parser->arena, token.value.integer);
             break;
             
         case TOKEN_TRUE:
             lexer_get(in_parser->lexer);
-            result = ast_create_boolean(True);
+            result = ast_create_boolean(in_parser->arena, True);
             break;
             
         case TOKEN_FALSE:
             lexer_get(in_parser->lexer);
-            result = ast_create_boolean(False);
+            result = ast_create_boolean(in_parser->arena, False);
             break;
         
         case TOKEN_NULL:
             lexer_get(in_parser->lexer);
-            result = ast_create(AST_NULL);
+            result = ast_create(in_parser->arena, AST_NULL);
             break;
             
         default:
-            if (negate)
-                ast_dispose(negate);
             return NULL;
     }
     
@@ -148,66 +160,79 @@ static AstNode* _parse_operand(Parser *in_parser)
 }
 
 
-static Boolean _is_binary_operator(enum LexerTokenType in_type)
-{
-    switch (in_type)
-    {
-        case TOKEN_AND:
-        case TOKEN_EQUAL:
-        case TOKEN_NOT_EQUAL:
-        case TOKEN_HYPHEN:
-        case TOKEN_IS:
-        case TOKEN_ISA:
-        case TOKEN_LESS:
-        case TOKEN_LESS_EQUAL:
-        case TOKEN_MORE:
-        case TOKEN_MORE_EQUAL:
-        case TOKEN_MOD:
-        case TOKEN_MULTIPLY:
-        case TOKEN_SLASH:
-        case TOKEN_BACK_SLASH:
-        case TOKEN_PLUS:
-        case TOKEN_OR:
-            return True;
-        default:
-            return False;
-    }
-}
+/* operator precedence, from loosest to tightest binding (as REALbasic); Not binds tighter
+ than the arithmetic and comparison operators, so Not a = b is (Not a) = b */
+enum Precedence
+{
+    PRECEDENCE_NONE = 0,
+    PRECEDENCE_OR,
+    PRECEDENCE_AND,
+    PRECEDENCE_COMPARE,
+    PRECEDENCE_ADD,
+    PRECEDENCE_MULTIPLY,
+    PRECEDENCE_NOT,
+    PRECEDENCE_ISA,
+};
 
+struct BinaryOperator
+{
+    unsigned char   precedence;
+    Boolean         right_associative;
+    AstOperator     op;
+};
 
-/* parsing: operand operator operand ...
-    operand can be a subexpression (...) or a path (name().name().name()...)
-    or a literal colour, boolean, string or integer;
- there must be an expression or this is a syntax error. */
-static AstNode* _parse_expression(Parser *in_parser)
+/* indexed by token type; tokens that aren't binary operators have no precedence */
+static const struct BinaryOperator binary_operators[TOKEN_COUNT] = {
+    [TOKEN_OR] =            { PRECEDENCE_OR, False, AST_OP_LOGICAL_OR },
+    [TOKEN_AND] =           { PRECEDENCE_AND, False, AST_OP_LOGICAL_AND },
+    [TOKEN_EQUAL] =         { PRECEDENCE_COMPARE, False, AST_OP_EQUAL },
+    [TOKEN_NOT_EQUAL] =     { PRECEDENCE_COMPARE, False, AST_OP_NOT_EQUAL },
+    [TOKEN_LESS] =          { PRECEDENCE_COMPARE, False, AST_OP_LESS_THAN },
+    [TOKEN_LESS_EQUAL] =    { PRECEDENCE_COMPARE, False, AST_OP_LESS_OR_EQUAL },
+    [TOKEN_MORE] =          { PRECEDENCE_COMPARE, False, AST_OP_MORE_THAN },
+    [TOKEN_MORE_EQUAL] =    { PRECEDENCE_COMPARE, False, AST_OP_MORE_OR_EQUAL },
+    [TOKEN_IS] =            { PRECEDENCE_COMPARE, False, AST_OP_IS },
+    [TOKEN_PLUS] =          { PRECEDENCE_ADD, False, AST_OP_ADD },
+    [TOKEN_HYPHEN] =        { PRECEDENCE_ADD, False, AST_OP_SUBTRACT },
+    [TOKEN_MULTIPLY] =      { PRECEDENCE_MULTIPLY, False, AST_OP_MULTIPLY },
+    [TOKEN_SLASH] =         { PRECEDENCE_MULTIPLY, False, AST_OP_DIVIDE },
+    [TOKEN_BACK_SLASH] =    { PRECEDENCE_MULTIPLY, False, AST_OP_INT_DIVIDE },
+    [TOKEN_MOD] =           { PRECEDENCE_MULTIPLY, False, AST_OP_MODULUS },
+    [TOKEN_ISA] =           { PRECEDENCE_ISA, False, AST_OP_IS_A },
+};
+
+
+static AstNode* _parse_binary(Parser *in_parser, int in_min_precedence);
+
+
+/* parsing: Not <operand> | New <class> [(<arguments>)] | <operand> */
+static AstNode* _parse_unary(Parser *in_parser)
 {
     AstNode *expr, *operand;
     Token token;
     
-    /* create expression */
-    expr = ast_create(AST_EXPRESSION);
-    
-    /* peek at what's next */
     token = lexer_peek(in_parser->lexer, 0);
-    
-    /* parse unary NOT */
     if (token.type == TOKEN_NOT)
     {
         lexer_get(in_parser->lexer);
-        ast_append(expr, ast_create_operator("logical-not"));
-        
-        token = lexer_peek(in_parser->lexer, 0);
+        operand = _parse_binary(in_parser, PRECEDENCE_NOT + 1);
+        if (!operand) return NULL;
+        expr = ast_create(in_parser->arena, AST_EXPRESSION);
+        ast_append(expr, ast_create_operator(in_parser->arena, AST_OP_LOGICAL_NOT));
+        ast_append(expr, operand);
+        return expr;
     }
-    else if (token.type == TOKEN_NEW)
+    if (token.type == TOKEN_NEW)
     {
         lexer_get(in_parser->lexer);
-        ast_append(expr, ast_create_operator("new"));
         
         /* expect identifier */
         token = lexer_get(in_parser->lexer);
         if (token.type != TOKEN_IDENTIFIER)
             SYNTAX("Expected class name");
-        ast_append(expr, ast_create_string(token.text));
+        expr = ast_create(in_parser->arena, AST_EXPRESSION);
+        ast_append(expr, ast_create_operator(in_parser->arena, AST_OP_NEW));
+        ast_append(expr, ast_create_atom(in_parser->arena, token.value.atom));
         
         /* optional argument list */
         token = lexer_peek(in_parser->lexer, 0);
@@ -216,71 +241,60 @@ static AstNode* _parse_expression(Parser *in_parser)
         
         return expr;
     }
+    return _parse_operand(in_parser);
+}
+
+
+/* precedence climbing: parses a unary term, then folds in binary operators that bind at
+ least as tightly as in_min_precedence, each taking as its right operand everything that
+ binds tighter than itself.  Each binary operation is an expression of exactly three
+ children: <left> <operator> <right> */
+static AstNode* _parse_binary(Parser *in_parser, int in_min_precedence)
+{
+    const struct BinaryOperator *op;
+    AstNode *left, *right, *expr;
+    Token token;
     
-    /* expecting an operand:
-     subexpression, path, or literal */
-    operand = _parse_operand(in_parser);
-    if (!operand) return NULL;
-    ast_append(expr, operand);
+    left = _parse_unary(in_parser);
+    if (!left) return NULL;
     
-    /* parse remaining terms (if any) */
     for (;;)
     {
-        /* expecting end of expression or an operator */
         token = lexer_peek(in_parser->lexer, 0);
-        if (_is_binary_operator(token.type))
-        {
-            lexer_get(in_parser->lexer);
-            switch (token.type)
-            {
-                case TOKEN_AND:
-                    ast_append(expr, ast_create_operator("logical-and")); break;
-                case TOKEN_EQUAL:
-                    ast_append(expr, ast_create_operator("equal")); break;
-                case TOKEN_NOT_EQUAL:
-                    ast_append(expr, ast_create_operator("not-equal")); break;
-                case TOKEN_HYPHEN:
-                    ast_append(expr, ast_create_operator("subtract")); break;
-                case TOKEN_IS:
-                    ast_append(expr, ast_create_operator("is")); break;
-                case TOKEN_ISA:
-                    ast_append(expr, ast_create_operator("is-a")); break;
-                case TOKEN_LESS:
-                    ast_append(expr, ast_create_operator("less-than")); break;
-                case TOKEN_LESS_EQUAL:
-                    ast_append(expr, ast_create_operator("less-or-equal")); break;
-                case TOKEN_MORE:
-                    ast_append(expr, ast_create_operator("more-than")); break;
-                case TOKEN_MORE_EQUAL:
-                    ast_append(expr, ast_create_operator("more-or-equal")); break;
-                case TOKEN_MOD:
-                    ast_append(expr, ast_create_operator("modulus")); break;
-                case TOKEN_MULTIPLY:
-                    ast_append(expr, ast_create_operator("multiply")); break;
-                case TOKEN_SLASH:
-                    ast_append(expr, ast_create_operator("divide")); break;
-                case TOKEN_BACK_SLASH:
-                    ast_append(expr, ast_create_operator("int-divide")); break;
-                case TOKEN_PLUS:
-                    ast_append(expr, ast_create_operator("add")); break;
-                case TOKEN_OR:
-                    ast_append(expr, ast_create_operator("logical-or")); break;
-                    break;
-                    
-                default:
-                    SYNTAX("Internal compiler error; parsing undeclared binary operator");
-                    break;
-            }
-        }
-        else break;
+        assert(token.type < TOKEN_COUNT);
+        op = &(binary_operators[token.type]);
+        if ((op->precedence == PRECEDENCE_NONE) || (op->precedence < in_min_precedence)) break;
+        lexer_get(in_parser->lexer);
         
-        /* expecting another operand */
-        operand = _parse_operand(in_parser);
-        if (!operand)
-            SYNTAX("Expected operand");
-        ast_append(expr, operand);
+        right = _parse_binary(in_parser, op->right_associative ? op->precedence : op->precedence + 1);
+        if (!right) SYNTAX("Expected operand");
+        
+        expr = ast_create(in_parser->arena, AST_EXPRESSION);
+        ast_append(expr, left);
+        ast_append(expr, ast_create_operator(in_parser->arena, op->op));
+        ast_append(expr, right);
+        left = expr;
     }
     
+    return left;
+}
+
+
+/* parsing: operand operator operand ...
+    operand can be a subexpression (...) or a path (name().name().name()...)
+    or a literal colour, boolean, string or integer;
+ there must be an expression or this is a syntax error.
+ The result is always an expression; a lone operand is wrapped in one */
+static AstNode* _parse_expression(Parser *in_parser)
+{
+    AstNode *expr, *result;
+    
+    result = _parse_binary(in_parser, PRECEDENCE_OR);
+    if (!result) return NULL;
+    if (ast_is(result, AST_EXPRESSION)) return result;
+    
+    expr = ast_create(in_parser->arena, AST_EXPRESSION);
+    ast_append(expr, result);
     return expr;
 }
 
@@ -303,7 +317,7 @@ static AstNode* _parse_list(Parser *in_parser, AstNode*(*in_of)(Parser*), Boolea
     }
     
     /* create list */
-    list = ast_create(AST_LIST);
+    list = ast_create(in_parser->arena, AST_LIST);
     
     /* is list empty? */
     token = lexer_peek(in_parser->lexer, 0);
@@ -350,7 +364,7 @@ static AstNode* _parse_path(Parser *in_parser)
     Token token;
     Boolean can_index;
     
-    path = ast_create(AST_PATH);
+    path = ast_create(in_parser->arena, AST_PATH);
     
     token = lexer_peek(in_parser->lexer, 0);
     while ((token.type == TOKEN_IDENTIFIER) || (token.type == TOKEN_SELF) ||
@@ -360,13 +374,13 @@ static AstNode* _parse_path(Parser *in_parser)
         lexer_get(in_parser->lexer);
         can_index = ((token.type == TOKEN_IDENTIFIER) || (token.type == TOKEN_SUPER));
         if (token.type == TOKEN_IDENTIFIER)
-            ast_append(path, ast_create_string( token.text ));
+            ast_append(path, ast_create_atom(in_parser->arena, token.value.atom));
         else if (token.type == TOKEN_SUPER)
-            ast_append(path, ast_create_string( "super" ));
+            ast_append(path, ast_create_string(in_parser->arena,  "super" ));
         else if (token.type == TOKEN_SELF)
-            ast_append(path, ast_create_string( "self" ));
+            ast_append(path, ast_create_string(in_parser->arena,  "self" ));
         else if (token.type == TOKEN_ME)
-            ast_append(path, ast_create_string( "me" ));
+            ast_append(path, ast_create_string(in_parser->arena,  "me" ));
         
         /* expecting: ( OR . */
         token = lexer_peek(in_parser->lexer, 0);
@@ -399,19 +413,23 @@ static AstNode* _parse_path(Parser *in_parser)
 }
 
 
-const char* long_to_string(long in_int)
+static const char* _parser_long_text(Parser *in_parser, long in_int)
 {
-    static char buffer[100];
-    snprintf(buffer, 100, "%ld", in_int);
-    return buffer;
+    snprintf(in_parser->number_text, sizeof(in_parser->number_text), "%ld", in_int);
+    return in_parser->number_text;
 }
 
 
-const char* double_to_string(double in_double)
+static const char* _parser_double_text(Parser *in_parser, double in_double)
 {
-    static char buffer[100];
-    snprintf(buffer, 100, "%lf", in_double);
-    return buffer;
+    snprintf(in_parser->number_text, sizeof(in_parser->number_text), "%lf", in_double);
+    return in_parser->number_text;
+}
+
+
+static AstNode* _parser_number_literal(Parser *in_parser, const char *in_text)
+{
+    return ast_create_literal(in_parser->arena, in_text, strlen(in_text));
 }
 
 
@@ -421,7 +439,7 @@ static AstNode* _parse_dim_identifier(Parser *in_parser)
     token = lexer_get(in_parser->lexer);
     if (token.type != TOKEN_IDENTIFIER)
         SYNTAX("Expected identifier");
-    return ast_create_string(token.text);
+    return ast_create_atom(in_parser->arena, token.value.atom);
 }
 
 
@@ -431,8 +449,8 @@ static AstNode* _parse_dim(Parser *in_parser)
     AstNode *cond, *expr;
     
     /* create the Dim node */
-    cond = ast_create(AST_CONTROL);
-    ast_append(cond, ast_create_string("dim"));
+    cond = ast_create(in_parser->arena, AST_CONTROL);
+    ast_append(cond, ast_create_string(in_parser->arena, "dim"));
     
     /* skip the Dim keyword */
     token = lexer_get(in_parser->lexer);
@@ -456,7 +474,7 @@ static AstNode* _parse_dim(Parser *in_parser)
         if (token.type == TOKEN_NEW)
         {
             lexer_get(in_parser->lexer);
-            ast_append(cond, ast_create_operator("new"));
+            ast_append(cond, ast_create_operator(in_parser->arena, AST_OP_NEW));
         }
 
         /* expect type path */
@@ -480,7 +498,7 @@ static AstNode* _parse_dim(Parser *in_parser)
         token = lexer_get(in_parser->lexer);
         if (token.type != TOKEN_IDENTIFIER)
             SYNTAX("Expected identifier");
-        ast_append(cond, ast_create_string(token.text));
+        ast_append(cond, ast_create_atom(in_parser->arena, token.value.atom));
         
         /* expect array dimension list */
         expr = _parse_list(in_parser, _parse_expression, False);
@@ -513,8 +531,8 @@ static AstNode* _parse_redim(Parser *in_parser)
     AstNode *cond, *expr;
     
     /* create the ReDim node */
-    cond = ast_create(AST_CONTROL);
-    ast_append(cond, ast_create_string("redim"));
+    cond = ast_create(in_parser->arena, AST_CONTROL);
+    ast_append(cond, ast_create_string(in_parser->arena, "redim"));
     
     /* skip the ReDim keyword */
     token = lexer_get(in_parser->lexer);
@@ -539,8 +557,8 @@ static AstNode* _parse_return(Parser *in_parser)
     AstNode *ret, *expr;
     
     /* create return node */
-    ret = ast_create(AST_CONTROL);
-    ast_append(ret, ast_create_string("return"));
+    ret = ast_create(in_parser->arena, AST_CONTROL);
+    ast_append(ret, ast_create_string(in_parser->arena, "return"));
     
     /* skip Return */
     lexer_get(in_parser->lexer);
@@ -582,7 +600,7 @@ static AstNode* _parse_statement(Parser *in_parser)
     int i, c;
     
     /* begin statement */
-    stmt = in_parser->statement = ast_create(AST_STATEMENT);
+    stmt = in_parser->statement = ast_create(in_parser->arena, AST_STATEMENT);
     
     /* peek at the first token */
     token = lexer_peek(in_parser->lexer, 0);
@@ -592,33 +610,33 @@ static AstNode* _parse_statement(Parser *in_parser)
     {
         /* expect an identifier, followed by a constant, followed by end of line */
         lexer_get(in_parser->lexer);
-        ast_append(stmt, ast_create_string("pragma"));
+        ast_append(stmt, ast_create_string(in_parser->arena, "pragma"));
         
         token = lexer_get(in_parser->lexer);
         if (token.type != TOKEN_IDENTIFIER)
             SYNTAX("Expected pragma identifier");
-        ast_append(stmt, ast_create_string(token.text));
+        ast_append(stmt, ast_create_atom(in_parser->arena, token.value.atom));
         
         token = lexer_get(in_parser->lexer);
         switch (token.type)
         {
             case TOKEN_IDENTIFIER:
-                ast_append(stmt, ast_create_string(token.text));
+                ast_append(stmt, ast_create_atom(in_parser->arena, token.value.atom));
                 break;
             case TOKEN_LIT_STRING:
-                ast_append(stmt, ast_create_string(token.text));
+                ast_append(stmt, ast_create_literal(in_parser->arena, token.text, token.length));
                 break;
             case TOKEN_LIT_INTEGER:
-                ast_append(stmt, ast_create_string( long_to_string(token.value.integer) ));
+                ast_append(stmt, _parser_number_literal(in_parser, _parser_long_text(in_parser, token.value.integer)));
                 break;
             case TOKEN_LIT_REAL:
-                ast_append(stmt, ast_create_string( double_to_string(token.value.real) ));
+                ast_append(stmt, _parser_number_literal(in_parser, _parser_double_text(in_parser, token.value.real)));
                 break;
             case TOKEN_TRUE:
-                ast_append(stmt, ast_create_string("true"));
+                ast_append(stmt, ast_create_string(in_parser->arena, "true"));
                 break;
             case TOKEN_FALSE:
-                ast_append(stmt, ast_create_string("false"));
+                ast_append(stmt, ast_create_string(in_parser->arena, "false"));
                 break;
             default:
                 SYNTAX("Expected pragma value");
@@ -660,7 +678,7 @@ static AstNode* _parse_statement(Parser *in_parser)
     else if (token.type == TOKEN_EXIT)
     {
         /* expect end of line */
-        ast_append(stmt, ast_create_string("break"));
+        ast_append(stmt, ast_create_string(in_parser->arena, "break"));
         lexer_get(in_parser->lexer);
         
         token = lexer_peek(in_parser->lexer, 0);
@@ -672,7 +690,7 @@ static AstNode* _parse_statement(Parser *in_parser)
     else if (token.type == TOKEN_CONTINUE)
     {
         /* expect end of line */
-        ast_append(stmt, ast_create_string("continue"));
+        ast_append(stmt, ast_create_string(in_parser->arena, "continue"));
         lexer_get(in_parser->lexer);
         
         token = lexer_peek(in_parser->lexer, 0);
@@ -722,7 +740,6 @@ static AstNode* _parse_statement(Parser *in_parser)
                 c = ast_count(list);
                 for (i = 0; i < c; i++)
                     ast_append(last, ast_remove(list, 0));
-                ast_dispose(list);
                 //ast_prepend(list, ast_remove(path, AST_LAST));
             }
             else
@@ -764,8 +781,8 @@ static AstNode* _parse_if(Parser *in_parser)
     AstNode *cond, *expr;
     
     /* create the If node */
-    cond = ast_create(AST_CONTROL);
-    ast_append(cond, ast_create_string("if"));
+    cond = ast_create(in_parser->arena, AST_CONTROL);
+    ast_append(cond, ast_create_string(in_parser->arena, "if"));
     
     /* skip the If keyword */
     token = lexer_get(in_parser->lexer);
@@ -886,8 +903,8 @@ static AstNode* _parse_select(Parser *in_parser)
     AstNode *cond, *expr;
     
     /* create the Select node */
-    cond = ast_create(AST_CONTROL);
-    ast_append(cond, ast_create_string("select"));
+    cond = ast_create(in_parser->arena, AST_CONTROL);
+    ast_append(cond, ast_create_string(in_parser->arena, "select"));
     
     /* skip the Select Case keywords */
     lexer_get(in_parser->lexer);
@@ -966,7 +983,7 @@ static AstNode* _parse_for(Parser *in_parser)
     AstNode *cond, *expr;
     
     /* create the For node */
-    cond = ast_create(AST_CONTROL);
+    cond = ast_create(in_parser->arena, AST_CONTROL);
     
     /* skip the For keyword */
     lexer_get(in_parser->lexer);
@@ -976,8 +993,8 @@ static AstNode* _parse_for(Parser *in_parser)
     if (token.type == TOKEN_IDENTIFIER)
     {
         /* parse For Next loop */
-        ast_append(cond, ast_create_string("for"));
-        ast_append(cond, ast_create_string(token.text));
+        ast_append(cond, ast_create_string(in_parser->arena, "for"));
+        ast_append(cond, ast_create_atom(in_parser->arena, token.value.atom));
         
         /* expect = */
         token = lexer_get(in_parser->lexer);
@@ -992,9 +1009,9 @@ static AstNode* _parse_for(Parser *in_parser)
         /* expect To or DownTo */
         token = lexer_get(in_parser->lexer);
         if (token.type == TOKEN_TO)
-            ast_append(cond, ast_create_string("increment"));
+            ast_append(cond, ast_create_string(in_parser->arena, "increment"));
         else if (token.type == TOKEN_DOWNTO)
-            ast_append(cond, ast_create_string("decrement"));
+            ast_append(cond, ast_create_string(in_parser->arena, "decrement"));
         else
             SYNTAX("Expected To");
         
@@ -1014,8 +1031,8 @@ static AstNode* _parse_for(Parser *in_parser)
         }
         else
         {
-            expr = ast_create(AST_EXPRESSION);
-            ast_append(expr, ast_create_integer(1));
+            expr = ast_create(in_parser->arena, AST_EXPRESSION);
+            ast_append(expr, ast_create_integer(in_parser->arena, 1));
             ast_append(cond, expr);
         }
         
@@ -1037,7 +1054,7 @@ static AstNode* _parse_for(Parser *in_parser)
         if (token.type == TOKEN_IDENTIFIER)
         {
             lexer_get(in_parser->lexer);
-            if (!ast_text_is(ast_child(cond, 1), token.text))
+            if (!ast_atom_is(ast_child(cond, 1), token.value.atom))
                 SYNTAX("Counter variable must match For");
         }
         
@@ -1049,13 +1066,13 @@ static AstNode* _parse_for(Parser *in_parser)
     else if (token.type == TOKEN_EACH)
     {
         /* parse For Each loop */
-        ast_append(cond, ast_create_string("foreach"));
+        ast_append(cond, ast_create_string(in_parser->arena, "foreach"));
         
         /* expect local identifier */
         token = lexer_get(in_parser->lexer);
         if (token.type != TOKEN_IDENTIFIER)
             SYNTAX("Expected identifier");
-        ast_append(cond, ast_create_string(token.text));
+        ast_append(cond, ast_create_atom(in_parser->arena, token.value.atom));
         
         /* expect In */
         token = lexer_get(in_parser->lexer);
@@ -1100,8 +1117,8 @@ static AstNode* _parse_while(Parser *in_parser)
     AstNode *cond, *expr;
     
     /* create the While node */
-    cond = ast_create(AST_CONTROL);
-    ast_append(cond, ast_create_string("while"));
+    cond = ast_create(in_parser->arena, AST_CONTROL);
+    ast_append(cond, ast_create_string(in_parser->arena, "while"));
     
     /* skip the While keyword */
     lexer_get(in_parser->lexer);
@@ -1141,8 +1158,8 @@ static AstNode* _parse_do(Parser *in_parser)
     AstNode *cond, *expr;
     
     /* create the Do node */
-    cond = ast_create(AST_CONTROL);
-    ast_append(cond, ast_create_string("do"));
+    cond = ast_create(in_parser->arena, AST_CONTROL);
+    ast_append(cond, ast_create_string(in_parser->arena, "do"));
     
     /* skip Do */
     lexer_get(in_parser->lexer);
@@ -1201,7 +1218,7 @@ static AstNode* _parse_block(Parser *in_parser)
     AstNode *block, *result;
     
     /* create a block */
-    block = ast_create(AST_LIST);
+    block = ast_create(in_parser->arena, AST_LIST);
     
     for (;;)
     {
@@ -1266,7 +1283,7 @@ static AstNode* _parse_routine_arg(Parser *in_parser)
     Boolean by_ref;
     
     /* create an argument */
-    arg = ast_create(AST_LIST);
+    arg = ast_create(in_parser->arena, AST_LIST);
     
     /* check for byref/byval */
     by_ref = False;
@@ -1281,7 +1298,7 @@ static AstNode* _parse_routine_arg(Parser *in_parser)
     token = lexer_get(in_parser->lexer);
     if (token.type != TOKEN_IDENTIFIER)
         SYNTAX("Expected argument name");
-    ast_append(arg, ast_create_string(token.text));
+    ast_append(arg, ast_create_atom(in_parser->arena, token.value.atom));
     
     /* handle array designator () */
     token = lexer_peek(in_parser->lexer, 0);
@@ -1291,12 +1308,12 @@ static AstNode* _parse_routine_arg(Parser *in_parser)
         token = lexer_get(in_parser->lexer);
         if (token.type != TOKEN_PAREN_RIGHT)
             SYNTAX("Expected )");
-        ast_append(arg, ast_create_string("array"));
+        ast_append(arg, ast_create_string(in_parser->arena, "array"));
     }
     else
     {
-        if (by_ref) ast_append(arg, ast_create_string("reference"));
-        else ast_append(arg, ast_create_string("value"));
+        if (by_ref) ast_append(arg, ast_create_string(in_parser->arena, "reference"));
+        else ast_append(arg, ast_create_string(in_parser->arena, "value"));
     }
     
     /* expect As */
@@ -1320,16 +1337,16 @@ static AstNode* _parse_routine(Parser *in_parser)
     Boolean is_function;
     
     /* create a routine */
-    routine = ast_create(AST_CONTROL);
+    routine = ast_create(in_parser->arena, AST_CONTROL);
     
     /* read access modifier: Public | Protected | Private */
     token = lexer_get(in_parser->lexer);
     if (token.type == TOKEN_PUBLIC)
-        access = ast_create_string("public");
+        access = ast_create_string(in_parser->arena, "public");
     else if (token.type == TOKEN_PROTECTED)
-        access = ast_create_string("protected");
+        access = ast_create_string(in_parser->arena, "protected");
     else if (token.type == TOKEN_PRIVATE)
-        access = ast_create_string("private");
+        access = ast_create_string(in_parser->arena, "private");
     else
         SYNTAX("Expected access modifier");
     
@@ -1338,16 +1355,16 @@ static AstNode* _parse_routine(Parser *in_parser)
     if (token.type == TOKEN_SHARED)
     {
         lexer_get(in_parser->lexer);
-        shared = ast_create_string("class");
+        shared = ast_create_string(in_parser->arena, "class");
     }
     else
-        shared = ast_create_string("instance");
+        shared = ast_create_string(in_parser->arena, "instance");
     
     /* check if Sub or Function and skip keyword */
     token = lexer_get(in_parser->lexer);
     is_function = (token.type == TOKEN_FUNCTION);
-    if (!is_function) ast_append(routine, ast_create_string("subroutine"));
-    else ast_append(routine, ast_create_string("function"));
+    if (!is_function) ast_append(routine, ast_create_string(in_parser->arena, "subroutine"));
+    else ast_append(routine, ast_create_string(in_parser->arena, "function"));
     
     /* expect routine name */
     token = lexer_get(in_parser->lexer);
@@ -1360,7 +1377,7 @@ static AstNode* _parse_routine(Parser *in_parser)
             SYNTAX("Expected function name");
         }
     }
-    ast_append(routine, ast_create_string(token.text));
+    ast_append(routine, ast_create_atom(in_parser->arena, token.value.atom));
     
     /* append access modifiers and shared modifier */
     ast_append(routine, access);
@@ -1431,17 +1448,17 @@ static AstNode* _parse_property(Parser *in_parser)
     AstNode *prop, *access, *shared, *expr;
     
     /* create proeprty */
-    prop = ast_create(AST_CONTROL);
-    ast_append(prop, ast_create_string("property"));
+    prop = ast_create(in_parser->arena, AST_CONTROL);
+    ast_append(prop, ast_create_string(in_parser->arena, "property"));
     
     /* read access modifier: Public | Protected | Private */
     token = lexer_get(in_parser->lexer);
     if (token.type == TOKEN_PUBLIC)
-        access = ast_create_string("public");
+        access = ast_create_string(in_parser->arena, "public");
     else if (token.type == TOKEN_PROTECTED)
-        access = ast_create_string("protected");
+        access = ast_create_string(in_parser->arena, "protected");
     else if (token.type == TOKEN_PRIVATE)
-        access = ast_create_string("private");
+        access = ast_create_string(in_parser->arena, "private");
     else
         SYNTAX("Expected access modifier");
     
@@ -1450,16 +1467,16 @@ static AstNode* _parse_property(Parser *in_parser)
     if (token.type == TOKEN_SHARED)
     {
         lexer_get(in_parser->lexer);
-        shared = ast_create_string("class");
+        shared = ast_create_string(in_parser->arena, "class");
     }
     else
-        shared = ast_create_string("instance");
+        shared = ast_create_string(in_parser->arena, "instance");
     
     /* expect property name */
     token = lexer_get(in_parser->lexer);
     if (token.type != TOKEN_IDENTIFIER)
         SYNTAX("Expected property identifier");
-    ast_append(prop, ast_create_string(token.text));
+    ast_append(prop, ast_create_atom(in_parser->arena, token.value.atom));
     
     /* append access modifiers and shared modifier */
     ast_append(prop, access);
@@ -1500,8 +1517,8 @@ static AstNode* _parse_event_decl(Parser *in_parser)
     AstNode *event, *result;
     
     /* create event declaration */
-    event = ast_create(AST_CONTROL);
-    ast_append(event, ast_create_string("event"));
+    event = ast_create(in_parser->arena, AST_CONTROL);
+    ast_append(event, ast_create_string(in_parser->arena, "event"));
     
     /* skip Event */
     lexer_get(in_parser->lexer);
@@ -1509,7 +1526,7 @@ static AstNode* _parse_event_decl(Parser *in_parser)
     /* expect event identifier */
     token = lexer_get(in_parser->lexer);
     if (token.type != TOKEN_IDENTIFIER) SYNTAX("Expected event identifier");
-    ast_append(event, ast_create_string(token.text));
+    ast_append(event, ast_create_atom(in_parser->arena, token.value.atom));
     
     /* handle optional argument list */
     token = lexer_peek(in_parser->lexer, 0);
@@ -1550,8 +1567,8 @@ static AstNode* _parse_event_hdlr(Parser *in_parser)
     AstNode *event, *result;
     
     /* create event declaration */
-    event = ast_create(AST_CONTROL);
-    ast_append(event, ast_create_string("handler"));
+    event = ast_create(in_parser->arena, AST_CONTROL);
+    ast_append(event, ast_create_string(in_parser->arena, "handler"));
     
     /* skip Handler */
     lexer_get(in_parser->lexer);
@@ -1561,16 +1578,16 @@ static AstNode* _parse_event_hdlr(Parser *in_parser)
     token2 = lexer_peek(in_parser->lexer, 0);
     if ((token.type == TOKEN_IDENTIFIER) && (token2.type == TOKEN_DOT))
     {
-        ast_append(event, ast_create_string(token.text));
+        ast_append(event, ast_create_atom(in_parser->arena, token.value.atom));
         lexer_get(in_parser->lexer);
         token = lexer_get(in_parser->lexer);
         if (token.type != TOKEN_IDENTIFIER) SYNTAX("Expected event identifier");
-        ast_append(event, ast_create_string(token.text));
+        ast_append(event, ast_create_atom(in_parser->arena, token.value.atom));
     }
     else
     {
         if (token.type != TOKEN_IDENTIFIER) SYNTAX("Expected event identifier");
-        ast_append(event, ast_create_string(token.text));
+        ast_append(event, ast_create_atom(in_parser->arena, token.value.atom));
     }
     
     
@@ -1631,8 +1648,8 @@ static AstNode* _parse_class(Parser *in_parser)
     AstNode *class, *routine, *path;
     
     /* create class */
-    class = ast_create(AST_CONTROL);
-    ast_append(class, ast_create_string("class"));
+    class = ast_create(in_parser->arena, AST_CONTROL);
+    ast_append(class, ast_create_string(in_parser->arena, "class"));
     
     /* skip Class */
     lexer_get(in_parser->lexer);
@@ -1641,7 +1658,7 @@ static AstNode* _parse_class(Parser *in_parser)
     token = lexer_get(in_parser->lexer);
     if (token.type != TOKEN_IDENTIFIER)
         SYNTAX("Expected class identifier");
-    ast_append(class, ast_create_string(token.text));
+    ast_append(class, ast_create_atom(in_parser->arena, token.value.atom));
     
     /* handle Inherits */
     token = lexer_peek(in_parser->lexer, 0);
@@ -1743,7 +1760,7 @@ static AstNode* _parse_file(Parser *in_parser)
     AstNode *file, *class;
     
     /* create list of file structures */
-    file = ast_create(AST_LIST);
+    file = ast_create(in_parser->arena, AST_LIST);
     
     /* iterate over file contents */
     for (;;)
@@ -1770,24 +1787,45 @@ static AstNode* _parse_file(Parser *in_parser)
 
 
 
+/* the tree, and anything left behind by a syntax error, goes with the arena */
 static void _reset(Parser *in_parser)
 {
     in_parser->error_message = NULL;
-    if (in_parser->ast) ast_dispose(in_parser->ast);
-    in_parser->init = _parse_file;
+    in_parser->ast = NULL;
+    in_parser->statement = NULL;
+    arena_reset(in_parser->arena);
+    if (in_parser->lexer) lexer_dispose(in_parser->lexer);
+    in_parser->lexer = NULL;
 }
 
 
 Boolean parser_parse(Parser *in_parser, char *in_source)
 {
+    const char *message;
+    long offset;
+    
     _reset(in_parser);
     
-    in_parser->lexer = lexer_create(in_source);
+    if (in_parser->defined)
+        in_parser->lexer = lexer_create_conditional(in_source, in_parser->defined);
+    else
+        in_parser->lexer = lexer_create_table(in_source);
+    if (lexer_utf8_error(in_parser->lexer) >= 0)
+    {
+        _error(in_parser, lexer_utf8_error(in_parser->lexer), "Source isn't valid UTF-8");
+        return False;
+    }
+    if ((offset = lexer_condition_error(in_parser->lexer, &message)) >= 0)
+    {
+        _error(in_parser, offset, (char*)message);
+        return False;
+    }
     in_parser->ast = in_parser->init(in_parser);
     if (in_parser->error_message)
     {
-        ast_dispose(in_parser->ast);
         in_parser->ast = NULL;
+        in_parser->statement = NULL;
+        arena_reset(in_parser->arena);
         return False;
     }
     return True;
@@ -1803,14 +1841,31 @@ Parser* parser_create(void)
     parser->error_message = NULL;
     parser->error_offset = 0;
     parser->lexer = NULL;
+    parser->arena = arena_create();
     parser->ast = NULL;
     parser->statement = NULL;
-    parser->init = &_parse_statement;
+    parser->defined = NULL;
+    parser->init = &_parse_file;
     
     return parser;
 }
 
 
+void parser_dispose(Parser *in_parser)
+{
+    if (!in_parser) return;
+    if (in_parser->lexer) lexer_dispose(in_parser->lexer);
+    arena_dispose(in_parser->arena);
+    safe_free(in_parser);
+}
+
+
+void parser_set_defined(Parser *in_parser, const char * const *in_defined)
+{
+    in_parser->defined = in_defined;
+}
+
+
 const char* parser_error_message(Parser *in_parser)
 {
     return in_parser->error_message;
@@ -1823,6 +1878,20 @@ long parser_error_offset(Parser *in_parser)
 }
 
 
+/* maps an offset in the most recently parsed source to a 1-based line and column */
+void parser_location(Parser *in_parser, long in_offset, long *out_line, long *out_column)
+{
+    assert(in_parser->lexer);
+    lexer_location(in_parser->lexer, in_offset, out_line, out_column);
+}
+
+
+void parser_error_location(Parser *in_parser, long *out_line, long *out_column)
+{
+    parser_location(in_parser, in_parser->error_offset, out_line, out_column);
+}
+
+
 AstNode* parser_ast(Parser *in_parser)
 {
     return in_parser->ast;
@@ -1834,11 +1903,30 @@ AstNode* parser_ast(Parser *in_parser)
 #ifdef DEBUG
 
 
-static Parser *g_test_parser;
+#define TEST_STRESS_THREADS 8
+#define TEST_STRESS_PASSES 4
+
+
+typedef struct TestContext
+{
+    Parser *parser;
+    Boolean quiet;
+    Boolean failed;
+    char *result;
+    char err_msg_buffer[1024];
+} TestContext;
 
 
 static void _test_case_result(void *in_user, const char *in_file, int in_case_number, long in_line_number, const char *in_error)
 {
+    TestContext *context = in_user;
+    
+    if (context->quiet)
+    {
+        if (in_error) context->failed = True;
+        return;
+    }
+    
     if (in_error)
     {
         printf("%s: case %d, line %ld: failed: %s\n", in_file, in_case_number, in_line_number, in_error);
@@ -1849,11 +1937,29 @@ static void _test_case_result(void *in_user, const char *in_file, int in_case_nu
 }
 
 
+static char* _test_ast_text(AstNode *in_ast);
+
+
+/* the frozen form of the tree must describe itself identically */
+static Boolean _test_frozen_matches(AstNode *in_ast, const char *in_text)
+{
+    AstNode *frozen;
+    char *text;
+    Boolean result;
+    
+    frozen = ast_freeze(in_ast);
+    text = _test_ast_text(frozen);
+    result = ((text != NULL) && (strcmp(text, in_text) == 0) && (ast_size(frozen) == ast_size(in_ast)));
+    if (text) safe_free(text);
+    ast_dispose(frozen);
+    return result;
+}
+
+
 static const char* _test_case_runner(void *in_user, const char *in_file, int in_case_number, const char *in_input, const char *in_output)
 {
-    char *result;
+    TestContext *context = in_user;
     char *err;
-    static char err_msg_buffer[1024];
     
     err = NULL;
     
@@ -1862,46 +1968,1087 @@ static const char* _test_case_runner(void *in_user, const char *in_file, int in_
 //        err = NULL;
 //    }
 
-    parser_parse(g_test_parser, (char*)in_input);
-    result = NULL;
-    ast_walk(g_test_parser->ast, ast_string_walker, &result);
+    parser_parse(context->parser, (char*)in_input);
+    if (context->result) safe_free(context->result);
+    context->result = ast_write_string(context->parser->ast, AST_FORMAT_TEXT);
     
-    if (result == NULL)
+    if (context->result == NULL)
     {
-        snprintf(err_msg_buffer, 1024, "%ld: %s", g_test_parser->error_offset, g_test_parser->error_message);
-        if (strcmp(err_msg_buffer, in_output) != 0)
-            err = err_msg_buffer;
+        snprintf(context->err_msg_buffer, 1024, "%ld: %s", context->parser->error_offset, context->parser->error_message);
+        if (strcmp(context->err_msg_buffer, in_output) != 0)
+            err = context->err_msg_buffer;
     }
     else
     {
-        if (strcmp(result, in_output) != 0)
-            err = result;
+        if (strcmp(context->result, in_output) != 0)
+            err = context->result;
+        else if (!_test_frozen_matches(context->parser->ast, context->result))
+            err = "Frozen tree doesn't match";
     }
     
     return err;
 }
 
 
+static const char *test_defined[] = { "TargetMacOS", NULL };
+
+static void _test_run_corpora(TestContext *io_context)
+{
+    io_context->parser->init = _parse_statement;
+    test_run_cases(TESTSDIR "parser-statement.tests",
+                   _test_case_runner, _test_case_result, io_context);
+    
+    io_context->parser->init = _parse_block;
+    test_run_cases(TESTSDIR "parser-control.tests",
+                   _test_case_runner, _test_case_result, io_context);
+    
+    io_context->parser->init = _parse_file;
+    test_run_cases(TESTSDIR "parser-class.tests",
+                   _test_case_runner, _test_case_result, io_context);
+    
+    io_context->parser->init = _parse_block;
+    parser_set_defined(io_context->parser, test_defined);
+    test_run_cases(TESTSDIR "parser-conditional.tests",
+                   _test_case_runner, _test_case_result, io_context);
+    parser_set_defined(io_context->parser, NULL);
+}
+
+
+static void* _test_stress_thread(void *in_context)
+{
+    int pass;
+    
+    for (pass = 0; pass < TEST_STRESS_PASSES; pass++)
+        _test_run_corpora(in_context);
+    return NULL;
+}
+
+
+/* parses the test corpora on several threads at once; every thread must produce the
+ expected output for every case */
+static const char* _test_stress(void)
+{
+    pthread_t threads[TEST_STRESS_THREADS];
+    TestContext contexts[TEST_STRESS_THREADS];
+    int t;
+    
+    for (t = 0; t < TEST_STRESS_THREADS; t++)
+    {
+        contexts[t].parser = parser_create();
+        contexts[t].quiet = True;
+        contexts[t].failed = False;
+        contexts[t].result = NULL;
+        CHECK(pthread_create(&(threads[t]), NULL, &_test_stress_thread, &(contexts[t])) == 0);
+    }
+    for (t = 0; t < TEST_STRESS_THREADS; t++)
+        pthread_join(threads[t], NULL);
+    
+    for (t = 0; t < TEST_STRESS_THREADS; t++)
+    {
+        CHECK(!contexts[t].failed);
+        if (contexts[t].result) safe_free(contexts[t].result);
+        parser_dispose(contexts[t].parser);
+    }
+    
+    return NULL;
+}
+
+
+static char* _test_ast_text(AstNode *in_ast)
+{
+    return ast_write_string(in_ast, AST_FORMAT_TEXT);
+}
+
+
+#define TEST_ARENA_PASSES 100
+
+static const char *test_arena_source =
+"Class CSimple\n"
+"\tPublic Function test(a As Integer, b As Integer) As Integer\n"
+"\t\tReturn (a + b) * 2 - a Mod b\n"
+"\tEnd Function\n"
+"End Class\n";
+
+static const char *test_arena_error =
+"Class CSimple\n"
+"\tPublic Sub test\n"
+"\t\tIf a = 1 Then\n"
+"\t\t\tMsgBox \"One\"\n"
+"\t\tElse\n"
+"\t\t\tx = (1 + \n"
+"End Class\n";
+
+
+/* copies outlive the parse, and syntax errors don't leave anything behind */
+static const char* _test_arena(void)
+{
+    Parser *parser;
+    AstNode *copy;
+    char *text1, *text2;
+    long size;
+    int i;
+    
+    parser = parser_create();
+    CHECK(parser_parse(parser, (char*)test_arena_source));
+    text1 = _test_ast_text(parser_ast(parser));
+    copy = ast_copy(parser_ast(parser), NULL);
+    
+    size = arena_size(parser->arena);
+    for (i = 0; i < TEST_ARENA_PASSES; i++)
+    {
+        CHECK(!parser_parse(parser, (char*)test_arena_error));
+        CHECK(parser_ast(parser) == NULL);
+        CHECK(arena_used(parser->arena) == 0);
+        CHECK(arena_size(parser->arena) == size);
+    }
+    
+    text2 = _test_ast_text(copy);
+    CHECK(text1 && text2);
+    CHECK(strcmp(text1, text2) == 0);
+    safe_free(text2);
+    
+    /* and back into an arena */
+    CHECK(parser_parse(parser, (char*)test_arena_source));
+    ast_dispose(copy);
+    copy = ast_copy(parser_ast(parser), parser->arena);
+    text2 = _test_ast_text(copy);
+    CHECK(strcmp(text1, text2) == 0);
+    safe_free(text1);
+    safe_free(text2);
+    
+    parser_dispose(parser);
+    return NULL;
+}
+
+
+#define TEST_RECLAIM_PASSES 1000
+
+/* distinct literals don't accumulate anywhere but the arena, which is reset by the next parse */
+static const char* _test_reclaim(void)
+{
+    Parser *parser;
+    char source[256];
+    long count, used;
+    int i;
+    
+    parser = parser_create();
+    count = used = 0;
+    for (i = 0; i < TEST_RECLAIM_PASSES; i++)
+    {
+        snprintf(source, sizeof(source), "Class CSimple\n\tPublic Sub test\n\t\t#pragma Limit %d\n"
+                 "\t\tMsgBox \"Message %d\"\n\tEnd Sub\nEnd Class\n", i, i);
+        CHECK(parser_parse(parser, source));
+        if (i == 0)
+        {
+            count = intern_count();
+            used = arena_used(parser->arena);
+        }
+    }
+    CHECK(intern_count() == count);
+    CHECK(arena_used(parser->arena) <= used + 8);
+    parser_dispose(parser);
+    return NULL;
+}
+
+
+/* accessors, skipping and thawing on a frozen tree */
+static const char* _test_frozen(void)
+{
+    Parser *parser;
+    AstNode *frozen, *routine, *node, *thawed;
+    char *text1, *text2;
+    int i;
+    
+    parser = parser_create();
+    CHECK(parser_parse(parser, (char*)test_arena_source));
+    frozen = ast_freeze(parser_ast(parser));
+    CHECK(ast_is_frozen(frozen));
+    CHECK(!ast_is_frozen(parser_ast(parser)));
+    
+    /* the class, its name and then the function */
+    routine = ast_child(ast_child(frozen, 0), 2);
+    CHECK(ast_is(routine, AST_CONTROL));
+    CHECK(ast_text_is(ast_child(routine, 0), "function"));
+    CHECK(ast_text_is(ast_child(routine, 1), "test"));
+    CHECK(ast_child(routine, AST_LAST) == ast_child(routine, ast_count(routine) - 1));
+    CHECK(ast_child(routine, ast_count(routine)) == NULL);
+    
+    /* skipping each child's subtree lands on the next, the last child's on the routine's sibling */
+    node = ast_child(routine, AST_FIRST);
+    CHECK(node == ast_child(routine, 0));
+    for (i = 1; i < ast_count(routine); i++)
+        node = ast_skip(node);
+    CHECK(node == ast_child(routine, AST_LAST));
+    CHECK(ast_skip(node) == ast_skip(routine));
+    CHECK(ast_skip(routine) == ast_skip(frozen));
+    CHECK(ast_size(frozen) == ast_size(parser_ast(parser)));
+    CHECK(ast_memory(frozen) == ast_size(frozen) * 16);
+    CHECK(ast_memory(frozen) < ast_memory(parser_ast(parser)));
+    
+    /* a working node is 24 bytes; a list of more than one child adds an array */
+    node = ast_create(NULL, AST_LIST);
+    ast_append(node, ast_create_integer(NULL, 1));
+    CHECK(ast_memory(node) == 2 * 24);
+    ast_append(node, ast_create_integer(NULL, 2));
+    CHECK(ast_memory(node) == 3 * 24 + 2 * (long)sizeof(AstNode*));
+    ast_dispose(node);
+    
+    thawed = ast_copy(frozen, NULL);
+    CHECK(!ast_is_frozen(thawed));
+    text1 = _test_ast_text(parser_ast(parser));
+    text2 = _test_ast_text(thawed);
+    CHECK(strcmp(text1, text2) == 0);
+    safe_free(text1);
+    safe_free(text2);
+    ast_dispose(thawed);
+    
+    ast_dispose(frozen);
+    parser_dispose(parser);
+    
+    /* deeper than the walk's initial stack */
+    thawed = node = ast_create(NULL, AST_LIST);
+    for (i = 0; i < 200; i++)
+    {
+        ast_append(node, ast_create_integer(NULL, i));
+        ast_append(node, ast_create(NULL, AST_LIST));
+        node = ast_child(node, AST_LAST);
+    }
+    text1 = _test_ast_text(thawed);
+    CHECK(_test_frozen_matches(thawed, text1));
+    safe_free(text1);
+    ast_dispose(thawed);
+    
+    return NULL;
+}
+
+
+static const char *test_json_expected =
+"{\"type\":\"statement\",\"children\":["
+"{\"type\":\"string\",\"value\":\"say \\\"hi\\\"\\u000a\"},"
+"{\"type\":\"expression\",\"children\":["
+"{\"type\":\"integer\",\"value\":-3},"
+"{\"type\":\"operator\",\"value\":\"multiply\"},"
+"{\"type\":\"real\",\"value\":0.5}]},"
+"{\"type\":\"list\",\"children\":[]},"
+"{\"type\":\"boolean\",\"value\":true},"
+"{\"type\":\"null\"}]}\n";
+
+static const char *test_json_non_finite =
+"{\"type\":\"list\",\"children\":["
+"{\"type\":\"real\",\"value\":null},"
+"{\"type\":\"real\",\"value\":null},"
+"{\"type\":\"real\",\"value\":null}]}\n";
+
+
+static void _test_file_text(FILE *in_file, char *out_text, long in_size)
+{
+    long length;
+    
+    rewind(in_file);
+    length = fread(out_text, 1, in_size - 1, in_file);
+    out_text[length] = 0;
+}
+
+
+/* the JSON form, escaping and empty lists, and the file sink matching the string sink */
+static const char* _test_json(void)
+{
+    AstNode *tree, *frozen, *expr;
+    char *text, buffer[1024];
+    FILE *file;
+    
+    tree = ast_create(NULL, AST_STATEMENT);
+    ast_append(tree, ast_create_string(NULL, "say \"hi\"\n"));
+    expr = ast_create(NULL, AST_EXPRESSION);
+    ast_append(expr, ast_create_integer(NULL, -3));
+    ast_append(expr, ast_create_operator(NULL, AST_OP_MULTIPLY));
+    ast_append(expr, ast_create_real(NULL, 0.5));
+    ast_append(tree, expr);
+    ast_append(tree, ast_create(NULL, AST_LIST));
+    ast_append(tree, ast_create_boolean(NULL, True));
+    ast_append(tree, ast_create(NULL, AST_NULL));
+    frozen = ast_freeze(tree);
+    
+    text = ast_write_string(tree, AST_FORMAT_JSON);
+    CHECK(strcmp(text, test_json_expected) == 0);
+    safe_free(text);
+    text = ast_write_string(frozen, AST_FORMAT_JSON);
+    CHECK(strcmp(text, test_json_expected) == 0);
+    safe_free(text);
+    CHECK(ast_write_string(NULL, AST_FORMAT_JSON) == NULL);
+    
+    file = tmpfile();
+    CHECK(file != NULL);
+    ast_write_file(frozen, AST_FORMAT_TEXT, file);
+    _test_file_text(file, buffer, sizeof(buffer));
+    fclose(file);
+    text = ast_write_string(tree, AST_FORMAT_TEXT);
+    CHECK(strcmp(text, buffer) == 0);
+    safe_free(text);
+    ast_dispose(frozen);
+    ast_dispose(tree);
+    
+    /* infinities and NaN aren't JSON numbers */
+    tree = ast_create(NULL, AST_LIST);
+    ast_append(tree, ast_create_real(NULL, HUGE_VAL));
+    ast_append(tree, ast_create_real(NULL, -HUGE_VAL));
+    ast_append(tree, ast_create_real(NULL, NAN));
+    text = ast_write_string(tree, AST_FORMAT_JSON);
+    CHECK(strcmp(text, test_json_non_finite) == 0);
+    safe_free(text);
+    ast_dispose(tree);
+    return NULL;
+}
+
+
+static const char *test_literal_source =
+"Class CSimple\n"
+"\tPublic Sub test\n"
+"\t\t#pragma Limit 42\n"
+"\t\tMsgBox \"Hello World\"\n"
+"\tEnd Sub\n"
+"End Class\n";
+
+
+typedef struct TestLiterals
+{
+    int count;
+    AstNode *nodes[2];
+} TestLiterals;
+
+
+static AstWalkResult _test_literal_walker(AstNode *in_node, Boolean in_end, int in_level, void *io_user)
+{
+    TestLiterals *literals = io_user;
+    
+    (void)in_level;
+    if ((!in_end) && ast_is(in_node, AST_STRING) && (ast_atom(in_node) == ATOM_NONE) && (literals->count < 2))
+        literals->nodes[literals->count++] = in_node;
+    return AST_WALK_CONTINUE;
+}
+
+
+/* string literals and pragma values hold their own text and are compared exactly, in every
+ form of the tree */
+static const char* _test_literals(void)
+{
+    Parser *parser;
+    AstNode *trees[3];
+    TestLiterals literals;
+    char *text;
+    int t;
+    
+    parser = parser_create();
+    CHECK(parser_parse(parser, (char*)test_literal_source));
+    trees[0] = ast_copy(parser_ast(parser), NULL);
+    trees[1] = ast_freeze(parser_ast(parser));
+    trees[2] = ast_copy(trees[1], NULL);
+    
+    /* the copies keep their text after the arena has gone */
+    text = _test_ast_text(parser_ast(parser));
+    parser_dispose(parser);
+    
+    for (t = 0; t < 3; t++)
+    {
+        memset(&literals, 0, sizeof(literals));
+        ast_walk(trees[t], _test_literal_walker, &literals);
+        CHECK(literals.count == 2);
+        CHECK(strcmp(ast_text(literals.nodes[0]), "42") == 0);
+        CHECK(ast_text_is(literals.nodes[1], "Hello World"));
+        CHECK(!ast_text_is(literals.nodes[1], "HELLO WORLD"));
+        CHECK(!ast_text_is(literals.nodes[1], "Hello"));
+        CHECK(ast_atom_is(literals.nodes[1], intern_string("Hello World")));
+        CHECK(!ast_atom_is(literals.nodes[1], intern_string("hello world")));
+        CHECK(_test_frozen_matches(trees[t], text));
+    }
+    CHECK(ast_memory(trees[1]) == ast_size(trees[1]) * 16 + (long)strlen("42") + (long)strlen("Hello World") + 2);
+    
+    safe_free(text);
+    for (t = 0; t < 3; t++)
+        ast_dispose(trees[t]);
+    return NULL;
+}
+
+
+#define TEST_TEMPORARY_PATH P_tmpdir "/rlb-test-XXXXXX"
+
+/* the part of a file's modification time below a second */
+static long _test_nanoseconds(struct stat *in_info)
+{
+#ifdef __APPLE__
+    return in_info->st_mtimespec.tv_nsec;
+#else
+    return in_info->st_mtim.tv_nsec;
+#endif
+}
+
+
+/* creates a file of its own in the temporary directory, holding the text; the caller unlinks it */
+static Boolean _test_temporary_file(char *out_pathname, const char *in_text)
+{
+    Boolean written;
+    long length;
+    int fd;
+    
+    strcpy(out_pathname, TEST_TEMPORARY_PATH);
+    fd = mkstemp(out_pathname);
+    if (fd < 0) return False;
+    length = strlen(in_text);
+    written = (write(fd, in_text, length) == length);
+    if (close(fd) != 0) written = False;
+    if (!written) unlink(out_pathname);
+    return written;
+}
+
+
+/* a tree saved and mapped back in reads the same as the original; it isn't loaded once its source
+ has changed in any way, nor from a file that isn't a sound tree */
+/* one of several threads writing out the same loaded tree at once */
+typedef struct TestCacheReader
+{
+    AstNode     *tree;
+    char        *text;
+} TestCacheReader;
+
+static void* _test_cache_reader(void *io_reader)
+{
+    TestCacheReader *reader = io_reader;
+    reader->text = _test_ast_text(reader->tree);
+    return NULL;
+}
+
+
+static const char* _test_cache(void)
+{
+    TestCacheReader readers[TEST_STRESS_THREADS];
+    pthread_t threads[TEST_STRESS_THREADS];
+    Parser *parser;
+    AstNode *loaded, *frozen, *thawed, *routine;
+    char *text1, *text2, *image;
+    char cache[sizeof(TEST_TEMPORARY_PATH)], source[sizeof(TEST_TEMPORARY_PATH)];
+    TestLiterals literals;
+    struct stat info;
+    struct timespec times[2];
+    FILE *file;
+    long length, i, misses;
+    int t;
+    
+    CHECK(_test_temporary_file(source, test_arena_source));
+    CHECK(_test_temporary_file(cache, ""));
+    parser = parser_create();
+    CHECK(parser_parse(parser, (char*)test_arena_source));
+    CHECK(ast_save(parser_ast(parser), cache, source));
+    loaded = ast_load(cache, source);
+    CHECK(loaded != NULL);
+    CHECK(ast_is_frozen(loaded));
+    CHECK(ast_size(loaded) == ast_size(parser_ast(parser)));
+    
+    text1 = _test_ast_text(parser_ast(parser));
+    text2 = _test_ast_text(loaded);
+    CHECK(strcmp(text1, text2) == 0);
+    safe_free(text2);
+    
+    routine = ast_child(ast_child(loaded, 0), 2);
+    CHECK(ast_text_is(ast_child(routine, 1), "TEST"));
+    CHECK(ast_atom(ast_child(routine, 1)) == intern_string("test"));
+    CHECK(ast_skip(routine) == ast_skip(loaded));
+    
+    /* a loaded tree is never written to, so threads may share it */
+    for (t = 0; t < TEST_STRESS_THREADS; t++)
+    {
+        readers[t].tree = loaded;
+        readers[t].text = NULL;
+        CHECK(pthread_create(&(threads[t]), NULL, &_test_cache_reader, &(readers[t])) == 0);
+    }
+    for (t = 0; t < TEST_STRESS_THREADS; t++)
+        pthread_join(threads[t], NULL);
+    for (t = 0; t < TEST_STRESS_THREADS; t++)
+    {
+        CHECK(readers[t].text && (strcmp(text1, readers[t].text) == 0));
+        safe_free(readers[t].text);
+    }
+    
+    /* copies outlive the mapping */
+    frozen = ast_freeze(loaded);
+    thawed = ast_copy(loaded, NULL);
+    ast_dispose(loaded);
+    text2 = _test_ast_text(frozen);
+    CHECK(strcmp(text1, text2) == 0);
+    safe_free(text2);
+    text2 = _test_ast_text(thawed);
+    CHECK(strcmp(text1, text2) == 0);
+    safe_free(text2);
+    
+    /* saving a mapped tree */
+    CHECK(ast_save(frozen, cache, source));
+    loaded = ast_load(cache, source);
+    CHECK(ast_save(loaded, cache, source));
+    ast_dispose(loaded);
+    loaded = ast_load(cache, source);
+    text2 = _test_ast_text(loaded);
+    CHECK(strcmp(text1, text2) == 0);
+    safe_free(text2);
+    ast_dispose(loaded);
+    
+    ast_dispose(thawed);
+    ast_dispose(frozen);
+    safe_free(text1);
+    
+    /* any damage to the file is a miss, or else leaves a tree that's safe to read */
+    file = fopen(cache, "rb");
+    CHECK(file != NULL);
+    fseek(file, 0, SEEK_END);
+    length = ftell(file);
+    rewind(file);
+    image = safe_malloc(length);
+    CHECK(fread(image, 1, length, file) == (size_t)length);
+    fclose(file);
+    misses = 0;
+    for (i = 0; i < length; i++)
+    {
+        image[i] = ~image[i];
+        file = fopen(cache, "wb");
+        CHECK(file != NULL);
+        CHECK(fwrite(image, 1, length, file) == (size_t)length);
+        fclose(file);
+        image[i] = ~image[i];
+        loaded = ast_load(cache, source);
+        if (!loaded)
+        {
+            misses++;
+            continue;
+        }
+        text2 = _test_ast_text(loaded);
+        safe_free(text2);
+        ast_dispose(loaded);
+    }
+    safe_free(image);
+    CHECK(misses > 0);
+    
+    /* a source touched within the same second is stale, where the file system keeps finer times,
+     as is one that's changed size */
+    CHECK(ast_save(parser_ast(parser), cache, source));
+    CHECK(stat(source, &info) == 0);
+    times[0].tv_sec = 0;
+    times[0].tv_nsec = UTIME_OMIT;
+    times[1].tv_sec = info.st_mtime;
+    times[1].tv_nsec = (_test_nanoseconds(&info) + 1) % 1000000000;
+    CHECK(utimensat(AT_FDCWD, source, times, 0) == 0);
+    CHECK(stat(source, &info) == 0);
+    if (_test_nanoseconds(&info) == times[1].tv_nsec)
+        CHECK(ast_load(cache, source) == NULL);
+    times[1].tv_nsec = (times[1].tv_nsec + 999999999) % 1000000000;
+    CHECK(utimensat(AT_FDCWD, source, times, 0) == 0);
+    loaded = ast_load(cache, source);
+    CHECK(loaded != NULL);
+    ast_dispose(loaded);
+    file = fopen(source, "ab");
+    CHECK(file != NULL);
+    fputc('\n', file);
+    fclose(file);
+    CHECK(ast_load(cache, source) == NULL);
+    
+    /* literals are written with their text */
+    CHECK(parser_parse(parser, (char*)test_literal_source));
+    CHECK(ast_save(parser_ast(parser), cache, source));
+    loaded = ast_load(cache, source);
+    CHECK(loaded != NULL);
+    text1 = _test_ast_text(parser_ast(parser));
+    CHECK(_test_frozen_matches(loaded, text1));
+    safe_free(text1);
+    memset(&literals, 0, sizeof(literals));
+    ast_walk(loaded, _test_literal_walker, &literals);
+    CHECK(literals.count == 2);
+    CHECK(ast_text_is(literals.nodes[1], "Hello World"));
+    CHECK(!ast_text_is(literals.nodes[1], "hello world"));
+    ast_dispose(loaded);
+    parser_dispose(parser);
+    
+    file = fopen(cache, "wb");
+    CHECK(file != NULL);
+    fputs("not a syntax tree, but long enough to have a header", file);
+    fclose(file);
+    CHECK(ast_load(cache, source) == NULL);
+    unlink(cache);
+    CHECK(ast_load(cache, source) == NULL);
+    unlink(source);
+    
+    return NULL;
+}
+
+
+typedef struct TestWalk
+{
+    int entered;
+    int ended;
+    int depth;
+    Boolean skip_routines;
+    AstOperator stop_at;
+} TestWalk;
+
+
+static AstWalkResult _test_walker(AstNode *in_node, Boolean in_end, int in_level, void *io_user)
+{
+    TestWalk *walk = io_user;
+    
+    if (in_level > walk->depth) walk->depth = in_level;
+    if (in_end)
+    {
+        walk->ended++;
+        return AST_WALK_CONTINUE;
+    }
+    walk->entered++;
+    if (walk->skip_routines && ast_is(in_node, AST_CONTROL) && ast_text_is(ast_child(in_node, 0), "function"))
+        return AST_WALK_SKIP;
+    if ((walk->stop_at != AST_OP_NONE) && (ast_operator(in_node) == walk->stop_at))
+        return AST_WALK_STOP;
+    return AST_WALK_CONTINUE;
+}
+
+
+#define TEST_WALK_DEPTH 100000
+
+/* skipping and stopping, on both kinds of tree, and a tree too deep to walk recursively */
+static const char* _test_walk(void)
+{
+    Parser *parser;
+    AstNode *trees[2], *node;
+    AstWalkStack *stack;
+    TestWalk walk;
+    Arena *arena;
+    int t, i;
+    
+    parser = parser_create();
+    CHECK(parser_parse(parser, (char*)test_arena_source));
+    trees[0] = parser_ast(parser);
+    trees[1] = ast_freeze(trees[0]);
+    stack = ast_walk_stack_create();
+    
+    for (t = 0; t < 2; t++)
+    {
+        memset(&walk, 0, sizeof(walk));
+        ast_walk_with(trees[t], _test_walker, &walk, stack);
+        CHECK(walk.entered == ast_size(trees[t]));
+        CHECK(walk.ended == walk.entered);
+        
+        /* the file, the class and its two strings, and the function, which is still ended */
+        memset(&walk, 0, sizeof(walk));
+        walk.skip_routines = True;
+        ast_walk_with(trees[t], _test_walker, &walk, stack);
+        CHECK(walk.entered == 5);
+        CHECK(walk.ended == 5);
+        
+        /* the first operator is in the third statement's expression; nothing more is ended */
+        memset(&walk, 0, sizeof(walk));
+        walk.stop_at = AST_OP_ADD;
+        ast_walk(trees[t], _test_walker, &walk);
+        CHECK(walk.entered > 5);
+        CHECK(walk.entered < ast_size(trees[t]));
+        CHECK(walk.ended < walk.entered);
+    }
+    
+    ast_dispose(trees[1]);
+    parser_dispose(parser);
+    
+    arena = arena_create();
+    trees[0] = node = ast_create(arena, AST_EXPRESSION);
+    for (i = 0; i < TEST_WALK_DEPTH; i++)
+    {
+        ast_append(node, ast_create_operator(arena, AST_OP_NEGATE));
+        ast_append(node, ast_create(arena, AST_EXPRESSION));
+        node = ast_child(node, AST_LAST);
+    }
+    memset(&walk, 0, sizeof(walk));
+    ast_walk_with(trees[0], _test_walker, &walk, stack);
+    CHECK(walk.entered == TEST_WALK_DEPTH * 2 + 1);
+    CHECK(walk.depth == TEST_WALK_DEPTH);
+    
+    ast_walk_stack_dispose(stack);
+    arena_dispose(arena);
+    return NULL;
+}
+
+
 void parser_run_tests()
 {
-    g_test_parser = parser_create();
-    g_test_parser->init = _parse_statement;
-    if (!g_test_parser)
+    TestContext context;
+    const char *test_error;
+    
+    context.parser = parser_create();
+    if (!context.parser)
     {
         fprintf(stderr, "Couldn't initalize parser test environment.\n");
         return;
     }
+    context.quiet = False;
+    context.failed = False;
+    context.result = NULL;
+    
+    _test_run_corpora(&context);
+    if (context.result) safe_free(context.result);
+    parser_dispose(context.parser);
+    
+    test_error = _test_arena();
+    if (!test_error) test_error = _test_reclaim();
+    if (!test_error) test_error = _test_frozen();
+    if (!test_error) test_error = _test_walk();
+    if (!test_error) test_error = _test_json();
+    if (!test_error) test_error = _test_literals();
+    if (!test_error) test_error = _test_cache();
+    if (!test_error) test_error = _test_stress();
+    if (test_error)
+    {
+        fprintf(stderr, "parser_run_tests(): Failed: %s\n", test_error);
+        exit(1);
+    }
+    else
+    {
+        fprintf(stdout, "parser_run_tests(): OK (%d threads)\n", TEST_STRESS_THREADS);
+    }
+}
+
+
+/*********
+ Benchmarks
+ */
+
+#define BENCHMARK_STATEMENTS 50000
+#define BENCHMARK_PASSES 5
+#define BENCHMARK_WALKS 20
+#define BENCHMARK_PROJECT_FILES 100
+#define BENCHMARK_FILE_METHODS 50
+
+
+/* a single routine of BENCHMARK_STATEMENTS statements, so one list node holds them all */
+static char* _bench_routine_source(void)
+{
+    static const char *statements[] = {
+        "        total = total + values(%d) * 2\r\n",
+        "        System.DebugLog \"Item\", %d, total\r\n",
+        "        Dim count%d As Integer = total Mod 7\r\n",
+    };
+    char *source, *offset;
+    int i;
+    
+    source = safe_malloc(64 * BENCHMARK_STATEMENTS + 128);
+    offset = source;
+    offset += sprintf(offset, "Class CBenchmark\r\n    Public Sub Run\r\n");
+    for (i = 0; i < BENCHMARK_STATEMENTS; i++)
+        offset += sprintf(offset, statements[i % 3], i);
+    sprintf(offset, "    End Sub\r\nEnd Class\r\n");
+    
+    return source;
+}
+
+
+static void _bench_tree_report(void)
+{
+    Parser *parser;
+    AstNode *copy;
+    char *source;
+    clock_t start, parse_time, copy_time;
+    long parse_allocations, copy_allocations;
+    int pass;
+    
+    source = _bench_routine_source();
+    parser = parser_create();
+    
+    parse_allocations = debug_memory_allocations();
+    start = clock();
+    for (pass = 0; pass < BENCHMARK_PASSES; pass++)
+    {
+        if (!parser_parse(parser, source))
+        {
+            fprintf(stdout, "parser benchmark: %s\n", parser_error_message(parser));
+            break;
+        }
+    }
+    parse_time = clock() - start;
+    parse_allocations = (debug_memory_allocations() - parse_allocations) / BENCHMARK_PASSES;
+    
+    /* the same tree built on the heap, a node at a time */
+    copy_allocations = debug_memory_allocations();
+    start = clock();
+    copy = ast_copy(parser_ast(parser), NULL);
+    copy_time = clock() - start;
+    copy_allocations = debug_memory_allocations() - copy_allocations;
+    ast_dispose(copy);
+    
+    fprintf(stdout, "%-24s %10d statements   parse %8.1f ms %8ld allocations   heap copy %8.1f ms %8ld allocations\n",
+            "routine", BENCHMARK_STATEMENTS,
+            (double)parse_time * 1000 / CLOCKS_PER_SEC / BENCHMARK_PASSES, parse_allocations,
+            (double)copy_time * 1000 / CLOCKS_PER_SEC, copy_allocations);
+    
+    parser_dispose(parser);
+    safe_free(source);
+}
+
+
+static AstWalkResult _bench_count_walker(AstNode *in_node, Boolean in_end, int in_level, void *io_user)
+{
+    (void)in_node;
+    (void)in_level;
+    if (!in_end) (*(long*)io_user)++;
+    return AST_WALK_CONTINUE;
+}
+
+
+static double _bench_walk(AstNode *in_tree)
+{
+    clock_t start;
+    long nodes;
+    int pass;
+    
+    nodes = 0;
+    start = clock();
+    for (pass = 0; pass < BENCHMARK_WALKS; pass++)
+        ast_walk(in_tree, _bench_count_walker, &nodes);
+    if (nodes != ast_size(in_tree) * BENCHMARK_WALKS) return 0;
+    return (double)(clock() - start) * 1000 / CLOCKS_PER_SEC / BENCHMARK_WALKS;
+}
+
+
+/* walks of the parsed tree, of a heap copy made node by node and of the frozen form */
+static void _bench_walk_report(void)
+{
+    Parser *parser;
+    AstNode *copy, *frozen;
+    char *source;
+    double parsed, copied, flat;
+    
+    source = _bench_routine_source();
+    parser = parser_create();
+    if (!parser_parse(parser, source)) return;
+    copy = ast_copy(parser_ast(parser), NULL);
+    frozen = ast_freeze(parser_ast(parser));
+    
+    parsed = _bench_walk(parser_ast(parser));
+    copied = _bench_walk(copy);
+    flat = _bench_walk(frozen);
+    fprintf(stdout, "%-24s %10ld nodes        arena %8.2f ms   heap %8.2f ms   frozen %8.2f ms\n",
+            "walk", ast_size(frozen), parsed, copied, flat);
+    
+    ast_dispose(frozen);
+    ast_dispose(copy);
+    parser_dispose(parser);
+    safe_free(source);
+}
+
+
+static void _bench_write(const char *in_name, AstNode *in_tree, AstFormat in_format)
+{
+    clock_t start;
+    double elapsed;
+    char *text;
+    long length;
+    
+    start = clock();
+    text = ast_write_string(in_tree, in_format);
+    elapsed = (double)(clock() - start) / CLOCKS_PER_SEC;
+    length = strlen(text);
+    fprintf(stdout, "%-24s %10ld bytes %8.2f ms   %8.1f MB/s\n",
+            in_name, length, elapsed * 1000, (elapsed > 0) ? length / elapsed / 1e6 : 0);
+    safe_free(text);
+}
+
+
+/* serializing the frozen tree to a string, which grows as it's written */
+static void _bench_write_report(void)
+{
+    Parser *parser;
+    AstNode *frozen;
+    char *source;
+    
+    source = _bench_routine_source();
+    parser = parser_create();
+    if (!parser_parse(parser, source)) return;
+    frozen = ast_freeze(parser_ast(parser));
+    
+    _bench_write("write (text)", frozen, AST_FORMAT_TEXT);
+    _bench_write("write (json)", frozen, AST_FORMAT_JSON);
+    
+    ast_dispose(frozen);
+    parser_dispose(parser);
+    safe_free(source);
+}
+
+
+#define BENCHMARK_LOADS 1000
+
+/* reparsing against mapping the saved tree back in, and the first walk over it */
+static void _bench_cache_report(void)
+{
+    Parser *parser;
+    AstNode *frozen, *loaded;
+    clock_t start;
+    double parse, load, walk;
+    char *source, cache[sizeof(TEST_TEMPORARY_PATH)], source_path[sizeof(TEST_TEMPORARY_PATH)];
+    long nodes;
+    int pass;
+    
+    source = _bench_routine_source();
+    parser = parser_create();
+    start = clock();
+    if (!parser_parse(parser, source)) return;
+    frozen = ast_freeze(parser_ast(parser));
+    parse = (double)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+    if (!_test_temporary_file(source_path, source)) return;
+    if ((!_test_temporary_file(cache, "")) || (!ast_save(frozen, cache, source_path)))
+    {
+        unlink(cache);
+        unlink(source_path);
+        return;
+    }
     
-    test_run_cases(TESTSDIR "parser-statement.tests",
-                   _test_case_runner, _test_case_result, NULL);
+    start = clock();
+    for (pass = 0; pass < BENCHMARK_LOADS; pass++)
+        ast_dispose(ast_load(cache, source_path));
+    load = (double)(clock() - start) * 1000000 / CLOCKS_PER_SEC / BENCHMARK_LOADS;
+    
+    nodes = 0;
+    start = clock();
+    loaded = ast_load(cache, source_path);
+    ast_walk(loaded, _bench_count_walker, &nodes);
+    walk = (double)(clock() - start) * 1000 / CLOCKS_PER_SEC;
+    
+    fprintf(stdout, "%-24s %10ld nodes        parse %8.2f ms   load %8.2f us   load+walk %8.2f ms\n",
+            "cache", ast_size(loaded), parse, load, walk);
+    
+    ast_dispose(loaded);
+    unlink(cache);
+    unlink(source_path);
+    ast_dispose(frozen);
+    parser_dispose(parser);
+    safe_free(source);
+}
+
+
+typedef struct BenchMemory
+{
+    Parser *parser;
+    long files;
+    long nodes;
+    long arena;
+    long tree;
+    long frozen;
+} BenchMemory;
+
+
+static void _bench_memory_add(BenchMemory *io_memory)
+{
+    AstNode *frozen;
+    
+    frozen = ast_freeze(parser_ast(io_memory->parser));
+    io_memory->files++;
+    io_memory->nodes += ast_size(frozen);
+    io_memory->arena += arena_used(io_memory->parser->arena);
+    io_memory->tree += ast_memory(parser_ast(io_memory->parser));
+    io_memory->frozen += ast_memory(frozen);
+    ast_dispose(frozen);
+}
+
+
+static const char* _bench_memory_case(void *in_user, const char *in_file, int in_case_number, const char *in_input, const char *in_output)
+{
+    BenchMemory *memory = in_user;
     
-    g_test_parser->init = _parse_block;
-    test_run_cases(TESTSDIR "parser-control.tests",
-                   _test_case_runner, _test_case_result, NULL);
+    (void)in_file;
+    (void)in_case_number;
+    (void)in_output;
+    if (parser_parse(memory->parser, (char*)in_input)) _bench_memory_add(memory);
+    return NULL;
+}
+
+
+/* the corpora are only measured; the tests check the results */
+static void _bench_memory_result(void *in_user, const char *in_file, int in_case_number, long in_line_number, const char *in_error)
+{
+    (void)in_user;
+    (void)in_file;
+    (void)in_case_number;
+    (void)in_line_number;
+    (void)in_error;
+}
+
+
+static void _bench_memory_print(const char *in_name, BenchMemory *in_memory)
+{
+    if (in_memory->nodes == 0) return;
+    fprintf(stdout, "%-24s %10ld nodes        arena %8.1f KB   tree %8.1f KB (%ld B/node)   frozen %8.1f KB (%ld B/node)\n",
+            in_name, in_memory->nodes, (double)in_memory->arena / 1024,
+            (double)in_memory->tree / 1024, in_memory->tree / in_memory->nodes,
+            (double)in_memory->frozen / 1024, in_memory->frozen / in_memory->nodes);
+}
+
+
+/* the size of the trees for the test corpora and for a synthetic project of
+ BENCHMARK_PROJECT_FILES files of about 1000 lines */
+static void _bench_memory_report(void)
+{
+    static const char *method =
+    "    Protected Function Method%d(customer As Integer, pending As Boolean) As Double\r\n"
+    "        Dim total As Double = 0.0\r\n"
+    "        Dim count As Integer = &h%X\r\n"
+    "        For index = 1 To count\r\n"
+    "            If pending And (index Mod 2 = 0) Then\r\n"
+    "                total = total + 1.5e2 * index\r\n"
+    "            Else\r\n"
+    "                total = total - customer / 3\r\n"
+    "            End If\r\n"
+    "        Next\r\n"
+    "        System.DebugLog(\"Balance for \", customer, total)\r\n"
+    "        Return total\r\n"
+    "    End Function\r\n"
+    "\r\n"
+    "    Public Sub Update%d(name As String)\r\n"
+    "        Me.Name = name\r\n"
+    "        Me.Modified = True\r\n"
+    "        Notify \"Changed\", name, Me.Count + 1\r\n"
+    "    End Sub\r\n"
+    "\r\n";
+    BenchMemory memory;
+    char *source, *offset;
+    int file, i;
+    
+    memset(&memory, 0, sizeof(memory));
+    memory.parser = parser_create();
+    
+#ifdef TESTSDIR
+    memory.parser->init = _parse_statement;
+    test_run_cases(TESTSDIR "parser-statement.tests", _bench_memory_case, _bench_memory_result, &memory);
+    memory.parser->init = _parse_block;
+    test_run_cases(TESTSDIR "parser-control.tests", _bench_memory_case, _bench_memory_result, &memory);
+    memory.parser->init = _parse_file;
+    test_run_cases(TESTSDIR "parser-class.tests", _bench_memory_case, _bench_memory_result, &memory);
+    _bench_memory_print("memory (corpora)", &memory);
+#endif
+    parser_dispose(memory.parser);
     
-    g_test_parser->init = _parse_file;
-    test_run_cases(TESTSDIR "parser-class.tests",
-                   _test_case_runner, _test_case_result, NULL);
+    memset(&memory, 0, sizeof(memory));
+    memory.parser = parser_create();
+    source = safe_malloc((strlen(method) + 32) * BENCHMARK_FILE_METHODS + 128);
+    for (file = 0; file < BENCHMARK_PROJECT_FILES; file++)
+    {
+        offset = source;
+        offset += sprintf(offset, "Class CProject%d Inherits Object\r\n\r\n", file);
+        for (i = 0; i < BENCHMARK_FILE_METHODS; i++)
+            offset += sprintf(offset, method, i, i, i);
+        sprintf(offset, "End Class\r\n");
+        if (parser_parse(memory.parser, source)) _bench_memory_add(&memory);
+    }
+    _bench_memory_print("memory (project)", &memory);
+    safe_free(source);
+    parser_dispose(memory.parser);
+}
+
+
+void parser_run_benchmarks(void)
+{
+    _bench_tree_report();
+    _bench_walk_report();
+    _bench_write_report();
+    _bench_cache_report();
+    _bench_memory_report();
 }
 
 
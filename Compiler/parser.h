@@ -33,18 +33,28 @@
 typedef struct Parser Parser;
 
 Parser* parser_create(void);
+void parser_dispose(Parser *in_parser);
 
 Boolean parser_parse(Parser *in_parser, char *in_source);
 
+/* compiles conditionally, for the build constants in the NULL terminated list (see
+ lexer_create_conditional()); the list must outlive the parser.  NULL turns it off */
+void parser_set_defined(Parser *in_parser, const char * const *in_defined);
+
 const char* parser_error_message(Parser *in_parser);
 long parser_error_offset(Parser *in_parser);
+void parser_error_location(Parser *in_parser, long *out_line, long *out_column);
+void parser_location(Parser *in_parser, long in_offset, long *out_line, long *out_column);
 
+/* the tree belongs to the parser and is released by the next parse or parser_dispose();
+ use ast_copy() to keep it longer */
 AstNode* parser_ast(Parser *in_parser);
 
 
 #ifdef DEBUG
 
 void parser_run_tests();
+void parser_run_benchmarks(void);
 
 #endif
 
@@ -26,8 +26,12 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 #include "memory.h"
+#include "readfile.h"
 
 #define MAX_SOURCE_FILE_SIZE        250 * 1024 * 1024
 
@@ -69,5 +73,36 @@ char* readfile(const char *in_pathname)
 }
 
 
+long readfile_chunk(void *io_file, char *out_buffer, long in_size)
+{
+    size_t bytes;
+    
+    bytes = fread(out_buffer, 1, in_size, (FILE*)io_file);
+    if ((bytes == 0) && ferror((FILE*)io_file))
+        fail("Couldn't read input");
+    return bytes;
+}
+
+
+long readfile_chunk_fd(void *io_fd, char *out_buffer, long in_size)
+{
+    ssize_t bytes;
+    
+    do bytes = read(*(int*)io_fd, out_buffer, in_size);
+    while ((bytes < 0) && (errno == EINTR));
+    if (bytes < 0)
+        fail("Couldn't read input");
+    return bytes;
+}
+
+
+/* modification time in seconds, or -1 if the file doesn't exist */
+long readfile_modified(const char *in_pathname)
+{
+    struct stat info;
+    
+    if (stat(in_pathname, &info) != 0) return -1;
+    return info.st_mtime;
+}
 
 
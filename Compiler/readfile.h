@@ -30,4 +30,17 @@
 char* readfile(const char *in_pathname);
 
 
+/* reads up to in_size bytes of the input into out_buffer; returns the number of bytes read,
+ which may be fewer than asked for, or 0 at the end of the input */
+typedef long (*ReadChunk)(void *io_user, char *out_buffer, long in_size);
+
+/* chunk readers for a FILE* (such as stdin) and for a pointer to a file descriptor (such as
+ a pipe) */
+long readfile_chunk(void *io_file, char *out_buffer, long in_size);
+long readfile_chunk_fd(void *io_fd, char *out_buffer, long in_size);
+
+/* modification time in seconds, or -1 if the file doesn't exist */
+long readfile_modified(const char *in_pathname);
+
+
 #endif
@@ -24,9 +24,17 @@
  **************************************************************************************************/
 
 #include <stdio.h>
+#include <string.h>
 
 
+#include "scan.h"
+#include "arena.h"
+#include "unicode.h"
+#include "intern.h"
+#include "number.h"
+#include "lexer.h"
 #include "parser.h"
+#include "index.h"
 
 
 int main(int argc, const char * argv[])
@@ -34,8 +42,21 @@ int main(int argc, const char * argv[])
     //Lexer *theLexer;
     //Token tok;
     
-
+    if ((argc > 1) && (strcmp(argv[1], "-bench") == 0))
+    {
+        lexer_run_benchmarks();
+        parser_run_benchmarks();
+        return 0;
+    }
+    
+    scan_run_tests();
+    arena_run_tests();
+    unicode_run_tests();
+    intern_run_tests();
+    number_run_tests();
+    lexer_run_tests();
     parser_run_tests();
+    index_run_tests();
     
     //parser_parse(parser_create(), "Dim x As Integer");
     
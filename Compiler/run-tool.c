@@ -24,6 +24,7 @@
  **************************************************************************************************/
 
 #include <stdio.h>
+#include <string.h>
 
 #include "parser.h"
 #include "index.h"
@@ -31,41 +32,74 @@
 #include "memory.h"
 
 
+/* the source's pathname with its extension (if any) replaced; the caller frees the result */
+static char* _derived_path(const char *in_source, const char *in_extension)
+{
+    const char *dot, *slash;
+    char *result;
+    long stem;
+    
+    dot = strrchr(in_source, '.');
+    slash = strrchr(in_source, '/');
+    stem = ((dot && ((!slash) || (dot > slash + 1))) ? dot - in_source : (long)strlen(in_source));
+    result = safe_malloc(stem + strlen(in_extension) + 1);
+    memcpy(result, in_source, stem);
+    strcpy(result + stem, in_extension);
+    return result;
+}
+
+
 int main(int argc, const char * argv[])
 {
     Index *index;
     Parser *parser;
-    char *source;
+    char *source, *cache_path, *index_path;
     AstNode *ast;
     
+    /* currently always in indexing mode: run-tool <source> [<index>]; the tree is cached
+     beside the source, as is the index unless it's given */
+    if ((argc < 2) || (argc > 3))
+    {
+        fprintf(stderr, "usage: %s <source> [<index>]\n", argv[0]);
+        return 1;
+    }
+    cache_path = _derived_path(argv[1], ".ast");
+    index_path = ((argc > 2) ? NULL : _derived_path(argv[1], ".index"));
     
-    /* for testing, currently assumed to be in indexing mode as if invoked with appropriate
-     command line arguments */
-    
-    source = readfile("/Users/josh/Desktop/test.bas");
-    
-    index = index_open("/Users/josh/Desktop/test.index");
-    
-    parser = parser_create();
+    index = index_open(index_path ? index_path : argv[2]);
     
-    if (!parser_parse(parser, source))
+    /* a source that hasn't changed since it was last parsed is loaded from its cached tree */
+    ast = ast_load(cache_path, argv[1]);
+    if (!ast)
     {
-        fail(parser_error_message(parser)); /* need fail to support arguments like printf! */
+        source = readfile(argv[1]);
+        parser = parser_create();
+        
+        if (!parser_parse(parser, source))
+        {
+            fail(parser_error_message(parser)); /* need fail to support arguments like printf! */
+        }
+        
+        /* indexing and translation work from the frozen form of the tree */
+        ast = ast_freeze(parser_ast(parser));
+        ast_save(ast, cache_path, argv[1]);
+        parser_dispose(parser);
+        safe_free(source);
     }
     
-    ast = parser_ast(parser);
-    
-    ast_walk(ast, ast_debug_walker, NULL);
+    ast_write_file(ast, AST_FORMAT_TEXT, stdout);
     
     /* 
      need to check the modification date of the file against the one we stored when it was last
      indexed.  if same, exit this process.  otherwise, continue...
-     
-     need to walk the AST and index all the symbols into the sym table of the index 
      */
     
+    index_file(index, argv[1], ast);
     
+    ast_dispose(ast);
     index_close(index);
+    safe_free(cache_path);
+    if (index_path) safe_free(index_path);
     
     return 0;
 }
@@ -0,0 +1,536 @@
+/***************************************************************************************************
+ *
+ * RunlessBASIC
+ * Copyright 2013 Joshua Hawcroft <dev@joshhawcroft.com>
+ *
+ * scan.c
+ * Bulk character-class scanning kernels for the lexer.
+ *
+ ***************************************************************************************************
+ *
+ * RunlessBASIC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RunlessBASIC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RunlessBASIC.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************************************/
+
+/*
+ * The source is checked once to be valid UTF-8, as it is loaded.  Runs of ASCII are skipped 16
+ * (SSE2) or 32 (AVX2) bytes at a time; with AVX2, multi-byte characters are checked a block at a
+ * time too, by classifying each byte and the three before it with table lookups (Keiser & Lemire,
+ * "Validating UTF-8 in less than one instruction per byte").  A portable scalar version serves
+ * other machines.  The best kernel is chosen at run-time by asking the CPU what it supports; the
+ * choice is held by each lexer, so there is no global state.
+ *
+ * The vector kernels never read beyond in_end; the tail of the buffer is finished by the scalar
+ * kernel.
+ *
+ * Runs of identifier characters, indentation and comments are skipped by the lexer with its
+ * character table: they are mostly only a few bytes long, and vector kernels for them measured
+ * no faster.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "scan.h"
+#include "memory.h"
+#include "test.h"
+
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define SCAN_X86 1
+#include <cpuid.h>
+#include <immintrin.h>
+#define SCAN_TARGET(isa) __attribute__((target(isa)))
+#endif
+
+
+/*********
+ Scalar
+ */
+
+/* the length of the valid multi-byte character at in_text, or 0 if it is invalid or truncated */
+static int _scan_utf8_char(const unsigned char *in_text, const unsigned char *in_end)
+{
+    unsigned char low, high;
+    int count, i;
+
+    low = 0x80;
+    high = 0xBF;
+    if (in_text[0] < 0xC2) return 0;
+    else if (in_text[0] < 0xE0) count = 2;
+    else if (in_text[0] < 0xF0)
+    {
+        count = 3;
+        if (in_text[0] == 0xE0) low = 0xA0;             /* overlong */
+        else if (in_text[0] == 0xED) high = 0x9F;       /* surrogate */
+    }
+    else if (in_text[0] < 0xF5)
+    {
+        count = 4;
+        if (in_text[0] == 0xF0) low = 0x90;             /* overlong */
+        else if (in_text[0] == 0xF4) high = 0x8F;       /* beyond U+10FFFF */
+    }
+    else return 0;
+
+    if (in_end - in_text < count) return 0;
+    if ((in_text[1] < low) || (in_text[1] > high)) return 0;
+    for (i = 2; i < count; i++)
+    {
+        if ((in_text[i] & 0xC0) != 0x80) return 0;
+    }
+    return count;
+}
+
+
+static const char* _scan_utf8_scalar(const char *in_text, const char *in_end)
+{
+    const unsigned char *text, *end;
+    uint64_t word;
+    int count;
+
+    text = (const unsigned char*)in_text;
+    end = (const unsigned char*)in_end;
+    while (text < end)
+    {
+        /* ASCII eight bytes at a time */
+        if (end - text >= 8)
+        {
+            memcpy(&word, text, 8);
+            if (!(word & 0x8080808080808080ULL))
+            {
+                text += 8;
+                continue;
+            }
+        }
+        if (*text < 0x80)
+        {
+            text++;
+            continue;
+        }
+        count = _scan_utf8_char(text, end);
+        if (!count) break;
+        text += count;
+    }
+    return (const char*)text;
+}
+
+
+static const ScanKernels _scan_scalar = {
+    SCAN_SCALAR, "scalar", &_scan_utf8_scalar
+};
+
+
+#ifdef SCAN_X86
+
+/*********
+ SSE2
+ */
+
+/* skips ASCII 16 bytes at a time; multi-byte characters are checked one at a time */
+SCAN_TARGET("sse2")
+static const char* _scan_utf8_sse2(const char *in_text, const char *in_end)
+{
+    unsigned int mask;
+    int count;
+
+    while (in_end - in_text >= 16)
+    {
+        mask = _mm_movemask_epi8(_mm_loadu_si128((const __m128i*)in_text));
+        if (!mask)
+        {
+            in_text += 16;
+            continue;
+        }
+        in_text += __builtin_ctz(mask);
+        while ( (in_text < in_end) && ((unsigned char)*in_text >= 0x80) )
+        {
+            count = _scan_utf8_char((const unsigned char*)in_text, (const unsigned char*)in_end);
+            if (!count) return in_text;
+            in_text += count;
+        }
+    }
+    return _scan_utf8_scalar(in_text, in_end);
+}
+
+
+static const ScanKernels _scan_sse2 = {
+    SCAN_SSE2, "sse2", &_scan_utf8_sse2
+};
+
+
+/*********
+ AVX2
+ */
+
+/* error classes of a byte and the byte before it; a pair is invalid if all three of its
+ lookups share a bit */
+#define UTF8_TOO_SHORT      (1 << 0)    /* lead byte followed by a lead byte or ASCII */
+#define UTF8_TOO_LONG       (1 << 1)    /* ASCII followed by a continuation */
+#define UTF8_OVERLONG_3     (1 << 2)    /* 11100000 100_____ */
+#define UTF8_TOO_LARGE      (1 << 3)    /* 11110100 1001____ and above */
+#define UTF8_SURROGATE      (1 << 4)    /* 11101101 101_____ */
+#define UTF8_OVERLONG_2     (1 << 5)    /* 1100000_ 10______ */
+#define UTF8_TOO_LARGE_1000 (1 << 6)    /* 11110101 and above, 1000____ */
+#define UTF8_OVERLONG_4     (1 << 6)    /* 11110000 1000____ */
+#define UTF8_TWO_CONTS      (1 << 7)    /* two continuations; valid only if part of a 3 or 4 byte character */
+#define UTF8_CARRY          (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+/* the vector of the bytes n places earlier, carrying from the previous block */
+#define SCAN_PREV_AVX2(input, prev, n) _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev, input, 0x21), 16 - (n))
+
+
+SCAN_TARGET("avx2")
+static __m256i _scan_lookup_avx2(__m256i in_index, char t0, char t1, char t2, char t3, char t4, char t5, char t6, char t7,
+                                 char t8, char t9, char t10, char t11, char t12, char t13, char t14, char t15)
+{
+    return _mm256_shuffle_epi8(_mm256_setr_epi8(t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15,
+                                                t0, t1, t2, t3, t4, t5, t6, t7, t8, t9, t10, t11, t12, t13, t14, t15), in_index);
+}
+
+
+/* non-zero bytes where the block, following the previous block, isn't valid UTF-8 */
+SCAN_TARGET("avx2")
+static __m256i _scan_utf8_errors_avx2(__m256i in_input, __m256i in_prev)
+{
+    __m256i prev1, high_nibbles, byte_1_high, byte_1_low, byte_2_high, special, must_continue;
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+    prev1 = SCAN_PREV_AVX2(in_input, in_prev, 1);
+    high_nibbles = _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble);
+    byte_1_high = _scan_lookup_avx2(high_nibbles,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS, UTF8_TWO_CONTS,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+        UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        (char)(UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4));
+    byte_1_low = _scan_lookup_avx2(_mm256_and_si256(prev1, nibble),
+        (char)(UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4),
+        (char)(UTF8_CARRY | UTF8_OVERLONG_2),
+        (char)UTF8_CARRY,
+        (char)UTF8_CARRY,
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000));
+    byte_2_high = _scan_lookup_avx2(_mm256_and_si256(_mm256_srli_epi16(in_input, 4), nibble),
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4),
+        (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE),
+        (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE),
+        (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE),
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
+    special = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    /* the second continuation of a 3 byte character, or the second or third of a 4 byte one */
+    must_continue = _mm256_or_si256(_mm256_subs_epu8(SCAN_PREV_AVX2(in_input, in_prev, 2), _mm256_set1_epi8(0xE0 - 0x80)),
+                                    _mm256_subs_epu8(SCAN_PREV_AVX2(in_input, in_prev, 3), _mm256_set1_epi8(0xF0 - 0x80)));
+    must_continue = _mm256_and_si256(must_continue, _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(must_continue, special);
+}
+
+
+/* finds the first error exactly, once a block is known to contain one; the characters before
+ the block are valid, so the scalar kernel can start from the last character to begin before it */
+static const char* _scan_utf8_resume(const char *in_start, const char *in_block, const char *in_end)
+{
+    const char *text;
+
+    text = (in_block - in_start > 3) ? in_block - 3 : in_start;
+    while ( (text < in_block) && (((unsigned char)*text & 0xC0) == 0x80) ) text++;
+    return _scan_utf8_scalar(text, in_end);
+}
+
+
+SCAN_TARGET("avx2")
+static const char* _scan_utf8_avx2(const char *in_text, const char *in_end)
+{
+    const char *start;
+    __m256i input, prev, incomplete, errors;
+
+    start = in_text;
+    prev = _mm256_setzero_si256();
+    incomplete = _mm256_setzero_si256();
+    while (in_end - in_text >= 32)
+    {
+        input = _mm256_loadu_si256((const __m256i*)in_text);
+        if (!_mm256_movemask_epi8(input))
+        {
+            /* ASCII; only an error if the last block ended part way through a character */
+            if (!_mm256_testz_si256(incomplete, incomplete))
+                return _scan_utf8_resume(start, in_text, in_end);
+        }
+        else
+        {
+            errors = _scan_utf8_errors_avx2(input, prev);
+            if (!_mm256_testz_si256(errors, errors))
+                return _scan_utf8_resume(start, in_text, in_end);
+
+            /* lead bytes too near the end of the block to be complete within it */
+            incomplete = _mm256_subs_epu8(input, _mm256_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                                  -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+                                                                  (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1)));
+        }
+        prev = input;
+        in_text += 32;
+    }
+    return _scan_utf8_resume(start, in_text, in_end);
+}
+
+
+static const ScanKernels _scan_avx2 = {
+    SCAN_AVX2, "avx2", &_scan_utf8_avx2
+};
+
+
+#ifndef bit_OSXSAVE
+#define bit_OSXSAVE (1 << 27)
+#endif
+#ifndef bit_AVX
+#define bit_AVX (1 << 28)
+#endif
+#ifndef bit_AVX2
+#define bit_AVX2 (1 << 5)
+#endif
+#ifndef bit_SSE2
+#define bit_SSE2 (1 << 26)
+#endif
+
+
+/* which of the YMM/XMM register states does the operating system preserve? */
+static unsigned int _scan_xgetbv(void)
+{
+    unsigned int eax, edx;
+    __asm__ __volatile__ ("xgetbv" : "=a" (eax), "=d" (edx) : "c" (0));
+    return eax;
+}
+
+#endif
+
+
+/*********
+ Dispatch
+ */
+
+static enum ScanLevel _scan_cpu_level(void)
+{
+#ifdef SCAN_X86
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1, &eax, &ebx, &ecx, &edx)) return SCAN_SCALAR;
+    if (!(edx & bit_SSE2)) return SCAN_SCALAR;
+
+    /* AVX2 also requires that the operating system saves the YMM registers */
+    if ( (ecx & bit_OSXSAVE) && (ecx & bit_AVX) && (__get_cpuid_max(0, NULL) >= 7) &&
+         ((_scan_xgetbv() & 6) == 6) )
+    {
+        __cpuid_count(7, 0, eax, ebx, ecx, edx);
+        if (ebx & bit_AVX2) return SCAN_AVX2;
+    }
+    return SCAN_SSE2;
+#else
+    return SCAN_SCALAR;
+#endif
+}
+
+
+/* the best kernels available at or below the requested level */
+const ScanKernels* scan_kernels(enum ScanLevel in_level)
+{
+    enum ScanLevel available;
+
+    available = _scan_cpu_level();
+    if (in_level > available) in_level = available;
+
+    switch (in_level)
+    {
+#ifdef SCAN_X86
+        case SCAN_AVX2: return &_scan_avx2;
+        case SCAN_SSE2: return &_scan_sse2;
+#endif
+        default: break;
+    }
+    return &_scan_scalar;
+}
+
+
+const ScanKernels* scan_best(void)
+{
+    return scan_kernels(SCAN_AVX2);
+}
+
+
+
+
+/*********
+ Testing
+ */
+
+#ifdef DEBUG
+
+
+/* every kernel must agree with the scalar version, from every starting point and
+ at every distance from the end of the buffer */
+static const char* _test_kernels(const ScanKernels *in_kernels)
+{
+    static const char alphabet[] = "aZ09_$ \t\r\n'\"(.&\x80\xC3\xA9\xFF";
+    char *buffer;
+    long size, i, start;
+    unsigned int seed;
+
+    seed = 1;
+    for (size = 0; size <= 200; size += 7)
+    {
+        buffer = safe_malloc(size + 1);
+        for (i = 0; i < size; i++)
+        {
+            seed = seed * 1103515245 + 12345;
+            /* long runs of a single class, so that the vector loops are exercised */
+            if ((seed >> 16) % 4 == 0)
+                buffer[i] = alphabet[(seed >> 8) % (sizeof(alphabet) - 1)];
+            else
+                buffer[i] = (i > 0 ? buffer[i-1] : 'a');
+        }
+        buffer[size] = 0;
+
+        for (start = 0; start <= size; start++)
+        {
+            CHECK(in_kernels->utf8(buffer + start, buffer + size) == _scan_utf8_scalar(buffer + start, buffer + size));
+        }
+        safe_free(buffer);
+    }
+
+    return NULL;
+}
+
+
+static const char* test_1(void)
+{
+    const char *text = "Dim_x1\xC3\xA9 = \t\t  7 ' comment\r\nEnd";
+    const char *end = text + strlen(text);
+
+    CHECK(_scan_utf8_scalar(text, end) == end);
+    text = "ok \xE4\xB8\x96 \xF0\x9F\x98\x80 \xED\xA0\x80 bad";
+    end = text + strlen(text);
+    CHECK(_scan_utf8_scalar(text, end) == text + 12);
+    text = "truncated \xE4\xB8";
+    end = text + strlen(text);
+    CHECK(_scan_utf8_scalar(text, end) == text + 10);
+
+    return NULL;
+}
+
+
+/* mostly valid UTF-8 with an occasional invalid sequence; every kernel must find the same
+ first error as the scalar kernel */
+static const char* _test_utf8(const ScanKernels *in_kernels)
+{
+    static const char *pieces[] = {
+        "a", "a", "a", "a", "a", "a", "a", "a", "a", "a", "a", "a", " ", "\x7F",
+        "\xC2\x80", "\xDF\xBF", "\xC3\xA9", "\xE0\xA0\x80", "\xED\x9F\xBF", "\xEE\x80\x80", "\xEF\xBF\xBF",
+        "\xE4\xB8\x96", "\xF0\x90\x80\x80", "\xF4\x8F\xBF\xBF", "\xF0\xA3\x8E\x8F"
+    };
+    static const char *invalid[] = {
+        "\x80", "\xBF", "\xC0\x80", "\xC1\xBF", "\xC3", "\xC3\x28", "\xE0\x9F\xBF", "\xED\xA0\x80", "\xE4\xB8",
+        "\xF0\x8F\xBF\xBF", "\xF4\x90\x80\x80", "\xF5\x80\x80\x80", "\xF0\x90\x80", "\xFF", "\xC3\xA9\xA9"
+    };
+    char *buffer;
+    const char *piece;
+    long size, length, start;
+    unsigned int seed;
+    int round;
+
+    seed = 7;
+    buffer = safe_malloc(400);
+    for (round = 0; round < 400; round++)
+    {
+        size = 0;
+        seed = seed * 1103515245 + 12345;
+        length = (seed >> 8) % 360;
+        while (size < length)
+        {
+            seed = seed * 1103515245 + 12345;
+            if ((round % 4 != 0) && ((seed >> 8) % 97 == 0))
+                piece = invalid[(seed >> 16) % (sizeof(invalid) / sizeof(char*))];
+            else
+                piece = pieces[(seed >> 16) % (sizeof(pieces) / sizeof(char*))];
+            memcpy(buffer + size, piece, strlen(piece));
+            size += strlen(piece);
+        }
+        buffer[size] = 0;
+
+        if (round % 4 == 0) CHECK(_scan_utf8_scalar(buffer, buffer + size) == buffer + size);
+        for (start = 0; start <= size; start += 5)
+            CHECK(in_kernels->utf8(buffer + start, buffer + size) == _scan_utf8_scalar(buffer + start, buffer + size));
+    }
+    safe_free(buffer);
+
+    return NULL;
+}
+
+
+static const char* test_2(void)
+{
+    const char *test_error;
+    enum ScanLevel level;
+
+    CHECK(scan_kernels(SCAN_SCALAR) == &_scan_scalar);
+    CHECK(scan_best()->level == _scan_cpu_level());
+
+    for (level = SCAN_SCALAR; level <= scan_best()->level; level++)
+    {
+        CHECK(scan_kernels(level)->level == level);
+        test_error = _test_kernels(scan_kernels(level));
+        if (test_error) return test_error;
+        test_error = _test_utf8(scan_kernels(level));
+        if (test_error) return test_error;
+    }
+
+    return NULL;
+}
+
+
+void scan_run_tests(void)
+{
+    const char *test_error;
+    test_error = NULL;
+
+    if (!test_error) test_error = test_1();
+    if (!test_error) test_error = test_2();
+
+    if (test_error)
+    {
+        fprintf(stderr, "scan_run_tests(): Failed: %s\n", test_error);
+        exit(1);
+    }
+    else
+    {
+        fprintf(stdout, "scan_run_tests(): OK (%s)\n", scan_best()->name);
+    }
+}
+
+
+#endif
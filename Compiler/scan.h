@@ -0,0 +1,61 @@
+/***************************************************************************************************
+ *
+ * RunlessBASIC
+ * Copyright 2013 Joshua Hawcroft <dev@joshhawcroft.com>
+ *
+ * scan.h
+ * (see C source file for details)
+ *
+ ***************************************************************************************************
+ *
+ * RunlessBASIC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RunlessBASIC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RunlessBASIC.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************************************/
+
+#ifndef _SCAN_H
+#define _SCAN_H
+
+
+enum ScanLevel
+{
+    SCAN_SCALAR = 0,
+    SCAN_SSE2,
+    SCAN_AVX2,
+};
+
+
+/*
+ * The kernel scans forward from in_text and returns a pointer to the first byte of an invalid
+ * or truncated UTF-8 sequence, or in_end if the text is all valid UTF-8.
+ */
+typedef const char* (*ScanKernel)(const char *in_text, const char *in_end);
+
+typedef struct ScanKernels
+{
+    enum ScanLevel  level;
+    const char      *name;
+    ScanKernel      utf8;
+} ScanKernels;
+
+
+const ScanKernels* scan_kernels(enum ScanLevel in_level);
+const ScanKernels* scan_best(void);
+
+
+#ifdef DEBUG
+void scan_run_tests(void);
+#endif
+
+
+#endif
@@ -0,0 +1,58 @@
+/***************************************************************************************************
+ *
+ * RunlessBASIC
+ * Copyright 2013 Joshua Hawcroft <dev@joshhawcroft.com>
+ *
+ * unicode.h
+ * (see C source file for details)
+ *
+ ***************************************************************************************************
+ *
+ * RunlessBASIC is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * RunlessBASIC is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with RunlessBASIC.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ **************************************************************************************************/
+
+#include <stdint.h>
+
+#include "memory.h"
+
+#ifndef _UNICODE_H
+#define _UNICODE_H
+
+
+/* the most bytes a single character takes in UTF-8 */
+#define UNICODE_MAX_BYTES 4
+
+#define UNICODE_REPLACEMENT 0xFFFD
+
+
+/* decodes one UTF-8 character; returns the number of bytes, or 0 if the sequence is invalid
+ or truncated (ASCII is decoded too) */
+int unicode_decode(const char *in_text, long in_length, long *out_char);
+
+/* encodes a character as UTF-8; returns the number of bytes written.  Surrogates and values
+ outside the Unicode range are encoded as U+FFFD */
+int unicode_encode(long in_char, char *out_text);
+
+/* the Unicode identifier properties (UAX #31) */
+Boolean unicode_is_xid_start(long in_char);
+Boolean unicode_is_xid_continue(long in_char);
+
+
+#ifdef DEBUG
+void unicode_run_tests(void);
+#endif
+
+
+#endif